@@ -0,0 +1,293 @@
+#include "affinity.h"
+#include "package.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <dirent.h>
+#include <fstream>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const int mpol_preferred = 1;              // MPOL_PREFERRED из linux/mempolicy.h
+static const unsigned long max_nodes = 1024;
+
+/** \brief Имя роли потока
+ *
+ * \return Имя роли для вывода и разбора опций.
+ */
+const char *thread_role_name(thread_roles role)
+{
+    switch (role)
+    {
+    case THREAD_RECEIVE:
+        return "rx";
+    case THREAD_WRITER:
+        return "writer";
+    case THREAD_COMPUTE:
+        return "compute";
+    default:
+        return "unknown";
+    }
+}
+
+/** \brief Разбор списка процессоров
+ *
+ * Список задается в формате cpulist ядра: номера и диапазоны через
+ * запятую, например 0-3,8,10-11, или узлом NUMA в виде node:<номер>. Для
+ * узла список читается из /sys/devices/system/node/node<номер>/cpulist.
+ *
+ * \param[in]  spec    Список.
+ * \param[out] cpus    Номера процессоров.
+ *
+ * \return true, если список корректен и не пуст, false иначе.
+ */
+bool parse_cpu_list(const std::string& spec, std::vector<int>& cpus)
+{
+    if (spec.compare(0, 5, "node:") == 0)
+    {
+        std::ifstream ifs("/sys/devices/system/node/node" + spec.substr(5) + "/cpulist");
+        std::string list;
+        if (spec.size() == 5 || !std::getline(ifs, list))
+            return false;
+        return parse_cpu_list(list, cpus);
+    }
+    cpus.clear();
+    size_t pos = 0;
+    while (pos < spec.size())
+    {
+        size_t end = spec.find(',', pos);
+        if (end == std::string::npos)
+            end = spec.size();
+        std::string item = spec.substr(pos, end - pos);
+        char *tail = nullptr;
+        long first = strtol(item.c_str(), &tail, 10);
+        long last = first;
+        if (tail == item.c_str())
+            return false;
+        if (*tail == '-')
+        {
+            const char *next = tail + 1;
+            last = strtol(next, &tail, 10);
+            if (tail == next)
+                return false;
+        }
+        if (*tail != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+            return false;
+        for (long cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(static_cast<int>(cpu));
+        pos = end + 1;
+    }
+    return !cpus.empty();
+}
+
+/** \brief Разбор закрепления потоков
+ *
+ * \param[in]  spec    Строка <роль>=<список>, роль - rx, writer или compute,
+ *                     список - как в parse_cpu_list().
+ * \param[out] role    Роль потоков.
+ * \param[out] cpus    Номера процессоров.
+ *
+ * \return true, если строка корректна, false иначе.
+ */
+bool parse_affinity(const std::string& spec, thread_roles& role, std::vector<int>& cpus)
+{
+    size_t eq = spec.find('=');
+    if (eq == std::string::npos)
+        return false;
+    std::string name = spec.substr(0, eq);
+    for (int i = THREAD_RECEIVE; i < THREAD_ROLE_COUNT; ++i)
+    {
+        if (name == thread_role_name(static_cast<thread_roles>(i)))
+        {
+            role = static_cast<thread_roles>(i);
+            return parse_cpu_list(spec.substr(eq + 1), cpus);
+        }
+    }
+    return false;
+}
+
+/** \brief Доступны ли процессоры процессу
+ *
+ * \param[in] cpus    Номера процессоров.
+ *
+ * \return true, если все процессоры входят в маску процесса, false иначе.
+ */
+bool cpus_allowed(const std::vector<int>& cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return false;
+    for (int cpu: cpus)
+        if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &set))
+            return false;
+    return true;
+}
+
+/** \brief Узел NUMA процессора
+ *
+ * \param[in] cpu    Номер процессора.
+ *
+ * \return Номер узла или -1, если его не удалось узнать.
+ */
+int cpu_node(int cpu)
+{
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr)
+        return -1;
+    int node = -1;
+    while (dirent *entry = readdir(dir))
+    {
+        std::string name = entry->d_name;
+        if (name.compare(0, 4, "node") == 0 && name.size() > 4)
+        {
+            node = atoi(name.c_str() + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/** \brief Закрепить поток за процессорами
+ *
+ * \param[in] thread    Поток.
+ * \param[in] cpus      Номера процессоров.
+ *
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */
+int pin_thread(pthread_t thread, const std::vector<int>& cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu: cpus)
+        CPU_SET(cpu, &set);
+    int result = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (result != 0)
+    {
+        errno = result;
+        return -1;
+    }
+    return 0;
+}
+
+/** \brief Выделять память потока на узле его процессоров
+ *
+ * Функция задает текущему потоку политику MPOL_PREFERRED: новые страницы
+ * потока выделяются на узле NUMA первого процессора из \p cpus , а если
+ * там нет памяти - на других узлах. Используется системный вызов, чтобы не
+ * зависеть от libnuma. Если узел неизвестен (ядро без NUMA), функция
+ * ничего не делает.
+ *
+ * \param[in] cpus    Номера процессоров.
+ *
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */
+int bind_thread_memory(const std::vector<int>& cpus)
+{
+    int node = cpus.empty() ? -1 : cpu_node(cpus.front());
+    if (node < 0 || node >= static_cast<int>(max_nodes))
+        return 0;
+    unsigned long mask[max_nodes / (8 * sizeof(unsigned long))] = {};
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    return syscall(SYS_set_mempolicy, mpol_preferred, mask, max_nodes) == 0 ? 0 : -1;
+}
+
+/** \brief Закрепить текущий поток
+ *
+ * Функция закрепляет текущий поток за процессорами \p cpus , выделяет его
+ * память на их узле NUMA и заранее создает \p package_slots слотов в 
+ * пуле пакетов потока. Слот возвращается в пул создавшего его потока, где
+ * бы ни был удален пакет, поэтому заполнять пул нужно только потоку, 
+ * который создает пакеты, - потоку приема. Тогда пакеты, которые он 
+ * создает, лежат в памяти его узла.
+ *
+ * \param[in] cpus             Номера процессоров.
+ * \param[in] package_slots    Число слотов пакетов, 0 - не заполнять пул.
+ *
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */
+int pin_current_thread(const std::vector<int>& cpus, size_t package_slots)
+{
+    if (pin_thread(pthread_self(), cpus) != 0 || bind_thread_memory(cpus) != 0)
+        return -1;
+    reserve_package_slots(package_slots);
+    return 0;
+}
+
+/** \brief Процессоры прерываний очередей приема интерфейса
+ *
+ * Функция находит прерывания MSI сетевой карты интерфейса \p ifname в
+ * /sys/class/net/<интерфейс>/device/msi_irqs (у virtio - у родительского
+ * устройства PCI) и объединяет их процессоры из
+ * /proc/irq/<номер>/smp_affinity_list. Учитываются прерывания, имя
+ * обработчика которых указывает на очередь приема (rx, input, comp для
+ * совмещенных очередей mlx5); если таких нет - все прерывания карты. На
+ * этих процессорах ядро обрабатывает принятые пакеты, поэтому поток приема
+ * на их узле NUMA читает данные из локальной памяти.
+ *
+ * \param[in]  ifname    Имя интерфейса.
+ * \param[out] cpus      Номера процессоров по возрастанию.
+ *
+ * \return true, если процессоры найдены, false, если у интерфейса нет
+ * прерываний MSI (loopback, veth, мосты) или они недоступны.
+ */
+bool interface_queue_cpus(const std::string& ifname, std::vector<int>& cpus)
+{
+    std::string device = "/sys/class/net/" + ifname + "/device";
+    DIR *dir = opendir((device + "/msi_irqs").c_str());
+    if (dir == nullptr)
+        dir = opendir((device + "/../msi_irqs").c_str());
+    if (dir == nullptr)
+        return false;
+    std::vector<int> irqs;
+    while (dirent *entry = readdir(dir))
+        if (entry->d_name[0] >= '0' && entry->d_name[0] <= '9')
+            irqs.push_back(atoi(entry->d_name));
+    closedir(dir);
+
+    std::vector<bool> any(CPU_SETSIZE, false);
+    std::vector<bool> queues(CPU_SETSIZE, false);
+    bool queue_found = false;
+    for (int irq: irqs)
+    {
+        std::string path = "/proc/irq/" + std::to_string(irq);
+        std::ifstream ifs(path + "/smp_affinity_list");
+        std::string list;
+        std::vector<int> irq_cpus;
+        if (!std::getline(ifs, list) || !parse_cpu_list(list, irq_cpus))
+            continue;
+        // имя обработчика - поддиректория /proc/irq/<номер>
+        bool queue = false;
+        if (DIR *actions = opendir(path.c_str()))
+        {
+            while (dirent *entry = readdir(actions))
+            {
+                std::string name = entry->d_name;
+                for (auto& c: name)
+                    c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+                if (entry->d_type == DT_DIR && (name.find("rx") != std::string::npos ||
+                    name.find("input") != std::string::npos || 
+                    name.find("comp") != std::string::npos))
+                    queue = true;
+            }
+            closedir(actions);
+        }
+        queue_found = queue_found || queue;
+        for (int cpu: irq_cpus)
+        {
+            any[cpu] = true;
+            if (queue)
+                queues[cpu] = true;
+        }
+    }
+    const std::vector<bool>& selected = queue_found ? queues : any;
+    cpus.clear();
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if (selected[cpu])
+            cpus.push_back(cpu);
+    return !cpus.empty();
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+// потоки сервера, которые можно закрепить за процессорами
+enum thread_roles {
+    THREAD_RECEIVE = 0,   // чтение сокета
+    THREAD_WRITER,        // запись и групповой fsync директорий хранения
+    THREAD_COMPUTE,       // пул обработки пакетов
+    THREAD_ROLE_COUNT
+};
+
+const char *thread_role_name(thread_roles role);
+
+bool parse_cpu_list(const std::string& spec, std::vector<int>& cpus);
+
+bool parse_affinity(const std::string& spec, thread_roles& role, std::vector<int>& cpus);
+
+bool cpus_allowed(const std::vector<int>& cpus);
+
+int cpu_node(int cpu);
+
+int pin_thread(pthread_t thread, const std::vector<int>& cpus);
+
+int bind_thread_memory(const std::vector<int>& cpus);
+
+int pin_current_thread(const std::vector<int>& cpus, size_t package_slots = 0);
+
+bool interface_queue_cpus(const std::string& ifname, std::vector<int>& cpus);
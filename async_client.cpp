@@ -0,0 +1,129 @@
+#include "async_client.h"
+
+#include <cerrno>
+
+/** \brief Конструктор асинхронного клиента
+ *
+ * Функция создает \p workers клиентов, подключенных к серверу \p addr : 
+ * \p port , и по потоку на каждого. Адрес разрешается и сокеты создаются 
+ * один раз, а файлы, поставленные в очередь функцией send_file, передаются 
+ * параллельно, до \p workers одновременно. Так один долгоживущий объект 
+ * передает любое число файлов без запуска процесса на файл.
+ *
+ * \param[in] addr       IPv4 адрес сервера.
+ * \param[in] port       Порт сервера.
+ * \param[in] workers    Число одновременных передач.
+ * \param[in] setup      Функция настройки каждого клиента, например 
+ *                       set_checksum или set_congestion_control.
+ *
+ * \throw std::runtime_error, если клиента создать не удалось.
+ */
+AsyncClient::AsyncClient(const std::string& addr, int port, size_t workers,
+                         const std::function<void(Client&)>& setup)
+    : m_active(0)
+    , m_stop(false)
+{
+    if (workers == 0)
+        workers = 1;
+    for (size_t i = 0; i < workers; ++i)
+    {
+        m_clients.emplace_back(new Client(addr, port));
+        if (setup)
+            setup(*m_clients.back());
+    }
+    for (auto& client: m_clients)
+        m_threads.emplace_back(&AsyncClient::run, this, std::ref(*client));
+}
+
+/** \brief Деструктор асинхронного клиента
+ *
+ * Функция дожидается передачи всех файлов в очереди и останавливает потоки.
+ */
+AsyncClient::~AsyncClient()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    for (auto& thread: m_threads)
+        thread.join();
+}
+
+/** \brief Передать файл
+ *
+ * Функция ставит файл \p filename в очередь передачи и сразу возвращает 
+ * управление.
+ *
+ * \return Будущий результат передачи.
+ */
+std::future<TransferResult> AsyncClient::send_file(const std::string& filename)
+{
+    auto promise = std::make_shared<std::promise<TransferResult>>();
+    std::future<TransferResult> future = promise->get_future();
+    send_file(filename, [promise](const TransferResult& result) {
+        promise->set_value(result);
+    });
+    return future;
+}
+
+/** \brief Передать файл с обратным вызовом
+ *
+ * Функция ставит файл \p filename в очередь передачи и сразу возвращает 
+ * управление. После передачи \p callback вызывается с результатом в потоке
+ * передачи, поэтому он должен быть быстрым и потокобезопасным.
+ */
+void AsyncClient::send_file(const std::string& filename, const TransferCallback& callback)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back({filename, callback});
+    }
+    m_cv.notify_one();
+}
+
+/** \brief Число незавершенных передач
+ *
+ * \return Файлы в очереди и передаваемые сейчас.
+ */
+size_t AsyncClient::pending() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queue.size() + m_active;
+}
+
+/** \brief Дождаться передачи всех файлов
+ */
+void AsyncClient::wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_idle.wait(lock, [this]() { return m_queue.empty() && m_active == 0; });
+}
+
+void AsyncClient::run(Client& client)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_cv.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+        if (m_queue.empty())
+            return;
+        Transfer transfer = std::move(m_queue.front());
+        m_queue.pop_front();
+        ++m_active;
+        lock.unlock();
+
+        TransferResult result;
+        result.filename = transfer.filename;
+        result.result = client.send_file(transfer.filename);
+        result.error = result.result < 0 ? errno : 0;
+        result.stats = client.get_send_stats();
+        if (transfer.callback)
+            transfer.callback(result);
+
+        lock.lock();
+        --m_active;
+        if (m_queue.empty() && m_active == 0)
+            m_idle.notify_all();
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "client.h"
+#include "stats.h"
+
+struct TransferResult {
+    std::string filename;
+    int result = 0;      // 0 или -1, код ошибки в error
+    int error = 0;       // errno при ошибке
+    SendStats stats;
+};
+
+typedef std::function<void(const TransferResult& result)> TransferCallback;
+
+class AsyncClient {
+public:
+    AsyncClient(const std::string& addr, int port, size_t workers = 4,
+                const std::function<void(Client&)>& setup = nullptr);
+
+    ~AsyncClient();
+
+    std::future<TransferResult> send_file(const std::string& filename);
+
+    void send_file(const std::string& filename, const TransferCallback& callback);
+
+    size_t pending() const;
+
+    void wait();
+
+private:
+    struct Transfer {
+        std::string filename;
+        TransferCallback callback;
+    };
+
+    std::vector<std::unique_ptr<Client>> m_clients;
+    std::vector<std::thread> m_threads;
+    std::deque<Transfer> m_queue;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::condition_variable m_idle;
+    size_t m_active;
+    bool m_stop;
+
+    AsyncClient(const AsyncClient&) = delete;
+
+    AsyncClient& operator=(const AsyncClient&) = delete;
+
+    void run(Client& client);
+};
@@ -0,0 +1,179 @@
+#!/bin/bash
+#
+# Сквозной замер скорости передачи файлов через loopback.
+#
+# Скрипт запускает udp_server и передает ему udp_client файлы нескольких
+# размеров. Для каждого файла выводится JSON-объект со скоростью передачи,
+# числом пакетов в секунду, процессорным временем клиента и сервера на
+# гигабайт данных и задержкой от запуска клиента до записи файла сервером.
+#
+# Настройки задаются переменными окружения:
+#   BENCH_SIZES        размеры файлов в байтах, допустимы суффиксы K и M
+#                      (по умолчанию "1M 4M 16M")
+#   BENCH_DATA         random - случайные данные, text - сжимаемый текст
+#   BENCH_CLIENT_OPTS  опции udp_client, например "-k -z"
+#   BENCH_SERVER_OPTS  опции udp_server
+#   BENCH_PORT         порт сервера (по умолчанию 9999)
+#   BENCH_OUTPUT       файл, в который дополнительно пишется результат
+#   BENCH_TIMEOUT      максимальное время ожидания файла, секунд
+
+set -u
+
+SIZES=${BENCH_SIZES:-"1M 4M 16M"}
+DATA=${BENCH_DATA:-random}
+CLIENT_OPTS=${BENCH_CLIENT_OPTS:-}
+SERVER_OPTS=${BENCH_SERVER_OPTS:-}
+PORT=${BENCH_PORT:-9999}
+OUTPUT=${BENCH_OUTPUT:-}
+TIMEOUT=${BENCH_TIMEOUT:-300}
+ADDR=127.0.0.1
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+CLIENT=$HERE/udp_client
+SERVER=$HERE/udp_server
+CLK_TCK=$(getconf CLK_TCK)
+
+WORK=$(mktemp -d)
+SERVER_PID=
+
+cleanup()
+{
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null
+        wait "$SERVER_PID" 2>/dev/null
+    fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+fail()
+{
+    echo "bench: $*" >&2
+    exit 1
+}
+
+# размер с суффиксом K или M в байтах
+to_bytes()
+{
+    case $1 in
+        *K) echo $(( ${1%K} * 1024 )) ;;
+        *M) echo $(( ${1%M} * 1024 * 1024 )) ;;
+        *)  echo "$1" ;;
+    esac
+}
+
+# процессорное время процесса в тиках (utime + stime)
+proc_cpu_ticks()
+{
+    awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+# значение счетчика UDP из /proc/net/snmp
+udp_counter()
+{
+    awk -v name="$1" '
+        $1 == "Udp:" && !header { for (i = 2; i <= NF; i++) col[$i] = i; header = 1; next }
+        $1 == "Udp:" && header  { print $col[name]; exit }
+    ' /proc/net/snmp
+}
+
+now_ns()
+{
+    date +%s%N
+}
+
+generate()
+{
+    local file=$1 size=$2
+    if [ "$DATA" = text ]; then
+        awk -v size="$size" 'BEGIN {
+            srand(1)
+            while (n < size) {
+                line = sprintf("%d,2026-01-%02d,user%d,%s,%d\n", i++, i % 28 + 1,
+                               int(rand() * 50), (rand() < 0.5 ? "GET" : "POST"),
+                               int(rand() * 900) + 100)
+                printf "%s", line
+                n += length(line)
+            }
+        }' | head -c "$size" > "$file"
+    else
+        head -c "$size" /dev/urandom > "$file"
+    fi
+}
+
+[ -x "$CLIENT" ] && [ -x "$SERVER" ] || fail "сначала выполните make all"
+
+mkdir -p "$WORK/in" "$WORK/out"
+stdbuf -oL "$SERVER" $SERVER_OPTS "$ADDR" "$PORT" "$WORK/out" > "$WORK/server.log" 2>&1 &
+SERVER_PID=$!
+for _ in $(seq 100); do
+    grep -q "Ожидание" "$WORK/server.log" && break
+    kill -0 "$SERVER_PID" 2>/dev/null || fail "сервер не запустился: $(cat "$WORK/server.log")"
+    sleep 0.05
+done
+
+results=()
+for size_arg in $SIZES; do
+    size=$(to_bytes "$size_arg")
+    name="bench_$size.bin"
+    generate "$WORK/in/$name" "$size"
+
+    server_ticks_before=$(proc_cpu_ticks "$SERVER_PID")
+    out_before=$(udp_counter OutDatagrams)
+    drops_before=$(udp_counter RcvbufErrors)
+    start=$(now_ns)
+
+    TIMEFORMAT="%U %S"
+    client_cpu=$( { time "$CLIENT" $CLIENT_OPTS "$ADDR" "$PORT" "$WORK/in/$name" \
+                    > "$WORK/client.log" 2>&1; } 2>&1 ) || fail "клиент завершился с ошибкой: $(cat "$WORK/client.log")"
+    sent=$(now_ns)
+
+    deadline=$(( sent + TIMEOUT * 1000000000 ))
+    status=ok
+    until grep -q "Получен файл \"$WORK/out/$name\"" "$WORK/server.log"; do
+        if grep -q "удален файл \"$WORK/out/$name\"" "$WORK/server.log" ||
+           [ "$(now_ns)" -gt "$deadline" ]; then
+            status=lost
+            break
+        fi
+        sleep 0.005
+    done
+    done_at=$(now_ns)
+    if [ "$status" = ok ] && ! cmp -s "$WORK/in/$name" "$WORK/out/$name"; then
+        status=corrupted
+    fi
+
+    server_ticks=$(( $(proc_cpu_ticks "$SERVER_PID") - server_ticks_before ))
+    packets=$(( $(udp_counter OutDatagrams) - out_before ))
+    drops=$(( $(udp_counter RcvbufErrors) - drops_before ))
+
+    results+=("$(awk -v size="$size" -v start="$start" -v sent="$sent" -v done_at="$done_at" \
+        -v client_cpu="$client_cpu" -v server_ticks="$server_ticks" -v tck="$CLK_TCK" \
+        -v packets="$packets" -v drops="$drops" -v status="$status" \
+        -v opts="$CLIENT_OPTS" -v data="$DATA" 'BEGIN {
+        split(client_cpu, c, " ")
+        elapsed = (done_at - start) / 1e9
+        send_time = (sent - start) / 1e9
+        gb = size / 1e9
+        client = c[1] + c[2]
+        server = server_ticks / tck
+        printf "{\"size\": %d, \"data\": \"%s\", \"client_opts\": \"%s\", \"status\": \"%s\", ", size, data, opts, status
+        printf "\"mb_per_s\": %.3f, \"packets\": %d, \"packets_per_s\": %.1f, ", size / 1e6 / elapsed, packets, packets / elapsed
+        printf "\"rcvbuf_drops\": %d, \"send_time_s\": %.6f, \"completion_latency_s\": %.6f, ", drops, send_time, elapsed
+        printf "\"client_cpu_s\": %.3f, \"server_cpu_s\": %.3f, ", client, server
+        printf "\"client_cpu_s_per_gb\": %.3f, \"server_cpu_s_per_gb\": %.3f}", client / gb, server / gb
+    }')")
+    rm -f "$WORK/in/$name" "$WORK/out/$name"
+done
+
+json="["
+for i in "${!results[@]}"; do
+    [ "$i" -gt 0 ] && json+=","
+    json+=$'\n  '"${results[$i]}"
+done
+json+=$'\n]'
+
+echo "$json"
+if [ -n "$OUTPUT" ]; then
+    echo "$json" > "$OUTPUT"
+fi
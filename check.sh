@@ -0,0 +1,89 @@
+#!/bin/bash
+#
+# Сквозная проверка повторного использования клиента.
+#
+# Скрипт запускает udp_server и передает ему два файла одним вызовом
+# udp_client -c, то есть одним клиентом через один сокет. Проверка
+# завершается ошибкой, если хотя бы один файл не принят или поврежден или
+# если клиент при передаче второго файла не принял ни одного отчета о
+# приеме либо снижал скорость по тайм-ауту отчетов. Время передачи файлов
+# выводится для сравнения.
+#
+# Настройки задаются переменными окружения:
+#   CHECK_SIZE       размер каждого файла (по умолчанию 64M)
+#   CHECK_PORT       порт сервера (по умолчанию 9998)
+#   CHECK_TIMEOUT    максимальное время ожидания файла, секунд
+
+set -u
+
+SIZE=${CHECK_SIZE:-64M}
+PORT=${CHECK_PORT:-9998}
+TIMEOUT=${CHECK_TIMEOUT:-60}
+ADDR=127.0.0.1
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+CLIENT=$HERE/udp_client
+SERVER=$HERE/udp_server
+
+WORK=$(mktemp -d)
+SERVER_PID=
+
+cleanup()
+{
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null
+        wait "$SERVER_PID" 2>/dev/null
+    fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+fail()
+{
+    echo "check: $*" >&2
+    exit 1
+}
+
+[ -x "$CLIENT" ] && [ -x "$SERVER" ] || fail "сначала выполните make all"
+
+case $SIZE in
+    *K) bytes=$(( ${SIZE%K} * 1024 )) ;;
+    *M) bytes=$(( ${SIZE%M} * 1024 * 1024 )) ;;
+    *)  bytes=$SIZE ;;
+esac
+
+mkdir -p "$WORK/in" "$WORK/out"
+head -c "$bytes" /dev/urandom > "$WORK/in/first.bin"
+head -c "$bytes" /dev/urandom > "$WORK/in/second.bin"
+
+stdbuf -oL "$SERVER" "$ADDR" "$PORT" "$WORK/out" > "$WORK/server.log" 2>&1 &
+SERVER_PID=$!
+for _ in $(seq 100); do
+    grep -q "Ожидание" "$WORK/server.log" && break
+    kill -0 "$SERVER_PID" 2>/dev/null || fail "сервер не запустился: $(cat "$WORK/server.log")"
+    sleep 0.05
+done
+
+"$CLIENT" -c -j "$ADDR" "$PORT" "$WORK/in/first.bin" "$WORK/in/second.bin" \
+    > "$WORK/client.log" 2>&1 || fail "клиент завершился с ошибкой: $(cat "$WORK/client.log")"
+
+for name in first.bin second.bin; do
+    deadline=$(( $(date +%s) + TIMEOUT ))
+    until grep -q "Получен файл \"$WORK/out/$name\"" "$WORK/server.log"; do
+        grep -q "удален файл \"$WORK/out/$name\"" "$WORK/server.log" && fail "файл $name потерян"
+        [ "$(date +%s)" -gt "$deadline" ] && fail "файл $name не получен за $TIMEOUT с"
+        sleep 0.01
+    done
+    cmp -s "$WORK/in/$name" "$WORK/out/$name" || fail "файл $name поврежден"
+done
+
+# по строке "Скорость:" и JSON со временем передачи на каждый файл
+reports=($(grep "^Скорость:" "$WORK/client.log" | sed -n 's/.*feedback_reports=\([0-9]*\).*/\1/p'))
+timeouts=($(grep "^Скорость:" "$WORK/client.log" | sed -n 's/.*timeouts=\([0-9]*\).*/\1/p'))
+times=($(grep -o '"elapsed_ms": *[0-9.]*' "$WORK/client.log" | sed 's/.*: *//'))
+[ "${#reports[@]}" -eq 2 ] && [ "${#timeouts[@]}" -eq 2 ] && [ "${#times[@]}" -eq 2 ] ||
+    fail "неожиданный вывод клиента: $(cat "$WORK/client.log")"
+[ "${reports[1]}" -gt 0 ] || fail "второй файл: отчеты о приеме не приняты"
+[ "${timeouts[1]}" -eq 0 ] || fail "второй файл: тайм-аутов отчетов ${timeouts[1]}"
+
+echo "check: ok, ${times[0]} мс и ${times[1]} мс"
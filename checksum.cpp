@@ -0,0 +1,296 @@
+#include "checksum.h"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+static const uint32_t crc32c_poly = 0x82F63B78;   // отраженный полином Castagnoli
+
+static const uint64_t prime64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t prime64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t prime64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t prime64_5 = 0x27D4EB2F165667C5ULL;
+
+/** \brief Таблицы программного CRC32C
+ *
+ * Таблицы для вычисления CRC32C методом slicing-by-8. Заполняются один раз
+ * при первом обращении.
+ */
+struct Crc32cTables {
+    uint32_t table[8][256];
+
+    Crc32cTables()
+    {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; ++j)
+                crc = (crc & 1) ? (crc >> 1) ^ crc32c_poly : crc >> 1;
+            table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; ++i)
+            for (int k = 1; k < 8; ++k)
+                table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+    }
+};
+
+static const Crc32cTables& crc32c_tables()
+{
+    static const Crc32cTables tables;
+    return tables;
+}
+
+/** \brief Программный CRC32C
+ *
+ * Переносимая реализация CRC32C, обрабатывающая по 8 байт за итерацию.
+ * Используется, если процессор не поддерживает инструкцию crc32 из SSE4.2.
+ */
+static uint32_t crc32c_software(uint32_t crc, const unsigned char *p, size_t len)
+{
+    const Crc32cTables& t = crc32c_tables();
+    while (len >= 8)
+    {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, p, sizeof(lo));
+        memcpy(&hi, p + 4, sizeof(hi));
+        lo ^= crc;
+        crc = t.table[7][lo & 0xFF] ^ t.table[6][(lo >> 8) & 0xFF] ^
+              t.table[5][(lo >> 16) & 0xFF] ^ t.table[4][lo >> 24] ^
+              t.table[3][hi & 0xFF] ^ t.table[2][(hi >> 8) & 0xFF] ^
+              t.table[1][(hi >> 16) & 0xFF] ^ t.table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc >> 8) ^ t.table[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__)
+/** \brief Аппаратный CRC32C
+ *
+ * Реализация CRC32C на инструкции crc32 из набора SSE4.2. Функция
+ * компилируется с отдельным целевым набором инструкций, поэтому остальная
+ * программа не требует -msse4.2.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t crc64 = crc;
+    while (len >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    uint32_t crc32 = static_cast<uint32_t>(crc64);
+    while (len--)
+        crc32 = _mm_crc32_u8(crc32, *p++);
+    return crc32;
+}
+#endif
+
+typedef uint32_t (*crc32c_fn)(uint32_t, const unsigned char *, size_t);
+
+/** \brief Выбор реализации CRC32C
+ *
+ * Функция определяет возможности процессора и возвращает самую быструю из
+ * доступных реализаций CRC32C.
+ */
+static crc32c_fn select_crc32c()
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        return crc32c_hardware;
+#endif
+    return crc32c_software;
+}
+
+static const crc32c_fn crc32c_impl = select_crc32c();
+
+/** \brief Вычисление CRC32C
+ *
+ * Функция вычисляет контрольную сумму CRC32C (полином Castagnoli) для \p len
+ * байтов из \p data . Сумму можно считать по частям, передавая в \p crc
+ * результат предыдущего вызова. Для первого вызова \p crc должен быть 0.
+ *
+ * \param[in] crc     Контрольная сумма предыдущих частей данных.
+ * \param[in] data    Данные.
+ * \param[in] len     Размер данных в байтах.
+ *
+ * \return Контрольная сумма.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    return ~crc32c_impl(~crc, static_cast<const unsigned char *>(data), len);
+}
+
+/** \brief Используется ли аппаратный CRC32C
+ *
+ * \return true, если контрольная сумма считается инструкциями процессора,
+ * false, если используется переносимая реализация.
+ */
+bool crc32c_is_hardware()
+{
+#if defined(__x86_64__)
+    return crc32c_impl == crc32c_hardware;
+#else
+    return false;
+#endif
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * prime64_2;
+    acc = rotl64(acc, 31);
+    return acc * prime64_1;
+}
+
+static inline uint64_t hash_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= hash_round(0, val);
+    return acc * prime64_1 + prime64_4;
+}
+
+/** \brief Конструктор потокового хеша файла
+ *
+ * Функция создает объект для вычисления 64-битного хеша (алгоритм XXH64)
+ * по частям. Хеш используется для проверки целостности файла целиком и
+ * считается по мере чтения или записи данных, без отдельного прохода по файлу.
+ *
+ * \param[in] seed    Начальное значение хеша.
+ */
+FileHash::FileHash(uint64_t seed)
+{
+    reset(seed);
+}
+
+/** \brief Сброс хеша
+ *
+ * Функция возвращает объект в начальное состояние.
+ *
+ * \param[in] seed    Начальное значение хеша.
+ */
+void FileHash::reset(uint64_t seed)
+{
+    m_seed = seed;
+    m_acc[0] = seed + prime64_1 + prime64_2;
+    m_acc[1] = seed + prime64_2;
+    m_acc[2] = seed;
+    m_acc[3] = seed - prime64_1;
+    m_total_len = 0;
+    m_tail_size = 0;
+}
+
+/** \brief Добавить данные в хеш
+ *
+ * Функция добавляет очередную часть данных \p data размером \p len в хеш.
+ *
+ * \param[in] data    Данные.
+ * \param[in] len     Размер данных в байтах.
+ */
+void FileHash::update(const void *data, size_t len)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    m_total_len += len;
+    if (m_tail_size + len < sizeof(m_tail))
+    {
+        memcpy(m_tail + m_tail_size, p, len);
+        m_tail_size += static_cast<uint32_t>(len);
+        return;
+    }
+    if (m_tail_size > 0)
+    {
+        size_t fill = sizeof(m_tail) - m_tail_size;
+        memcpy(m_tail + m_tail_size, p, fill);
+        for (int i = 0; i < 4; ++i)
+            m_acc[i] = hash_round(m_acc[i], read64(m_tail + i * 8));
+        p += fill;
+        len -= fill;
+        m_tail_size = 0;
+    }
+    while (len >= sizeof(m_tail))
+    {
+        for (int i = 0; i < 4; ++i)
+            m_acc[i] = hash_round(m_acc[i], read64(p + i * 8));
+        p += sizeof(m_tail);
+        len -= sizeof(m_tail);
+    }
+    memcpy(m_tail, p, len);
+    m_tail_size = static_cast<uint32_t>(len);
+}
+
+/** \brief Значение хеша
+ *
+ * Функция возвращает хеш всех данных, добавленных методом update(). Объект
+ * при этом не изменяется, поэтому добавление данных можно продолжить.
+ *
+ * \return 64-битный хеш.
+ */
+uint64_t FileHash::digest() const
+{
+    uint64_t h;
+    if (m_total_len >= sizeof(m_tail))
+    {
+        h = rotl64(m_acc[0], 1) + rotl64(m_acc[1], 7) +
+            rotl64(m_acc[2], 12) + rotl64(m_acc[3], 18);
+        for (int i = 0; i < 4; ++i)
+            h = hash_merge_round(h, m_acc[i]);
+    } else {
+        h = m_seed + prime64_5;
+    }
+    h += m_total_len;
+
+    const unsigned char *p = m_tail;
+    uint32_t len = m_tail_size;
+    while (len >= 8)
+    {
+        h ^= hash_round(0, read64(p));
+        h = rotl64(h, 27) * prime64_1 + prime64_4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4)
+    {
+        h ^= static_cast<uint64_t>(read32(p)) * prime64_1;
+        h = rotl64(h, 23) * prime64_2 + prime64_3;
+        p += 4;
+        len -= 4;
+    }
+    while (len--)
+    {
+        h ^= (*p++) * prime64_5;
+        h = rotl64(h, 11) * prime64_1;
+    }
+    h ^= h >> 33;
+    h *= prime64_2;
+    h ^= h >> 29;
+    h *= prime64_3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#define CHECKSUM_SIZE  sizeof(uint32_t)
+#define FILE_HASH_SIZE sizeof(uint64_t)
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+bool crc32c_is_hardware();
+
+class FileHash {
+public:
+    FileHash(uint64_t seed = 0);
+
+    void reset(uint64_t seed = 0);
+
+    void update(const void *data, size_t len);
+
+    uint64_t digest() const;
+
+private:
+    uint64_t m_acc[4];
+    uint64_t m_seed;
+    uint64_t m_total_len;
+    unsigned char m_tail[32];
+    uint32_t m_tail_size;
+};
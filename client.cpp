@@ -1,4 +1,24 @@
 #include "client.h"
+#include "compression.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <random>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+
+static const uint32_t max_compression_backoff = 64;   // пакетов без попыток сжатия
+static const int signature_request_attempts  = 3;    // запросов сигнатур до отказа от дельты
+static const int signature_timeout_ms        = 500;  // ожидание очередного пакета сигнатур
+static const int signature_rcvbuf_size       = 4 * 1024 * 1024;
+static const uint64_t max_copy_op_bytes      = 4 * 1024 * 1024; // блоков в одной ссылке
+static const microseconds sample_interval(100 * 1000);  // интервал замера скорости
+static const int max_send_retries            = 1000; // повторов sendto при EAGAIN/ENOBUFS
+static const int send_retry_delay_us         = 50;
+static const int default_multicast_ttl       = 1;    // группа не выходит за пределы сети
+static const seconds receiver_timeout(1);            // без отчетов получатель группы забывается
 
 /** \brief Констуктор  клиента
  * 
@@ -21,6 +41,15 @@
 Client::Client(const std::string &addr, int port)
     : m_port(port)
     , m_addr(addr)
+    , m_checksum(false)
+    , m_compression(false)
+    , m_block_size(0)
+    , m_compression_backoff(0)
+    , m_skip_compression(0)
+    , m_delta(false)
+    , m_congestion(false)
+    , m_multicast(false)
+    , m_phase_clock(m_send_stats)
 {
     addrinfo hint;
     memset(&hint, 0, sizeof(hint));
@@ -39,6 +68,15 @@ Client::Client(const std::string &addr, int port)
         freeaddrinfo(m_addrinfo);
         throw std::runtime_error("не смог создать сокет");
     }
+    const sockaddr_in *server = reinterpret_cast<const sockaddr_in *>(m_addrinfo->ai_addr);
+    m_multicast = IN_MULTICAST(ntohl(server->sin_addr.s_addr));
+    if (m_multicast)
+    {
+        // копия для серверов на этой же машине
+        int loop = 1;
+        setsockopt(m_socket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+        set_multicast_ttl(default_multicast_ttl);
+    }
 }
 
 /** \brief Очистка объекта клиента
@@ -89,22 +127,220 @@ int Client::get_socket() const
     return m_socket;
 }
 
+/** \brief Включить проверку целостности.
+ * 
+ * Функция включает или выключает режим проверки целостности. В этом режиме
+ * каждый пакет содержит контрольную сумму CRC32C, а последним пакетом 
+ * передается хеш всего файла, по которому сервер проверяет записанный файл.
+ * 
+ * \param[in] enabled    true, чтобы включить режим, false иначе.
+ */ 
+void Client::set_checksum(bool enabled)
+{
+    m_checksum = enabled;
+}
+
+/** \brief Включена ли проверка целостности.
+ * 
+ * \return true, если режим проверки целостности включен, false иначе.
+ */ 
+bool Client::get_checksum() const
+{
+    return m_checksum;
+}
+
+/** \brief Включить сжатие данных.
+ * 
+ * Функция включает или выключает сжатие данных файла. В этом режиме данные
+ * сжимаются блоками, каждый из которых помещается в один пакет и 
+ * распаковывается сервером независимо от остальных. Размер блока 
+ * подбирается по степени сжатия предыдущих блоков, а несжимаемые блоки 
+ * передаются как есть.
+ * 
+ * \param[in] enabled    true, чтобы включить сжатие, false иначе.
+ */ 
+void Client::set_compression(bool enabled)
+{
+    m_compression = enabled;
+    if (enabled && m_scratch.empty())
+        m_scratch.resize(compress_bound(MAX_COMPRESSION_BLOCK));
+}
+
+/** \brief Включено ли сжатие данных.
+ * 
+ * \return true, если сжатие данных включено, false иначе.
+ */ 
+bool Client::get_compression() const
+{
+    return m_compression;
+}
+
+/** \brief Статистика сжатия.
+ * 
+ * Функция возвращает статистику сжатия всех переданных клиентом данных:
+ * исходный и переданный объем, число сжатых и несжатых блоков и 
+ * процессорное время, затраченное на сжатие.
+ * 
+ * \return Ссылка на статистику сжатия.
+ */ 
+const CodecStats& Client::get_codec_stats() const
+{
+    return m_codec_stats;
+}
+
+/** \brief Включить дельта-передачу.
+ * 
+ * Функция включает или выключает дельта-передачу. В этом режиме клиент 
+ * запрашивает у сервера сигнатуры блоков его копии файла и передает только
+ * измененные участки, а для остальных - ссылки на блоки копии сервера. Если 
+ * сервер не ответил или у него нет копии файла, файл передается целиком.
+ * 
+ * \param[in] enabled    true, чтобы включить режим, false иначе.
+ */ 
+void Client::set_delta(bool enabled)
+{
+    m_delta = enabled;
+}
+
+/** \brief Включена ли дельта-передача.
+ * 
+ * \return true, если дельта-передача включена, false иначе.
+ */ 
+bool Client::get_delta() const
+{
+    return m_delta;
+}
+
+/** \brief Статистика дельта-передачи.
+ * 
+ * \return Ссылка на статистику дельта-передачи: число полученных сигнатур,
+ * совпавших блоков и объем переданных новых данных.
+ */ 
+const DeltaStats& Client::get_delta_stats() const
+{
+    return m_delta_stats;
+}
+
+/** \brief Включить управление скоростью.
+ * 
+ * Функция включает или выключает управление скоростью отправки по отчетам
+ * сервера о приеме. Без него клиент отправляет один пакет в миллисекунду.
+ * Как меняется скорость, смотрите в CongestionController::on_feedback().
+ * 
+ * \param[in] enabled    true, чтобы включить режим, false иначе.
+ */ 
+void Client::set_congestion_control(bool enabled)
+{
+    m_congestion = enabled;
+}
+
+/** \brief Включено ли управление скоростью.
+ * 
+ * \return true, если управление скоростью включено, false иначе.
+ */ 
+bool Client::get_congestion_control() const
+{
+    return m_congestion;
+}
+
+/** \brief Статистика управления скоростью.
+ * 
+ * \return Ссылка на статистику: число отчетов сервера, потери, случаи 
+ * уменьшения скорости, текущая и наибольшая скорость.
+ */ 
+const CongestionStats& Client::get_congestion_stats() const
+{
+    const CongestionController *slowest = &m_congestion_control;
+    for (const auto& receiver: m_receivers)
+        if (slowest == &m_congestion_control || receiver.second.control.rate() < slowest->rate())
+            slowest = &receiver.second.control;
+    return slowest->get_stats();
+}
+
+/** \brief Групповая ли передача.
+ * 
+ * Клиент передает файлы группе, если адрес сервера - групповой IPv4 адрес
+ * (224.0.0.0/4). Каждую датаграмму получают все серверы, вступившие в 
+ * группу, а отчеты о приеме приходят от каждого из них отдельно. Скорость
+ * отправки задает самый медленный получатель, смотрите Client::pace().
+ * Дельта-передача в групповом режиме не используется: у получателей 
+ * могут быть разные прежние версии файла.
+ * 
+ * \return true, если адрес сервера групповой, false иначе.
+ */ 
+bool Client::get_multicast() const
+{
+    return m_multicast;
+}
+
+/** \brief Задать время жизни групповых датаграмм.
+ * 
+ * По умолчанию время жизни равно default_multicast_ttl, и датаграммы не 
+ * проходят через маршрутизаторы.
+ * 
+ * \param[in] ttl    Число маршрутизаторов, которые может пройти датаграмма.
+ * 
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */ 
+int Client::set_multicast_ttl(int ttl)
+{
+    unsigned char value = static_cast<unsigned char>(ttl);
+    if (ttl < 0 || ttl > 255)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return setsockopt(m_socket, IPPROTO_IP, IP_MULTICAST_TTL, &value, sizeof(value));
+}
+
+/** \brief Задать интерфейс для групповой передачи.
+ * 
+ * Без этого интерфейс выбирается по таблице маршрутизации.
+ * 
+ * \param[in] interface    IPv4 адрес интерфейса.
+ * 
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */ 
+int Client::set_multicast_interface(const std::string& interface)
+{
+    in_addr address;
+    if (inet_pton(AF_INET, interface.c_str(), &address) != 1)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return setsockopt(m_socket, IPPROTO_IP, IP_MULTICAST_IF, &address, sizeof(address));
+}
+
+/** \brief Статистика отправки.
+ * 
+ * \return Ссылка на статистику последней передачи: время по фазам 
+ * send_phases, число отправленных датаграмм, отказов sendto с EAGAIN и
+ * ENOBUFS и замеры скорости каждые sample_interval.
+ */ 
+const SendStats& Client::get_send_stats() const
+{
+    return m_send_stats;
+}
+
 /** \brief Получить случайное значение.
  * 
- * Функция возвращает случайное значение, полученное с помощью стандарной
- * функции  rand().
+ * Функция возвращает случайное значение из генератора потока, засеянного
+ * std::random_device. Каждый файл получает свой идентификатор потока 
+ * пакетов, даже если один клиент передает много файлов.
  * 
  * \return Возвращает целое число.
  */ 
 int get_random_value() {
-    static auto seed = std::time(nullptr);
-    std::srand(static_cast<unsigned int>(seed));
-    return std::rand();
+    static thread_local std::mt19937 rng(std::random_device{}());
+    return static_cast<int>(rng() & 0x7fffffff);
 }
 
 /** \brief Отправить данные через клиент. 
  * 
  * Функция отправляет данные из \p data в клиентский сокет по протоколу UDP.
+ * Если очередь отправки ядра переполнена (EAGAIN или ENOBUFS), отправка 
+ * повторяется после короткой паузы, а отказы учитываются в статистике.
  * 
  * \param[in] data    Данные для отправки.
  * \param[in] len     Длина данных в байтах. 
@@ -120,7 +356,179 @@ int Client::send(const char *data, int len) {
     print_package_as_row(package);
 #endif
 
-    return sendto(m_socket, data, len, 0, m_addrinfo->ai_addr, m_addrinfo->ai_addrlen);
+    int result;
+    {
+        PhaseScope phase(m_phase_clock, PHASE_SEND);
+        for (int retry = 0; ; ++retry)
+        {
+            result = sendto(m_socket, data, len, 0, m_addrinfo->ai_addr, 
+                            m_addrinfo->ai_addrlen);
+            if (result >= 0 || retry == max_send_retries)
+                break;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                ++m_send_stats.eagain;
+            else if (errno == ENOBUFS)
+                ++m_send_stats.enobufs;
+            else
+                break;
+            PhaseScope wait(m_phase_clock, PHASE_PACING);
+            usleep(send_retry_delay_us);
+        }
+    }
+    if (result >= 0)
+        m_phase_clock.on_sent(result);
+    return result;
+}
+
+/** \brief Ограниченный по времени прием
+ * 
+ * Функция ожидает ответ сервера на сокете клиента не дольше 
+ * \p max_waiting_time_ms миллисекунд.
+ * 
+ * \param[in] buf                  Массив байтов, куда будет записан ответ.
+ * \param[in] buf_len              Размер массива байтов.
+ * \param[in] max_waiting_time_ms  Максимальное время ожидания.
+ * 
+ * \return -1, в случае ошибки или по таймауту (errno равен EAGAIN), иначе
+ * количество принятых байтов.
+ */ 
+int Client::timed_recv(char *buf, int buf_len, int max_waiting_time_ms)
+{
+    PhaseScope phase(m_phase_clock, PHASE_RECEIVE);
+    fd_set s;
+    FD_ZERO(&s);
+    FD_SET(m_socket, &s);
+    struct timeval timeout;
+    timeout.tv_sec = max_waiting_time_ms / 1000;
+    timeout.tv_usec = (max_waiting_time_ms % 1000) * 1000;
+    int result = select(m_socket + 1, &s, 0, 0, &timeout);
+    if (result < 0)
+        return -1;
+    else if (result == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    return recvfrom(m_socket, buf, buf_len, 0, nullptr, nullptr);
+}
+
+/** \brief Прием отчетов сервера.
+ * 
+ * Функция без ожидания читает из сокета все пришедшие отчеты сервера о 
+ * приеме пакетов файла \p marker и передает их контроллеру скорости.
+ * В групповом режиме у каждого получателя свой контроллер, получатель
+ * определяется по адресу, с которого пришел отчет.
+ * 
+ * \param[in] marker    Идентификатор файла.
+ */ 
+void Client::poll_feedback(uint32_t marker)
+{
+    PhaseScope phase(m_phase_clock, PHASE_RECEIVE);
+    char buf[MAX_PACKAGE_SIZE];
+    sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    int bytes;
+    while ((bytes = recvfrom(m_socket, buf, sizeof(buf), MSG_DONTWAIT,
+                             reinterpret_cast<sockaddr *>(&from), &from_len)) >= 0)
+    {
+        from_len = sizeof(from);
+        if (bytes < static_cast<int>(HEADER_SIZE))
+            continue;
+        Package reply(buf, bytes);
+        FeedbackReport report;
+        if (!reply.valid() || !reply.has_option(FLAG_CONTROL) ||
+            reply.get_marker() != marker ||
+            !read_feedback(reply.get_data(), reply.get_data_size(), report))
+            continue;
+        auto now = steady_clock::now();
+        if (!m_multicast)
+        {
+            m_congestion_control.on_feedback(report, now);
+            continue;
+        }
+        uint64_t id = static_cast<uint64_t>(ntohl(from.sin_addr.s_addr)) << 16 | 
+                      ntohs(from.sin_port);
+        auto it = m_receivers.find(id);
+        if (it == m_receivers.end())
+            it = m_receivers.emplace(id, Receiver()).first;
+        it->second.control.on_feedback(report, now);
+        it->second.last_report = now;
+    }
+}
+
+/** \brief Время отправки следующего пакета.
+ * 
+ * Функция проверяет отсутствие отчетов и возвращает время, раньше которого
+ * следующий пакет отправлять не нужно. В групповом режиме это наибольшее
+ * время среди контроллеров получателей: группа движется со скоростью
+ * самого медленного из них, иначе он терял бы пакеты, которые повторно не
+ * передаются. Получатели, от которых нет отчетов дольше receiver_timeout,
+ * забываются. Пока отчетов нет ни от кого, действует общий контроллер.
+ * 
+ * \param[in] now    Текущее время.
+ * 
+ * \return Время отправки следующего пакета.
+ */ 
+time_point<steady_clock> Client::pace(time_point<steady_clock> now)
+{
+    for (auto it = m_receivers.begin(); it != m_receivers.end(); )
+    {
+        if (now - it->second.last_report > receiver_timeout)
+            it = m_receivers.erase(it);
+        else
+            ++it;
+    }
+    if (m_receivers.empty())
+    {
+        m_congestion_control.check_timeout(now);
+        return m_congestion_control.next_send_time();
+    }
+    time_point<steady_clock> next = now;
+    for (auto& receiver: m_receivers)
+    {
+        receiver.second.control.check_timeout(now);
+        next = std::max(next, receiver.second.control.next_send_time());
+    }
+    return next;
+}
+
+/** \brief Отправка пакета данных.
+ * 
+ * Функция запечатывает и отправляет очередной пакет потока данных файла.
+ * 
+ * \param[in] package    Пакет.
+ * 
+ * \return -1 , если в ходе выполения произошла ошибка, иначе количество 
+ * переданных байт.
+ */ 
+int Client::send_package(Package& package)
+{
+    package.seal();
+    if (!m_congestion)
+    {
+        int result = send(package.as_bytes(), package.package_size());
+        // задержка требуется чтобы сервер успел прочитать переданные данные
+        PhaseScope phase(m_phase_clock, PHASE_PACING);
+        usleep(1000);
+        return result;
+    }
+    poll_feedback(package.get_marker());
+    auto now = steady_clock::now();
+    auto next = pace(now);
+    if (next > now)
+    {
+        PhaseScope phase(m_phase_clock, PHASE_PACING);
+        usleep(duration_cast<microseconds>(next - now).count());
+        now = steady_clock::now();
+    }
+    int result = send(package.as_bytes(), package.package_size());
+    if (result >= 0)
+    {
+        m_congestion_control.on_sent(package.get_number(), result, now);
+        for (auto& receiver: m_receivers)
+            receiver.second.control.on_sent(package.get_number(), result, now);
+    }
+    return result;
 }
 
 /** \brief Очистка имени файла
@@ -142,30 +550,115 @@ std::string clear_filename(const std::string filename)
 
 /** \brief Отправка имени файла.
  * Функция отправляет имя файла. \p marker используется в идентификации
- * передаваемой информации в пределах одного отправителя.
+ * передаваемой информации в пределах одного отправителя. Если \p delta 
+ * равен true, то сервер соберет файл из блоков своей старой копии и новых 
+ * данных.
  * 
  * \param[in] marker    Идентификатор файла.    
  * \param[in] filename  Имя отправляемого файла.
+ * \param[in] delta     Признак дельта-передачи.
  * 
  * \return -1 , если в ходе выполения произошла ошибка. В таком случае
  * номер ошибки устанавливается в errno. При успешном выполнеии возращается
  * количество переданных байт.
  */ 
-int Client::send_filename(uint32_t marker, const std::string &filename) 
+int Client::send_filename(uint32_t marker, const std::string &filename, bool delta) 
 {
     std::string cleared_filename = clear_filename(filename);
     Package package;
     package.set_number(1);
     package.set_marker(marker);
+    package.set_option(FLAG_CHECKSUM, m_checksum);
+    package.set_option(FLAG_DELTA, delta);
     package.set_data(cleared_filename.c_str(), strlen(cleared_filename.c_str()));
+    package.seal();
     return send(package.as_bytes(), package.package_size());
 }
 
+/** \brief Запись данных в пакет.
+ * 
+ * Функция записывает в \p package начало данных \p data длиной \p len . 
+ * Если сжатие выключено, то в пакет записывается столько данных, сколько в 
+ * него помещается. Если включено, то данные сжимаются. Когда сжатый блок не
+ * помещается в пакет, блок уменьшается пропорционально степени сжатия. Если 
+ * данные не сжимаются, то они передаются как есть, а попытки сжатия 
+ * откладываются на число пакетов, растущее с каждой неудачей.
+ * 
+ * \param[in] package    Пакет.
+ * \param[in] data       Данные файла.
+ * \param[in] len        Длина данных.
+ * 
+ * \return Число байтов \p data , записанных в пакет.
+ */ 
+uint32_t Client::pack_data(Package& package, const char *data, uint32_t len)
+{
+    uint32_t capacity = package.max_data_size();
+    package.set_option(FLAG_COMPRESSED, false);
+    if (!m_compression)
+    {
+        len = std::min(len, capacity);
+        package.set_data(data, len);
+        return len;
+    }
+    uint64_t started = thread_cpu_time_ns();
+    uint32_t room = capacity - COMPRESSED_SIZE_PREFIX;
+    uint32_t consumed = 0;
+    if (m_skip_compression > 0)
+    {
+        --m_skip_compression;
+    } else {
+        uint32_t block = len;
+        int packed = compress_block(data, block, m_scratch.data(), m_scratch.size());
+        if (packed > static_cast<int>(room) && packed < static_cast<int>(block))
+        {
+            block = static_cast<uint64_t>(block) * room * 9 / (packed * 10ULL);
+            packed = compress_block(data, block, m_scratch.data(), m_scratch.size());
+        }
+        if (block > 0 && packed > 0 && packed <= static_cast<int>(room) &&
+            packed + COMPRESSED_SIZE_PREFIX < block)
+        {
+            char buf[MAX_DATA_SIZE];
+            uint16_t raw_size = static_cast<uint16_t>(block);
+            memcpy(buf, &raw_size, COMPRESSED_SIZE_PREFIX);
+            memcpy(buf + COMPRESSED_SIZE_PREFIX, m_scratch.data(), packed);
+            package.set_option(FLAG_COMPRESSED);
+            package.set_data(buf, packed + COMPRESSED_SIZE_PREFIX);
+            uint64_t next = static_cast<uint64_t>(block) * room * 9 / (packed * 10ULL);
+            m_block_size = std::max<uint64_t>(capacity, 
+                std::min<uint64_t>(next, MAX_COMPRESSION_BLOCK));
+            m_compression_backoff = 0;
+            consumed = block;
+            ++m_codec_stats.compressed_blocks;
+        } else {
+            m_block_size = 2 * capacity;
+            m_compression_backoff = std::min(max_compression_backoff,
+                                             std::max(1U, m_compression_backoff * 2));
+            m_skip_compression = m_compression_backoff;
+        }
+    }
+    if (consumed == 0)
+    {
+        consumed = std::min(len, capacity);
+        package.set_data(data, consumed);
+        ++m_codec_stats.raw_blocks;
+    }
+    m_codec_stats.raw_bytes += consumed;
+    m_codec_stats.wire_bytes += package.get_data_size();
+    m_codec_stats.cpu_ns += thread_cpu_time_ns() - started;
+    return consumed;
+}
+
 /** \brief Отправка содержимого файла.
  * Функция отправляет данные файла, получаемый  из потока \p in по частям.
  * \p marker используется в идентификации передаваемой информации в пределах
  * одного отправителя.
  * 
+ * \note
+ * В режиме проверки целостности хеш файла считается по мере чтения, поэтому
+ * данные не читаются повторно. После последней части данных отправляется
+ * пакет с флагом FLAG_LAST_PACKAGE, содержащий только хеш файла. Как данные
+ * записываются в пакеты при сжатии, смотрите в функции pack_data().
+ * 
  * \param[in] marker    Идентификатор файла.    
  * \param[in] in        Входной поток данных файла.
  * 
@@ -173,114 +666,357 @@ int Client::send_filename(uint32_t marker, const std::string &filename)
  * номер ошибки устанавливается в errno. При успешном выполнеии возращается
  * количество переданных байт.
  */ 
-int Client::send_file_data(uint32_t marker, std::ifstream& in) {
+int64_t Client::send_file_data(uint32_t marker, std::ifstream& in) {
     Package package;
     package.set_marker(marker);
-    char buf[MAX_DATA_SIZE];
-    int buf_len = 0;
+    package.set_option(FLAG_CHECKSUM, m_checksum);
+    FileHash file_hash;
+    std::vector<char> buf(m_compression ? MAX_COMPRESSION_BLOCK : MAX_DATA_SIZE);
+    size_t buf_begin = 0;
+    size_t buf_end = 0;
+    // номер в заголовке 32-битный и для файлов больше 5.9 ТБ переполняется,
+    // сервер восстанавливает полный номер по предыдущим пакетам
     uint32_t package_number = 1;
-    int file_len = 0;
+    uint64_t file_len = 0;
+    bool last = false;
+    m_block_size = 4 * package.max_data_size();
     do 
     {
-        in.read(buf, std::streamsize(MAX_DATA_SIZE));
-        buf_len = in.gcount();
-        file_len += buf_len;
+        size_t want = m_compression ? m_block_size : package.max_data_size();
+        if (buf_end - buf_begin < want && !in.eof())
+        {
+            memmove(buf.data(), buf.data() + buf_begin, buf_end - buf_begin);
+            buf_end -= buf_begin;
+            buf_begin = 0;
+            PhaseScope phase(m_phase_clock, PHASE_READ);
+            in.read(buf.data() + buf_end, std::streamsize(want - buf_end));
+            buf_end += in.gcount();
+            file_len += in.gcount();
+        }
+        const char *chunk = buf.data() + buf_begin;
+        uint32_t len = pack_data(package, chunk, std::min(want, buf_end - buf_begin));
+        if (m_checksum)
+            file_hash.update(chunk, len);
+        buf_begin += len;
+        last = in.eof() && buf_begin == buf_end;
         package.set_number(++package_number);
-        package.set_data(buf, buf_len);
-        if (in.eof()) {
+        if (last && !m_checksum) {
             package.set_package_flag(FLAG_LAST_PACKAGE);
         }
-        if (send(package.as_bytes(), package.package_size()) < 0) {
+        if (send_package(package) < 0) {
             return -1;
         }
-        // задержка требуется чтобы сервер успел прочитать переданные данные
-        usleep(1000);
-    } while (!in.eof());
+    } while (!last);
+    if (m_checksum)
+    {
+        uint64_t digest = file_hash.digest();
+        package.set_option(FLAG_COMPRESSED, false);
+        package.set_number(++package_number);
+        package.set_data(reinterpret_cast<const char *>(&digest), FILE_HASH_SIZE);
+        package.set_package_flag(FLAG_LAST_PACKAGE);
+        if (send_package(package) < 0)
+            return -1;
+    }
     return file_len;
 }
 
-/** \brief Отправка файла.
+/** \brief Запрос сигнатур файла.
  * 
- * Функция принимает имя файла в качестве \p filename , отрывает и передает 
- * имя файла и его содержимое по UDP протоколу.
+ * Функция запрашивает у сервера сигнатуры блоков его копии файла 
+ * \p filename и загружает их в \p index . Сервер отвечает только на запрос
+ * открытой передачи, поэтому перед запросом отправляется имя файла с 
+ * опцией FLAG_DELTA, и дальше данные файла передаются с тем же 
+ * идентификатором без имени. Сигнатуры приходят несколькими пакетами, 
+ * потеря части из них лишь уменьшает число найденных совпадений. Если 
+ * сервер не ответил, имя и запрос повторяются signature_request_attempts 
+ * раз, повтор имени сервер отбрасывает как дубликат.
  * 
- * \param[in] filename   Имя файла.    
+ * \param[in] marker      Идентификатор файла.
+ * \param[in] filename    Имя файла.
+ * \param[in] index       Индекс, в который загружаются сигнатуры.
  * 
- * \return -1 , если в ходе выполения произошла ошибка. В таком случае
- * номер ошибки устанавливается в errno. При успешном выполнеии возращается 0.
+ * \return Число полученных сигнатур или -1, если сервер не ответил.
  */ 
-int Client::send_file(const std::string &filename)
+int Client::request_signatures(uint32_t marker, const std::string& filename, 
+                               SignatureIndex& index)
 {
-    std::ifstream ifs(filename, std::ios::binary | std::ios::in);
-    if (ifs.fail())
-        return -1;
-    uint32_t marker = static_cast<uint32_t>(get_random_value());
-
-#ifdef DEBUG
-    print_headers_as_row();
-#endif
-
-    if (send_filename(marker, filename) < 0) 
+    int rcvbuf = signature_rcvbuf_size;
+    setsockopt(m_socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    std::string request(1, static_cast<char>(CONTROL_SIGNATURE_REQUEST));
+    request += clear_filename(filename);
+    Package package;
+    package.set_marker(marker);
+    package.set_option(FLAG_CONTROL);
+    package.set_data(request.data(), std::min<size_t>(request.size(), MAX_DATA_SIZE));
+    char buf[MAX_PACKAGE_SIZE];
+    SignaturesHeader header;
+    std::vector<BlockSignature> signatures;
+    for (int attempt = 0; attempt < signature_request_attempts; ++attempt)
     {
-        ifs.close();
-        return -1;
-    }    
-    if (send_file_data(marker, ifs) < 0)
+        if (send_filename(marker, filename, true) < 0 ||
+            send(package.as_bytes(), package.package_size()) < 0)
+            return -1;
+        bool received = false;
+        int bytes;
+        while ((bytes = timed_recv(buf, sizeof(buf), signature_timeout_ms)) >= 0)
+        {
+            if (bytes < static_cast<int>(HEADER_SIZE))
+                continue;
+            Package reply(buf, bytes);
+            if (!reply.valid() || !reply.has_option(FLAG_CONTROL) || 
+                reply.get_marker() != marker ||
+                !read_signatures(reply.get_data(), reply.get_data_size(), 
+                                 header, signatures))
+                continue;
+            if (!received)
+            {
+                index.reset(header.block_size);
+                received = true;
+            }
+            if (header.block_size != index.block_size())
+                continue;
+            for (uint16_t i = 0; i < header.count; ++i)
+                index.insert(header.first_block + i, signatures[i]);
+            if (reply.get_package_flag() == FLAG_LAST_PACKAGE)
+                break;
+        }
+        if (received)
+        {
+            m_delta_stats.signatures += index.size();
+            return static_cast<int>(index.size());
+        }
+    }
+    return -1;
+}
+
+/** \brief Отправка новых данных при дельта-передаче.
+ * 
+ * Функция отправляет участок \p data длиной \p len , не найденный в копии
+ * сервера, обычными пакетами данных (при необходимости сжатыми).
+ * 
+ * \param[in] package      Пакет.
+ * \param[in] number       Номер последнего отправленного пакета.
+ * \param[in] data         Данные.
+ * \param[in] len          Длина данных.
+ * \param[in] file_hash    Хеш файла.
+ * 
+ * \return -1 , если в ходе выполения произошла ошибка, 0 иначе.
+ */ 
+int Client::send_literals(Package& package, uint32_t& number, const char *data, 
+                          size_t len, FileHash& file_hash)
+{
+    package.set_option(FLAG_DELTA, false);
+    while (len > 0)
     {
-        ifs.close();
-        return -1;
+        size_t want = m_compression ? m_block_size : package.max_data_size();
+        uint32_t sent = pack_data(package, data, std::min(want, len));
+        if (m_checksum)
+            file_hash.update(data, sent);
+        package.set_number(++number);
+        if (send_package(package) < 0)
+            return -1;
+        m_delta_stats.literal_bytes += sent;
+        data += sent;
+        len -= sent;
     }
-    ifs.close();
     return 0;
 }
 
-void print_usage(char *program_name)
+/** \brief Отправка ссылки на блоки копии сервера.
+ * 
+ * \param[in] package    Пакет.
+ * \param[in] number     Номер последнего отправленного пакета.
+ * \param[in] op         Ссылка на блоки.
+ * 
+ * \return -1 , если в ходе выполения произошла ошибка, 0 иначе.
+ */ 
+int Client::send_copy_op(Package& package, uint32_t& number, const CopyOp& op)
 {
-    std::cout << "Используйте: " << program_name;
-    std::cout << " <IPv4 адрес сервера> <Порт сервера>"
-                 " <Имя файла>"
-              << std::endl;
+    char buf[COPY_OP_SIZE];
+    write_copy_op(buf, op);
+    package.set_option(FLAG_COMPRESSED, false);
+    package.set_option(FLAG_DELTA);
+    package.set_data(buf, COPY_OP_SIZE);
+    package.set_number(++number);
+    ++m_delta_stats.copy_ops;
+    m_delta_stats.matched_blocks += op.count;
+    m_delta_stats.matched_bytes += static_cast<uint64_t>(op.count) * op.block_size;
+    return send_package(package);
 }
 
-int main(int argc, char *argv[])
+/** \brief Дельта-передача файла.
+ * 
+ * Функция ищет в файле \p filename блоки, совпадающие с блоками копии 
+ * сервера, сдвигая окно размером в блок на один байт и сравнивая сначала 
+ * скользящую, затем сильную контрольную сумму (алгоритм rsync). Совпавшие 
+ * подряд блоки передаются одной ссылкой, остальные данные - как есть. Файл
+ * отображается в память, поэтому его размер не ограничен памятью клиента.
+ * Имя файла отправляет request_signatures().
+ * 
+ * \param[in] marker      Идентификатор файла.
+ * \param[in] filename    Имя файла.
+ * \param[in] index       Сигнатуры блоков копии сервера.
+ * 
+ * \return -1 , если в ходе выполения произошла ошибка, иначе размер файла.
+ */ 
+int64_t Client::send_file_delta(uint32_t marker, const std::string& filename, 
+                            const SignatureIndex& index)
 {
-    if (argc != 4)
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat info;
+    if (fstat(fd, &info) != 0)
     {
-        std::cerr << "ошибка: требуется четыре аргумента" << std::endl;
-        print_usage(argv[0]);
-        exit(1);
+        close(fd);
+        return -1;
+    }
+    size_t size = info.st_size;
+    const char *data = nullptr;
+    if (size > 0)
+    {
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED)
+        {
+            close(fd);
+            return -1;
+        }
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(mapped);
     }
-    int port = 0;
-    try 
+    close(fd);
+
+    // имя файла уже отправлено вместе с запросом сигнатур
+    int result = 0;
+    Package package;
+    package.set_marker(marker);
+    package.set_option(FLAG_CHECKSUM, m_checksum);
+    FileHash file_hash;
+    uint32_t number = 1;
+    m_block_size = 4 * package.max_data_size();
+    const uint32_t block_size = index.block_size();
+    const uint32_t max_run = std::max<uint64_t>(1, max_copy_op_bytes / block_size);
+    CopyOp op = {block_size, 0, 0};
+    size_t op_pos = 0;
+    size_t literal = 0;
+    size_t pos = 0;
+    RollingChecksum weak;
+    bool weak_ready = false;
+    while (result >= 0 && pos + block_size <= size)
     {
-        port = std::stoi(std::string(argv[2]));
+        if (!weak_ready)
+        {
+            weak.reset(data + pos, block_size);
+            weak_ready = true;
+        }
+        int64_t preferred = op.count ? int64_t(op.first_block) + op.count : -1;
+        int64_t block = index.find(weak.value(), data + pos, preferred);
+        if (block < 0)
+        {
+            if (pos + block_size < size)
+                weak.roll(data[pos], data[pos + block_size]);
+            ++pos;
+            continue;
+        }
+        bool extend = op.count > 0 && literal == pos && block == preferred && 
+                      op.count < max_run;
+        if (!extend)
+        {
+            if (op.count > 0)
+            {
+                if (m_checksum)
+                    file_hash.update(data + op_pos, size_t(op.count) * block_size);
+                result = send_copy_op(package, number, op);
+            }
+            if (result >= 0 && literal < pos)
+                result = send_literals(package, number, data + literal, 
+                                       pos - literal, file_hash);
+            op.first_block = static_cast<uint64_t>(block);
+            op.count = 0;
+            op_pos = pos;
+        }
+        ++op.count;
+        pos += block_size;
+        literal = pos;
+        weak_ready = false;
     }
-    catch (std::invalid_argument &e)
+    if (result >= 0 && op.count > 0)
     {
-        std::cerr << "Ошибка: значение порта должено быть целом числом." << std::endl;
-        exit(1);
+        if (m_checksum)
+            file_hash.update(data + op_pos, size_t(op.count) * block_size);
+        result = send_copy_op(package, number, op);
     }
-    try
+    if (result >= 0 && literal < size)
+        result = send_literals(package, number, data + literal, size - literal, 
+                               file_hash);
+    if (result >= 0)
     {
-        std::cout << "Инициализация клиента: ";
-        Client client(std::string(argv[1]), port);
-        std::cout << "Успешно." << std::endl << "Попытка передачи фала \"" 
-            << argv[3] << "\" по адресу [" << client.get_address() << ":" 
-            << client.get_port() << "]" << std::endl; 
-        
-        if (client.send_file(std::string(argv[3])) < 0)
+        package.set_option(FLAG_DELTA, false);
+        package.set_option(FLAG_COMPRESSED, false);
+        package.set_number(++number);
+        package.set_package_flag(FLAG_LAST_PACKAGE);
+        if (m_checksum)
         {
-            std::cerr << "Отправка не удалась. Ошибка: " 
-                << std::strerror(errno) << std::endl;
-            exit(1);
+            uint64_t digest = file_hash.digest();
+            package.set_data(reinterpret_cast<const char *>(&digest), FILE_HASH_SIZE);
+        } else {
+            package.set_data("", 0);
         }
-        std::cout << "Отправка произведена успешно." << std::endl;
+        result = send_package(package);
     }
-    catch (const std::runtime_error &err)
+    if (data != nullptr)
+        munmap(const_cast<char *>(data), size);
+    return result < 0 ? -1 : static_cast<int64_t>(size);
+}
+
+/** \brief Отправка файла.
+ * 
+ * Функция принимает имя файла в качестве \p filename , отрывает и передает 
+ * имя файла и его содержимое по UDP протоколу. Время передачи делится 
+ * между фазами send_phases, результат доступен через get_send_stats().
+ * Сервер ведет для каждого файла новую сессию с собственной нумерацией
+ * отчетов о приеме, поэтому управление скоростью и список получателей
+ * группы начинаются заново: иначе отчеты нового файла отбрасывались бы как
+ * устаревшие, и клиент передавал бы его со скоростью после тайм-аутов.
+ * 
+ * \param[in] filename   Имя файла.    
+ * 
+ * \return -1 , если в ходе выполения произошла ошибка. В таком случае
+ * номер ошибки устанавливается в errno. При успешном выполнеии возращается 0.
+ */ 
+int Client::send_file(const std::string &filename)
+{
+    std::ifstream ifs(filename, std::ios::binary | std::ios::in);
+    if (ifs.fail())
+        return -1;
+    uint32_t marker = static_cast<uint32_t>(get_random_value());
+
+#ifdef DEBUG
+    print_headers_as_row();
+#endif
+
+    m_send_stats = SendStats();
+    m_congestion_control = CongestionController();
+    m_receivers.clear();
+    m_phase_clock.start(sample_interval);
+    int result = 0;
+    bool sent = false;
+    if (m_delta && !m_multicast)
     {
-        std::cerr << "Ошибка при инициализации клиента: " << err.what() 
-            << std::endl;
-        exit(1);
+        // передача уже открыта именем файла, без сигнатур данные идут целиком
+        SignatureIndex index;
+        if (request_signatures(marker, filename, index) > 0)
+            result = send_file_delta(marker, filename, index) < 0 ? -1 : 0;
+        else
+            result = send_file_data(marker, ifs) < 0 ? -1 : 0;
+        sent = true;
     }
-    return 0;
-}
\ No newline at end of file
+    if (!sent && (send_filename(marker, filename) < 0 || 
+                  send_file_data(marker, ifs) < 0))
+        result = -1;
+    int error = errno;
+    ifs.close();
+    m_phase_clock.stop();
+    errno = error;
+    return result;
+}
@@ -8,9 +8,13 @@
 #include <iostream>
 #include <unistd.h>
 #include <fstream>
+#include <map>
 #include <vector>
 
 #include "package.h"
+#include "stats.h"
+#include "delta.h"
+#include "congestion.h"
 
 
 
@@ -28,22 +32,93 @@ public:
 
     int get_socket() const;
 
+    void set_checksum(bool enabled);
+
+    bool get_checksum() const;
+
+    void set_compression(bool enabled);
+
+    bool get_compression() const;
+
+    const CodecStats& get_codec_stats() const;
+
+    void set_delta(bool enabled);
+
+    bool get_delta() const;
+
+    const DeltaStats& get_delta_stats() const;
+
+    void set_congestion_control(bool enabled);
+
+    bool get_congestion_control() const;
+
+    const CongestionStats& get_congestion_stats() const;
+
+    const SendStats& get_send_stats() const;
+
+    bool get_multicast() const;
+
+    int set_multicast_ttl(int ttl);
+
+    int set_multicast_interface(const std::string& interface);
+
     int send_file(const std::string& filename );
 
     char* strerror(int result);
 
 private:
+    struct Receiver {
+        CongestionController control;
+        time_point<steady_clock> last_report;
+    };
+
     int m_socket;
     int m_port;
     std::string m_addr;
     addrinfo *m_addrinfo;
     std::ifstream ifs;
+    bool m_checksum;
+    bool m_compression;
+    uint32_t m_block_size;
+    uint32_t m_compression_backoff;
+    uint32_t m_skip_compression;
+    std::vector<char> m_scratch;
+    CodecStats m_codec_stats;
+    bool m_delta;
+    DeltaStats m_delta_stats;
+    bool m_congestion;
+    CongestionController m_congestion_control;
+    bool m_multicast;
+    std::map<uint64_t, Receiver> m_receivers;
+    SendStats m_send_stats;
+    PhaseClock m_phase_clock;
 
     int send(const char *data, int len);
 
-    int send_filename(uint32_t marker, const std::string& filename);
+    int timed_recv(char *buf, int buf_len, int max_waiting_time_ms);
+
+    void poll_feedback(uint32_t marker);
+
+    time_point<steady_clock> pace(time_point<steady_clock> now);
+
+    int send_package(Package& package);
+
+    int send_filename(uint32_t marker, const std::string& filename, bool delta = false);
+
+    int64_t send_file_data(uint32_t marker, std::ifstream& ifs);
+
+    uint32_t pack_data(Package& package, const char *data, uint32_t len);
+
+    int request_signatures(uint32_t marker, const std::string& filename, 
+                           SignatureIndex& index);
+
+    int send_literals(Package& package, uint32_t& number, const char *data, 
+                      size_t len, FileHash& file_hash);
+
+    int send_copy_op(Package& package, uint32_t& number, const CopyOp& op);
 
-    int send_file_data(uint32_t marker, std::ifstream& ifs);
+    int64_t send_file_delta(uint32_t marker, const std::string& filename, 
+                        const SignatureIndex& index);
 };
 
 #endif
\ No newline at end of file
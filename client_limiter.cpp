@@ -0,0 +1,249 @@
+#include "client_limiter.h"
+
+#include <algorithm>
+
+using namespace std::chrono;
+
+static const size_t max_clients = 65536;                  // адресов в таблице, остальные учитываются вместе
+static const uint32_t overflow_ip = 0;                    // общая запись адресов сверх max_clients
+static const seconds client_idle_timeout(60);             // запись удаляется после простоя
+static const seconds expire_interval(10);
+static const uint64_t default_burst = 1024 * 1024;        // пачка, если она не задана
+static const uint64_t min_burst = 64 * 1024;              // не меньше нескольких датаграмм
+static const double max_debt = 8;                         // долг в пачках, после которого датаграммы отбрасываются
+static const double control_rate = 256;                   // управляющих датаграмм в секунду
+static const double control_burst = 256;
+
+std::ostream& operator<<(std::ostream& os, const ClientStats& stats)
+{
+    return os << "packages=" << stats.packages << " bytes=" << stats.bytes
+              << " throttled=" << stats.throttled << " limited=" << stats.limited
+              << " control=" << stats.control << " control_limited=" << stats.control_limited;
+}
+
+/** \brief Разбор ограничения скорости клиента
+ *
+ * \param[in]  spec                Строка <Мбит/с>[:<КиБ>], второе число -
+ *                                 наибольшая пачка.
+ * \param[out] bytes_per_second    Скорость в байтах в секунду.
+ * \param[out] burst               Пачка в байтах, не меньше min_burst.
+ *
+ * \return true, если строка корректна, false иначе.
+ */
+bool parse_client_rate(const std::string& spec, double& bytes_per_second, uint64_t& burst)
+{
+    size_t colon = spec.find(':');
+    size_t used = 0;
+    double mbit = std::stod(spec.substr(0, colon), &used);
+    if (used != spec.substr(0, colon).size() || mbit <= 0)
+        return false;
+    bytes_per_second = mbit * 1e6 / 8;
+    burst = default_burst;
+    if (colon != std::string::npos)
+    {
+        std::string kib = spec.substr(colon + 1);
+        if (kib.empty() || kib.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+        burst = std::stoull(kib) * 1024;
+    }
+    burst = std::max(burst, min_burst);
+    return true;
+}
+
+/** \brief Конструктор учета клиентов
+ *
+ * По умолчанию скорость не ограничена, а учитываются только датаграммы и
+ * байты каждого адреса.
+ */
+ClientLimiter::ClientLimiter()
+    : m_rate(0)
+    , m_burst(0)
+    , m_expired(steady_clock::now())
+{}
+
+/** \brief Задать ограничение скорости
+ *
+ * Ограничение действует на каждый IP адрес клиента отдельно, по алгоритму
+ * token bucket: адрес накапливает право принять до \p burst байтов со
+ * скоростью \p bytes_per_second . Протокол не передает потерянные пакеты
+ * повторно, поэтому датаграммы сверх накопленного сначала принимаются в
+ * долг, не больше max_debt пачек, а долг сообщается клиенту в отчетах о
+ * приеме как заполнение буфера (смотрите pressure_permille()), и клиент с
+ * управлением скоростью замедляется без потерь. Запас нужен на время, за
+ * которое клиент получает отчеты и снижает скорость после медленного
+ * старта. Отбрасываются только датаграммы клиента, который не замедлился и
+ * исчерпал долг. Все сессии одного адреса делят его ограничение.
+ * Управляющие датаграммы ограничиваются отдельно, смотрите admit_control().
+ *
+ * \param[in] bytes_per_second    Скорость в байтах в секунду, 0 - без
+ *                                ограничения.
+ * \param[in] burst               Наибольшая пачка в байтах.
+ */
+void ClientLimiter::set_rate(double bytes_per_second, uint64_t burst)
+{
+    m_rate = std::max(0.0, bytes_per_second);
+    m_burst = static_cast<double>(burst);
+    for (auto& item: m_clients)
+        item.second.tokens = std::min(item.second.tokens, m_burst);
+}
+
+/** \brief Учесть датаграмму клиента
+ *
+ * Функция учитывает датаграмму размером \p bytes от адреса \p ip и решает,
+ * принять ли ее. Если адресов больше max_clients, новые адреса учитываются
+ * и ограничиваются одной общей записью.
+ *
+ * \param[in] ip       IPv4 адрес клиента.
+ * \param[in] bytes    Размер датаграммы.
+ * \param[in] now      Время приема.
+ *
+ * \return true, если датаграмму нужно обработать, false, если адрес
+ * исчерпал и пачку, и долг.
+ */
+bool ClientLimiter::admit(uint32_t ip, int bytes, steady_clock::time_point now)
+{
+    Client& client = find_client(ip, now);
+    if (m_rate > 0)
+    {
+        double elapsed = duration<double>(now - client.refilled).count();
+        client.tokens = std::min(m_burst, client.tokens + elapsed * m_rate);
+        client.refilled = now;
+        if (client.tokens - bytes < -max_debt * m_burst)
+        {
+            ++client.stats.limited;
+            return false;
+        }
+        if (client.tokens < bytes)
+            ++client.stats.throttled;
+        client.tokens -= bytes;
+    }
+    ++client.stats.packages;
+    client.stats.bytes += bytes;
+    return true;
+}
+
+/** \brief Учесть управляющую датаграмму клиента
+ *
+ * Управляющие датаграммы (запросы сигнатур) не расходуют пачку данных, но
+ * каждая может стоить серверу чтения файла, поэтому у адреса отдельное
+ * небольшое ограничение: control_burst датаграмм и control_rate в секунду,
+ * независимо от set_rate(). Клиент повторяет запрос сигнатур не больше
+ * нескольких раз на файл и в это ограничение укладывается.
+ *
+ * \param[in] ip     IPv4 адрес клиента.
+ * \param[in] now    Время приема.
+ *
+ * \return true, если датаграмму нужно обработать, false, если адрес
+ * исчерпал ограничение.
+ */
+bool ClientLimiter::admit_control(uint32_t ip, steady_clock::time_point now)
+{
+    Client& client = find_client(ip, now);
+    double elapsed = duration<double>(now - client.control_refilled).count();
+    client.control_tokens = std::min(control_burst, client.control_tokens + elapsed * control_rate);
+    client.control_refilled = now;
+    if (client.control_tokens < 1)
+    {
+        ++client.stats.control_limited;
+        return false;
+    }
+    client.control_tokens -= 1;
+    ++client.stats.control;
+    return true;
+}
+
+/** \brief Запись клиента
+ *
+ * Функция находит или создает запись адреса \p ip . Если адресов больше
+ * max_clients, новые адреса учитываются одной общей записью.
+ *
+ * \param[in] ip     IPv4 адрес клиента.
+ * \param[in] now    Время приема.
+ *
+ * \return Запись клиента.
+ */
+ClientLimiter::Client& ClientLimiter::find_client(uint32_t ip, steady_clock::time_point now)
+{
+    auto iter = m_clients.find(ip);
+    if (iter == m_clients.end())
+    {
+        if (m_clients.size() >= max_clients)
+            ip = overflow_ip;
+        iter = m_clients.find(ip);
+        if (iter == m_clients.end())
+        {
+            iter = m_clients.emplace(ip, Client()).first;
+            iter->second.tokens = m_burst;
+            iter->second.refilled = now;
+            iter->second.control_tokens = control_burst;
+            iter->second.control_refilled = now;
+        }
+    }
+    iter->second.seen = now;
+    return iter->second;
+}
+
+/** \brief Превышение скорости клиента
+ *
+ * \param[in] ip    IPv4 адрес клиента.
+ *
+ * \return Долг адреса в долях 1/1000 от пачки, 0, если долга нет. При
+ * значении больше 500 клиент снижает скорость, как при заполнении буфера
+ * приема сервера.
+ */
+uint32_t ClientLimiter::pressure_permille(uint32_t ip) const
+{
+    auto iter = m_clients.find(ip);
+    if (iter == m_clients.end())
+        iter = m_clients.find(overflow_ip);
+    if (m_rate <= 0 || iter == m_clients.end() || iter->second.tokens >= 0)
+        return 0;
+    return static_cast<uint32_t>(std::min(1000.0, -iter->second.tokens * 1000 / m_burst));
+}
+
+/** \brief Удалить записи неактивных клиентов
+ *
+ * Функция раз в expire_interval удаляет записи адресов, от которых не было
+ * датаграмм дольше client_idle_timeout.
+ *
+ * \param[in] now    Текущее время.
+ */
+void ClientLimiter::expire(steady_clock::time_point now)
+{
+    if (now - m_expired < expire_interval)
+        return;
+    m_expired = now;
+    for (auto iter = m_clients.begin(); iter != m_clients.end();)
+    {
+        if (now - iter->second.seen > client_idle_timeout)
+            iter = m_clients.erase(iter);
+        else
+            ++iter;
+    }
+}
+
+size_t ClientLimiter::size() const
+{
+    return m_clients.size();
+}
+
+/** \brief Самые активные клиенты
+ *
+ * \param[in] count    Наибольшее число клиентов.
+ *
+ * \return Адреса и счетчики клиентов по убыванию принятых байтов.
+ */
+std::vector<std::pair<uint32_t, ClientStats>> ClientLimiter::busiest(size_t count) const
+{
+    std::vector<std::pair<uint32_t, ClientStats>> result;
+    for (const auto& item: m_clients)
+        result.emplace_back(item.first, item.second.stats);
+    count = std::min(count, result.size());
+    std::partial_sort(result.begin(), result.begin() + count, result.end(),
+                      [](const std::pair<uint32_t, ClientStats>& a,
+                         const std::pair<uint32_t, ClientStats>& b) {
+                          return a.second.bytes > b.second.bytes;
+                      });
+    result.resize(count);
+    return result;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct ClientStats {
+    uint64_t packages  = 0;   // датаграмм данных
+    uint64_t bytes     = 0;
+    uint64_t throttled = 0;   // принято сверх скорости в долг
+    uint64_t limited   = 0;   // отброшено ограничением скорости
+    uint64_t control   = 0;   // управляющих датаграмм
+    uint64_t control_limited = 0;   // управляющих, отброшенных сверх их ограничения
+};
+
+std::ostream& operator<<(std::ostream& os, const ClientStats& stats);
+
+bool parse_client_rate(const std::string& spec, double& bytes_per_second, uint64_t& burst);
+
+// Учет и ограничение скорости приема по IP адресу клиента
+class ClientLimiter {
+public:
+    ClientLimiter();
+
+    void set_rate(double bytes_per_second, uint64_t burst);
+
+    bool admit(uint32_t ip, int bytes, std::chrono::steady_clock::time_point now);
+
+    bool admit_control(uint32_t ip, std::chrono::steady_clock::time_point now);
+
+    uint32_t pressure_permille(uint32_t ip) const;
+
+    void expire(std::chrono::steady_clock::time_point now);
+
+    size_t size() const;
+
+    std::vector<std::pair<uint32_t, ClientStats>> busiest(size_t count) const;
+
+private:
+    struct Client {
+        double tokens = 0;                                // байтов, отрицательное - долг
+        std::chrono::steady_clock::time_point refilled;
+        double control_tokens = 0;                        // управляющих датаграмм
+        std::chrono::steady_clock::time_point control_refilled;
+        std::chrono::steady_clock::time_point seen;
+        ClientStats stats;
+    };
+
+    double m_rate;                                        // байт/с, 0 - без ограничения
+    double m_burst;
+    std::unordered_map<uint32_t, Client> m_clients;
+    std::chrono::steady_clock::time_point m_expired;
+
+    Client& find_client(uint32_t ip, std::chrono::steady_clock::time_point now);
+};
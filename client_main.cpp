@@ -0,0 +1,217 @@
+#include "client.h"
+#include "spool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+
+void print_usage(char *program_name)
+{
+    std::cout << "Используйте: " << program_name;
+    std::cout << " [опции] <IPv4 адрес сервера> <Порт сервера>"
+                 " <Имя файла> [<Имя файла>...]"
+              << std::endl;
+    std::cout << "       " << program_name << " [опции] -w <директория>"
+                 " <IPv4 адрес сервера> <Порт сервера>" << std::endl;
+    std::cout << "Опции:" << std::endl
+              << "  -k    проверка целостности пакетов и файла" << std::endl
+              << "  -z    сжатие данных файла" << std::endl
+              << "  -d    дельта-передача относительно копии файла на сервере" 
+              << std::endl
+              << "  -c    управление скоростью по отчетам сервера о приеме" 
+              << std::endl
+              << "  -t    время по фазам отправки и скорость по интервалам" 
+              << std::endl
+              << "  -j    то же в формате JSON" << std::endl
+              << "  -w <директория>  передавать файлы, появляющиеся в директории" 
+              << std::endl
+              << "  -n <число>       одновременных передач в режиме -w (4)" << std::endl
+              << "  -r               удалять переданные файлы" << std::endl
+              << "  -a <директория>  переносить переданные файлы в директорию" 
+              << std::endl
+              << "  -T <число>       время жизни групповых датаграмм (1)" << std::endl
+              << "  -I <адрес>       интерфейс для группового адреса сервера" << std::endl;
+}
+
+/** \brief Настройка групповой передачи
+ * 
+ * Функция задает клиенту с групповым адресом сервера время жизни датаграмм
+ * \p ttl , если оно не отрицательно, и интерфейс \p interface , если он 
+ * указан.
+ * 
+ * \exception runtime_error
+ * Параметр не удалось установить.
+ */ 
+static void set_multicast(Client& client, int ttl, const std::string& interface)
+{
+    if (!client.get_multicast())
+        return;
+    if (ttl >= 0 && client.set_multicast_ttl(ttl) != 0)
+        throw std::runtime_error(std::string("время жизни: ") + std::strerror(errno));
+    if (!interface.empty() && client.set_multicast_interface(interface) != 0)
+        throw std::runtime_error(std::string("интерфейс: ") + std::strerror(errno));
+}
+
+/** \brief Передача файлов спул-директории
+ * 
+ * Функция создает асинхронный клиент с \p workers одновременными 
+ * передачами и бесконечно передает файлы, появляющиеся в \p spool_dir .
+ */ 
+static void run_spool(const std::string& addr, int port, const std::string& spool_dir,
+                      size_t workers, spool_actions action, const std::string& archive_dir,
+                      bool checksum, bool compression, bool delta, bool congestion,
+                      int ttl, const std::string& interface)
+{
+    Logger log;
+    AsyncClient client(addr, port, workers, [&](Client& worker) {
+        worker.set_checksum(checksum);
+        worker.set_compression(compression);
+        worker.set_delta(delta);
+        worker.set_congestion_control(congestion);
+        set_multicast(worker, ttl, interface);
+    });
+    SpoolSender sender(spool_dir, client, log);
+    sender.set_after_send(action, archive_dir);
+    sender.work();
+}
+
+int main(int argc, char *argv[])
+{
+    bool checksum = false;
+    bool compression = false;
+    bool delta = false;
+    bool congestion = false;
+    bool timing = false;
+    bool json = false;
+    std::string spool_dir;
+    size_t workers = 4;
+    spool_actions action = SPOOL_KEEP;
+    std::string archive_dir;
+    int ttl = -1;
+    std::string interface;
+    int opt;
+    while ((opt = getopt(argc, argv, "kzdctjw:n:ra:T:I:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'k':
+            checksum = true;
+            break;
+        case 'z':
+            compression = true;
+            break;
+        case 'd':
+            delta = true;
+            break;
+        case 'c':
+            congestion = true;
+            break;
+        case 't':
+            timing = true;
+            break;
+        case 'j':
+            json = true;
+            break;
+        case 'w':
+            spool_dir = optarg;
+            break;
+        case 'n':
+            workers = std::max(1, atoi(optarg));
+            break;
+        case 'r':
+            action = SPOOL_REMOVE;
+            break;
+        case 'a':
+            action = SPOOL_MOVE;
+            archive_dir = optarg;
+            break;
+        case 'T':
+            ttl = atoi(optarg);
+            break;
+        case 'I':
+            interface = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (spool_dir.empty() ? argc - optind < 3 : argc - optind != 2)
+    {
+        std::cerr << "ошибка: требуется " << (spool_dir.empty() ? "не меньше трех" : "два") 
+            << " аргумента" << std::endl;
+        print_usage(argv[0]);
+        exit(1);
+    }
+    int port = 0;
+    try 
+    {
+        port = std::stoi(std::string(argv[optind + 1]));
+    }
+    catch (std::invalid_argument &e)
+    {
+        std::cerr << "Ошибка: значение порта должено быть целом числом." << std::endl;
+        exit(1);
+    }
+    if (!spool_dir.empty())
+    {
+        try
+        {
+            run_spool(argv[optind], port, spool_dir, workers, action, archive_dir,
+                      checksum, compression, delta, congestion, ttl, interface);
+        }
+        catch (const std::runtime_error &err)
+        {
+            std::cerr << "Ошибка при инициализации клиента: " << err.what() 
+                << std::endl;
+            exit(1);
+        }
+        return 0;
+    }
+    try
+    {
+        std::cout << "Инициализация клиента: ";
+        Client client(std::string(argv[optind]), port);
+        client.set_checksum(checksum);
+        client.set_compression(compression);
+        client.set_delta(delta);
+        client.set_congestion_control(congestion);
+        set_multicast(client, ttl, interface);
+        std::cout << "Успешно." << std::endl;
+        // все файлы передаются одним клиентом через один сокет
+        for (int i = optind + 2; i < argc; ++i)
+        {
+            std::cout << "Попытка передачи фала \"" << argv[i] << "\" по адресу [" 
+                << client.get_address() << ":" << client.get_port() << "]" << std::endl; 
+
+            if (client.send_file(std::string(argv[i])) < 0)
+            {
+                std::cerr << "Отправка не удалась. Ошибка: " 
+                    << std::strerror(errno) << std::endl;
+                exit(1);
+            }
+            std::cout << "Отправка произведена успешно." << std::endl;
+            if (client.get_compression())
+                std::cout << "Сжатие: " << client.get_codec_stats() << std::endl;
+            if (client.get_delta())
+                std::cout << "Дельта: " << client.get_delta_stats() << std::endl;
+            if (client.get_congestion_control())
+                std::cout << "Скорость: " << client.get_congestion_stats() << std::endl;
+            if (json)
+            {
+                write_json(std::cout, client.get_send_stats());
+            } else if (timing) {
+                std::cout << "Фазы: " << client.get_send_stats() << std::endl;
+                for (const auto& sample: client.get_send_stats().samples)
+                    std::cout << "Интервал: " << sample << std::endl;
+            }
+        }
+    }
+    catch (const std::runtime_error &err)
+    {
+        std::cerr << "Ошибка при инициализации клиента: " << err.what() 
+            << std::endl;
+        exit(1);
+    }
+    return 0;
+}
\ No newline at end of file
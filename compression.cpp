@@ -0,0 +1,231 @@
+#include "compression.h"
+
+#include <cstring>
+#include <vector>
+
+// Формат блока совпадает с блочным форматом LZ4: последовательности из
+// токена, литералов, 16-битного смещения и длины совпадения.
+static const int min_match      = 4;
+static const int last_literals  = 5;    // последние байты блока всегда литералы
+static const int match_limit    = 12;   // совпадение не начинается ближе к концу
+static const int hash_log       = 12;
+static const int max_offset     = 65535;
+static const int skip_trigger   = 6;    // ускорение поиска на несжимаемых данных
+
+static inline uint32_t read32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - hash_log);
+}
+
+/** \brief Запись длины в расширенном формате
+ *
+ * Функция дописывает к \p op продолжение длины \p len , которая не
+ * поместилась в 4 бита токена.
+ *
+ * \return Указатель на следующий байт или nullptr, если не хватило места.
+ */
+static char *write_length(char *op, const char *op_end, int len)
+{
+    while (len >= 255)
+    {
+        if (op >= op_end)
+            return nullptr;
+        *op++ = static_cast<char>(255);
+        len -= 255;
+    }
+    if (op >= op_end)
+        return nullptr;
+    *op++ = static_cast<char>(len);
+    return op;
+}
+
+/** \brief Запись последовательности
+ *
+ * Функция записывает в \p op литералы [\p anchor, \p anchor + \p lit_len) и,
+ * если \p match_len не 0, совпадение длины \p match_len со смещением
+ * \p offset .
+ *
+ * \return Указатель на следующий байт или nullptr, если не хватило места.
+ */
+static char *write_sequence(char *op, const char *op_end, const char *anchor,
+                            int lit_len, int offset, int match_len)
+{
+    if (op >= op_end)
+        return nullptr;
+    char *token = op++;
+    int ml = match_len ? match_len - min_match : 0;
+    *token = static_cast<char>(((lit_len >= 15 ? 15 : lit_len) << 4) |
+                               (ml >= 15 ? 15 : ml));
+    if (lit_len >= 15 && (op = write_length(op, op_end, lit_len - 15)) == nullptr)
+        return nullptr;
+    if (op_end - op < lit_len)
+        return nullptr;
+    memcpy(op, anchor, lit_len);
+    op += lit_len;
+    if (match_len == 0)
+        return op;
+    if (op_end - op < 2)
+        return nullptr;
+    *op++ = static_cast<char>(offset & 0xFF);
+    *op++ = static_cast<char>(offset >> 8);
+    if (ml >= 15 && (op = write_length(op, op_end, ml - 15)) == nullptr)
+        return nullptr;
+    return op;
+}
+
+/** \brief Максимальный размер сжатых данных
+ *
+ * \param[in] src_len    Размер исходных данных.
+ *
+ * \return Размер буфера, в который гарантированно поместится результат
+ * compress_block() для данных размером \p src_len .
+ */
+int compress_bound(int src_len)
+{
+    return src_len + src_len / 255 + 16;
+}
+
+/** \brief Сжатие блока данных
+ *
+ * Функция сжимает \p src_len байтов из \p src быстрым LZ-алгоритмом
+ * (блочный формат LZ4) и записывает результат в \p dst . Блок сжимается
+ * независимо от других, поэтому его можно распаковать даже при потере
+ * соседних пакетов.
+ *
+ * \param[in] src        Исходные данные.
+ * \param[in] src_len    Размер исходных данных, не больше MAX_COMPRESSION_BLOCK.
+ * \param[in] dst        Буфер для сжатых данных.
+ * \param[in] dst_cap    Размер буфера.
+ *
+ * \return Размер сжатых данных или 0, если они не поместились в \p dst .
+ */
+int compress_block(const char *src, int src_len, char *dst, int dst_cap)
+{
+    char *op = dst;
+    const char *op_end = dst + dst_cap;
+    const char *anchor = src;
+    if (src_len > match_limit)
+    {
+        int32_t table[1 << hash_log];
+        memset(table, -1, sizeof(table));
+        const char *ip = src;
+        const char *limit = src + src_len - match_limit;
+        const char *match_end = src + src_len - last_literals;
+        int searches = 1 << skip_trigger;
+        while (ip < limit)
+        {
+            uint32_t h = hash32(read32(ip));
+            int32_t ref_pos = table[h];
+            table[h] = static_cast<int32_t>(ip - src);
+            const char *ref = src + ref_pos;
+            if (ref_pos < 0 || ip - ref > max_offset || read32(ref) != read32(ip))
+            {
+                ip += searches++ >> skip_trigger;
+                continue;
+            }
+            searches = 1 << skip_trigger;
+            while (ip > anchor && ref > src && ip[-1] == ref[-1])
+            {
+                --ip;
+                --ref;
+            }
+            int len = min_match;
+            while (ip + len < match_end && ip[len] == ref[len])
+                ++len;
+            op = write_sequence(op, op_end, anchor, static_cast<int>(ip - anchor),
+                                static_cast<int>(ip - ref), len);
+            if (op == nullptr)
+                return 0;
+            ip += len;
+            anchor = ip;
+            if (ip < limit)
+                table[hash32(read32(ip - 2))] = static_cast<int32_t>(ip - 2 - src);
+        }
+    }
+    op = write_sequence(op, op_end, anchor,
+                        static_cast<int>(src + src_len - anchor), 0, 0);
+    if (op == nullptr)
+        return 0;
+    return static_cast<int>(op - dst);
+}
+
+/** \brief Распаковка блока данных
+ *
+ * Функция распаковывает блок \p src , сжатый функцией compress_block(), в
+ * \p dst . Все смещения и длины проверяются, поэтому поврежденный блок не
+ * приводит к выходу за границы буферов.
+ *
+ * \param[in] src        Сжатые данные.
+ * \param[in] src_len    Размер сжатых данных.
+ * \param[in] dst        Буфер для распакованных данных.
+ * \param[in] dst_cap    Размер буфера.
+ *
+ * \return Размер распакованных данных или -1, если блок поврежден.
+ */
+int decompress_block(const char *src, int src_len, char *dst, int dst_cap)
+{
+    const unsigned char *ip = reinterpret_cast<const unsigned char *>(src);
+    const unsigned char *ip_end = ip + src_len;
+    char *op = dst;
+    char *op_end = dst + dst_cap;
+    while (ip < ip_end)
+    {
+        unsigned token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15)
+        {
+            unsigned char b;
+            do {
+                if (ip >= ip_end)
+                    return -1;
+                b = *ip++;
+                lit_len += b;
+            } while (b == 255);
+        }
+        if (static_cast<size_t>(ip_end - ip) < lit_len ||
+            static_cast<size_t>(op_end - op) < lit_len)
+            return -1;
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == ip_end)
+            break;
+        if (ip_end - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > static_cast<size_t>(op - dst))
+            return -1;
+        size_t match_len = token & 15;
+        if (match_len == 15)
+        {
+            unsigned char b;
+            do {
+                if (ip >= ip_end)
+                    return -1;
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += min_match;
+        if (static_cast<size_t>(op_end - op) < match_len)
+            return -1;
+        const char *ref = op - offset;
+        if (offset >= match_len)
+        {
+            memcpy(op, ref, match_len);
+            op += match_len;
+        } else {
+            while (match_len--)
+                *op++ = *ref++;
+        }
+    }
+    return static_cast<int>(op - dst);
+}
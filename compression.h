@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// размер префикса сжатых данных пакета, в котором хранится исходный размер
+#define COMPRESSED_SIZE_PREFIX sizeof(uint16_t)
+#define MAX_COMPRESSION_BLOCK  UINT16_MAX
+
+int compress_bound(int src_len);
+
+int compress_block(const char *src, int src_len, char *dst, int dst_cap);
+
+int decompress_block(const char *src, int src_len, char *dst, int dst_cap);
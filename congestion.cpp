@@ -0,0 +1,316 @@
+#include "congestion.h"
+#include "package.h"
+
+#include <algorithm>
+#include <cstring>
+
+static const milliseconds feedback_interval(25);    // период отчетов сервера
+static const milliseconds feedback_timeout(250);    // без отчетов скорость уменьшается вдвое
+static const microseconds max_pacing_burst(2000);   // допустимое опоздание при отправке
+static const double initial_rate = MAX_PACKAGE_SIZE * 1000.0; // 1 пакет в мс, байт/с
+static const double min_rate = 64 * 1024.0;
+static const double max_rate = 1250.0 * 1000 * 1000;
+static const double additive_increase = 32 * 1024.0; // прирост скорости за отчет, байт/с
+static const double decrease_factor = 0.7;           // уменьшение скорости при потерях
+static const double loss_threshold = 0.02;           // доля потерь, считающаяся перегрузкой
+static const uint32_t queue_high = 500;              // заполнение буфера сервера - перегрузка
+static const uint32_t queue_low = 250;               // заполнение буфера сервера - без роста
+static const double bottleneck_ratio = 0.8;          // доставка медленнее отправки - канал полон
+
+/** \brief Записать отчет о приеме
+ *
+ * Функция записывает в \p buf управляющее сообщение CONTROL_FEEDBACK с
+ * отчетом \p report . Буфер должен вмещать FEEDBACK_SIZE байтов.
+ *
+ * \return Размер сообщения в байтах.
+ */
+uint32_t write_feedback(char *buf, const FeedbackReport& report)
+{
+    char *p = buf;
+    *p++ = CONTROL_FEEDBACK;
+    memcpy(p, &report.sequence, sizeof(report.sequence));
+    p += sizeof(report.sequence);
+    memcpy(p, &report.highest, sizeof(report.highest));
+    p += sizeof(report.highest);
+    memcpy(p, &report.received, sizeof(report.received));
+    p += sizeof(report.received);
+    memcpy(p, &report.lost, sizeof(report.lost));
+    p += sizeof(report.lost);
+    memcpy(p, &report.interval_us, sizeof(report.interval_us));
+    p += sizeof(report.interval_us);
+    memcpy(p, &report.received_bytes, sizeof(report.received_bytes));
+    p += sizeof(report.received_bytes);
+    memcpy(p, &report.queue_permille, sizeof(report.queue_permille));
+    p += sizeof(report.queue_permille);
+    return static_cast<uint32_t>(p - buf);
+}
+
+/** \brief Прочитать отчет о приеме
+ *
+ * Функция разбирает управляющее сообщение CONTROL_FEEDBACK.
+ *
+ * \return true, если сообщение корректно, false иначе.
+ */
+bool read_feedback(const char *buf, uint32_t len, FeedbackReport& report)
+{
+    if (len != FEEDBACK_SIZE || buf[0] != CONTROL_FEEDBACK)
+        return false;
+    const char *p = buf + 1;
+    memcpy(&report.sequence, p, sizeof(report.sequence));
+    p += sizeof(report.sequence);
+    memcpy(&report.highest, p, sizeof(report.highest));
+    p += sizeof(report.highest);
+    memcpy(&report.received, p, sizeof(report.received));
+    p += sizeof(report.received);
+    memcpy(&report.lost, p, sizeof(report.lost));
+    p += sizeof(report.lost);
+    memcpy(&report.interval_us, p, sizeof(report.interval_us));
+    p += sizeof(report.interval_us);
+    memcpy(&report.received_bytes, p, sizeof(report.received_bytes));
+    p += sizeof(report.received_bytes);
+    memcpy(&report.queue_permille, p, sizeof(report.queue_permille));
+    return report.interval_us > 0;
+}
+
+/** \brief Конструктор счетчика приема
+ *
+ * Функция создает счетчик пакетов одного потока на стороне сервера. По нему
+ * раз в feedback_interval составляется отчет для клиента.
+ */
+ReceiveMeter::ReceiveMeter()
+    : m_sequence(0)
+    , m_highest(0)
+    , m_reported_highest(0)
+    , m_received(0)
+    , m_received_bytes(0)
+    , m_queue_permille(0)
+    , m_interval_start(steady_clock::now())
+{}
+
+/** \brief Учесть пакет
+ *
+ * \param[in] number    Номер пакета.
+ * \param[in] bytes     Размер датаграммы.
+ */
+void ReceiveMeter::on_package(uint32_t number, uint32_t bytes)
+{
+    if (static_cast<int32_t>(number - m_highest) > 0)
+        m_highest = number;
+    ++m_received;
+    m_received_bytes += bytes;
+}
+
+/** \brief Учесть заполнение буфера приема
+ *
+ * В отчет попадает наибольшее заполнение буфера приема сокета сервера за
+ * интервал.
+ *
+ * \param[in] queue_permille    Заполнение буфера в долях 1/1000.
+ */
+void ReceiveMeter::on_queue(uint32_t queue_permille)
+{
+    m_queue_permille = std::max(m_queue_permille, queue_permille);
+}
+
+/** \brief Число пакетов за интервал
+ *
+ * \return Число пакетов, принятых с прошлого отчета.
+ */
+uint32_t ReceiveMeter::received() const
+{
+    return m_received;
+}
+
+/** \brief Пора ли отправить отчет
+ *
+ * \return true, если с прошлого отчета прошло не меньше feedback_interval и
+ * за это время пришел хотя бы один пакет.
+ */
+bool ReceiveMeter::report_due(time_point<steady_clock> now) const
+{
+    return m_received > 0 && now - m_interval_start >= feedback_interval;
+}
+
+/** \brief Составить отчет
+ *
+ * Функция составляет отчет о приеме за интервал с прошлого отчета и
+ * начинает новый интервал. Потерянными считаются пакеты, на которые вырос
+ * наибольший номер, но которые не пришли, как в отчетах RTCP. Переставленный
+ * пакет, пришедший в следующем интервале, уменьшает потери того интервала.
+ *
+ * \param[in] now    Текущее время.
+ *
+ * \return Отчет о приеме.
+ */
+FeedbackReport ReceiveMeter::make_report(time_point<steady_clock> now)
+{
+    FeedbackReport report;
+    uint32_t expected = m_highest - m_reported_highest;
+    report.sequence = ++m_sequence;
+    report.highest = m_highest;
+    report.received = m_received;
+    report.lost = expected > m_received ? expected - m_received : 0;
+    report.interval_us = static_cast<uint32_t>(std::max<int64_t>(1,
+        duration_cast<microseconds>(now - m_interval_start).count()));
+    report.received_bytes = m_received_bytes;
+    report.queue_permille = m_queue_permille;
+    m_reported_highest = m_highest;
+    m_received = 0;
+    m_received_bytes = 0;
+    m_queue_permille = 0;
+    m_interval_start = now;
+    return report;
+}
+
+/** \brief Конструктор контроллера перегрузки
+ *
+ * Функция создает контроллер скорости отправки клиента. Пока от сервера нет
+ * отчетов, скорость равна initial_rate, то есть прежнему темпу в один пакет в
+ * миллисекунду, поэтому со старым сервером клиент работает как раньше.
+ */
+CongestionController::CongestionController()
+    : m_rate(initial_rate)
+    , m_slow_start(true)
+    , m_feedback_seen(false)
+    , m_last_sent(0)
+    , m_recovery_until(0)
+    , m_last_sequence(0)
+    , m_sent_bytes(0)
+    , m_next_send(steady_clock::now())
+    , m_last_feedback(steady_clock::now())
+{
+    m_stats.rate = m_rate;
+    m_stats.max_rate = m_rate;
+}
+
+void CongestionController::set_rate(double rate)
+{
+    m_rate = std::min(max_rate, std::max(min_rate, rate));
+    m_stats.rate = m_rate;
+    m_stats.max_rate = std::max(m_stats.max_rate, m_rate);
+}
+
+/** \brief Время отправки следующего пакета
+ *
+ * \return Время, раньше которого следующий пакет отправлять не нужно.
+ */
+time_point<steady_clock> CongestionController::next_send_time() const
+{
+    return m_next_send;
+}
+
+/** \brief Учесть отправленный пакет
+ *
+ * Функция сдвигает время следующей отправки на время передачи \p bytes
+ * байтов с текущей скоростью. Если отправитель опоздал больше чем на
+ * max_pacing_burst, опоздание не наверстывается, чтобы не отправлять пачку
+ * пакетов подряд.
+ *
+ * \param[in] number    Номер пакета.
+ * \param[in] bytes     Размер датаграммы.
+ * \param[in] now       Время отправки.
+ */
+void CongestionController::on_sent(uint32_t number, uint32_t bytes, time_point<steady_clock> now)
+{
+    m_last_sent = number;
+    m_sent_bytes += bytes;
+    m_next_send = std::max(m_next_send, now - max_pacing_burst) +
+        duration_cast<steady_clock::duration>(duration<double>(bytes / m_rate));
+}
+
+/** \brief Обработать отчет сервера
+ *
+ * Функция меняет скорость по схеме AIMD. В начале передачи скорость растет
+ * на четверть за отчет, пока сервер принимает все, что отправлено. Когда
+ * доставка отстает от отправки или появляются потери, медленный старт
+ * заканчивается и скорость растет на additive_increase за отчет. Медленный
+ * старт заканчивается и тогда, когда буфер приема сервера заполнен больше
+ * queue_low.
+ *
+ * Перегрузкой считаются потери больше loss_threshold или заполнение буфера
+ * приема сервера больше queue_high: протокол не передает потерянные пакеты
+ * повторно, поэтому скорость снижается раньше, чем буфер переполнится, как
+ * при ECN. При перегрузке скорость уменьшается в decrease_factor раз, но не
+ * ниже половины и не выше скорости доставки, которую измерил сервер. 
+ * Перегрузка в отчетах о пакетах, отправленных до уменьшения, повторно не
+ * учитывается. Пока буфер заполнен больше queue_low, скорость не растет.
+ *
+ * \param[in] report    Отчет сервера.
+ * \param[in] now       Время приема отчета.
+ */
+void CongestionController::on_feedback(const FeedbackReport& report, time_point<steady_clock> now)
+{
+    if (m_feedback_seen && static_cast<int32_t>(report.sequence - m_last_sequence) <= 0)
+        return;
+    double elapsed = duration<double>(now - m_last_feedback).count();
+    double send_rate = (m_feedback_seen && elapsed > 0) ? m_sent_bytes / elapsed : m_rate;
+    double delivery_rate = report.received_bytes * 1e6 / report.interval_us;
+    m_feedback_seen = true;
+    m_last_sequence = report.sequence;
+    m_last_feedback = now;
+    m_sent_bytes = 0;
+    ++m_stats.feedback_reports;
+    m_stats.reported_lost += report.lost;
+
+    uint32_t total = report.received + report.lost;
+    double loss = total > 0 ? static_cast<double>(report.lost) / total : 0.0;
+    if (loss > loss_threshold || report.queue_permille > queue_high)
+    {
+        if (static_cast<int32_t>(report.highest - m_recovery_until) > 0)
+        {
+            ++m_stats.congestion_events;
+            m_slow_start = false;
+            m_recovery_until = m_last_sent;
+            set_rate(std::max(m_rate / 2, std::min(m_rate * decrease_factor, delivery_rate)));
+        }
+        return;
+    }
+    // отправитель не успевает отправлять с текущей скоростью, канал не проверен
+    bool app_limited = send_rate < bottleneck_ratio * m_rate;
+    if (m_slow_start && !app_limited && (delivery_rate < bottleneck_ratio * send_rate ||
+                                         report.queue_permille > queue_low))
+    {
+        m_slow_start = false;
+        set_rate(std::max(delivery_rate, m_rate * decrease_factor));
+        return;
+    }
+    if (app_limited || report.queue_permille > queue_low)
+        return;
+    set_rate(m_slow_start ? m_rate * 1.25 : m_rate + additive_increase);
+}
+
+/** \brief Проверить отсутствие отчетов
+ *
+ * Если сервер присылал отчеты, но не присылает их дольше feedback_timeout,
+ * то отчеты или данные теряются, и скорость уменьшается вдвое.
+ *
+ * \param[in] now    Текущее время.
+ */
+void CongestionController::check_timeout(time_point<steady_clock> now)
+{
+    if (!m_feedback_seen || now - m_last_feedback < feedback_timeout)
+        return;
+    ++m_stats.timeouts;
+    m_slow_start = false;
+    m_last_feedback = now;
+    m_sent_bytes = 0;
+    set_rate(m_rate / 2);
+}
+
+/** \brief Текущая скорость
+ *
+ * \return Скорость отправки в байтах в секунду.
+ */
+double CongestionController::rate() const
+{
+    return m_rate;
+}
+
+/** \brief Статистика контроллера
+ *
+ * \return Ссылка на статистику контроллера перегрузки.
+ */
+const CongestionStats& CongestionController::get_stats() const
+{
+    return m_stats;
+}
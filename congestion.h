@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include "stats.h"
+
+using namespace std::chrono;
+
+#define FEEDBACK_SIZE (sizeof(uint8_t) + 6 * sizeof(uint32_t) + sizeof(uint64_t))
+
+struct FeedbackReport {
+    uint32_t sequence;        // номер отчета
+    uint32_t highest;         // наибольший принятый номер пакета
+    uint32_t received;        // принято пакетов за интервал
+    uint32_t lost;            // не пришло пакетов за интервал
+    uint32_t interval_us;     // длительность интервала
+    uint64_t received_bytes;  // принято байтов за интервал
+    uint32_t queue_permille;  // заполнение буфера приема сервера, доли 1/1000
+};
+
+uint32_t write_feedback(char *buf, const FeedbackReport& report);
+
+bool read_feedback(const char *buf, uint32_t len, FeedbackReport& report);
+
+class ReceiveMeter {
+public:
+    ReceiveMeter();
+
+    void on_package(uint32_t number, uint32_t bytes);
+
+    bool report_due(time_point<steady_clock> now) const;
+
+    void on_queue(uint32_t queue_permille);
+
+    uint32_t received() const;
+
+    FeedbackReport make_report(time_point<steady_clock> now);
+
+private:
+    uint32_t m_sequence;
+    uint32_t m_highest;
+    uint32_t m_reported_highest;
+    uint32_t m_received;
+    uint64_t m_received_bytes;
+    uint32_t m_queue_permille;
+    time_point<steady_clock> m_interval_start;
+};
+
+class CongestionController {
+public:
+    CongestionController();
+
+    time_point<steady_clock> next_send_time() const;
+
+    void on_sent(uint32_t number, uint32_t bytes, time_point<steady_clock> now);
+
+    void on_feedback(const FeedbackReport& report, time_point<steady_clock> now);
+
+    void check_timeout(time_point<steady_clock> now);
+
+    double rate() const;
+
+    const CongestionStats& get_stats() const;
+
+private:
+    double m_rate;
+    bool m_slow_start;
+    bool m_feedback_seen;
+    uint32_t m_last_sent;
+    uint32_t m_recovery_until;
+    uint32_t m_last_sequence;
+    uint64_t m_sent_bytes;
+    time_point<steady_clock> m_next_send;
+    time_point<steady_clock> m_last_feedback;
+    CongestionStats m_stats;
+
+    void set_rate(double rate);
+};
@@ -0,0 +1,309 @@
+#include "delta.h"
+#include "checksum.h"
+#include "package.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+static const uint32_t min_delta_block_size = 2048;
+static const uint32_t max_delta_block_size = 64 * 1024;
+static const uint64_t strong_checksum_seed = 0x64656C7461ULL;
+
+/** \brief Конструктор скользящей контрольной суммы
+ *
+ * Функция создает объект слабой контрольной суммы блока (как в rsync),
+ * которую можно пересчитать при сдвиге окна на один байт за O(1).
+ */
+RollingChecksum::RollingChecksum()
+    : m_a(0)
+    , m_b(0)
+    , m_len(0)
+{}
+
+/** \brief Посчитать контрольную сумму окна
+ *
+ * Функция считает контрольную сумму окна \p data длиной \p len заново.
+ *
+ * \param[in] data    Начало окна.
+ * \param[in] len     Длина окна.
+ */
+void RollingChecksum::reset(const char *data, uint32_t len)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    m_a = 0;
+    m_b = 0;
+    m_len = len;
+    for (uint32_t i = 0; i < len; ++i)
+    {
+        m_a += p[i];
+        m_b += (len - i) * p[i];
+    }
+}
+
+/** \brief Сдвинуть окно на один байт
+ *
+ * \param[in] out    Байт, покидающий окно.
+ * \param[in] in     Байт, входящий в окно.
+ */
+void RollingChecksum::roll(unsigned char out, unsigned char in)
+{
+    m_a += in - out;
+    m_b += m_a - m_len * out;
+}
+
+/** \brief Значение контрольной суммы
+ *
+ * \return 32-битная слабая контрольная сумма текущего окна.
+ */
+uint32_t RollingChecksum::value() const
+{
+    return (m_a & 0xFFFF) | (m_b << 16);
+}
+
+/** \brief Конструктор индекса сигнатур
+ *
+ * Функция создает пустой индекс сигнатур блоков файла сервера, по которому
+ * клиент ищет совпадающие блоки.
+ */
+SignatureIndex::SignatureIndex()
+    : m_block_size(0)
+    , m_size(0)
+{}
+
+/** \brief Очистить индекс
+ *
+ * \param[in] block_size    Размер блока, для которого посчитаны сигнатуры.
+ */
+void SignatureIndex::reset(uint32_t block_size)
+{
+    m_block_size = block_size;
+    m_size = 0;
+    m_blocks.clear();
+}
+
+/** \brief Добавить сигнатуру блока
+ *
+ * \param[in] index        Номер блока в файле сервера.
+ * \param[in] signature    Сигнатура блока.
+ */
+void SignatureIndex::insert(uint64_t index, const BlockSignature& signature)
+{
+    m_blocks[signature.weak].emplace_back(index, signature.strong);
+    ++m_size;
+}
+
+/** \brief Найти блок
+ *
+ * Функция ищет блок файла сервера, совпадающий с блоком \p data размером
+ * block_size(). Сначала сравнивается слабая сумма \p weak , сильная сумма
+ * считается только при ее совпадении. Если подходят несколько блоков,
+ * предпочитается блок \p preferred , чтобы соседние совпадения можно было
+ * объединить в одну ссылку.
+ *
+ * \param[in] weak         Слабая контрольная сумма блока.
+ * \param[in] data         Данные блока.
+ * \param[in] preferred    Предпочтительный номер блока или -1.
+ *
+ * \return Номер совпавшего блока или -1.
+ */
+int64_t SignatureIndex::find(uint32_t weak, const char *data, int64_t preferred) const
+{
+    auto iter = m_blocks.find(weak);
+    if (iter == m_blocks.end())
+        return -1;
+    uint64_t strong = strong_checksum(data, m_block_size);
+    int64_t found = -1;
+    for (const auto& block: iter->second)
+    {
+        if (block.second != strong)
+            continue;
+        if (static_cast<int64_t>(block.first) == preferred)
+            return preferred;
+        if (found < 0)
+            found = static_cast<int64_t>(block.first);
+    }
+    return found;
+}
+
+/** \brief Размер блока
+ *
+ * \return Размер блока, для которого посчитаны сигнатуры.
+ */
+uint32_t SignatureIndex::block_size() const
+{
+    return m_block_size;
+}
+
+/** \brief Число сигнатур
+ *
+ * \return Число сигнатур в индексе.
+ */
+size_t SignatureIndex::size() const
+{
+    return m_size;
+}
+
+/** \brief Сильная контрольная сумма блока
+ *
+ * \param[in] data    Данные блока.
+ * \param[in] len     Размер блока.
+ *
+ * \return 64-битный хеш блока.
+ */
+uint64_t strong_checksum(const char *data, uint32_t len)
+{
+    FileHash hash(strong_checksum_seed);
+    hash.update(data, len);
+    return hash.digest();
+}
+
+/** \brief Размер блока для дельты
+ *
+ * Функция выбирает размер блока пропорционально квадратному корню из
+ * размера файла, как в rsync. Так объем сигнатур и точность поиска
+ * изменений растут одинаково.
+ *
+ * \param[in] file_size    Размер файла.
+ *
+ * \return Размер блока, кратный 1 КиБ.
+ */
+uint32_t delta_block_size(uint64_t file_size)
+{
+    uint64_t block = static_cast<uint64_t>(std::sqrt(static_cast<double>(file_size)));
+    block = (block + 1023) & ~1023ULL;
+    if (block < min_delta_block_size)
+        return min_delta_block_size;
+    if (block > max_delta_block_size)
+        return max_delta_block_size;
+    return static_cast<uint32_t>(block);
+}
+
+/** \brief Посчитать сигнатуры файла
+ *
+ * Функция читает файл \p filename и считает сигнатуры его полных блоков,
+ * но не больше \p max_blocks первых. Неполный последний блок и блоки сверх
+ * \p max_blocks не подписываются, при дельта-передаче они передаются как
+ * новые данные.
+ *
+ * \param[in]  filename      Имя файла.
+ * \param[out] block_size    Размер блока.
+ * \param[out] file_size     Размер файла.
+ * \param[out] signatures    Сигнатуры блоков.
+ * \param[in]  max_blocks    Наибольшее число сигнатур.
+ *
+ * \return 0, в случае успеха, -1, если файл не удалось прочитать.
+ */
+int sign_file(const std::string& filename, uint32_t& block_size, uint64_t& file_size,
+              std::vector<BlockSignature>& signatures, size_t max_blocks)
+{
+    std::ifstream in(filename, std::ios::binary | std::ios::in | std::ios::ate);
+    if (!in.is_open())
+        return -1;
+    file_size = static_cast<uint64_t>(in.tellg());
+    in.seekg(0);
+    block_size = delta_block_size(file_size);
+    signatures.clear();
+    signatures.reserve(std::min<uint64_t>(file_size / block_size, max_blocks));
+    std::vector<char> buf(block_size);
+    RollingChecksum weak;
+    while (signatures.size() < max_blocks && in.read(buf.data(), block_size) && 
+           in.gcount() == block_size)
+    {
+        weak.reset(buf.data(), block_size);
+        signatures.push_back({weak.value(), strong_checksum(buf.data(), block_size)});
+    }
+    return 0;
+}
+
+/** \brief Записать пакет сигнатур
+ *
+ * Функция записывает в \p buf управляющее сообщение CONTROL_SIGNATURES с
+ * заголовком \p header и header.count сигнатурами из \p signatures .
+ *
+ * \return Размер сообщения в байтах.
+ */
+uint32_t write_signatures(char *buf, const SignaturesHeader& header,
+                          const BlockSignature *signatures)
+{
+    char *p = buf;
+    *p++ = CONTROL_SIGNATURES;
+    memcpy(p, &header.block_size, sizeof(header.block_size));
+    p += sizeof(header.block_size);
+    memcpy(p, &header.file_size, sizeof(header.file_size));
+    p += sizeof(header.file_size);
+    memcpy(p, &header.first_block, sizeof(header.first_block));
+    p += sizeof(header.first_block);
+    memcpy(p, &header.count, sizeof(header.count));
+    p += sizeof(header.count);
+    for (uint16_t i = 0; i < header.count; ++i)
+    {
+        memcpy(p, &signatures[i].weak, sizeof(signatures[i].weak));
+        p += sizeof(signatures[i].weak);
+        memcpy(p, &signatures[i].strong, sizeof(signatures[i].strong));
+        p += sizeof(signatures[i].strong);
+    }
+    return static_cast<uint32_t>(p - buf);
+}
+
+/** \brief Прочитать пакет сигнатур
+ *
+ * Функция разбирает управляющее сообщение CONTROL_SIGNATURES.
+ *
+ * \return true, если сообщение корректно, false иначе.
+ */
+bool read_signatures(const char *buf, uint32_t len, SignaturesHeader& header,
+                     std::vector<BlockSignature>& signatures)
+{
+    if (len < SIGNATURES_HEADER_SIZE || buf[0] != CONTROL_SIGNATURES)
+        return false;
+    const char *p = buf + 1;
+    memcpy(&header.block_size, p, sizeof(header.block_size));
+    p += sizeof(header.block_size);
+    memcpy(&header.file_size, p, sizeof(header.file_size));
+    p += sizeof(header.file_size);
+    memcpy(&header.first_block, p, sizeof(header.first_block));
+    p += sizeof(header.first_block);
+    memcpy(&header.count, p, sizeof(header.count));
+    p += sizeof(header.count);
+    if (len != SIGNATURES_HEADER_SIZE + header.count * SIGNATURE_ENTRY_SIZE ||
+        header.block_size == 0)
+        return false;
+    signatures.resize(header.count);
+    for (uint16_t i = 0; i < header.count; ++i)
+    {
+        memcpy(&signatures[i].weak, p, sizeof(signatures[i].weak));
+        p += sizeof(signatures[i].weak);
+        memcpy(&signatures[i].strong, p, sizeof(signatures[i].strong));
+        p += sizeof(signatures[i].strong);
+    }
+    return true;
+}
+
+/** \brief Записать ссылку на блоки
+ *
+ * Функция записывает в \p buf ссылку на \p op.count блоков старой копии
+ * файла, начиная с блока \p op.first_block . Буфер должен вмещать
+ * COPY_OP_SIZE байтов.
+ */
+void write_copy_op(char *buf, const CopyOp& op)
+{
+    memcpy(buf, &op.block_size, sizeof(op.block_size));
+    memcpy(buf + 4, &op.first_block, sizeof(op.first_block));
+    memcpy(buf + 12, &op.count, sizeof(op.count));
+}
+
+/** \brief Прочитать ссылку на блоки
+ *
+ * \return true, если ссылка корректна, false иначе.
+ */
+bool read_copy_op(const char *buf, uint32_t len, CopyOp& op)
+{
+    if (len != COPY_OP_SIZE)
+        return false;
+    memcpy(&op.block_size, buf, sizeof(op.block_size));
+    memcpy(&op.first_block, buf + 4, sizeof(op.first_block));
+    memcpy(&op.count, buf + 12, sizeof(op.count));
+    return op.block_size > 0;
+}
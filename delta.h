@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#define SIGNATURE_ENTRY_SIZE   (sizeof(uint32_t) + sizeof(uint64_t))
+#define SIGNATURES_HEADER_SIZE (sizeof(uint8_t) + sizeof(uint32_t) + 2 * sizeof(uint64_t) + \
+                                sizeof(uint16_t))
+#define COPY_OP_SIZE           (2 * sizeof(uint32_t) + sizeof(uint64_t))
+
+struct BlockSignature {
+    uint32_t weak;
+    uint64_t strong;
+};
+
+struct SignaturesHeader {
+    uint32_t block_size;
+    uint64_t file_size;
+    uint64_t first_block;
+    uint16_t count;
+};
+
+struct CopyOp {
+    uint32_t block_size;
+    uint64_t first_block;
+    uint32_t count;
+};
+
+class RollingChecksum {
+public:
+    RollingChecksum();
+
+    void reset(const char *data, uint32_t len);
+
+    void roll(unsigned char out, unsigned char in);
+
+    uint32_t value() const;
+
+private:
+    uint32_t m_a;
+    uint32_t m_b;
+    uint32_t m_len;
+};
+
+class SignatureIndex {
+public:
+    SignatureIndex();
+
+    void reset(uint32_t block_size);
+
+    void insert(uint64_t index, const BlockSignature& signature);
+
+    int64_t find(uint32_t weak, const char *data, int64_t preferred) const;
+
+    uint32_t block_size() const;
+
+    size_t size() const;
+
+private:
+    uint32_t m_block_size;
+    size_t m_size;
+    std::unordered_map<uint32_t, std::vector<std::pair<uint64_t, uint64_t>>> m_blocks;
+};
+
+uint64_t strong_checksum(const char *data, uint32_t len);
+
+uint32_t delta_block_size(uint64_t file_size);
+
+int sign_file(const std::string& filename, uint32_t& block_size, uint64_t& file_size,
+              std::vector<BlockSignature>& signatures, size_t max_blocks = SIZE_MAX);
+
+uint32_t write_signatures(char *buf, const SignaturesHeader& header,
+                          const BlockSignature *signatures);
+
+bool read_signatures(const char *buf, uint32_t len, SignaturesHeader& header,
+                     std::vector<BlockSignature>& signatures);
+
+void write_copy_op(char *buf, const CopyOp& op);
+
+bool read_copy_op(const char *buf, uint32_t len, CopyOp& op);
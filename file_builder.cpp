@@ -1,14 +1,35 @@
 #include "file_builder.h"
 #include "format.h"
+#include "compression.h"
+#include "delta.h"
+#include "trace.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <sstream>
 #include <regex>
 
 // регулярное выражение для валидации  имени файла
 const std::regex file_name_regex("^[\\w|\\d|.|&|,|:|;]+$"); 
 
+static const uint32_t copy_buf_size = 64 * 1024;
+static const uint64_t max_reorder_window = 1 << 20;  // пакетов впереди последнего записанного
+static const uint64_t max_spill_size = 1ULL << 30;   // байтов вытесненных пакетов одного сборщика
+
+/** \brief Проверка имени файла
+ * 
+ * Функция проверяет, что \p name является допустимым именем файла без пути.
+ * 
+ * \return true, если имя допустимо, false иначе.
+ */ 
+bool valid_file_name(const std::string& name)
+{
+    return std::regex_match(name, file_name_regex);
+}
+
 /** \brief Конструктор файлового сборщика 
  * 
  * Функция инициализирует объект файлового сборщика принимая в качестве 
@@ -17,14 +38,27 @@ const std::regex file_name_regex("^[\\w|\\d|.|&|,|:|;]+$");
  * \note
  * \p marker необходим для внутренней проверки идентификации, чтобы быть 
  * уверенным, что принимающие пакеты принадлежат одному потоку пакетов.
+ * В \p stats , если он задан, сборщик учитывает статистику распаковки.
+ * Если задан бюджет памяти \p budget , то ожидающие записи пакеты сверх 
+ * квоты сборщика или общего предела вытесняются на диск.
  */ 
-FileBuilder::FileBuilder(const std::string& dir, uint32_t marker)
+FileBuilder::FileBuilder(const std::string& dir, uint32_t marker, ServerStats *stats,
+                         MemoryBudget *budget)
     : m_marker(marker)
     , m_last_writed_pkg_number(0)
+    , m_file_size(0)
     , m_file_name_is_ready(false)
     , m_file_body_is_ready(false)
     , m_file_is_created(false)
     , m_last_writing_package_time(system_clock::now())
+    , m_received(max_reorder_window)
+    , m_durability(DURABILITY_BUFFERED)
+    , m_batcher(nullptr)
+    , m_storage(nullptr)
+    , m_root(-1)
+    , m_stats(stats)
+    , m_budget(budget)
+    , m_buffered_bytes(0)
 {
     m_dir = dir;
     if (m_dir.find_last_of("/") != dir.size() - 1)
@@ -33,37 +67,135 @@ FileBuilder::FileBuilder(const std::string& dir, uint32_t marker)
 
 /** \brief Деструктор файлового сборщика 
  * 
- * Функция закрывает открытый файл, и если он не готов, то удаляет его.
+ * Функция закрывает открытый файл, и если он не собран, то удаляет его. 
+ * Собранный файл, ожидающий группового fsync, остается у потока 
+ * синхронизации. Память ожидавших записи пакетов возвращается в бюджет, а
+ * директория хранения освобождается.
  */ 
 FileBuilder::~FileBuilder()
 {
-    if (m_fout.is_open())
+    if (m_budget != nullptr)
+        m_budget->release(m_buffered_bytes);
+    if (m_root >= 0)
+        m_storage->release(m_root, m_file_size, m_file_body_is_ready);
+    m_writer.close();
+    if (m_sink != nullptr && m_file_name_is_ready && !m_file_body_is_ready)
+        m_sink->abort();
+    else if (m_file_name_is_ready && !m_file_body_is_ready)
+        remove(m_tmp_filename.c_str());
+}
+
+/** \brief Полный номер пакета
+ * 
+ * В заголовке пакета хранятся младшие 32 бита номера. Функция 
+ * восстанавливает 64-битный номер, ближайший к номеру следующего 
+ * записываемого пакета, поэтому файлы длиннее 2^32 пакетов собираются 
+ * правильно, пока пакеты опаздывают меньше чем на 2^31 номеров.
+ * 
+ * \param[in] number    Номер из заголовка пакета.
+ * 
+ * \return 64-битный номер или значение меньше 1 для пакетов, пришедших 
+ * раньше начала потока.
+ */ 
+int64_t FileBuilder::sequence(uint32_t number) const
+{
+    uint64_t next = m_last_writed_pkg_number + 1;
+    return static_cast<int64_t>(next) + 
+           static_cast<int32_t>(number - static_cast<uint32_t>(next));
+}
+
+/** \brief Следующий пакет для записи
+ * 
+ * Функция ищет пакет, следующий за последним записанным, сначала в очереди, 
+ * затем среди вытесненных на диск. Вытесненный пакет загружается в 
+ * m_spilled.
+ * 
+ * \return Указатель на пакет или nullptr, если следующий пакет не пришел.
+ */ 
+const Package *FileBuilder::next_package()
+{
+    uint64_t next = m_last_writed_pkg_number + 1;
+    if (!m_pkg_queue.empty() && 
+        m_pkg_queue.top().get_number() == static_cast<uint32_t>(next))
+        return &m_pkg_queue.top();
+    if (m_spill == nullptr || !m_spill->take(next, m_spill_buf) ||
+        m_spill_buf.size() < HEADER_SIZE || m_spill_buf.size() > MAX_PACKAGE_SIZE)
+        return nullptr;
+    m_spilled.load_package(m_spill_buf.data(), m_spill_buf.size());
+    return &m_spilled;
+}
+
+/** \brief Убрать записанный пакет
+ * 
+ * Функция удаляет записанный пакет \p package из очереди и возвращает его 
+ * память в бюджет. Вытесненный пакет уже удален из файла вытеснения.
+ */ 
+void FileBuilder::drop_package(const Package *package)
+{
+    if (m_pkg_queue.empty() || package != &m_pkg_queue.top())
+        return;
+    if (m_budget != nullptr)
     {
-        m_fout.close();
-        if (!file_is_ready())
-            remove(m_tmp_filename.c_str());
+        m_budget->release(package->package_size());
+        m_buffered_bytes -= package->package_size();
     }
+    m_pkg_queue.pop();
 }
 
-/** \brief Проверка на присутствие следующего пакета
+/** \brief Сохранить пакет до записи
  * 
- * Функция сравнивает, если ли следующий пакет в очереди или нет.
+ * Функция помещает пакет с полным номером \p number в очередь, резервируя 
+ * память в бюджете. Если квота сборщика или общий предел исчерпаны, пакет 
+ * вытесняется на диск. Пакет, следующий за последним записанным, всегда 
+ * остается в памяти: он будет записан сразу.
  * 
- * \return true, если пакет пристствует, false иначе.
+ * \return true, если пакет сохранен, false, если его не удалось вытеснить.
  */ 
-bool FileBuilder::has_next_package() const 
+bool FileBuilder::store_package(Package&& package, uint64_t number)
 {
-    if (m_pkg_queue.empty()) {
-        return false;
+    if (m_budget != nullptr)
+    {
+        uint64_t size = package.package_size();
+        if (number == m_last_writed_pkg_number + 1)
+            m_budget->reserve(size);
+        else if (m_buffered_bytes + size > m_budget->session_quota() ||
+                 !m_budget->try_reserve(size))
+            return spill_package(package, number);
+        m_buffered_bytes += size;
     }
-    return m_pkg_queue.top().get_number() - m_last_writed_pkg_number == 1;
+    m_pkg_queue.push(std::move(package));
+    return true;
+}
+
+/** \brief Вытеснить пакет на диск
+ * 
+ * Функция записывает пакет в скрытый файл вытеснения в директории сервера.
+ * Имя файла уникально для сборщика, смотрите SpillFile. Размер файла 
+ * ограничен max_spill_size.
+ * 
+ * \return true, если пакет записан, false иначе.
+ */ 
+bool FileBuilder::spill_package(const Package& package, uint64_t number)
+{
+    if (m_spill == nullptr)
+        m_spill.reset(new SpillFile(m_dir + "." + std::to_string(m_marker) + ".spill",
+                                    max_spill_size));
+    if (!m_spill->store(number, package.as_bytes(), package.package_size()))
+        return false;
+    if (m_stats != nullptr)
+        ++m_stats->spilled;
+    return true;
 }
 
 /** \brief Добавление пакета очередь пакетов.
  * 
  * Функция добавляет очередной пакет в очередь пакетов. Так как используется 
  * очередь с приоритетом, то пакет будет автомтически добавлен в нужную 
- * позицию.
+ * позицию. Дубликаты уже принятых пакетов отбрасываются и учитываются в 
+ * статистике. Пакеты, номер которых дальше max_reorder_window от последнего
+ * записанного, отбрасываются как некорректные. Если пакет не поместился в 
+ * бюджет памяти и его не удалось вытеснить на диск, он отбрасывается 
+ * (учитывается как shed), и его повторная копия будет принята.
  * 
  * \warning
  * Осуществляется проверка, принадлежит ли переданный пакет тому же потоку 
@@ -74,9 +206,61 @@ bool FileBuilder::has_next_package() const
 void FileBuilder::insert_package(Package&& package) 
 {
     assert(package.get_marker() == m_marker);
-    if (package.get_number() < m_last_writed_pkg_number)
+    int64_t number = sequence(package.get_number());
+    if (number < 1 || m_received.contains(number))
+    {
+        if (m_stats != nullptr)
+            ++m_stats->duplicates;
         return;
-    m_pkg_queue.push(std::move(package));
+    }
+    if (!m_received.insert(number))
+    {
+        if (m_stats != nullptr)
+            ++m_stats->bad_packages;
+        return;
+    }
+    if (!store_package(std::move(package), number))
+    {
+        m_received.erase(number);
+        if (m_stats != nullptr)
+            ++m_stats->shed;
+        return;
+    }
+    TRACEPOINT(INSERT, m_marker, number, m_pkg_queue.size());
+}
+
+/** \brief Проверка на дубликат
+ * 
+ * Функция за O(1) проверяет, принят ли уже пакет с номером \p number . Ее 
+ * можно вызвать по заголовку датаграммы до создания пакета, чтобы не 
+ * копировать дубликат.
+ * 
+ * \param[in] number    Номер пакета.
+ * 
+ * \return true, если пакет уже принят, false иначе.
+ */ 
+bool FileBuilder::is_duplicate(uint32_t number) const
+{
+    int64_t full = sequence(number);
+    return full < 1 || m_received.contains(full);
+}
+
+/** \brief Идентификатор файла
+ * 
+ * \return Идентификатор потока пакетов, из которого собирается файл.
+ */ 
+uint32_t FileBuilder::get_marker() const
+{
+    return m_marker;
+}
+
+/** \brief Размер записанных данных
+ * 
+ * \return Число байтов, записанных в файл.
+ */ 
+uint64_t FileBuilder::get_file_size() const
+{
+    return m_file_size;
 }
 
 /** \brief Определено ли имя фала.
@@ -115,7 +299,102 @@ std::string FileBuilder::get_file_name() const
  */ 
 bool FileBuilder::file_is_ready() const 
 {
-    return m_file_body_is_ready && m_file_name_is_ready;
+    return m_file_body_is_ready && m_file_name_is_ready && 
+        (m_sync == nullptr || m_sync->state.load() == 1);
+}
+
+/** \brief Ожидает ли файл синхронизации
+ * 
+ * \return true, если файл собран и ждет группового fsync.
+ */ 
+bool FileBuilder::sync_pending() const
+{
+    return m_sync != nullptr && m_sync->state.load() == 0;
+}
+
+/** \brief Не удалось ли сохранить файл на диск
+ * 
+ * \return true, если групповой fsync файла завершился ошибкой.
+ */ 
+bool FileBuilder::sync_failed() const
+{
+    return m_sync != nullptr && m_sync->state.load() < 0;
+}
+
+/** \brief Задать режим сохранности
+ * 
+ * Функция задает режим сохранности файла, ее нужно вызвать до прихода 
+ * первого пакета. Для режима DURABILITY_GROUP нужен поток синхронизации 
+ * \p batcher , без него файл сохраняется как в режиме DURABILITY_DIRECT.
+ * 
+ * \param[in] mode       Режим сохранности.
+ * \param[in] batcher    Поток группового fsync.
+ */ 
+void FileBuilder::set_durability(durability_modes mode, SyncBatcher *batcher)
+{
+    m_durability = (mode == DURABILITY_GROUP && batcher == nullptr) ? DURABILITY_DIRECT : mode;
+    m_batcher = batcher;
+}
+
+/** \brief Задать буфер записи
+ * 
+ * Функция задает размер блока, которыми данные пакетов пишутся в файл, и 
+ * время, которое данные могут ждать в неполном блоке. Ее нужно вызвать до 
+ * прихода первого пакета.
+ * 
+ * \param[in] chunk_size        Размер блока в байтах.
+ * \param[in] flush_interval    Время ожидания данных в буфере.
+ */ 
+void FileBuilder::set_write_buffer(size_t chunk_size, milliseconds flush_interval)
+{
+    m_writer.set_chunk_size(chunk_size);
+    m_writer.set_flush_interval(flush_interval);
+}
+
+/** \brief Задать хранилище
+ * 
+ * Функция задает хранилище из нескольких директорий. Директорию для файла 
+ * сборщик выбирает в хранилище, когда узнает имя файла, а директория, 
+ * переданная в конструктор, используется для пакетов, вытесненных раньше. 
+ * Блоки файла пишет поток записи выбранной директории, а в режиме 
+ * DURABILITY_GROUP файл синхронизирует ее поток fsync.
+ * 
+ * \param[in] storage    Хранилище.
+ */ 
+void FileBuilder::set_storage(Storage *storage)
+{
+    m_storage = storage;
+}
+
+/** \brief Задать получателя файла
+ * 
+ * Функция задает получателя \p sink , которому сборщик передает данные 
+ * файла вместо записи в директорию хранения. Данные передаются по мере 
+ * того, как собирается непрерывная часть файла, а FileSink::finish() 
+ * вызывается после получения и проверки всего файла. Если файл не получен,
+ * вызывается FileSink::abort(). Ее нужно вызвать до прихода первого пакета.
+ * 
+ * \param[in] sink    Получатель файла.
+ */ 
+void FileBuilder::set_sink(std::unique_ptr<FileSink> sink)
+{
+    m_sink = std::move(sink);
+}
+
+/** \brief Записать буфер по таймауту
+ * 
+ * Функция записывает в файл данные, которые ждут в буфере записи дольше 
+ * заданного времени, если пакеты потока приходят медленно.
+ * 
+ * \param[in] now    Текущее время.
+ * 
+ * \return 0, в случае успеха, ErrErrno иначе.
+ */ 
+int FileBuilder::flush_by_timeout(time_point<steady_clock> now)
+{
+    if (m_file_body_is_ready || m_writer.flush_by_timeout(now) == 0)
+        return 0;
+    return ErrErrno;
 }
 
 /** \brief Копию время последней записи пакета в во временный файл.
@@ -153,6 +432,241 @@ time_point<system_clock>  FileBuilder::get_last_writing_package_time() const
 //     return 0;
 // }
 
+/** \brief Запись данных пакета в файл.
+ * 
+ * Функция записывает данные \p package в файл. Сжатые данные (опция 
+ * FLAG_COMPRESSED) распаковываются непосредственно перед записью, поэтому 
+ * пакеты, пришедшие не по порядку, хранятся в очереди в сжатом виде. 
+ * 
+ * \param[in] package    Пакет с данными файла.
+ * 
+ * \return 0, в случае успеха, ErrBadCompressedData, если сжатые данные 
+ * повреждены.
+ */ 
+int FileBuilder::write_data(const Package& package)
+{
+    const char *data = package.get_data();
+    uint32_t size = package.get_data_size();
+    if (package.has_option(FLAG_COMPRESSED))
+    {
+        uint64_t started = thread_cpu_time_ns();
+        uint16_t raw_size = 0;
+        if (size < COMPRESSED_SIZE_PREFIX)
+            return ErrBadCompressedData;
+        memcpy(&raw_size, data, COMPRESSED_SIZE_PREFIX);
+        m_decode_buf.resize(raw_size);
+        int decoded = decompress_block(data + COMPRESSED_SIZE_PREFIX, 
+                                       size - COMPRESSED_SIZE_PREFIX,
+                                       m_decode_buf.data(), raw_size);
+        if (decoded != raw_size)
+            return ErrBadCompressedData;
+        if (m_stats != nullptr)
+        {
+            m_stats->decompression.raw_bytes += raw_size;
+            m_stats->decompression.wire_bytes += size;
+            ++m_stats->decompression.compressed_blocks;
+            m_stats->decompression.cpu_ns += thread_cpu_time_ns() - started;
+        }
+        data = m_decode_buf.data();
+        size = raw_size;
+    } else if (m_stats != nullptr) {
+        m_stats->decompression.raw_bytes += size;
+        m_stats->decompression.wire_bytes += size;
+        ++m_stats->decompression.raw_blocks;
+    }
+    int result = output(data, size);
+    if (result != 0)
+        return result;
+    m_file_size += size;
+    if (package.has_option(FLAG_CHECKSUM))
+        m_file_hash.update(data, size);
+    return 0;
+}
+
+/** \brief Копирование блоков старой копии файла.
+ * 
+ * Функция обрабатывает ссылку на блоки при дельта-передаче: читает 
+ * указанные блоки из старой копии файла и дописывает их в новый файл. 
+ * Последний блок старой копии может быть неполным.
+ * 
+ * \param[in] package    Пакет со ссылкой на блоки (опция FLAG_DELTA).
+ * 
+ * \return 0, в случае успеха, ErrDeltaBase, если ссылка некорректна или 
+ * блоки не удалось прочитать.
+ */ 
+int FileBuilder::copy_base_data(const Package& package)
+{
+    CopyOp op;
+    if (!m_base.is_open() || 
+        !read_copy_op(package.get_data(), package.get_data_size(), op))
+        return ErrDeltaBase;
+    uint64_t left = static_cast<uint64_t>(op.count) * op.block_size;
+    m_base.clear();
+    m_base.seekg(static_cast<uint64_t>(op.first_block) * op.block_size);
+    m_copy_buf.resize(copy_buf_size);
+    while (left > 0)
+    {
+        m_base.read(m_copy_buf.data(), std::min<uint64_t>(left, copy_buf_size));
+        std::streamsize got = m_base.gcount();
+        if (got <= 0)
+            return ErrDeltaBase;
+        int result = output(m_copy_buf.data(), got);
+        if (result != 0)
+            return result;
+        m_file_size += got;
+        if (package.has_option(FLAG_CHECKSUM))
+            m_file_hash.update(m_copy_buf.data(), got);
+        left -= got;
+    }
+    return 0;
+}
+
+/** \brief Вывод данных файла.
+ * 
+ * Функция передает очередной участок данных файла получателю, если он 
+ * задан, иначе пишет его в файл.
+ * 
+ * \return 0, в случае успеха, ErrSink или ErrErrno иначе.
+ */ 
+int FileBuilder::output(const char *data, size_t size)
+{
+    if (m_sink != nullptr)
+        return m_sink->write(data, size) == 0 ? 0 : ErrSink;
+    return m_writer.write(data, size) == 0 ? 0 : ErrErrno;
+}
+
+/** \brief Создание файла.
+ * 
+ * Функция проверяет имя файла из первого пакета потока и создает файл. При 
+ * дельта-передаче (опция FLAG_DELTA) старая копия файла открывается для 
+ * чтения, а новая собирается во временном файле ".<имя>.<marker>.part", 
+ * который заменяет старую копию после получения всех данных. Если задано
+ * хранилище, файл создается в выбранной им директории. Если задан 
+ * получатель, файл не создается, а получатель узнает имя файла, старая же
+ * копия для дельта-передачи ищется в директориях хранения.
+ * 
+ * \param[in] package    Пакет с именем файла.
+ * 
+ * \return 0, в случае успеха, ErrInvalidFileName или ErrCouldNotCreateFile 
+ * иначе.
+ */ 
+int FileBuilder::open_file(const Package& package)
+{
+    std::string fresh_file_name(package.get_data(), package.get_data_size());
+    if (!valid_file_name(fresh_file_name))
+        return ErrInvalidFileName;    
+    if (m_sink != nullptr)
+    {
+        if (m_sink->open(fresh_file_name) != 0)
+            return ErrSink;
+        int root = m_storage != nullptr ? m_storage->find(fresh_file_name) : -1;
+        if (package.has_option(FLAG_DELTA))
+            m_base.open((root >= 0 ? m_storage->root(root).dir : m_dir) + fresh_file_name,
+                        std::ios::binary|std::ios::in);
+        m_origin_filename = fresh_file_name;
+        m_tmp_filename = fresh_file_name;
+        m_file_name_is_ready = true;
+        return 0;
+    }
+    if (m_storage != nullptr)
+    {
+        m_root = m_storage->place(fresh_file_name);
+        StorageRoot& root = m_storage->root(m_root);
+        m_dir = root.dir;
+        m_writer.set_queue(root.writer.get());
+        if (root.batcher)
+            m_batcher = root.batcher.get();
+    }
+    m_origin_filename = m_dir + fresh_file_name;
+    m_tmp_filename = m_origin_filename;
+    if (package.has_option(FLAG_DELTA))
+    {
+        m_base.open(m_origin_filename, std::ios::binary|std::ios::in);
+        m_tmp_filename = m_dir + "." + fresh_file_name + "." + 
+            std::to_string(m_marker) + ".part";
+    }
+    if (m_writer.open(m_tmp_filename, m_durability) != 0)
+        return ErrCouldNotCreateFile;    
+    m_file_name_is_ready = true;     
+    return 0;
+}
+
+/** \brief Завершение файла.
+ * 
+ * Функция закрывает собранный файл. При дельта-передаче временный файл 
+ * заменяет старую копию. В режиме DURABILITY_DIRECT файл и директория
+ * синхронизируются с диском до возврата, а в режиме DURABILITY_GROUP файл
+ * передается потоку синхронизации, и file_is_ready() вернет true только 
+ * после его fsync. Если задан получатель, ему сообщается о получении файла.
+ * 
+ * \return 0, в случае успеха, ErrErrno или ErrSink иначе.
+ */ 
+int FileBuilder::finish_file()
+{
+    m_base.close();
+    if (m_sink != nullptr)
+    {
+        if (m_sink->finish() != 0)
+            return ErrSink;
+    } else if (m_durability == DURABILITY_GROUP)
+    {
+        int fd = m_writer.release();
+        if (fd < 0)
+            return ErrErrno;
+        m_sync = m_batcher->submit(fd, m_tmp_filename, m_origin_filename);
+    } else if (m_durability == DURABILITY_DIRECT) {
+        int result = sync_file();
+        if (result != 0)
+            return result;
+    } else {
+        if (m_writer.close() != 0)
+            return ErrErrno;
+        if (m_tmp_filename != m_origin_filename &&
+            rename(m_tmp_filename.c_str(), m_origin_filename.c_str()) != 0)
+            return ErrErrno;
+    }
+    m_file_body_is_ready = true;
+    TRACEPOINT(COMPLETE, m_marker, m_file_size, m_last_writed_pkg_number + 1);
+    return 0;
+}
+
+/** \brief Синхронизация файла с диском.
+ * 
+ * Функция сбрасывает на диск данные файла, переименовывает его и сбрасывает
+ * директорию. Задержка учитывается в статистике синхронизации.
+ * 
+ * \return 0, в случае успеха, ErrErrno иначе.
+ */ 
+int FileBuilder::sync_file()
+{
+    auto started = steady_clock::now();
+    int result = m_writer.sync();
+    if (m_writer.close() != 0)
+        result = -1;
+    if (result == 0 && m_tmp_filename != m_origin_filename &&
+        rename(m_tmp_filename.c_str(), m_origin_filename.c_str()) != 0)
+        result = -1;
+    if (result == 0)
+    {
+        int dir_fd = open(m_dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir_fd < 0 || fsync(dir_fd) != 0)
+            result = -1;
+        if (dir_fd >= 0)
+            close(dir_fd);
+    }
+    if (m_stats != nullptr)
+    {
+        uint64_t latency = duration_cast<microseconds>(steady_clock::now() - started).count();
+        ++m_stats->sync.files;
+        ++m_stats->sync.batches;
+        m_stats->sync.latency_total_us += latency;
+        m_stats->sync.latency_max_us = std::max(m_stats->sync.latency_max_us, latency);
+        if (result != 0)
+            ++m_stats->sync.errors;
+    }
+    return result == 0 ? 0 : ErrErrno;
+}
+
 /** \brief Обработка пакетов.
  * 
  * В этой функции полученные пакеты файловый сборщик записывает последовательно
@@ -163,8 +677,15 @@ time_point<system_clock>  FileBuilder::get_last_writing_package_time() const
  * [time_create]-marker. Ошибки, возращаемы функцией следующие: 
  * ErrInvalidFileName - файл с таким именем нельзя созать, 
  * ErrExpectPackage   - не достает пакета для записи,
+ * ErrChecksumMismatch - хеш записанного файла не совпал с переданным,
+ * ErrBadCompressedData - не удалось распаковать данные пакета,
+ * ErrDeltaBase       - не удалось скопировать блоки старой копии файла,
+ * ErrSink            - получатель файла отказался от данных,
  * ErrErrno           - код ошибки смотреть в errno.
  * 
+ * Если пакеты содержат опцию FLAG_CHECKSUM, то хеш файла считается по мере
+ * записи данных и сверяется с хешем из последнего пакета.
+ * 
  * \warning
  * В случае, если имя файла, полученное файловым сборщиком, уже занятов в текущей 
  * директории, то файловый сборщик попытается удалить его.
@@ -180,33 +701,45 @@ int FileBuilder::process()
     //         return ErrErrno;
     //     m_file_is_created = true;
     // }
-    while (has_next_package() && !file_is_ready())
+    const Package *next;
+    while (!m_file_body_is_ready && (next = next_package()) != nullptr)
     {
-        const Package &package = m_pkg_queue.top();
-        if (package.get_number() == 1)
+        const Package &package = *next;
+        if (m_last_writed_pkg_number == 0)
+        {
+            int result = open_file(package);
+            if (result != 0)
+                return result;
+        } else if (package.get_package_flag() == FLAG_LAST_PACKAGE && 
+                   package.has_option(FLAG_CHECKSUM)) 
         {
-            std::stringstream fresh_file_name;
-            fresh_file_name.write(package.get_data(), package.get_data_size());
-            fresh_file_name << "\0";
-            if (!std::regex_match(fresh_file_name.str(), file_name_regex))
-                return ErrInvalidFileName;    
-            m_origin_filename = m_dir + fresh_file_name.str();
-            m_fout.open(m_origin_filename, std::ios::binary|std::ios::out);
-            if (!m_fout.is_open() || !m_fout.good())
-                return ErrCouldNotCreateFile;    
-            m_file_name_is_ready = true;     
+            uint64_t digest = 0;
+            if (package.get_data_size() == FILE_HASH_SIZE)
+                memcpy(&digest, package.get_data(), FILE_HASH_SIZE);
+            if (package.get_data_size() != FILE_HASH_SIZE || 
+                digest != m_file_hash.digest())
+                return ErrChecksumMismatch;
+            int result = finish_file();
+            if (result != 0)
+                return result;
         } else {
-            m_fout.write(package.get_data(), package.get_data_size());
+            int result = package.has_option(FLAG_DELTA) ? copy_base_data(package)
+                                                        : write_data(package);
+            if (result != 0)
+                return result;
             if (package.get_package_flag() == FLAG_LAST_PACKAGE) {
-                m_fout.close();
-                m_file_body_is_ready = true;
+                result = finish_file();
+                if (result != 0)
+                    return result;
             }  
         }
-        m_pkg_queue.pop();
+        drop_package(next);
         ++m_last_writed_pkg_number;
+        TRACEPOINT(WRITE, m_marker, m_last_writed_pkg_number, m_file_size);
+        m_received.advance(m_last_writed_pkg_number + 1);
         m_last_writing_package_time = std::chrono::system_clock::now();
     }
-    if (!file_is_ready())
+    if (!m_file_body_is_ready)
         return ErrExpectPackage;
     // if (file_exists(m_origin_filename) && 
     //     remove(m_origin_filename.c_str()) != 0)
@@ -12,6 +12,14 @@
 #include <map>
 
 #include "package.h"
+#include "stats.h"
+#include "received_set.h"
+#include "memory_budget.h"
+#include "spill_file.h"
+#include "file_writer.h"
+#include "sync_batcher.h"
+#include "storage.h"
+#include "sink.h"
 
 using namespace std::chrono;
 
@@ -19,19 +27,46 @@ enum errors {
     ErrInvalidFileName    = -2,
     ErrExpectPackage      = -3,
     ErrCouldNotCreateFile = -5,
-    ErrErrno              = -4
+    ErrErrno              = -4,
+    ErrChecksumMismatch   = -6,
+    ErrBadCompressedData  = -7,
+    ErrDeltaBase          = -8,
+    ErrSink               = -9
 };
 
+bool valid_file_name(const std::string& name);
+
 class FileBuilder {
 public:
-    FileBuilder(const std::string& dir, uint32_t marker);
+    FileBuilder(const std::string& dir, uint32_t marker, ServerStats *stats = nullptr,
+                MemoryBudget *budget = nullptr);
 
     ~FileBuilder();
 
     void insert_package(Package&& package);
 
+    bool is_duplicate(uint32_t number) const;
+
+    uint32_t get_marker() const;
+
+    uint64_t get_file_size() const;
+
     bool file_is_ready() const;
 
+    bool sync_pending() const;
+
+    bool sync_failed() const;
+
+    void set_durability(durability_modes mode, SyncBatcher *batcher = nullptr);
+
+    void set_write_buffer(size_t chunk_size, milliseconds flush_interval);
+
+    void set_storage(Storage *storage);
+
+    void set_sink(std::unique_ptr<FileSink> sink);
+
+    int flush_by_timeout(time_point<steady_clock> now);
+
     bool file_name_is_ready() const;
 
     std::string get_file_name() const;
@@ -47,17 +82,55 @@ public:
     int process();
 private:
     uint32_t m_marker;
-    uint32_t m_last_writed_pkg_number;
+    uint64_t m_last_writed_pkg_number;
+    uint64_t m_file_size;
     bool  m_file_name_is_ready;
     bool  m_file_body_is_ready;
     bool  m_file_is_created;
     std::string m_dir;
     time_point<system_clock> m_last_writing_package_time;
     std::priority_queue<Package> m_pkg_queue;
-    std::ofstream m_fout;
+    ReceivedSet m_received;
+    FileWriter m_writer;
+    durability_modes m_durability;
+    SyncBatcher *m_batcher;
+    std::shared_ptr<SyncTicket> m_sync;
+    Storage *m_storage;
+    int m_root;
+    std::unique_ptr<FileSink> m_sink;
+    std::ifstream m_base;
+    std::vector<char> m_copy_buf;
+    FileHash m_file_hash;
+    std::vector<char> m_decode_buf;
+    ServerStats *m_stats;
+    MemoryBudget *m_budget;
+    uint64_t m_buffered_bytes;
+    std::unique_ptr<SpillFile> m_spill;
+    std::vector<char> m_spill_buf;
+    Package m_spilled;
 
     std::string m_origin_filename;
     std::string m_tmp_filename;
 
-    bool has_next_package() const;
+    bool store_package(Package&& package, uint64_t number);
+
+    bool spill_package(const Package& package, uint64_t number);
+
+    int64_t sequence(uint32_t number) const;
+
+    const Package *next_package();
+
+    void drop_package(const Package *package);
+
+    int write_data(const Package& package);
+
+    int copy_base_data(const Package& package);
+
+    int output(const char *data, size_t size);
+
+    int open_file(const Package& package);
+
+    int finish_file();
+
+    int sync_file();
 };
\ No newline at end of file
@@ -0,0 +1,439 @@
+#include "file_writer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const size_t direct_alignment = 4096;            // выравнивание буфера, смещения и размера
+static const size_t default_chunk_size = 1024 * 1024;   // данные пишутся в файл блоками такого размера
+static const milliseconds default_flush_interval(200);   // данные лежат в буфере не дольше
+static const uint64_t direct_threshold = 8 * 1024 * 1024; // файлы меньше пишутся через кеш
+static const size_t max_queued_chunks = 2;              // блоков файла в очереди записи
+
+/** \brief Разбор режима сохранности
+ *
+ * \param[in]  name    Имя режима: buffered, direct или group.
+ * \param[out] mode    Режим.
+ *
+ * \return true, если имя известно, false иначе.
+ */
+bool parse_durability(const std::string& name, durability_modes& mode)
+{
+    for (int i = DURABILITY_BUFFERED; i <= DURABILITY_GROUP; ++i)
+    {
+        if (name == durability_name(static_cast<durability_modes>(i)))
+        {
+            mode = static_cast<durability_modes>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/** \brief Имя режима сохранности
+ *
+ * \return Имя режима для вывода и разбора опций.
+ */
+const char *durability_name(durability_modes mode)
+{
+    switch (mode)
+    {
+    case DURABILITY_BUFFERED:
+        return "buffered";
+    case DURABILITY_DIRECT:
+        return "direct";
+    case DURABILITY_GROUP:
+        return "group";
+    }
+    return "unknown";
+}
+
+/** \brief Конструктор записи файла
+ *
+ * Функция создает объект последовательной записи файла через дескриптор с
+ * буфером. В отличие от std::ofstream дескриптор можно синхронизировать с
+ * диском и передать в другой поток.
+ */
+FileWriter::FileWriter()
+    : m_fd(-1)
+    , m_mode(DURABILITY_BUFFERED)
+    , m_direct(false)
+    , m_direct_failed(false)
+    , m_buf(nullptr)
+    , m_buf_size(0)
+    , m_buf_used(0)
+    , m_chunk_size(default_chunk_size)
+    , m_flush_interval(default_flush_interval)
+    , m_offset(0)
+    , m_queue(nullptr)
+    , m_spare(nullptr)
+    , m_error(0)
+{}
+
+/** \brief Деструктор записи файла
+ *
+ * Функция дожидается записи блоков, переданных в очередь, и закрывает файл
+ * без записи оставшихся в буфере данных.
+ */
+FileWriter::~FileWriter()
+{
+    reap(true);
+    if (m_fd >= 0)
+        ::close(m_fd);
+    free(m_buf);
+    free(m_spare);
+}
+
+/** \brief Задать размер блока записи
+ *
+ * Функция задает размер буфера, в котором собираются данные пакетов перед
+ * записью в файл: вместо записи на каждый пакет файл пишется блоками по 
+ * \p chunk_size байтов. Размер округляется вверх до direct_alignment и 
+ * применяется при следующем открытии файла. Память буфера выделяется 
+ * страницами по мере заполнения, поэтому малые файлы большой буфер не 
+ * занимают.
+ *
+ * \param[in] chunk_size    Размер блока в байтах.
+ */
+void FileWriter::set_chunk_size(size_t chunk_size)
+{
+    chunk_size = std::max(chunk_size, direct_alignment);
+    m_chunk_size = (chunk_size + direct_alignment - 1) / direct_alignment * direct_alignment;
+}
+
+/** \brief Задать время жизни данных в буфере
+ *
+ * Функция задает, сколько данные могут ждать в неполном буфере: если блок 
+ * не заполнился за \p interval , то flush_by_timeout() запишет его, чтобы 
+ * медленный поток не задерживал данные в памяти.
+ *
+ * \param[in] interval    Время ожидания.
+ */
+void FileWriter::set_flush_interval(milliseconds interval)
+{
+    m_flush_interval = interval;
+}
+
+/** \brief Задать поток записи
+ *
+ * Функция задает поток записи \p queue директории, в которой создается 
+ * файл. Заполненные блоки тогда пишет он, а вызывающий поток только 
+ * копирует данные пакетов в буфер и не ждет диск, пока у файла в очереди 
+ * меньше max_queued_chunks блоков. Без потока записи блоки пишутся в 
+ * вызывающем потоке. Ее нужно вызвать до открытия файла.
+ *
+ * \param[in] queue    Поток записи или nullptr.
+ */
+void FileWriter::set_queue(WriteQueue *queue)
+{
+    reap(true);
+    m_queue = queue;
+}
+
+/** \brief Открыть файл
+ *
+ * Функция создает файл \p filename или обрезает существующий. Буфер 
+ * выравнивается по direct_alignment. В режиме DURABILITY_DIRECT, когда файл
+ * вырастает больше direct_threshold, запись переключается на O_DIRECT: 
+ * большие файлы не вытесняют из страничного кеша другие данные, а малые 
+ * не платят за запись в обход кеша.
+ *
+ * \param[in] filename    Имя файла.
+ * \param[in] mode        Режим сохранности.
+ *
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */
+int FileWriter::open(const std::string& filename, durability_modes mode)
+{
+    if (m_fd >= 0)
+        close();
+    m_mode = mode;
+    m_buf_size = m_chunk_size;
+    free(m_buf);
+    m_buf = static_cast<char *>(aligned_alloc(direct_alignment, m_buf_size));
+    free(m_spare);
+    m_spare = nullptr;
+    if (m_buf == nullptr)
+        return -1;
+    m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (m_fd < 0)
+        return -1;
+    m_direct = false;
+    m_direct_failed = false;
+    m_buf_used = 0;
+    m_offset = 0;
+    m_error = 0;
+    return 0;
+}
+
+/** \brief Записать данные
+ *
+ * Функция копирует данные в буфер и записывает его в файл одним вызовом 
+ * write, когда он заполнен, или передает его потоку записи, смотрите 
+ * set_queue(). Ошибка записи в потоке возвращается одним из следующих 
+ * вызовов.
+ *
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */
+int FileWriter::write(const char *data, size_t size)
+{
+    if (size > 0 && m_buf_used == 0)
+        m_buffered_since = steady_clock::now();
+    while (size > 0)
+    {
+        size_t part = std::min(size, m_buf_size - m_buf_used);
+        memcpy(m_buf + m_buf_used, data, part);
+        m_buf_used += part;
+        data += part;
+        size -= part;
+        if (m_buf_used == m_buf_size)
+        {
+            try_direct();
+            if (write_buffer(m_buf_used) != 0)
+                return -1;
+            m_buffered_since = steady_clock::now();
+        }
+    }
+    return 0;
+}
+
+/** \brief Записать буфер по таймауту
+ *
+ * Функция записывает неполный буфер, если первые данные в нем ждут дольше
+ * интервала, заданного set_flush_interval(). В режиме DURABILITY_DIRECT 
+ * записывается только часть буфера, кратная direct_alignment, а остаток 
+ * переносится в начало буфера: так смещение файла остается выровненным, и 
+ * O_DIRECT не выключается.
+ *
+ * \param[in] now    Текущее время.
+ *
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */
+int FileWriter::flush_by_timeout(time_point<steady_clock> now)
+{
+    if (m_fd < 0 || m_buf_used == 0 || now - m_buffered_since < m_flush_interval)
+        return 0;
+    size_t size = m_buf_used;
+    if (m_mode == DURABILITY_DIRECT)
+        size -= size % direct_alignment;
+    m_buffered_since = now;
+    if (size == 0)
+        return 0;
+    try_direct();
+    return write_buffer(size);
+}
+
+/** \brief Записать буфер
+ *
+ * Функция записывает оставшиеся в буфере данные и дожидается записи блоков
+ * из очереди. Размер данных может быть не кратен direct_alignment, поэтому
+ * O_DIRECT для них выключается.
+ *
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */
+int FileWriter::flush()
+{
+    if (m_buf_used > 0)
+    {
+        if (m_buf_used % direct_alignment != 0)
+            set_direct(false);
+        if (write_buffer(m_buf_used) != 0)
+            return -1;
+    }
+    return reap(true);
+}
+
+/** \brief Синхронизировать файл с диском
+ *
+ * Функция записывает буфер и ждет, пока данные файла не окажутся на диске.
+ *
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */
+int FileWriter::sync()
+{
+    if (flush() != 0)
+        return -1;
+    return fdatasync(m_fd);
+}
+
+/** \brief Отдать дескриптор
+ *
+ * Функция записывает буфер и возвращает дескриптор файла, который после 
+ * этого закрывает вызывающий, например после fsync в другом потоке.
+ *
+ * \return Дескриптор файла или -1, если запись не удалась.
+ */
+int FileWriter::release()
+{
+    if (flush() != 0)
+        return -1;
+    int fd = m_fd;
+    m_fd = -1;
+    return fd;
+}
+
+/** \brief Закрыть файл
+ *
+ * Функция записывает буфер и закрывает файл.
+ *
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */
+int FileWriter::close()
+{
+    if (m_fd < 0)
+        return 0;
+    int result = flush();
+    // блоки в очереди пишут в дескриптор, он закрывается после них
+    if (reap(true) != 0)
+        result = -1;
+    if (::close(m_fd) != 0)
+        result = -1;
+    m_fd = -1;
+    return result;
+}
+
+bool FileWriter::is_open() const
+{
+    return m_fd >= 0;
+}
+
+/** \brief Пишет ли файл в обход кеша
+ *
+ * \return true, если для файла включен O_DIRECT.
+ */
+bool FileWriter::is_direct() const
+{
+    return m_direct;
+}
+
+int FileWriter::write_fully(const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = ::write(m_fd, data, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0 && errno == EINVAL && m_direct)
+        {
+            // файловая система приняла флаг, но не поддерживает такую запись
+            set_direct(false);
+            m_direct_failed = true;
+            continue;
+        }
+        if (written < 0)
+            return -1;
+        data += written;
+        size -= written;
+        m_offset += written;
+    }
+    return 0;
+}
+
+int FileWriter::write_buffer(size_t size)
+{
+    if (m_queue != nullptr)
+        return submit_buffer(size);
+    if (write_fully(m_buf, size) != 0)
+        return -1;
+    m_buf_used -= size;
+    memmove(m_buf, m_buf + size, m_buf_used);
+    return 0;
+}
+
+/** \brief Передать буфер в очередь записи
+ *
+ * Функция передает первые \p size байтов буфера потоку записи, а остаток 
+ * переносит в свободный буфер, в который собираются следующие данные. Если 
+ * у файла в очереди уже max_queued_chunks блоков, функция ждет записи 
+ * самого старого: память файла ограничена, а прием замедляется до 
+ * скорости диска, как при записи в своем потоке.
+ *
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */
+int FileWriter::submit_buffer(size_t size)
+{
+    if (reap(false) != 0)
+        return -1;
+    while (m_chunks.size() >= max_queued_chunks)
+    {
+        m_queue->wait(*m_chunks.front().ticket);
+        if (reap(false) != 0)
+            return -1;
+    }
+    char *buf = m_spare;
+    if (buf == nullptr)
+        buf = static_cast<char *>(aligned_alloc(direct_alignment, m_buf_size));
+    if (buf == nullptr)
+        return -1;
+    m_spare = nullptr;
+    m_buf_used -= size;
+    memcpy(buf, m_buf + size, m_buf_used);
+    m_chunks.push_back({m_buf, m_queue->submit(m_fd, m_buf, size)});
+    m_buf = buf;
+    m_offset += size;
+    return 0;
+}
+
+/** \brief Забрать записанные блоки
+ *
+ * Функция освобождает буферы блоков, которые записал поток записи, и 
+ * запоминает первую ошибку: о ней сообщают все следующие вызовы до 
+ * открытия другого файла.
+ *
+ * \param[in] wait    Дождаться записи всех блоков.
+ *
+ * \return 0, если ошибок записи не было, -1 иначе, код ошибки в errno.
+ */
+int FileWriter::reap(bool wait)
+{
+    while (!m_chunks.empty())
+    {
+        Chunk& chunk = m_chunks.front();
+        if (wait)
+            m_queue->wait(*chunk.ticket);
+        int state = chunk.ticket->state.load();
+        if (state == WRITE_PENDING)
+            break;
+        if (state < 0 && m_error == 0)
+            m_error = -state;
+        if (state == WRITE_DONE_BUFFERED)
+        {
+            // поток записи выключил O_DIRECT, который не поддерживается
+            m_direct = false;
+            m_direct_failed = true;
+        }
+        if (m_spare == nullptr)
+            m_spare = chunk.buf;
+        else
+            free(chunk.buf);
+        m_chunks.pop_front();
+    }
+    if (m_error == 0)
+        return 0;
+    errno = m_error;
+    return -1;
+}
+
+void FileWriter::try_direct()
+{
+    if (m_mode != DURABILITY_DIRECT || m_direct || m_direct_failed ||
+        m_offset < direct_threshold || m_offset % direct_alignment != 0)
+        return;
+    set_direct(true);
+    m_direct_failed = !m_direct;
+}
+
+void FileWriter::set_direct(bool enabled)
+{
+    if (m_direct == enabled)
+        return;
+    int flags = fcntl(m_fd, F_GETFL);
+    if (flags < 0)
+        return;
+    flags = enabled ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+    if (fcntl(m_fd, F_SETFL, flags) == 0)
+        m_direct = enabled;
+}
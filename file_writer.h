@@ -0,0 +1,90 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "write_queue.h"
+
+using namespace std::chrono;
+
+// режимы сохранности принятых файлов
+enum durability_modes {
+    DURABILITY_BUFFERED = 0,   // страничный кеш без fsync
+    DURABILITY_DIRECT,         // O_DIRECT для больших файлов и fdatasync каждого файла
+    DURABILITY_GROUP           // fsync готовых файлов пачками в отдельном потоке
+};
+
+bool parse_durability(const std::string& name, durability_modes& mode);
+
+const char *durability_name(durability_modes mode);
+
+class FileWriter {
+public:
+    FileWriter();
+
+    ~FileWriter();
+
+    void set_chunk_size(size_t chunk_size);
+
+    void set_flush_interval(milliseconds interval);
+
+    void set_queue(WriteQueue *queue);
+
+    int open(const std::string& filename, durability_modes mode);
+
+    int write(const char *data, size_t size);
+
+    int flush();
+
+    int flush_by_timeout(time_point<steady_clock> now);
+
+    int sync();
+
+    int release();
+
+    int close();
+
+    bool is_open() const;
+
+    bool is_direct() const;
+
+private:
+    int m_fd;
+    durability_modes m_mode;
+    bool m_direct;
+    bool m_direct_failed;
+    char *m_buf;
+    size_t m_buf_size;
+    size_t m_buf_used;
+    size_t m_chunk_size;
+    milliseconds m_flush_interval;
+    time_point<steady_clock> m_buffered_since;
+    uint64_t m_offset;                  // записано или передано в очередь
+    WriteQueue *m_queue;
+    struct Chunk {
+        char *buf;
+        std::shared_ptr<WriteTicket> ticket;
+    };
+    std::deque<Chunk> m_chunks;         // блоки в очереди записи
+    char *m_spare;                      // буфер записанного блока для следующего
+    int m_error;                        // ошибка записи в очереди, 0 - нет
+
+    FileWriter(const FileWriter&) = delete;
+
+    FileWriter& operator=(const FileWriter&) = delete;
+
+    int write_fully(const char *data, size_t size);
+
+    int write_buffer(size_t size);
+
+    int submit_buffer(size_t size);
+
+    int reap(bool wait);
+
+    void try_direct();
+
+    void set_direct(bool enabled);
+};
@@ -0,0 +1,112 @@
+#include "memory_budget.h"
+
+#include <algorithm>
+
+/** \brief Конструктор бюджета памяти
+ *
+ * Функция создает общий для всех сборщиков файлов бюджет памяти под пакеты,
+ * ожидающие записи. Бюджет ограничивает суммарный объем пакетов \p limit
+ * байтами, а объем пакетов одного сборщика - \p session_quota байтами.
+ *
+ * \param[in] limit            Общий предел в байтах.
+ * \param[in] session_quota    Предел одного сборщика в байтах.
+ */
+MemoryBudget::MemoryBudget(uint64_t limit, uint64_t session_quota)
+    : m_limit(limit)
+    , m_session_quota(session_quota)
+    , m_usage(0)
+    , m_peak(0)
+{}
+
+/** \brief Изменить пределы
+ *
+ * \param[in] limit            Общий предел в байтах.
+ * \param[in] session_quota    Предел одного сборщика в байтах.
+ */
+void MemoryBudget::set_limits(uint64_t limit, uint64_t session_quota)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_limit = limit;
+    m_session_quota = session_quota;
+}
+
+/** \brief Зарезервировать память, если она есть
+ *
+ * \param[in] bytes    Объем в байтах.
+ *
+ * \return true, если память зарезервирована, false, если она превысила бы
+ * общий предел.
+ */
+bool MemoryBudget::try_reserve(uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_usage + bytes > m_limit)
+        return false;
+    m_usage += bytes;
+    m_peak = std::max(m_peak, m_usage);
+    return true;
+}
+
+/** \brief Зарезервировать память безусловно
+ *
+ * Используется для пакетов, которые будут записаны сразу, так что память
+ * занимается ненадолго. Такой резерв может превысить общий предел.
+ *
+ * \param[in] bytes    Объем в байтах.
+ */
+void MemoryBudget::reserve(uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_usage += bytes;
+    m_peak = std::max(m_peak, m_usage);
+}
+
+/** \brief Освободить память
+ *
+ * \param[in] bytes    Объем в байтах, ранее зарезервированный.
+ */
+void MemoryBudget::release(uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_usage -= std::min(m_usage, bytes);
+}
+
+/** \brief Занятая память
+ *
+ * \return Объем зарезервированной памяти в байтах.
+ */
+uint64_t MemoryBudget::usage() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_usage;
+}
+
+/** \brief Наибольшая занятая память
+ *
+ * \return Наибольший объем зарезервированной памяти в байтах.
+ */
+uint64_t MemoryBudget::peak() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_peak;
+}
+
+/** \brief Общий предел
+ *
+ * \return Общий предел в байтах.
+ */
+uint64_t MemoryBudget::limit() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_limit;
+}
+
+/** \brief Предел сборщика
+ *
+ * \return Предел одного сборщика в байтах.
+ */
+uint64_t MemoryBudget::session_quota() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_session_quota;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+
+class MemoryBudget {
+public:
+    MemoryBudget(uint64_t limit, uint64_t session_quota);
+
+    void set_limits(uint64_t limit, uint64_t session_quota);
+
+    bool try_reserve(uint64_t bytes);
+
+    void reserve(uint64_t bytes);
+
+    void release(uint64_t bytes);
+
+    uint64_t usage() const;
+
+    uint64_t peak() const;
+
+    uint64_t limit() const;
+
+    uint64_t session_quota() const;
+
+private:
+    mutable std::mutex m_mutex;   // сборщики работают в потоках пула
+    uint64_t m_limit;
+    uint64_t m_session_quota;
+    uint64_t m_usage;
+    uint64_t m_peak;
+};
@@ -0,0 +1,433 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "package.h"
+#include "file_builder.h"
+#include "logger.h"
+#include "session_key.h"
+#include "tombstone.h"
+
+// Микробенчмарки горячих путей Package, FileBuilder, make_key, фильтра
+// закрытых сессий и Logger.
+// Каждый замер повторяется несколько раз, в отчет попадает лучший и медианный
+// результат в наносекундах на операцию.
+
+static const int repeats = 5;
+static const uint32_t stream_packages = 4096;   // пакетов данных в одном файле
+
+struct BenchResult {
+    std::string name;
+    uint64_t ops;
+    double best_ns;
+    double median_ns;
+    std::string note;
+};
+
+/** \brief Буфер, отбрасывающий вывод
+ *
+ * Используется вместо буфера std::cout, чтобы замер Logger не зависел от
+ * терминала.
+ */
+class NullBuffer: public std::streambuf
+{
+protected:
+    int overflow(int c) override { return c; }
+
+    std::streamsize xsputn(const char *, std::streamsize n) override { return n; }
+};
+
+/** \brief Замер операции
+ *
+ * Функция выполняет \p body repeats раз. \p body выполняет \p ops операций
+ * и возвращает число наносекунд, затраченных на них, что позволяет
+ * исключить подготовку данных из замера.
+ */
+static BenchResult run(const std::string& name, uint64_t ops,
+                       const std::function<uint64_t()>& body)
+{
+    std::vector<double> samples;
+    body();  // прогрев
+    for (int i = 0; i < repeats; ++i)
+        samples.push_back(static_cast<double>(body()) / ops);
+    std::sort(samples.begin(), samples.end());
+    return {name, ops, samples.front(), samples[samples.size() / 2], ""};
+}
+
+static uint64_t elapsed_ns(steady_clock::time_point started)
+{
+    return duration_cast<nanoseconds>(steady_clock::now() - started).count();
+}
+
+static std::vector<char> make_wire_package(uint32_t number, uint32_t marker,
+                                           uint32_t data_size, bool last)
+{
+    Package package;
+    package.set_number(number);
+    package.set_marker(marker);
+    std::vector<char> data(data_size, static_cast<char>('a' + number % 26));
+    package.set_data(data.data(), data_size);
+    if (last)
+        package.set_package_flag(FLAG_LAST_PACKAGE);
+    return std::vector<char>(package.as_bytes(), package.as_bytes() + package.package_size());
+}
+
+static void bench_package(std::vector<BenchResult>& results)
+{
+    const uint64_t ops = 200000;
+    std::vector<char> wire = make_wire_package(7, 42, MAX_DATA_SIZE, false);
+    std::vector<char> data(MAX_DATA_SIZE, 'x');
+
+    results.push_back(run("package_from_bytes", ops, [&]() {
+        auto started = steady_clock::now();
+        for (uint64_t i = 0; i < ops; ++i)
+        {
+            Package package(wire.data(), wire.size());
+            asm volatile("" :: "r"(package.as_bytes()));
+        }
+        return elapsed_ns(started);
+    }));
+
+    results.push_back(run("package_build", ops, [&]() {
+        auto started = steady_clock::now();
+        for (uint64_t i = 0; i < ops; ++i)
+        {
+            Package package;
+            package.set_number(i);
+            package.set_marker(42);
+            package.set_data(data.data(), data.size());
+            asm volatile("" :: "r"(package.as_bytes()));
+        }
+        return elapsed_ns(started);
+    }));
+
+    Package source(wire.data(), wire.size());
+    results.push_back(run("package_copy", ops, [&]() {
+        auto started = steady_clock::now();
+        for (uint64_t i = 0; i < ops; ++i)
+        {
+            Package copy(source);
+            asm volatile("" :: "r"(copy.as_bytes()));
+        }
+        return elapsed_ns(started);
+    }));
+
+    const uint64_t move_ops = ops / 4;
+    results.push_back(run("package_move", move_ops, [&]() {
+        std::vector<Package> packages;
+        packages.reserve(move_ops);
+        for (uint64_t i = 0; i < move_ops; ++i)
+            packages.emplace_back(wire.data(), wire.size());
+        std::vector<Package> moved;
+        moved.reserve(move_ops);
+        auto started = steady_clock::now();
+        for (auto& package: packages)
+            moved.push_back(std::move(package));
+        return elapsed_ns(started);
+    }));
+
+    // как при -W N: пакеты создает поток приема, а удаляет поток пула
+    const size_t batch_size = 256;
+    results.push_back(run("package_cross_thread", ops, [&]() {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::vector<Package>> batches;
+        bool done = false;
+        std::thread consumer([&]() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                cv.wait(lock, [&]() { return done || !batches.empty(); });
+                if (batches.empty())
+                    return;
+                std::vector<Package> batch = std::move(batches.front());
+                batches.pop_front();
+                lock.unlock();
+                batch.clear();
+                lock.lock();
+            }
+        });
+        auto started = steady_clock::now();
+        std::vector<Package> batch;
+        for (uint64_t i = 0; i < ops; ++i)
+        {
+            batch.emplace_back(wire.data(), wire.size());
+            if (batch.size() == batch_size || i + 1 == ops)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                batches.push_back(std::move(batch));
+                batch = std::vector<Package>();
+                batch.reserve(batch_size);
+                cv.notify_one();
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        cv.notify_one();
+        consumer.join();
+        return elapsed_ns(started);
+    }));
+}
+
+/** \brief Поток пакетов файла
+ *
+ * Функция возвращает пакеты одного файла в порядке прихода: in_order,
+ * reversed (имя файла приходит последним), shuffled или duplicates (каждый
+ * пакет приходит дважды, а каждый четвертый - трижды, со случайными
+ * перестановками соседних пакетов).
+ */
+static std::vector<std::vector<char>> make_stream(const std::string& pattern,
+                                                  uint32_t marker)
+{
+    std::vector<std::vector<char>> stream;
+    std::string name = "bench_" + std::to_string(marker) + ".bin";
+    Package name_package;
+    name_package.set_number(1);
+    name_package.set_marker(marker);
+    name_package.set_data(name.c_str(), name.size());
+    stream.emplace_back(name_package.as_bytes(),
+                        name_package.as_bytes() + name_package.package_size());
+    for (uint32_t i = 0; i < stream_packages; ++i)
+        stream.push_back(make_wire_package(i + 2, marker, MAX_DATA_SIZE,
+                                           i + 1 == stream_packages));
+
+    std::mt19937 rng(marker);
+    if (pattern == "reversed")
+    {
+        std::reverse(stream.begin(), stream.end());
+    } else if (pattern == "shuffled") {
+        std::shuffle(stream.begin(), stream.end(), rng);
+    } else if (pattern == "duplicates") {
+        std::vector<std::vector<char>> duplicated;
+        for (size_t i = 0; i < stream.size(); ++i)
+        {
+            duplicated.push_back(stream[i]);
+            duplicated.push_back(stream[i]);
+            if (i % 4 == 0)
+                duplicated.push_back(stream[i]);
+        }
+        for (size_t i = 1; i < duplicated.size(); ++i)
+            if (rng() % 2)
+                std::swap(duplicated[i - 1], duplicated[i]);
+        stream.swap(duplicated);
+    }
+    return stream;
+}
+
+static void bench_file_builder(std::vector<BenchResult>& results, const std::string& dir)
+{
+    const char *patterns[] = {"in_order", "reversed", "shuffled", "duplicates"};
+    uint32_t marker = 1;
+    for (const char *pattern: patterns)
+    {
+        std::vector<std::vector<char>> stream = make_stream(pattern, marker);
+        bool complete = true;
+        BenchResult result = run(std::string("file_builder_") + pattern, stream.size(), [&]() {
+            ServerStats stats;
+            std::unique_ptr<FileBuilder> fb(new FileBuilder(dir, marker, &stats));
+            auto started = steady_clock::now();
+            for (const auto& wire: stream)
+            {
+                fb->insert_package(Package(wire.data(), wire.size()));
+                fb->process();
+            }
+            uint64_t ns = elapsed_ns(started);
+            complete = complete && fb->file_is_ready();
+            return ns;
+        });
+        result.note = complete ? "complete" : "incomplete";
+        results.push_back(result);
+        remove((dir + "/bench_" + std::to_string(marker) + ".bin").c_str());
+        ++marker;
+    }
+}
+
+static void bench_keys(std::vector<BenchResult>& results)
+{
+    const uint64_t ops = 200000;
+    const int sessions = 1000;
+    std::string ip = "192.168.100.200";
+    std::map<std::string, int> store;
+    for (int i = 0; i < sessions; ++i)
+        store.emplace(make_key(ip, 40000 + i, 1000003u * i), i);
+
+    results.push_back(run("make_key", ops, [&]() {
+        auto started = steady_clock::now();
+        for (uint64_t i = 0; i < ops; ++i)
+        {
+            std::string key = make_key(ip, 40000 + i % sessions, 1000003u * (i % sessions));
+            asm volatile("" :: "r"(key.data()));
+        }
+        return elapsed_ns(started);
+    }));
+
+    results.push_back(run("make_key_and_lookup", ops, [&]() {
+        uint64_t found = 0;
+        auto started = steady_clock::now();
+        for (uint64_t i = 0; i < ops; ++i)
+        {
+            int n = i % sessions;
+            found += store.count(make_key(ip, 40000 + n, 1000003u * n));
+        }
+        asm volatile("" :: "r"(found));
+        return elapsed_ns(started);
+    }));
+}
+
+static void bench_tombstones(std::vector<BenchResult>& results)
+{
+    const uint64_t ops = 1000000;
+    const uint32_t closed = 100000;   // закрытых сессий в фильтре, как у сервера за 30 секунд
+    TombstoneFilter filter(seconds(30), 4, 1 << 20, 4);
+    for (uint32_t i = 0; i < closed; ++i)
+        filter.insert(session_id(0xc0a80000 + i % 256, 40000 + i % 20000, 1000003u * i));
+
+    BenchResult result = run("tombstone_lookup", ops, [&]() {
+        uint64_t found = 0;
+        auto started = steady_clock::now();
+        for (uint64_t i = 0; i < ops; ++i)
+            found += filter.contains(session_id(0x0a000000 + i % 256, 50000, i));
+        asm volatile("" :: "r"(found));
+        return elapsed_ns(started);
+    });
+    // сессии, которых нет в фильтре: доля найденных - ложные срабатывания
+    uint64_t false_positives = 0;
+    for (uint64_t i = 0; i < ops; ++i)
+        false_positives += filter.contains(session_id(0x0a000000 + i % 256, 50000, i));
+    std::ostringstream note;
+    note << "closed=" << closed << " memory_kib=" << filter.memory() / 1024
+         << " fp_measured=" << static_cast<double>(false_positives) / ops
+         << " fp_estimated=" << filter.get_stats().false_positive;
+    // закрытий в 10 раз больше расчетного: поколения сменяются досрочно
+    TombstoneFilter flooded(seconds(30), 4, 1 << 20, 4);
+    for (uint32_t i = 0; i < 10 * closed; ++i)
+        flooded.insert(session_id(0xc0a80000 + i % 256, 40000 + i % 20000, 1000003u * i));
+    note << " flood_early_rotations=" << flooded.get_stats().early_rotations
+         << " flood_fp_estimated=" << flooded.get_stats().false_positive;
+    result.note = note.str();
+    results.push_back(result);
+}
+
+static void bench_logger(std::vector<BenchResult>& results)
+{
+    const uint64_t ops = 100000;
+    NullBuffer null_buffer;
+    std::streambuf *cout_buffer = std::cout.rdbuf(&null_buffer);
+    Logger logger;
+    BenchResult result = run("logger_line", ops, [&]() {
+        auto started = steady_clock::now();
+        for (uint64_t i = 0; i < ops; ++i)
+            logger << "[INFO] Получен файл \"bench.bin\" из [127.0.0.1:" << i
+                << "]" << std::endl;
+        return elapsed_ns(started);
+    });
+    std::cout.rdbuf(cout_buffer);
+    results.push_back(result);
+}
+
+static void print_table(const std::vector<BenchResult>& results)
+{
+    std::cout << std::left << std::setw(28) << "benchmark" << std::right
+              << std::setw(10) << "ops" << std::setw(14) << "best ns/op"
+              << std::setw(14) << "median ns/op" << std::setw(16) << "ops/s"
+              << "  note" << std::endl;
+    for (const auto& r: results)
+        std::cout << std::left << std::setw(28) << r.name << std::right
+                  << std::setw(10) << r.ops
+                  << std::setw(14) << std::fixed << std::setprecision(1) << r.best_ns
+                  << std::setw(14) << r.median_ns
+                  << std::setw(16) << std::setprecision(0) << 1e9 / r.median_ns
+                  << "  " << r.note << std::endl;
+}
+
+static void print_json(const std::vector<BenchResult>& results)
+{
+    std::cout << "[";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const auto& r = results[i];
+        std::cout << (i ? "," : "") << "\n  {\"name\": \"" << r.name
+                  << "\", \"ops\": " << r.ops
+                  << std::fixed << std::setprecision(1)
+                  << ", \"best_ns_per_op\": " << r.best_ns
+                  << ", \"median_ns_per_op\": " << r.median_ns
+                  << ", \"note\": \"" << r.note << "\"}";
+    }
+    std::cout << "\n]" << std::endl;
+}
+
+static void print_usage(char *program_name)
+{
+    std::cout << "Используйте: " << program_name << " [-j] [-f фильтр]" << std::endl
+              << "  -j    вывод в формате JSON" << std::endl
+              << "  -f    запускать только замеры, имя которых содержит фильтр"
+              << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    bool json = false;
+    std::string filter;
+    int opt;
+    while ((opt = getopt(argc, argv, "jf:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            json = true;
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    char dir_template[] = "/tmp/udp_micro_bench.XXXXXX";
+    const char *dir = mkdtemp(dir_template);
+    if (dir == nullptr)
+    {
+        std::cerr << "Ошибка: не удалось создать временную директорию" << std::endl;
+        exit(1);
+    }
+
+    std::vector<BenchResult> results;
+    auto wanted = [&](const std::string& group) {
+        return filter.empty() || group.find(filter) != std::string::npos ||
+               filter.find(group) != std::string::npos;
+    };
+    if (wanted("package"))
+        bench_package(results);
+    if (wanted("file_builder"))
+        bench_file_builder(results, dir);
+    if (wanted("make_key"))
+        bench_keys(results);
+    if (wanted("tombstone"))
+        bench_tombstones(results);
+    if (wanted("logger"))
+        bench_logger(results);
+    rmdir(dir);
+
+    if (json)
+        print_json(results);
+    else
+        print_table(results);
+    return 0;
+}
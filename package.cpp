@@ -1,9 +1,260 @@
 #include "package.h"
 
+#include <algorithm>
+#include <atomic>
+
+static const size_t slot_alignment = 64;
+// после датаграммы в слоте хранится его владелец
+static const size_t slot_size = (MAX_PACKAGE_SIZE + sizeof(void *) + slot_alignment - 1) / 
+                                slot_alignment * slot_alignment;
+static const size_t slot_owner_offset = slot_size - sizeof(void *);
+static const size_t max_cached_slots = 4096;    // около 5.5 МиБ на поток
+
+// Освобожденные слоты пакетов не возвращаются системе, а остаются в списке
+// свободных слотов потока, который их выделил, поэтому создание и удаление 
+// пакета в установившемся режиме не обращается к malloc(), даже если пакеты
+// создает поток приема, а удаляют потоки пула. В конце слота хранится его
+// владелец: слот своего потока сразу попадает в его список, а слот другого 
+// потока - в стек удаленных освобождений владельца, который тот забирает 
+// целиком без блокировок, когда его список пуст. Указатель на следующий 
+// свободный слот хранится в начале самого слота. Список ограничен 
+// max_cached_slots.
+//
+// При завершении потока его свободные слоты возвращаются системе, а слоты,
+// еще занятые пакетами, освобождаются при удалении пакетов. Запись 
+// владельца удаляется вместе с последним из них. Переменные списка 
+// тривиальные: доступ к ним не проходит через функцию инициализации 
+// thread_local, а освобождает список объект SlotCacheCleanup, который 
+// создается вместе с владельцем.
+struct SlotOwner {
+    std::atomic<char *> remote{nullptr};   // слоты, освобожденные другими потоками
+    std::atomic<size_t> refs{1};           // поток и выделенные им слоты
+};
+
+static char closed_remote;   // вершина стека завершившегося потока
+
+static thread_local char *free_slots = nullptr;
+static thread_local size_t free_slots_count = 0;
+static thread_local SlotOwner *free_slots_owner = nullptr;
+static thread_local bool free_slots_closed = false;
+
+static SlotOwner *slot_owner(const char *slot)
+{
+    SlotOwner *owner;
+    memcpy(&owner, slot + slot_owner_offset, sizeof(owner));
+    return owner;
+}
+
+static char *next_slot(const char *slot)
+{
+    char *next;
+    memcpy(&next, slot, sizeof(next));
+    return next;
+}
+
+static void link_slot(char *slot, char *next)
+{
+    memcpy(slot, &next, sizeof(next));
+}
+
+static void unref_owner(SlotOwner *owner)
+{
+    if (owner->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete owner;
+}
+
+static void free_slot(char *slot)
+{
+    SlotOwner *owner = slot_owner(slot);
+    free(slot);
+    if (owner != nullptr)
+        unref_owner(owner);
+}
+
+struct SlotCacheCleanup {
+    ~SlotCacheCleanup()
+    {
+        SlotOwner *owner = free_slots_owner;
+        free_slots_owner = nullptr;
+        free_slots_closed = true;
+        while (free_slots != nullptr)
+        {
+            char *slot = free_slots;
+            free_slots = next_slot(slot);
+            free_slot(slot);
+        }
+        free_slots_count = 0;
+        if (owner == nullptr)
+            return;
+        // после закрытия стека другие потоки освобождают слоты сами
+        char *slot = owner->remote.exchange(&closed_remote, std::memory_order_acquire);
+        while (slot != nullptr)
+        {
+            char *next = next_slot(slot);
+            free_slot(slot);
+            slot = next;
+        }
+        unref_owner(owner);
+    }
+};
+
+static char *new_slot()
+{
+    if (free_slots_owner == nullptr && !free_slots_closed)
+    {
+        static thread_local SlotCacheCleanup cleanup;
+        (void)cleanup;
+        free_slots_owner = new SlotOwner();
+    }
+    char *slot = static_cast<char *>(aligned_alloc(slot_alignment, slot_size));
+    if (slot == nullptr)
+        return nullptr;
+    // слоты, выделенные после завершения списка потока, владельца не имеют
+    memcpy(slot + slot_owner_offset, &free_slots_owner, sizeof(free_slots_owner));
+    if (free_slots_owner != nullptr)
+        free_slots_owner->refs.fetch_add(1, std::memory_order_relaxed);
+    return slot;
+}
+
+static void push_free_slot(char *slot)
+{
+    if (free_slots_count >= max_cached_slots)
+    {
+        free_slot(slot);
+        return;
+    }
+    link_slot(slot, free_slots);
+    free_slots = slot;
+    ++free_slots_count;
+}
+
+static void collect_remote_slots()
+{
+    if (free_slots_owner->remote.load(std::memory_order_relaxed) == nullptr)
+        return;
+    char *slot = free_slots_owner->remote.exchange(nullptr, std::memory_order_acquire);
+    while (slot != nullptr)
+    {
+        char *next = next_slot(slot);
+        push_free_slot(slot);
+        slot = next;
+    }
+}
+
+static char *acquire_slot_slow()
+{
+    if (free_slots_owner != nullptr)
+        collect_remote_slots();
+    char *slot = free_slots;
+    if (slot == nullptr)
+        return new_slot();
+    free_slots = next_slot(slot);
+    --free_slots_count;
+    return slot;
+}
+
+static void release_slot_slow(char *slot, SlotOwner *owner)
+{
+    if (owner == nullptr)
+    {
+        free(slot);
+        return;
+    }
+    if (owner == free_slots_owner)
+    {
+        free_slot(slot);
+        return;
+    }
+    char *head = owner->remote.load(std::memory_order_relaxed);
+    do
+    {
+        if (head == &closed_remote)
+        {
+            free_slot(slot);
+            return;
+        }
+        link_slot(slot, head);
+    } while (!owner->remote.compare_exchange_weak(head, slot, std::memory_order_release,
+                                                  std::memory_order_relaxed));
+}
+
+// быстрый путь - слот своего потока - без вызовов функций
+static char *acquire_slot()
+{
+    char *slot = free_slots;
+    if (slot == nullptr)
+        return acquire_slot_slow();
+    memcpy(&free_slots, slot, sizeof(free_slots));
+    --free_slots_count;
+    return slot;
+}
+
+static void release_slot(char *slot)
+{
+    SlotOwner *owner;
+    memcpy(&owner, slot + slot_owner_offset, sizeof(owner));
+    if (owner != free_slots_owner || owner == nullptr || free_slots_count >= max_cached_slots)
+    {
+        release_slot_slow(slot, owner);
+        return;
+    }
+    memcpy(slot, &free_slots, sizeof(free_slots));
+    free_slots = slot;
+    ++free_slots_count;
+}
+
+/** \brief Заполнить пул слотов потока
+ * 
+ * Функция заранее выделяет слоты пакетов в списке свободных слотов текущего
+ * потока, пока в нем не станет \p count слотов (не больше 
+ * max_cached_slots), и обращается к каждой их странице. Так память слотов 
+ * выделяется по политике памяти потока, например на его узле NUMA, а не там,
+ * где слот впервые заполнит другой поток. Слоты остаются у потока, даже
+ * если пакеты из них удаляют другие потоки, поэтому заполнять пул имеет 
+ * смысл только потоку, который создает пакеты.
+ * 
+ * \param[in] count    Число слотов.
+ */ 
+void reserve_package_slots(size_t count)
+{
+    count = std::min(count, max_cached_slots);
+    while (!free_slots_closed && free_slots_count < count)
+    {
+        char *slot = new_slot();
+        if (slot == nullptr)
+            return;
+        memset(slot, 0, slot_owner_offset);
+        release_slot(slot);
+    }
+}
+
+/** \brief Чтение заголовка датаграммы
+ * 
+ * Функция читает номер, идентификатор и флаг пакета прямо из датаграммы 
+ * \p package размером \p size , не создавая пакет и не копируя данные.
+ * 
+ * \param[in]  package    Датаграмма.
+ * \param[in]  size       Размер датаграммы.
+ * \param[out] header     Заголовок пакета.
+ * 
+ * \return true, если датаграмма не короче заголовка, false иначе.
+ */ 
+bool peek_header(const char *package, uint32_t size, PackageHeader& header)
+{
+    if (size < HEADER_SIZE)
+        return false;
+    header.number = package_header::read<uint32_t>(package, package_header::number);
+    header.marker = package_header::read<uint32_t>(package, package_header::marker);
+    header.flag = package_header::read<uint8_t>(package, package_header::flag);
+    return true;
+}
 
 /** \brief Конструктор пакета
  *  
- * Функция создает объект пакета.
+ * Функция создает объект пакета. Датаграмма пакета хранится в слоте 
+ * размером MAX_PACKAGE_SIZE из пула, а поля заголовка дублируются в самом 
+ * объекте, поэтому объект занимает три машинных слова, а номер и 
+ * идентификатор читаются без обращения к слоту.
  * 
  * \exception runtime_error
  * В процесе инициализации может произойти случай, когда память под объект 
@@ -28,7 +279,7 @@ Package::Package()
  */
 Package::Package(const char *package, uint32_t size)
 {
-    initialize(size);
+    initialize();
     load_package(package, size);
 }
 
@@ -39,7 +290,7 @@ Package::Package(const char *package, uint32_t size)
 Package::~Package()
 {
     if (m_package != nullptr)
-        free(m_package);
+        release_slot(m_package);
 }
 
 /** \brief Конструктор пакета 
@@ -49,19 +300,14 @@ Package::~Package()
  *   
  * \param[in] other    Другой объект пакета.
  */ 
-Package::Package(Package&& other)
+Package::Package(Package&& other) noexcept
     : m_package(other.m_package)
     , m_number(other.m_number)
     , m_marker(other.m_marker)
-    , m_flag(other.m_flag)
-    , m_data(other.m_data)
     , m_data_size(other.m_data_size)
+    , m_flag(other.m_flag)
 {
     other.m_package = nullptr;
-    other.m_number = nullptr;
-    other.m_marker = nullptr;
-    other.m_flag = nullptr;
-    other.m_data = nullptr;
     other.m_data_size = 0;
 }
 
@@ -78,16 +324,20 @@ Package::Package(Package&& other)
  */ 
 Package::Package(const Package& other)
 {
-    initialize(other.package_size());
+    initialize();
     memcpy(m_package, other.m_package, other.package_size());
+    m_number = other.m_number;
+    m_marker = other.m_marker;
+    m_data_size = other.m_data_size;
+    m_flag = other.m_flag;
 }
 
 /** \brief Установка номера пакета
  * 
  * Функция устанавливает номер пакета, использующийся для определения
- * место пакета в передаваемом потоке пакетов. 32-битный тип дает 
- * возможность сумарно передать данные пакетами размером до 
- * 2^32 * MAX_DATA_SIZE байтов.  
+ * место пакета в передаваемом потоке пакетов. 32-битный номер 
+ * переполняется после 2^32 пакетов, сервер восстанавливает полный номер
+ * сам (смотрите FileBuilder::sequence()).
  * 
  * \warning 
  * В случае передачи ресурсов по средством std::move() для функций, требующих
@@ -99,7 +349,8 @@ Package::Package(const Package& other)
 void Package::set_number(uint32_t number)
 {
     assert(m_package != nullptr);
-    *m_number = number;
+    m_number = number;
+    package_header::write(m_package, package_header::number, number);
 }
 
 /** \brief Установка идентификатора пакета
@@ -119,7 +370,8 @@ void Package::set_number(uint32_t number)
 void Package::set_marker(uint32_t marker)
 {
     assert(m_package != nullptr);
-    *m_marker = marker;
+    m_marker = marker;
+    package_header::write(m_package, package_header::marker, marker);
 }
 
 /** \brief Запись данных в пакет
@@ -130,7 +382,7 @@ void Package::set_marker(uint32_t marker)
  * В случае передачи ресурсов по средством std::move() для функций, требующих
  * rvalue ссылку, объект пакета становится невалидным, поэтому при попытке
  * установить номер пакета пройзойдет assert(). Так же в случае, если размер
- * данных превысит MAX_DATA_SIZE, будет вызван assert().
+ * данных превысит max_data_size(), будет вызван assert().
  * 
  * \param[in] data    Данные представляющие собой массив байтов.
  * \param[in] size    Размер массива.
@@ -138,8 +390,8 @@ void Package::set_marker(uint32_t marker)
 void Package::set_data(const char *data, uint32_t size)
 {
     assert(m_package != nullptr);
-    assert(size <= MAX_DATA_SIZE);
-    memcpy(m_data, data, size);
+    assert(size <= max_data_size());
+    memcpy(m_package + DATA_OFFSET, data, size);
     m_data_size = size;
 }
 
@@ -147,7 +399,8 @@ void Package::set_data(const char *data, uint32_t size)
  * 
  * Функция устанавливает флаг пакета. Существует два флага пакета:
  * FLAG_LAST_PACKAGE и FLAG_NOT_LAST_PACKAGE. Они обозначают, является ли
- * текущий пакет в потоке пакетов последним. 
+ * текущий пакет в потоке пакетов последним. Опции пакета, установленные
+ * методом set_option(), при этом сохраняются.
  * 
  * \warning 
  * В случае передачи ресурсов по средством std::move() для функций, требующих
@@ -161,7 +414,77 @@ void Package::set_package_flag(uint8_t flag)
 {
     assert(m_package != nullptr);
     assert(flag == FLAG_LAST_PACKAGE || flag == FLAG_NOT_LAST_PACKAGE);
-    *m_flag = flag;
+    m_flag = (m_flag & ~FLAG_LAST_MASK) | flag;
+    package_header::write(m_package, package_header::flag, m_flag);
+}
+
+/** \brief Установка опции пакета.
+ * 
+ * Функция включает или выключает опцию пакета \p option . Опции хранятся в
+ * старших битах флага пакета. Опция FLAG_CHECKSUM означает, что после данных
+ * пакета следует контрольная сумма CRC32C, которая вычисляется методом seal().
+ * Опция FLAG_COMPRESSED означает, что данные пакета сжаты compress_block() и
+ * начинаются с исходного размера блока. Опция FLAG_CONTROL означает 
+ * управляющее сообщение, тип которого записан в первом байте данных. Опция 
+ * FLAG_DELTA у пакета с именем файла означает дельта-передачу, а у пакета с
+ * данными - ссылку на блоки старой копии файла (смотрите CopyOp).
+ * 
+ * \warning
+ * Опцию FLAG_CHECKSUM следует устанавливать до записи данных, так как она
+ * уменьшает max_data_size(). 
+ * 
+ * \param[in] option     Опция пакета.
+ * \param[in] enabled    true, чтобы включить опцию, false, чтобы выключить.
+ */ 
+void Package::set_option(uint8_t option, bool enabled)
+{
+    assert(m_package != nullptr);
+    assert((option & ~FLAG_OPTIONS_MASK) == 0);
+    if (enabled)
+        m_flag |= option;
+    else
+        m_flag &= ~option;
+    package_header::write(m_package, package_header::flag, m_flag);
+}
+
+/** \brief Проверка опции пакета.
+ * 
+ * \param[in] option    Опция пакета.
+ * 
+ * \return true, если опция \p option установлена, false иначе.
+ */ 
+bool Package::has_option(uint8_t option) const
+{
+    assert(m_package != nullptr);
+    return (m_flag & option) != 0;
+}
+
+/** \brief Максимальный размер данных пакета.
+ * 
+ * Функция возвращает максимальный размер данных, который можно записать в
+ * пакет с учетом установленных опций.
+ * 
+ * \return Максимальное число байтов данных.
+ */ 
+uint32_t Package::max_data_size() const
+{
+    return MAX_DATA_SIZE - trailer_size();
+}
+
+/** \brief Запечатать пакет.
+ * 
+ * Функция подготавливает пакет к отправке. Если установлена опция 
+ * FLAG_CHECKSUM, то после данных записывается контрольная сумма CRC32C 
+ * заголовка и данных пакета. Метод следует вызывать после изменения
+ * пакета и перед as_bytes().
+ */ 
+void Package::seal()
+{
+    assert(m_package != nullptr);
+    if (!has_option(FLAG_CHECKSUM))
+        return;
+    uint32_t crc = crc32c(0, m_package, HEADER_SIZE + m_data_size);
+    memcpy(m_package + DATA_OFFSET + m_data_size, &crc, CHECKSUM_SIZE);
 }
 
 /** \brief Установка флага пакета.
@@ -181,7 +504,7 @@ void Package::set_package_flag(uint8_t flag)
 uint32_t Package::get_number() const
 {
     assert(m_package != nullptr);
-    return *m_number;
+    return m_number;
 }
 
 /** \brief Вернуть идентификатор пакета
@@ -195,7 +518,7 @@ uint32_t Package::get_number() const
 uint32_t Package::get_marker() const
 {
     assert(m_package != nullptr);
-    return *m_marker;
+    return m_marker;
 }
 
 /** \brief Вернуть данные пакета.
@@ -214,7 +537,7 @@ uint32_t Package::get_marker() const
 const char *Package::get_data() const
 {
     assert(m_package != nullptr);
-    return m_data;
+    return m_package + DATA_OFFSET;
 }
 
 /** \brief Вернуть размер данные пакета.
@@ -232,15 +555,14 @@ uint32_t Package::get_data_size() const
 /** \brief Вернуть флаг пакета.
  * 
  * Функция возвращает флаг пакета. Пакет длжен иметь флаги 
+ * FLAG_LAST_PACKAGE или FLAG_NOT_LAST_PACKAGE. Опции пакета не учитываются.
  *
  * \return  Возвращает число байтов данных.
  */ 
 uint8_t Package::get_package_flag() const
 {
     assert(m_package != nullptr);
-    assert(*m_flag == FLAG_NOT_LAST_PACKAGE || 
-           *m_flag == FLAG_LAST_PACKAGE);
-    return *m_flag;
+    return m_flag & FLAG_LAST_MASK;
 }
 
 /** \brief Вернуть пакет как массив байтов.
@@ -267,9 +589,21 @@ const char *Package::as_bytes() const
  */ 
 uint32_t Package::package_size() const
 {
-    if (m_package == nullptr)
+    if (m_package == nullptr || m_data_size < 0)
+        return 0;
+    return HEADER_SIZE + m_data_size + trailer_size();
+}
+
+/** \brief Размер служебных данных после данных пакета.
+ * 
+ * \return Число байтов, которое занимает контрольная сумма пакета, если она
+ * включена, либо 0.
+ */ 
+uint32_t Package::trailer_size() const
+{
+    if (m_package == nullptr || !(m_flag & FLAG_CHECKSUM))
         return 0;
-    return HEADER_SIZE + m_data_size;
+    return CHECKSUM_SIZE;
 }
 
 
@@ -277,7 +611,9 @@ uint32_t Package::package_size() const
  * 
  * Функция принимает пакет, упакованный в массив байтов. В случае, если объект 
  * пакета передал ресурсы другому объекту пакету, то текущий пакет
- * проинициализирует себ, чтобы скопировать данные \p package . 
+ * проинициализирует себ, чтобы скопировать данные \p package . Если пакет
+ * содержит контрольную сумму, но слишком короткий для нее, то он считается
+ * невалидным.
  *
  * \param[in] package    Указатель на массив из байтов упакованного пакет.
  * \param[in] size       Размер пакета.
@@ -287,16 +623,24 @@ void Package::load_package(const char *package, uint32_t size)
     assert(size <= MAX_PACKAGE_SIZE);
     assert(size >= HEADER_SIZE);
     if (m_package == nullptr)
-        initialize(size);
+        initialize();
     memcpy(m_package, package, size);
-    uint32_t data_size = size - uint32_t(HEADER_SIZE);
-    m_data_size = (data_size > 0) ? data_size : 0;
+    m_number = package_header::read<uint32_t>(m_package, package_header::number);
+    m_marker = package_header::read<uint32_t>(m_package, package_header::marker);
+    m_flag = package_header::read<uint8_t>(m_package, package_header::flag);
+    int data_size = size - uint32_t(HEADER_SIZE) - trailer_size();
+    m_data_size = (data_size >= 0) ? data_size : -1;
 }
 
 /** \brief Сравнение пакетов
  * 
  * Функция  возращает булевское значение. Пакет считается меньше в том случае,
  * порядновый номер пакета меньше по сравнению с другим.
+ * 
+ * \note
+ * Номера сравниваются по модулю 2^32 (арифметика серийных номеров, RFC 1982),
+ * поэтому после переполнения номера в файлах больше 5.9 ТБ порядок 
+ * сохраняется, пока сравниваемые номера отличаются меньше чем на 2^31.
  *
  * \param[in] other     Ссыдкана объект пакета.
  * 
@@ -304,13 +648,12 @@ void Package::load_package(const char *package, uint32_t size)
  */ 
 bool Package::operator<(const Package &other) const
 {
-    return (*this).get_number() > other.get_number();
+    return static_cast<int32_t>(get_number() - other.get_number()) > 0;
 }
 
 /** \brief Копирование пакета
  * 
- * Функция  возращает ссылку на созданный новый объект пакета, в который 
- * скопированы данные ресурсы друго объекта пакета.
+ * Функция копирует данные другого объекта пакета в слот этого пакета.
  *
  * \param[in] other     Ссылка на объект пакета.
  * 
@@ -319,35 +662,64 @@ bool Package::operator<(const Package &other) const
 Package& Package::operator=(const Package& other)
 {
     assert(other.package_size() >= HEADER_SIZE);
-    initialize(other.package_size());
+    if (this == &other)
+        return *this;
+    if (m_package == nullptr)
+        initialize();
     memcpy(m_package, other.m_package, other.package_size());
+    m_number = other.m_number;
+    m_marker = other.m_marker;
     m_data_size = other.m_data_size;
+    m_flag = other.m_flag;
+    return *this;
+}
+
+/** \brief Перемещение пакета
+ * 
+ * Функция освобождает слот этого пакета и забирает слот \p other . После 
+ * этого \p other становится невалидным.
+ *
+ * \param[in] other     Другой объект пакета.
+ * 
+ * \return Ссылка на этот объект пакета.
+ */ 
+Package& Package::operator=(Package&& other) noexcept
+{
+    if (this == &other)
+        return *this;
+    if (m_package != nullptr)
+        release_slot(m_package);
+    m_package = other.m_package;
+    m_number = other.m_number;
+    m_marker = other.m_marker;
+    m_data_size = other.m_data_size;
+    m_flag = other.m_flag;
+    other.m_package = nullptr;
+    other.m_data_size = 0;
     return *this;
 }
 
 /** \brief Инициализация объекта
  * 
- * Функция  инициализирует объект пакета, резервируя память под ресурсы. 
- * Параметр \p package_size не должен превышать MAX_PACKAGE_SIZE. 
+ * Функция  инициализирует объект пакета, беря слот из пула и обнуляя 
+ * заголовок.
  * 
  * \exception runtime_error
  * В процесе инициализации может произойти случай, когда память под ресурсы 
  * не будет выделена. В таком случае вызывается исключение runtime_error.
- *
- * \param[in] package_size     Теоретичесикй размер пакета.
  */ 
-void Package::initialize(uint32_t package_size)
+void Package::initialize()
 {
-    m_package = (char *)calloc(1, package_size);
+    m_package = acquire_slot();
     if (m_package == NULL)
     {
         throw std::runtime_error("could not allocate memmory for package");
     }
-    m_number = (uint32_t *)(m_package + HEADER_NUMBER_OFFSET);
-    m_marker = (uint32_t *)(m_package + HEADER_MARKER_OFFSET);
-    m_flag = (uint8_t *)(m_package + HEADER_FLAG_OFFSET);
-    m_data = (char *)(m_package + DATA_OFFSET);
+    memset(m_package, 0, HEADER_SIZE);
+    m_number = 0;
+    m_marker = 0;
     m_data_size = 0;
+    m_flag = 0;
 }
 
 
@@ -355,12 +727,20 @@ void Package::initialize(uint32_t package_size)
  * 
  * Функция осуществляет простую валидацию пакета. Ее полезно использовать,
  * когда вызыввается конструктор объекта пакета, либо метод load_package(). 
+ * Если у пакета установлена опция FLAG_CHECKSUM, то дополнительно 
+ * проверяется его контрольная сумма.
  * 
  * \return true, если пакет считается валидным, falseиначе
  */ 
 bool Package::valid() const
 {
-    return m_package != nullptr && package_size() >= HEADER_SIZE;
+    if (m_package == nullptr || package_size() < HEADER_SIZE)
+        return false;
+    if (!has_option(FLAG_CHECKSUM))
+        return true;
+    uint32_t crc;
+    memcpy(&crc, m_package + DATA_OFFSET + m_data_size, CHECKSUM_SIZE);
+    return crc == crc32c(0, m_package, HEADER_SIZE + m_data_size);
 }
 
 #ifdef DEBUG
@@ -7,23 +7,93 @@
 #include <iomanip>
 #include <malloc.h>
 #include <iostream>
+#include <type_traits>
+
+#include "checksum.h"
 
 //#define DEBUG
 
 #define MAX_PACKAGE_SIZE      1400
 
-#define HEADER_NUMBER_SIZE    sizeof(uint32_t)
-#define HEADER_NUMBER_OFFSET  0
-#define HEADER_MARKER_SIZE    sizeof(uint32_t)
-#define HEADER_MARKER_OFFSET  (HEADER_NUMBER_OFFSET + HEADER_NUMBER_SIZE)
-#define HEADER_FLAG_SIZE      sizeof(uint8_t)
-#define HEADER_FLAG_OFFSET    (HEADER_MARKER_OFFSET + HEADER_MARKER_SIZE)
+// поле заголовка пакета: смещение от начала датаграммы и размер
+struct HeaderField {
+    size_t offset;
+    size_t size;
+};
 
-#define HEADER_SIZE           (HEADER_NUMBER_SIZE + HEADER_MARKER_SIZE + HEADER_FLAG_SIZE)
+// расположение заголовка в датаграмме, числа записываются в порядке little-endian
+namespace package_header {
+    constexpr HeaderField number = {0, sizeof(uint32_t)};
+    constexpr HeaderField marker = {number.offset + number.size, sizeof(uint32_t)};
+    constexpr HeaderField flag   = {marker.offset + marker.size, sizeof(uint8_t)};
+    constexpr size_t size        = flag.offset + flag.size;
+
+    template <typename T>
+    inline T to_little_endian(T value)
+    {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        T swapped = 0;
+        for (size_t i = 0; i < sizeof(T); ++i)
+            swapped |= static_cast<T>((value >> (8 * i)) & 0xff) << (8 * (sizeof(T) - 1 - i));
+        return swapped;
+#else
+        return value;
+#endif
+    }
+
+    // memcpy не зависит от выравнивания поля в датаграмме
+    template <typename T>
+    inline T read(const char *buf, HeaderField field)
+    {
+        static_assert(std::is_unsigned<T>::value, "header fields are unsigned");
+        T value;
+        memcpy(&value, buf + field.offset, sizeof(T));
+        return to_little_endian(value);
+    }
+
+    template <typename T>
+    inline void write(char *buf, HeaderField field, T value)
+    {
+        static_assert(std::is_unsigned<T>::value, "header fields are unsigned");
+        value = to_little_endian(value);
+        memcpy(buf + field.offset, &value, sizeof(T));
+    }
+
+    static_assert(number.size == sizeof(uint32_t) && marker.size == sizeof(uint32_t) &&
+                  flag.size == sizeof(uint8_t), "header field types");
+    static_assert(size == 9, "wire header size is part of the protocol");
+}
+
+#define HEADER_SIZE           package_header::size
 #define DATA_OFFSET           HEADER_SIZE
 #define MAX_DATA_SIZE         (MAX_PACKAGE_SIZE - HEADER_SIZE)
 #define FLAG_LAST_PACKAGE     1
 #define FLAG_NOT_LAST_PACKAGE 0
+#define FLAG_LAST_MASK        0x01
+
+// дополнительные опции пакета, хранятся в старших битах флага
+#define FLAG_CHECKSUM         0x02
+#define FLAG_COMPRESSED       0x04
+#define FLAG_CONTROL          0x08
+#define FLAG_DELTA            0x10
+#define FLAG_OPTIONS_MASK     (FLAG_CHECKSUM | FLAG_COMPRESSED | FLAG_CONTROL | FLAG_DELTA)
+
+// типы управляющих сообщений, первый байт данных пакета с FLAG_CONTROL
+enum control_types {
+    CONTROL_SIGNATURE_REQUEST = 1,
+    CONTROL_SIGNATURES        = 2,
+    CONTROL_FEEDBACK          = 3
+};
+
+struct PackageHeader {
+    uint32_t number;
+    uint32_t marker;
+    uint8_t flag;
+};
+
+bool peek_header(const char *package, uint32_t size, PackageHeader& header);
+
+void reserve_package_slots(size_t count);
 
 class Package {
 public:
@@ -33,7 +103,7 @@ public:
 
     Package(const Package& other);
 
-    Package(Package&& other);
+    Package(Package&& other) noexcept;
 
     ~Package();
 
@@ -45,6 +115,14 @@ public:
 
     void set_package_flag(uint8_t flag);
 
+    void set_option(uint8_t option, bool enabled = true);
+
+    bool has_option(uint8_t option) const;
+
+    uint32_t max_data_size() const;
+
+    void seal();
+
     uint32_t get_number() const;
 
     uint32_t get_marker() const;
@@ -65,19 +143,27 @@ public:
 
     Package& operator=(const Package& other);
 
+    Package& operator=(Package&& other) noexcept;
+
     bool valid() const;
 
 private:
-    char     *m_package;
-    uint32_t *m_number;
-    uint32_t *m_marker;
-    uint8_t  *m_flag;
-    char     *m_data;
-    int      m_data_size;
+    char     *m_package;    // слот пула, датаграмма целиком
+    uint32_t m_number;      // копии полей заголовка для чтения без разбора
+    uint32_t m_marker;
+    int16_t  m_data_size;
+    uint8_t  m_flag;
     
-    void initialize(uint32_t package_size = MAX_PACKAGE_SIZE);
+    void initialize();
+
+    uint32_t trailer_size() const;
 };
 
+static_assert(sizeof(Package) <= 3 * sizeof(void *), "Package must stay compact");
+static_assert(std::is_nothrow_move_constructible<Package>::value &&
+              std::is_nothrow_move_assignable<Package>::value,
+              "Package must be cheap to move in containers");
+
 #ifdef DEBUG
 void print_headers_as_row();
 
@@ -0,0 +1,572 @@
+#include "proxy.h"
+#include "package.h"
+
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+static const milliseconds max_hold_time(200);      // задержанный для перестановки пакет
+                                                   // отправляется не позже этого срока
+static const seconds session_timeout(60);          // удаление неактивного клиента
+static const int max_poll_wait_ms = 1000;
+
+/** \brief Вывод статистики искажений
+ *
+ * Функция выводит статистику одного направления прокси в одну строку вида
+ * ключ=значение.
+ */
+std::ostream& operator<<(std::ostream& os, const ImpairmentStats& stats)
+{
+    return os << "received=" << stats.received
+              << " forwarded=" << stats.forwarded
+              << " lost=" << stats.lost
+              << " burst_lost=" << stats.burst_lost
+              << " duplicated=" << stats.duplicated
+              << " reordered=" << stats.reordered
+              << " queue_drops=" << stats.queue_drops;
+}
+
+/** \brief Сравнение датаграмм
+ *
+ * Датаграмма считается меньше, если она должна быть отправлена позже. Так
+ * std::priority_queue возвращает первой ближайшую по времени датаграмму.
+ */
+bool Datagram::operator<(const Datagram& other) const
+{
+    if (release != other.release)
+        return release > other.release;
+    return order > other.order;
+}
+
+/** \brief Конструктор искажений канала
+ *
+ * Функция создает объект, применяющий к датаграммам одного направления
+ * потери, пачечные потери (модель Гилберта-Эллиота), перестановки,
+ * дублирование, задержку и ограничение полосы согласно \p config . Все
+ * случайные решения принимаются генератором с начальным значением \p seed ,
+ * поэтому при одинаковом входном потоке результат воспроизводится.
+ *
+ * \param[in] name       Имя направления для лога.
+ * \param[in] config     Параметры искажений.
+ * \param[in] seed       Начальное значение генератора случайных чисел.
+ * \param[in] logger     Логгер.
+ * \param[in] verbose    Логировать каждое действие над датаграммой.
+ */
+Impairment::Impairment(const std::string& name, const ImpairmentConfig& config,
+                       uint32_t seed, Logger& logger, bool verbose)
+    : m_name(name)
+    , m_config(config)
+    , m_rng(seed)
+    , m_uniform(0.0, 1.0)
+    , m_logger(logger)
+    , m_verbose(verbose)
+    , m_burst_state(false)
+    , m_order(0)
+    , m_link_bytes(0)
+    , m_link_free(steady_clock::now())
+{}
+
+bool Impairment::chance(double probability)
+{
+    return probability > 0.0 && m_uniform(m_rng) < probability;
+}
+
+/** \brief Запись действия в лог
+ *
+ * Функция логирует действие над датаграммой, указывая номер и
+ * идентификатор пакета, если датаграмма похожа на пакет.
+ */
+void Impairment::log_action(const char *action, const char *data, int len)
+{
+    if (!m_verbose)
+        return;
+    m_logger << "[PROXY] " << m_name << " " << action;
+    if (len >= static_cast<int>(HEADER_SIZE))
+    {
+        uint32_t number = package_header::read<uint32_t>(data, package_header::number);
+        uint32_t marker = package_header::read<uint32_t>(data, package_header::marker);
+        m_logger << " No=" << number << " marker=" << marker;
+    }
+    m_logger << " size=" << len << std::endl;
+}
+
+/** \brief Принять датаграмму
+ *
+ * Функция принимает датаграмму, которую нужно отправить через сокет \p fd
+ * по адресу \p dest , и решает, будет ли она потеряна, продублирована или
+ * задержана. Отправка происходит в flush().
+ *
+ * \param[in] fd      Сокет для отправки.
+ * \param[in] dest    Адрес получателя.
+ * \param[in] data    Данные датаграммы.
+ * \param[in] len     Размер датаграммы.
+ */
+void Impairment::submit(int fd, const sockaddr_in& dest, const char *data, int len)
+{
+    ++m_stats.received;
+    if (m_burst_state)
+        m_burst_state = !chance(m_config.burst_exit);
+    else
+        m_burst_state = chance(m_config.burst_enter);
+    if (m_burst_state)
+    {
+        ++m_stats.burst_lost;
+        log_action("burst_loss", data, len);
+        return;
+    }
+    if (chance(m_config.loss))
+    {
+        ++m_stats.lost;
+        log_action("loss", data, len);
+        return;
+    }
+    int copies = 1;
+    if (chance(m_config.duplicate))
+    {
+        ++m_stats.duplicated;
+        log_action("duplicate", data, len);
+        copies = 2;
+    }
+    auto now = steady_clock::now();
+    for (int i = 0; i < copies; ++i)
+    {
+        Datagram datagram;
+        uint32_t delay = m_config.delay_ms;
+        if (m_config.jitter_ms > 0)
+            delay += m_rng() % (m_config.jitter_ms + 1);
+        datagram.release = now + milliseconds(delay);
+        datagram.order = m_order++;
+        datagram.fd = fd;
+        datagram.dest = dest;
+        datagram.data.assign(data, data + len);
+        schedule(std::move(datagram));
+    }
+}
+
+/** \brief Поставить датаграмму в очередь на отправку
+ *
+ * Функция либо задерживает датаграмму, пока ее не обгонят reorder_depth
+ * следующих датаграмм, либо ставит ее в очередь задержки. Каждая
+ * незадержанная датаграмма уменьшает счетчики ранее задержанных.
+ */
+void Impairment::schedule(Datagram&& datagram)
+{
+    if (m_config.reorder_depth > 0 && chance(m_config.reorder))
+    {
+        ++m_stats.reordered;
+        log_action("reorder", datagram.data.data(), datagram.data.size());
+        auto release = datagram.release;
+        m_held.push_back({m_config.reorder_depth, std::move(datagram)});
+        m_held.back().datagram.release = release + max_hold_time;
+        return;
+    }
+    auto release = datagram.release;
+    m_delayed.push(std::move(datagram));
+    for (auto iter = m_held.begin(); iter != m_held.end();)
+    {
+        if (--iter->remaining == 0)
+        {
+            iter->datagram.release = release;
+            iter->datagram.order = m_order++;
+            m_delayed.push(std::move(iter->datagram));
+            iter = m_held.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+/** \brief Отправить готовые датаграммы
+ *
+ * Функция отправляет датаграммы, время задержки которых истекло. При
+ * ограничении полосы датаграммы проходят через очередь размером
+ * queue_bytes и отправляются со скоростью rate_mbit, а не поместившиеся в
+ * очередь отбрасываются.
+ *
+ * \param[in] now    Текущее время.
+ *
+ * \return Число отправленных датаграмм.
+ */
+int Impairment::flush(time_point<steady_clock> now)
+{
+    while (!m_held.empty() && m_held.front().datagram.release <= now)
+    {
+        m_held.front().datagram.order = m_order++;
+        m_delayed.push(std::move(m_held.front().datagram));
+        m_held.pop_front();
+    }
+    int sent = 0;
+    while (!m_delayed.empty() && m_delayed.top().release <= now)
+    {
+        Datagram datagram = m_delayed.top();
+        m_delayed.pop();
+        if (m_config.rate_mbit <= 0.0)
+        {
+            sendto(datagram.fd, datagram.data.data(), datagram.data.size(), 0,
+                   (const sockaddr *)&datagram.dest, sizeof(datagram.dest));
+            ++m_stats.forwarded;
+            ++sent;
+            continue;
+        }
+        if (m_link_bytes + datagram.data.size() > m_config.queue_bytes)
+        {
+            ++m_stats.queue_drops;
+            log_action("queue_drop", datagram.data.data(), datagram.data.size());
+            continue;
+        }
+        m_link_bytes += datagram.data.size();
+        m_link.push_back(std::move(datagram));
+    }
+    if (m_link.empty())
+        m_link_free = std::max(m_link_free, now);
+    while (!m_link.empty() && m_link_free <= now)
+    {
+        Datagram& datagram = m_link.front();
+        sendto(datagram.fd, datagram.data.data(), datagram.data.size(), 0,
+               (const sockaddr *)&datagram.dest, sizeof(datagram.dest));
+        auto transmit = duration<double>(datagram.data.size() * 8.0 /
+                                         (m_config.rate_mbit * 1e6));
+        m_link_free += duration_cast<steady_clock::duration>(transmit);
+        m_link_bytes -= datagram.data.size();
+        m_link.pop_front();
+        ++m_stats.forwarded;
+        ++sent;
+    }
+    return sent;
+}
+
+/** \brief Время следующего события
+ *
+ * \return Время, к которому нужно вызвать flush(), или
+ * time_point::max(), если отправлять нечего.
+ */
+time_point<steady_clock> Impairment::next_event() const
+{
+    auto next = time_point<steady_clock>::max();
+    if (!m_delayed.empty())
+        next = std::min(next, m_delayed.top().release);
+    if (!m_held.empty())
+        next = std::min(next, m_held.front().datagram.release);
+    if (!m_link.empty())
+        next = std::min(next, m_link_free);
+    return next;
+}
+
+/** \brief Статистика направления
+ *
+ * \return Ссылка на статистику искажений.
+ */
+const ImpairmentStats& Impairment::get_stats() const
+{
+    return m_stats;
+}
+
+/** \brief Разрешение адреса
+ *
+ * Функция преобразует IPv4 адрес \p addr и порт \p port в sockaddr_in.
+ *
+ * \exception runtime_error
+ * Если адрес не удалось разрешить.
+ */
+static sockaddr_in resolve(const std::string& addr, int port)
+{
+    addrinfo hint;
+    addrinfo *info = nullptr;
+    memset(&hint, 0, sizeof(hint));
+    hint.ai_family = AF_INET;
+    hint.ai_socktype = SOCK_DGRAM;
+    hint.ai_protocol = IPPROTO_UDP;
+    std::string s_port = std::to_string(port);
+    if (getaddrinfo(addr.c_str(), s_port.c_str(), &hint, &info) != 0 || info == nullptr)
+        throw std::runtime_error("некорректный адрес или порт: " + addr);
+    sockaddr_in result;
+    memcpy(&result, info->ai_addr, sizeof(result));
+    freeaddrinfo(info);
+    return result;
+}
+
+/** \brief Конструктор прокси
+ *
+ * Функция создает UDP прокси, который принимает датаграммы клиентов на
+ * \p listen_addr : \p listen_port и пересылает их серверу
+ * \p server_addr : \p server_port , искажая их согласно \p forward . Для
+ * каждого клиента создается отдельный сокет, поэтому ответы сервера
+ * возвращаются нужному клиенту с искажениями \p reverse .
+ *
+ * \exception runtime_error
+ * Если не удалось разрешить адреса, создать или привязать сокет.
+ */
+Proxy::Proxy(const std::string& listen_addr, int listen_port,
+             const std::string& server_addr, int server_port,
+             const ImpairmentConfig& forward, const ImpairmentConfig& reverse,
+             uint32_t seed, Logger& logger, bool verbose)
+    : m_server(resolve(server_addr, server_port))
+    , m_logger(logger)
+    , m_forward("fwd", forward, seed, logger, verbose)
+    , m_reverse("rev", reverse, seed ^ 0x5bd1e995, logger, verbose)
+    , m_stats_interval(5)
+{
+    sockaddr_in local = resolve(listen_addr, listen_port);
+    m_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (m_socket < 0)
+        throw std::runtime_error("не смог создать сокет");
+    if (bind(m_socket, (const sockaddr *)&local, sizeof(local)) != 0)
+    {
+        close(m_socket);
+        throw std::runtime_error(strerror(errno));
+    }
+}
+
+/** \brief Деструктор прокси
+ *
+ * Функция закрывает сокеты прокси и всех клиентов.
+ */
+Proxy::~Proxy()
+{
+    for (auto& session: m_sessions)
+        close(session.second->fd);
+    close(m_socket);
+}
+
+/** \brief Период вывода статистики
+ *
+ * \param[in] interval    Период вывода статистики в лог.
+ */
+void Proxy::set_stats_interval(seconds interval)
+{
+    m_stats_interval = interval;
+}
+
+/** \brief Нахождение или создание клиента
+ *
+ * Функция возвращает клиента с адресом \p client , создавая для нового
+ * клиента сокет, через который его датаграммы уходят серверу.
+ *
+ * \return Указатель на клиента или nullptr, если сокет не удалось создать.
+ */
+Proxy::Session *Proxy::find_or_create_session(const sockaddr_in& client)
+{
+    uint64_t key = (static_cast<uint64_t>(client.sin_addr.s_addr) << 16) | client.sin_port;
+    auto iter = m_sessions.find(key);
+    if (iter == m_sessions.end())
+    {
+        int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (fd < 0)
+            return nullptr;
+        std::unique_ptr<Session> session(new Session);
+        session->fd = fd;
+        session->client = client;
+        char ip[INET_ADDRSTRLEN] = {0};
+        inet_ntop(AF_INET, &client.sin_addr, ip, sizeof(ip));
+        m_logger << "[INFO] Новый клиент [" << ip << ":" << ntohs(client.sin_port)
+            << "]" << std::endl;
+        iter = m_sessions.emplace(key, std::move(session)).first;
+    }
+    iter->second->last_activity = steady_clock::now();
+    return iter->second.get();
+}
+
+/** \brief Удаление неактивных клиентов
+ *
+ * Функция закрывает сокеты клиентов, от которых и к которым не было
+ * датаграмм дольше session_timeout.
+ */
+void Proxy::clear_sessions_by_timeout(time_point<steady_clock> now)
+{
+    for (auto iter = m_sessions.begin(); iter != m_sessions.end();)
+    {
+        if (now - iter->second->last_activity > session_timeout)
+        {
+            close(iter->second->fd);
+            iter = m_sessions.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+/** \brief Вывод статистики
+ *
+ * Функция выводит в лог статистику обоих направлений.
+ */
+void Proxy::log_stats()
+{
+    m_logger << "[STATS] fwd: " << m_forward.get_stats() << std::endl;
+    m_logger << "[STATS] rev: " << m_reverse.get_stats() << std::endl;
+}
+
+/** \brief Работа прокси
+ *
+ * Функция запускает бесконечный цикл приема датаграмм от клиентов и
+ * сервера, их искажения и пересылки. Раз в m_stats_interval статистика
+ * выводится в лог.
+ */
+void Proxy::work()
+{
+    char buf[65536];
+    std::vector<pollfd> fds;
+    std::vector<Session *> owners;
+    auto stats_time = steady_clock::now();
+    m_logger << "[INFO] Прокси запущен." << std::endl;
+    while (1)
+    {
+        fds.clear();
+        owners.clear();
+        fds.push_back({m_socket, POLLIN, 0});
+        owners.push_back(nullptr);
+        for (auto& session: m_sessions)
+        {
+            fds.push_back({session.second->fd, POLLIN, 0});
+            owners.push_back(session.second.get());
+        }
+        auto now = steady_clock::now();
+        auto next = std::min(m_forward.next_event(), m_reverse.next_event());
+        int wait_ms = max_poll_wait_ms;
+        if (next != time_point<steady_clock>::max())
+        {
+            auto left = duration_cast<microseconds>(next - now).count();
+            wait_ms = left <= 0 ? 0 : std::min<long>(max_poll_wait_ms, (left + 999) / 1000);
+        }
+        if (poll(fds.data(), fds.size(), wait_ms) < 0 && errno != EINTR)
+        {
+            m_logger << "[ERROR] " << strerror(errno) << std::endl;
+            continue;
+        }
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+            int bytes;
+            sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            while ((bytes = recvfrom(fds[i].fd, buf, sizeof(buf), MSG_DONTWAIT,
+                                     (sockaddr *)&from, &from_len)) >= 0)
+            {
+                if (owners[i] == nullptr)
+                {
+                    Session *session = find_or_create_session(from);
+                    if (session != nullptr)
+                        m_forward.submit(session->fd, m_server, buf, bytes);
+                } else {
+                    owners[i]->last_activity = steady_clock::now();
+                    m_reverse.submit(m_socket, owners[i]->client, buf, bytes);
+                }
+                from_len = sizeof(from);
+            }
+        }
+        now = steady_clock::now();
+        m_forward.flush(now);
+        m_reverse.flush(now);
+        clear_sessions_by_timeout(now);
+        if (now - stats_time >= m_stats_interval)
+        {
+            stats_time = now;
+            log_stats();
+        }
+    }
+}
+
+void print_usage(char *program_name)
+{
+    std::cout << "Используйте: " << program_name
+              << " [опции] <IPv4 адрес прокси> <Порт прокси>"
+                 " <IPv4 адрес сервера> <Порт сервера>" << std::endl
+              << "Опции (вероятности задаются числом от 0 до 1):" << std::endl
+              << "  -s <число>   начальное значение генератора случайных чисел" << std::endl
+              << "  -l <p>       вероятность потери пакета" << std::endl
+              << "  -b <p>       вероятность начала пачки потерь" << std::endl
+              << "  -e <p>       вероятность конца пачки потерь (0.5)" << std::endl
+              << "  -r <p>       вероятность перестановки пакета" << std::endl
+              << "  -R <число>   сколько пакетов обгоняют переставленный (3)" << std::endl
+              << "  -u <p>       вероятность дублирования пакета" << std::endl
+              << "  -d <мс>      задержка" << std::endl
+              << "  -j <мс>      случайная добавка к задержке" << std::endl
+              << "  -w <Мбит/с>  ограничение полосы" << std::endl
+              << "  -q <байт>    размер очереди ограничителя полосы (262144)" << std::endl
+              << "  -B           искажать и ответы сервера" << std::endl
+              << "  -i <с>       период вывода статистики (5)" << std::endl
+              << "  -v           логировать каждое действие над пакетом" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    ImpairmentConfig config;
+    uint32_t seed = static_cast<uint32_t>(std::time(nullptr));
+    bool both = false;
+    bool verbose = false;
+    int interval = 5;
+    int opt;
+    try
+    {
+        while ((opt = getopt(argc, argv, "s:l:b:e:r:R:u:d:j:w:q:Bi:v")) != -1)
+        {
+            switch (opt)
+            {
+            case 's': seed = std::stoul(optarg); break;
+            case 'l': config.loss = std::stod(optarg); break;
+            case 'b': config.burst_enter = std::stod(optarg); break;
+            case 'e': config.burst_exit = std::stod(optarg); break;
+            case 'r': config.reorder = std::stod(optarg); break;
+            case 'R': config.reorder_depth = std::stoul(optarg); break;
+            case 'u': config.duplicate = std::stod(optarg); break;
+            case 'd': config.delay_ms = std::stoul(optarg); break;
+            case 'j': config.jitter_ms = std::stoul(optarg); break;
+            case 'w': config.rate_mbit = std::stod(optarg); break;
+            case 'q': config.queue_bytes = std::stoul(optarg); break;
+            case 'B': both = true; break;
+            case 'i': interval = std::stoi(optarg); break;
+            case 'v': verbose = true; break;
+            default:
+                print_usage(argv[0]);
+                exit(1);
+            }
+        }
+    }
+    catch (const std::logic_error &e)
+    {
+        std::cerr << "Ошибка: некорректное значение опции -" << char(opt) << std::endl;
+        exit(1);
+    }
+    if (argc - optind != 4)
+    {
+        std::cerr << "Ошибка: неверное количество аргументов." << std::endl;
+        print_usage(argv[0]);
+        exit(1);
+    }
+    int listen_port = 0;
+    int server_port = 0;
+    try
+    {
+        listen_port = std::stoi(std::string(argv[optind + 1]));
+        server_port = std::stoi(std::string(argv[optind + 3]));
+    }
+    catch (std::invalid_argument &e)
+    {
+        std::cerr << "Ошибка: значение порта должено быть целом числом." << std::endl;
+        exit(1);
+    }
+    Logger log;
+    try
+    {
+        Proxy proxy(argv[optind], listen_port, argv[optind + 2], server_port,
+                    config, both ? config : ImpairmentConfig(), seed, log, verbose);
+        proxy.set_stats_interval(seconds(interval));
+        log << "[INFO] seed=" << seed << " loss=" << config.loss
+            << " burst=" << config.burst_enter << "/" << config.burst_exit
+            << " reorder=" << config.reorder << "x" << config.reorder_depth
+            << " duplicate=" << config.duplicate
+            << " delay=" << config.delay_ms << "+" << config.jitter_ms << "ms"
+            << " rate=" << config.rate_mbit << "Mbit/s" << std::endl;
+        proxy.work();
+    }
+    catch (const std::runtime_error& err)
+    {
+        std::cerr << err.what() << std::endl;
+        exit(1);
+    }
+    return 0;
+}
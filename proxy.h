@@ -0,0 +1,127 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "logger.h"
+
+using namespace std::chrono;
+
+struct ImpairmentConfig {
+    double loss          = 0.0;   // вероятность случайной потери
+    double burst_enter   = 0.0;   // вероятность перехода в состояние пачечных потерь
+    double burst_exit    = 0.5;   // вероятность выхода из состояния пачечных потерь
+    double reorder       = 0.0;   // вероятность задержать пакет для перестановки
+    uint32_t reorder_depth = 3;   // сколько пакетов обгонят задержанный
+    double duplicate     = 0.0;   // вероятность дублирования
+    uint32_t delay_ms    = 0;     // постоянная задержка
+    uint32_t jitter_ms   = 0;     // случайная добавка к задержке
+    double rate_mbit     = 0.0;   // ограничение полосы, 0 - без ограничения
+    uint32_t queue_bytes = 256 * 1024; // очередь перед ограничителем полосы
+};
+
+struct ImpairmentStats {
+    uint64_t received   = 0;
+    uint64_t forwarded  = 0;
+    uint64_t lost       = 0;
+    uint64_t burst_lost = 0;
+    uint64_t duplicated = 0;
+    uint64_t reordered  = 0;
+    uint64_t queue_drops = 0;
+};
+
+std::ostream& operator<<(std::ostream& os, const ImpairmentStats& stats);
+
+struct Datagram {
+    time_point<steady_clock> release;
+    uint64_t order;
+    int fd;
+    sockaddr_in dest;
+    std::vector<char> data;
+
+    bool operator<(const Datagram& other) const;
+};
+
+class Impairment {
+public:
+    Impairment(const std::string& name, const ImpairmentConfig& config,
+               uint32_t seed, Logger& logger, bool verbose);
+
+    void submit(int fd, const sockaddr_in& dest, const char *data, int len);
+
+    int flush(time_point<steady_clock> now);
+
+    time_point<steady_clock> next_event() const;
+
+    const ImpairmentStats& get_stats() const;
+
+private:
+    struct Held {
+        uint32_t remaining;
+        Datagram datagram;
+    };
+
+    std::string m_name;
+    ImpairmentConfig m_config;
+    std::mt19937_64 m_rng;
+    std::uniform_real_distribution<double> m_uniform;
+    Logger& m_logger;
+    bool m_verbose;
+    bool m_burst_state;
+    uint64_t m_order;
+    ImpairmentStats m_stats;
+    std::priority_queue<Datagram> m_delayed;
+    std::deque<Held> m_held;
+    std::deque<Datagram> m_link;
+    uint64_t m_link_bytes;
+    time_point<steady_clock> m_link_free;
+
+    bool chance(double probability);
+
+    void schedule(Datagram&& datagram);
+
+    void log_action(const char *action, const char *data, int len);
+};
+
+class Proxy {
+public:
+    Proxy(const std::string& listen_addr, int listen_port,
+          const std::string& server_addr, int server_port,
+          const ImpairmentConfig& forward, const ImpairmentConfig& reverse,
+          uint32_t seed, Logger& logger, bool verbose);
+
+    ~Proxy();
+
+    void set_stats_interval(seconds interval);
+
+    void work();
+
+private:
+    struct Session {
+        int fd;
+        sockaddr_in client;
+        time_point<steady_clock> last_activity;
+    };
+
+    int m_socket;
+    sockaddr_in m_server;
+    Logger& m_logger;
+    Impairment m_forward;
+    Impairment m_reverse;
+    std::map<uint64_t, std::unique_ptr<Session>> m_sessions;
+    seconds m_stats_interval;
+
+    Session *find_or_create_session(const sockaddr_in& client);
+
+    void clear_sessions_by_timeout(time_point<steady_clock> now);
+
+    void log_stats();
+};
@@ -0,0 +1,95 @@
+#include "received_set.h"
+
+static const uint64_t bits_per_word = 64;
+
+/** \brief Конструктор множества принятых номеров
+ *
+ * Функция создает битовую карту номеров пакетов, принятых сборщиком. Все
+ * номера меньше базового считаются принятыми, а для номеров от базового
+ * хранится по одному биту. Карта растет по мере прихода пакетов с большими
+ * номерами, но не дальше \p max_window номеров от базового, и сдвигается
+ * вперед при записи пакетов вызовом advance().
+ *
+ * \param[in] max_window    Наибольшее расстояние от базового номера.
+ */
+ReceivedSet::ReceivedSet(uint64_t max_window)
+    : m_base(0)
+    , m_max_words((max_window + bits_per_word - 1) / bits_per_word)
+{}
+
+/** \brief Принят ли номер
+ *
+ * \param[in] number    Номер пакета.
+ *
+ * \return true, если пакет с номером \p number уже принят, false иначе.
+ */
+bool ReceivedSet::contains(uint64_t number) const
+{
+    if (number < m_base)
+        return true;
+    uint64_t word = (number - m_base) / bits_per_word;
+    if (word >= m_words.size())
+        return false;
+    return (m_words[word] >> (number % bits_per_word)) & 1;
+}
+
+/** \brief Отметить номер принятым
+ *
+ * \param[in] number    Номер пакета.
+ *
+ * \return true, если номер отмечен, false, если он уже был принят или
+ * находится дальше окна max_window.
+ */
+bool ReceivedSet::insert(uint64_t number)
+{
+    if (number < m_base)
+        return false;
+    uint64_t word = (number - m_base) / bits_per_word;
+    if (word >= m_max_words)
+        return false;
+    if (word >= m_words.size())
+        m_words.resize(word + 1, 0);
+    uint64_t bit = 1ULL << (number % bits_per_word);
+    if (m_words[word] & bit)
+        return false;
+    m_words[word] |= bit;
+    return true;
+}
+
+/** \brief Забыть номер
+ *
+ * Функция снимает отметку с номера пакета, который был принят, но не
+ * сохранен, чтобы его повторная копия не считалась дубликатом.
+ *
+ * \param[in] number    Номер пакета.
+ */
+void ReceivedSet::erase(uint64_t number)
+{
+    if (number < m_base)
+        return;
+    uint64_t word = (number - m_base) / bits_per_word;
+    if (word < m_words.size())
+        m_words[word] &= ~(1ULL << (number % bits_per_word));
+}
+
+/** \brief Сдвинуть окно
+ *
+ * Функция сообщает, что все номера меньше \p number приняты и обработаны,
+ * и освобождает слова карты, которые целиком лежат ниже \p number .
+ *
+ * \param[in] number    Первый необработанный номер.
+ */
+void ReceivedSet::advance(uint64_t number)
+{
+    while (m_base + bits_per_word <= number)
+    {
+        if (!m_words.empty())
+            m_words.pop_front();
+        m_base += bits_per_word;
+        if (m_words.empty())
+        {
+            m_base = number - number % bits_per_word;
+            break;
+        }
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+
+class ReceivedSet {
+public:
+    explicit ReceivedSet(uint64_t max_window);
+
+    bool contains(uint64_t number) const;
+
+    bool insert(uint64_t number);
+
+    void erase(uint64_t number);
+
+    void advance(uint64_t number);
+
+private:
+    uint64_t m_base;              // номер первого бита карты, кратен 64
+    uint64_t m_max_words;
+    std::deque<uint64_t> m_words;
+};
@@ -2,27 +2,30 @@
 
 #include <cstring>
 #include <sys/stat.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <linux/sock_diag.h>
 
-static const std::chrono::seconds key_black_list_timeout(30);   // 30 секунд игнорирования входящих пакетов по ключу
+#include "delta.h"
+#include "session_key.h"
+#include "trace.h"
+
+static const std::chrono::seconds tombstone_lifetime(30);       // 30 секунд игнорирования пакетов закрытой сессии
+static const size_t tombstone_generations = 4;                  // сессия хранится от 30 до 40 секунд
+static const size_t tombstone_bits = 1 << 20;                   // битов поколения, 128 КиБ
+static const unsigned tombstone_hashes = 4;
 static const std::chrono::seconds max_package_waiting_time(5);  // 2 секунд ожидания следующего необходимого пакета
                                                                 // для записи
-
-/** \brief Проверка существования директории
- * 
- * Функция проверяет существование директори с именем  \p dirname .
- * 
- * \return true, если директория существует, false иначе.
- */ 
-bool dir_exists(const std::string& dirname)
-{
-    struct stat info;
-    if (stat(dirname.c_str(), &info) != 0)
-        return false;
-    else if (info.st_mode & S_IFDIR)
-        return true;
-    else
-        return false;
-}
+static const std::chrono::seconds stats_log_interval(10);       // период вывода статистики в лог
+static const uint32_t signatures_burst = 64;                    // пакетов сигнатур без паузы
+static const size_t max_signed_blocks = 65536;                  // сигнатур в ответе, около 770 КиБ
+static const uint32_t max_signature_requests = 4;               // запросов сигнатур на сессию
+static const uint32_t max_signing_per_client = 4;               // ответов сигнатурами адресу в работе
+static const uint32_t queue_sample_interval = 16;               // пакетов между замерами буфера приема
+static const int receive_buffer_size = 4 * 1024 * 1024;
+static const int max_poll_datagrams = 256;                     // датаграмм за один вызов poll
+static const size_t logged_clients = 4;                         // клиентов в статистике
+static const size_t prewarmed_slots = 1024;                     // слотов пакетов потока приема, около 1.4 МиБ
 
 /** \brief Функция создания UDP сервера.
  * 
@@ -30,9 +33,9 @@ bool dir_exists(const std::string& dirname)
  * етевой адрес  интерфеса и порт, с которого сервер будет ожидать данные.
  * Адрес \p addr принимается в текстовом виде в формате IPv4. Порт \p port 
  * представлен в целочисленном типе. Если адрес не определится, будет
- * сгенерировано исключение. Третьим парамтром является директория \p dirname , 
- * включая полный путь к ней, в котороую будет сохраняться файлы, переданные
- * по протоколу UDP.
+ * сгенерировано исключение. Третьим парамтром являются директории \p dirs , 
+ * включая полный путь к ним, в котороые будет сохраняться файлы, переданные
+ * по протоколу UDP. Каждый файл целиком записывается в одну из директорий.
  * 
  * \warning
  * Используется только первый адрес, найденный функцией getaddrinfo.
@@ -46,14 +49,22 @@ bool dir_exists(const std::string& dirname)
  * \param[in] addr   IP адрес сервера в десятичном формате
  * \param[in] port   Номер порта сервера в виде целого числа.
  */ 
-Server::Server(const std::string &addr, int port, const std::string &dirname, Logger& logger)
-    : m_dir(dirname)
+Server::Server(const std::string &addr, int port, const std::vector<std::string>& dirs, 
+               Logger& logger)
+    : m_storage(dirs)
     , m_port(port)
     , m_addr(addr)
     , m_logger(logger)
+    , m_budget(default_memory_limit, default_session_quota)
+    , m_stats_time(steady_clock::now())
+    , m_durability(DURABILITY_BUFFERED)
+    , m_chunk_size(default_chunk_size)
+    , m_flush_interval(default_flush_interval)
+    , m_queue_affinity(false)
+    , m_tombstones(tombstone_lifetime, tombstone_generations, tombstone_bits, tombstone_hashes)
+    , m_signer(new WorkPool(1))
+    , m_pool(new WorkPool(0))
 {
-    if (!dir_exists(dirname))
-        throw std::runtime_error("directory does not exists");
     addrinfo hint;
     memset(&hint, 0, sizeof(hint));
     hint.ai_family = AF_INET;
@@ -69,12 +80,26 @@ Server::Server(const std::string &addr, int port, const std::string &dirname, Lo
         freeaddrinfo(m_addrinfo);
         throw std::runtime_error("could not create socket\n");
     }
+    const sockaddr_in *bound = reinterpret_cast<const sockaddr_in *>(m_addrinfo->ai_addr);
+    m_multicast = IN_MULTICAST(ntohl(bound->sin_addr.s_addr));
+    m_group_interface.s_addr = htonl(INADDR_ANY);
+    if (m_multicast)
+    {
+        // несколько серверов на одной машине получают копию каждой датаграммы
+        int reuse = 1;
+        setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    }
     status = bind(m_socket, m_addrinfo->ai_addr, m_addrinfo->ai_addrlen);
+    if (status == 0 && m_multicast)
+        status = join_group(true);
     if (status != 0) {
         freeaddrinfo(m_addrinfo);
         close(m_socket);
         throw std::runtime_error(strerror(errno));
     }
+    // запас, пока клиент не снизил скорость по отчету о заполнении буфера
+    int rcvbuf = receive_buffer_size;
+    setsockopt(m_socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
 }
 
 /** \brief Деструктор UDP сервера.
@@ -83,6 +108,8 @@ Server::Server(const std::string &addr, int port, const std::string &dirname, Lo
  */  
 Server::~Server()
 {
+    // поток сигнатур отправляет их через сокет
+    m_signer.reset();
     freeaddrinfo(m_addrinfo);
     close(m_socket);
 }
@@ -127,15 +154,389 @@ int Server::get_socket() const
     return m_socket;
 }
 
+/** \brief Получить дескриптор сокета AF_XDP.
+ * 
+ * Приложение, встроившее сервер в свой цикл событий, ждет готовности к 
+ * чтению и этого дескриптора, смотрите set_xdp().
+ * 
+ * \return Дескриптор или -1, если прием через AF_XDP не включен.
+ */ 
+int Server::get_xdp_socket() const
+{
+    return m_xdp ? m_xdp->get_fd() : -1;
+}
+
 /** \brief Получить копию директории.
  * 
- * Функция возвращает копию директории, введенной в процесе инициализации 
- * сервера. В эту дирректорию сохраняются все переданные файлы.
+ * Функция возвращает копию первой директории, введенной в процесе 
+ * инициализации сервера.
  *
  * \return Возвращает копию строки, содержащий директроию.
  */ 
 std::string Server::get_directory() const {
-    return m_dir;
+    return m_storage.root(0).dir;
+}
+
+/** \brief Задать пределы памяти.
+ * 
+ * Функция задает общий предел памяти под пакеты, ожидающие записи во всех
+ * сборщиках файлов, и предел одного сборщика. Пакеты сверх пределов 
+ * вытесняются на диск.
+ * 
+ * \param[in] limit            Общий предел в байтах.
+ * \param[in] session_quota    Предел одного сборщика в байтах.
+ */ 
+void Server::set_memory_limits(uint64_t limit, uint64_t session_quota)
+{
+    m_budget.set_limits(limit, session_quota);
+}
+
+/** \brief Задать режим сохранности.
+ * 
+ * Функция задает, как принятые файлы сохраняются на диск: через страничный
+ * кеш без fsync (DURABILITY_BUFFERED), с fsync каждого файла и O_DIRECT для
+ * больших файлов (DURABILITY_DIRECT) или с fsync готовых файлов пачками раз
+ * в \p group_interval в отдельном потоке (DURABILITY_GROUP). В последних 
+ * двух режимах о получении файла сервер сообщает только после того, как 
+ * файл сохранен на диске. У каждой директории хранения свой поток fsync.
+ * 
+ * \param[in] mode              Режим сохранности.
+ * \param[in] group_interval    Время сбора пачки файлов в режиме DURABILITY_GROUP.
+ */ 
+void Server::set_durability(durability_modes mode, milliseconds group_interval)
+{
+    m_durability = mode;
+    m_storage.set_durability(mode, group_interval);
+}
+
+/** \brief Вступить в группу или выйти из нее.
+ * 
+ * \param[in] join    true - вступить в группу, false - выйти.
+ * 
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */ 
+int Server::join_group(bool join)
+{
+    ip_mreq request;
+    request.imr_multiaddr = reinterpret_cast<const sockaddr_in *>(m_addrinfo->ai_addr)->sin_addr;
+    request.imr_interface = m_group_interface;
+    return setsockopt(m_socket, IPPROTO_IP, join ? IP_ADD_MEMBERSHIP : IP_DROP_MEMBERSHIP,
+                      &request, sizeof(request));
+}
+
+/** \brief Задать интерфейс группы.
+ * 
+ * Если адрес сервера - групповой (224.0.0.0/4), сервер при создании 
+ * вступает в группу на интерфейсе, выбранном по таблице маршрутизации. 
+ * Функция переводит членство в группе на интерфейс с адресом \p interface .
+ * Пакеты группы сервер обрабатывает так же, как обычные, а отчеты о приеме
+ * и сигнатуры отправляет на адрес клиента.
+ * 
+ * \param[in] interface    IPv4 адрес интерфейса.
+ * 
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */ 
+int Server::set_multicast_interface(const std::string& interface)
+{
+    in_addr address;
+    if (inet_pton(AF_INET, interface.c_str(), &address) != 1)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!m_multicast)
+        return 0;
+    join_group(false);
+    m_group_interface = address;
+    return join_group(true);
+}
+
+/** \brief Задать число потоков обработки пакетов.
+ * 
+ * По умолчанию пакеты обрабатываются в потоке приема. С \p threads 
+ * потоками проверка контрольных сумм, распаковка, проверка имени файла и 
+ * запись выполняются в пуле потоков (WorkPool), а поток приема только 
+ * читает сокет, разбирает заголовки и отправляет отчеты о приеме. Пакеты 
+ * одной сессии обрабатываются по порядку, разные сессии - параллельно.
+ * Очереди сессий обслуживаются по очереди квантами байтов (deficit round
+ * robin), поэтому пакеты маленьких файлов не ждут, пока пул обработает 
+ * накопившиеся пакеты большого.
+ * 
+ * \warning
+ * Вызывается до начала приема пакетов.
+ * 
+ * \param[in] threads    Число потоков, 0 - обработка в потоке приема.
+ */ 
+void Server::set_workers(size_t threads)
+{
+    m_pool.reset();
+    m_pool.reset(new WorkPool(threads, m_affinity[THREAD_COMPUTE]));
+}
+
+/** \brief Ограничить скорость приема от клиента.
+ * 
+ * Функция ограничивает скорость датаграмм данных с одного IP адреса 
+ * клиента, смотрите ClientLimiter. Превышение сообщается клиенту в отчетах
+ * о приеме как заполнение буфера, и с -c он снижает скорость. Датаграммы 
+ * клиента, который не снизил скорость, отбрасываются до поиска сессии, 
+ * поэтому он не занимает поток приема и пул за счет остальных. Управляющие
+ * датаграммы ограничиваются отдельным небольшим числом в секунду на адрес 
+ * (ClientLimiter::admit_control()) и пачку данных не расходуют; это 
+ * ограничение действует и без вызова функции. Датаграммы и байты каждого 
+ * адреса учитываются и без ограничения.
+ * 
+ * \param[in] bytes_per_second    Скорость в байтах в секунду, 0 - без 
+ *                                ограничения.
+ * \param[in] burst               Наибольшая пачка в байтах.
+ */ 
+void Server::set_client_rate_limit(double bytes_per_second, uint64_t burst)
+{
+    m_clients.set_rate(bytes_per_second, burst);
+}
+
+/** \brief Закрепить потоки за процессорами.
+ * 
+ * Функция задает процессоры \p cpus для потоков роли \p role : 
+ * - THREAD_RECEIVE - поток, вызывающий work(), закрепляется при ее вызове
+ *   или при вызове pin_receive_thread(). Сокету задается SO_INCOMING_CPU 
+ *   первого процессора: если несколько сокетов слушают порт с 
+ *   SO_REUSEPORT, ядро отдает этому сокету пакеты очереди сетевой карты, 
+ *   обработанной на этом процессоре;
+ * - THREAD_WRITER - потоки записи и группового fsync директорий;
+ * - THREAD_COMPUTE - потоки пула обработки пакетов, каждый за одним 
+ *   процессором списка по очереди.
+ * 
+ * Закрепленный поток выделяет память на узле NUMA своих процессоров, а 
+ * пул пакетов потока приема заполняется заранее, смотрите 
+ * pin_current_thread(). Без пула обработки пакеты записываются в потоке 
+ * приема, поэтому закреплять нужно его.
+ * 
+ * \warning
+ * Вызывается до начала приема пакетов.
+ * 
+ * \param[in] role    Роль потоков.
+ * \param[in] cpus    Номера процессоров.
+ * 
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno. EINVAL, если
+ * процессоры недоступны процессу.
+ */ 
+int Server::set_affinity(thread_roles role, const std::vector<int>& cpus)
+{
+    if (cpus.empty() || !cpus_allowed(cpus))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    m_affinity[role] = cpus;
+    if (role == THREAD_COMPUTE)
+        set_workers(m_pool->size());
+    else if (role == THREAD_WRITER)
+        return m_storage.set_affinity(cpus);
+    else if (role == THREAD_RECEIVE)
+        return setsockopt(m_socket, SOL_SOCKET, SO_INCOMING_CPU, &cpus.front(), sizeof(int));
+    return 0;
+}
+
+/** \brief Закреплять поток приема по очереди сетевой карты.
+ * 
+ * Если режим включен и процессоры потока приема не заданы, то 
+ * pin_receive_thread() закрепляет поток приема за узлом NUMA процессоров, 
+ * которые обрабатывают прерывания очередей приема сетевой карты (смотрите
+ * interface_queue_cpus()): данные пакетов уже лежат в памяти этого узла. 
+ * Интерфейс определяется по AF_XDP (set_xdp()), иначе по адресу сервера; 
+ * для адреса 0.0.0.0 - единственный поднятый интерфейс с адресом IPv4, 
+ * кроме loopback.
+ * 
+ * \note
+ * SO_INCOMING_CPU для этого не подходит: для неподключенного сокета UDP 
+ * getsockopt() возвращает -1, сокет не связан с одной очередью.
+ * 
+ * \param[in] enabled    true, чтобы включить режим, false иначе.
+ */ 
+void Server::set_queue_affinity(bool enabled)
+{
+    m_queue_affinity = enabled;
+}
+
+/** \brief Закрепить поток приема.
+ * 
+ * Функция закрепляет вызывающий поток за процессорами роли THREAD_RECEIVE,
+ * если они заданы, а иначе в режиме set_queue_affinity() - за узлом 
+ * очередей приема сетевой карты. Ее вызывает work(), а приложение, встроившее сервер в 
+ * свой цикл событий, вызывает ее из потока, в котором вызывает poll().
+ * 
+ * \return 0, в случае успеха или если процессоры не заданы, -1 иначе, код
+ * ошибки в errno.
+ */ 
+int Server::pin_receive_thread()
+{
+    if (m_affinity[THREAD_RECEIVE].empty())
+    {
+        if (m_queue_affinity)
+            pin_to_queue();
+        return 0;
+    }
+    return pin_current_thread(m_affinity[THREAD_RECEIVE], prewarmed_slots);
+}
+
+/** \brief Принимать пакеты через AF_XDP.
+ * 
+ * Функция подключает к очереди \p queue интерфейса \p ifname программу 
+ * XDP, которая перенаправляет датаграммы UDP на адрес и порт сервера в 
+ * сокет AF_XDP, минуя сетевой стек ядра (смотрите XdpReceiver). poll() 
+ * сначала забирает датаграммы из кольца приема, затем читает сокет UDP: 
+ * через него приходят пакеты других очередей и кадры, которые программа 
+ * пропускает в стек, и через него уходят отчеты о приеме и сигнатуры. 
+ * Универсальный режим (\p native равно false) работает на любом 
+ * интерфейсе, в том числе veth, но копирует кадр; режим драйвера 
+ * требует его поддержки. Если AF_XDP недоступен, сервер пишет 
+ * предупреждение и продолжает принимать через сокет.
+ * 
+ * \warning
+ * Контрольные суммы IP и UDP при приеме через AF_XDP не проверяются,
+ * целостность данных проверяется контрольными суммами пакетов (опция -k 
+ * клиента).
+ * 
+ * \param[in] ifname    Имя интерфейса.
+ * \param[in] queue     Номер очереди приема.
+ * \param[in] native    true - режим драйвера, false - универсальный режим.
+ * 
+ * \return 0, в случае успеха, -1, если прием идет через сокет.
+ */ 
+int Server::set_xdp(const std::string& ifname, uint32_t queue, bool native)
+{
+    m_xdp.reset();
+    try {
+        const sockaddr_in *addr = reinterpret_cast<const sockaddr_in *>(m_addrinfo->ai_addr);
+        m_xdp.reset(new XdpReceiver(ifname, queue, *addr, native));
+        m_xdp_ifname = ifname;
+    }
+    catch (const std::runtime_error& err) {
+        m_logger << "[WARNING] AF_XDP на " << ifname << ":" << queue << " недоступен, "
+            "прием через сокет: " << err.what() << std::endl;
+        return -1;
+    }
+    m_logger << "[INFO] Прием через AF_XDP на " << ifname << ":" << queue 
+        << (native ? " (драйвер)" : " (универсальный режим)") << std::endl;
+    return 0;
+}
+
+/** \brief Интерфейс адреса сервера
+ * 
+ * \param[in] addr    Адрес сервера.
+ * 
+ * \return Имя интерфейса с адресом \p addr . Для INADDR_ANY - имя 
+ * единственного поднятого интерфейса с адресом IPv4, кроме loopback. 
+ * Пустая строка, если интерфейс не найден или их несколько.
+ */ 
+static std::string address_interface(in_addr addr)
+{
+    ifaddrs *list = nullptr;
+    if (getifaddrs(&list) != 0)
+        return "";
+    std::string found;
+    bool ambiguous = false;
+    for (ifaddrs *item = list; item != nullptr; item = item->ifa_next)
+    {
+        if (item->ifa_addr == nullptr || item->ifa_addr->sa_family != AF_INET ||
+            (item->ifa_flags & IFF_UP) == 0)
+            continue;
+        in_addr local = reinterpret_cast<const sockaddr_in *>(item->ifa_addr)->sin_addr;
+        if (addr.s_addr != htonl(INADDR_ANY))
+        {
+            if (local.s_addr == addr.s_addr)
+            {
+                found = item->ifa_name;
+                break;
+            }
+        } else if ((item->ifa_flags & IFF_LOOPBACK) == 0) {
+            ambiguous = ambiguous || (!found.empty() && found != item->ifa_name);
+            found = item->ifa_name;
+        }
+    }
+    freeifaddrs(list);
+    return ambiguous ? "" : found;
+}
+
+/** \brief Закрепить поток приема за узлом очередей приема.
+ * 
+ * Смотрите set_queue_affinity().
+ */ 
+void Server::pin_to_queue()
+{
+    const sockaddr_in *addr = reinterpret_cast<const sockaddr_in *>(m_addrinfo->ai_addr);
+    std::string ifname = m_xdp ? m_xdp_ifname : address_interface(addr->sin_addr);
+    std::vector<int> queue_cpus;
+    if (ifname.empty() || !interface_queue_cpus(ifname, queue_cpus))
+    {
+        m_logger << "[WARNING] процессоры очередей приема " 
+            << (ifname.empty() ? "интерфейса сервера" : ifname) << " неизвестны, "
+            "поток приема не закреплен" << std::endl;
+        return;
+    }
+    // узел, если все прерывания обрабатываются на одном узле, иначе сами процессоры
+    int node = cpu_node(queue_cpus.front());
+    for (int cpu: queue_cpus)
+        if (cpu_node(cpu) != node)
+            node = -1;
+    std::vector<int> cpus;
+    if (node < 0 || !parse_cpu_list("node:" + std::to_string(node), cpus) || 
+        !cpus_allowed(cpus))
+        cpus = queue_cpus;
+    if (!cpus_allowed(cpus) || pin_current_thread(cpus, prewarmed_slots) != 0)
+    {
+        m_logger << "[ERROR] не удалось закрепить поток приема за процессорами "
+            "очередей " << ifname << ": " << strerror(errno) << std::endl;
+        return;
+    }
+    m_logger << "[INFO] Поток приема закреплен за " 
+        << (node < 0 ? std::string("процессорами") : "узлом " + std::to_string(node))
+        << " очередей приема " << ifname << " (" << cpus.size() 
+        << " процессоров)" << std::endl;
+}
+
+/** \brief Задать политику размещения файлов.
+ * 
+ * Функция задает, в какую из директорий хранения попадает новый файл: по 
+ * хешу имени (PLACEMENT_HASH), по очереди (PLACEMENT_ROUND_ROBIN) или в
+ * директорию с наименьшим числом файлов в записи и ожидающих fsync 
+ * (PLACEMENT_LEAST_BUSY). Файл, копия которого уже есть в одной из 
+ * директорий, записывается в нее.
+ * 
+ * \param[in] policy    Политика размещения.
+ */ 
+void Server::set_placement(placement_policies policy)
+{
+    m_storage.set_policy(policy);
+}
+
+/** \brief Задать получателей файлов.
+ * 
+ * Функция задает функцию \p factory , которая создает получателя для 
+ * каждого нового файла: данные файла передаются ему по мере сборки вместо 
+ * записи в директорию хранения. Пустая функция возвращает запись на диск.
+ * 
+ * \param[in] factory    Функция, создающая получателя файла.
+ */ 
+void Server::set_sink_factory(const SinkFactory& factory)
+{
+    m_sink_factory = factory;
+}
+
+/** \brief Задать буфер записи.
+ * 
+ * Функция задает размер блока, в котором сборщик файла собирает данные 
+ * идущих подряд пакетов, чтобы писать файл одним вызовом write на блок, а
+ * не на каждый пакет, и время, через которое неполный блок записывается, 
+ * если пакеты приходят медленно.
+ * 
+ * \param[in] chunk_size        Размер блока в байтах.
+ * \param[in] flush_interval    Время ожидания данных в блоке.
+ */ 
+void Server::set_write_buffer(size_t chunk_size, milliseconds flush_interval)
+{
+    m_chunk_size = chunk_size;
+    m_flush_interval = flush_interval;
 }
 
 /** \brief Извлечь информацию об адресе.
@@ -158,155 +559,281 @@ int extract_address_info(const sockaddr_in& address, std::string &ip, int &port)
     return 0;
 }
 
-/** \brief Создать ключ из имеющихся парамтров.
- * 
- * Функция создает строковый ключ, используя IP и порт клиента, идентификатор
- * потока пакетов. Ключ получается относительно уникальным.
+/** \brief Проверить сессии
  * 
- * \note
- * Ключ имеет вид: <clint_ip>-<client_port>-<marker>.
- * 
- * \param[in] client_ip    Адрес клиента
- * \param[in] client_port  Порт клиента.
- * \param[in] marker       Идентификатор потока пакета.
- * 
- * \return Возвращает копию строки, содержащий созданный ключ.
+ * Функция ставит в очередь каждой сессии проверку ее состояния, если 
+ * предыдущая проверка уже выполнена, и удаляет завершенные сессии, у 
+ * которых не осталось задач.
  */ 
-std::string make_key(std::string& client_ip, int client_port, uint32_t marker)
+void Server::check_sessions()
 {
-    std::ostringstream  ss;
-    ss << client_ip << "-" << client_port << "-" << static_cast<unsigned long>(marker);
-    return ss.str();
+    for (auto iter = m_sessions.begin(); iter != m_sessions.end();)
+    {
+        Session *session = iter->second.get();
+        if (session->closing)
+        {
+            if (session->strand->idle())
+            {
+                m_stats += session->stats;
+                iter = m_sessions.erase(iter);
+                continue;
+            }
+        } else if (!session->checking) {
+            session->checking = true;
+            std::string key = iter->first;
+            m_pool->post(session->strand, [this, session, key] {
+                check_session(*session, key);
+            });
+        }
+        ++iter;
+    }
 }
 
-/** \brief Разобрать ключ.
+/** \brief Проверка состояния сессии
  * 
- * Функция разбирает ключ, созданный на онсове параметров сетевого адреса, 
- * порта и идентификатора потока и загружает его в парамтры \p ip , \p port ,
- * \p marker . Эти параметры использовались при создании ключа в make_key. 
+ * Функция выполняется задачей сессии. Она записывает в файл данные, 
+ * которые ждут в буфере записи сборщика дольше m_flush_interval, и 
+ * передает потоку приема событие SESSION_STATE с состоянием сборки и 
+ * счетчиками сессии с прошлой проверки. Сборка завершена, если файл собран,
+ * его не удалось сохранить на диск или в сборщик долгое время не приходил 
+ * пакет.
  * 
- * \note
- * Ключ имеет вид: <clint_ip>-<client_port>-<marker>.
- * 
- * \param[in] key       Строка ключ.
- * \param[in] ip        строка адрес клиента.
- * \param[in] port      Порт клиента.
- * \param[in] marker    Идентификатор потока пакетов.
+ * \param[in] session    Сессия.
+ * \param[in] key        Символьный ключ сессии.
+ */ 
+void Server::check_session(Session& session, const std::string& key)
+{
+    FileBuilder *fb = session.builder.get();
+    if (fb->flush_by_timeout(steady_clock::now()) != 0)
+    {
+        SessionEvent event;
+        event.key = key;
+        event.type = SESSION_WRITE_ERROR;
+        event.error = errno;
+        post_event(std::move(event));
+    }
+    SessionEvent event;
+    event.key = key;
+    event.type = SESSION_STATE;
+    if (fb->file_is_ready())
+        event.state = STATE_READY;
+    else if (fb->sync_failed())
+        event.state = STATE_SYNC_FAILED;
+    else if (session.signing == 0 && !fb->sync_pending() &&
+             system_clock::now() - std::max(fb->get_last_writing_package_time(), 
+                                            session.signed_at) > max_package_waiting_time)
+        event.state = STATE_TIMEOUT;
+    if (event.state != STATE_RECEIVING)
+    {
+        if (fb->file_name_is_ready())
+            event.file_name = fb->get_file_name();
+        event.file_size = fb->get_file_size();
+    }
+    event.stats = session.stats;
+    session.stats = ServerStats();
+    session.checking = false;
+    post_event(std::move(event));
+}
+
+/** \brief Передать событие потоку приема
  * 
- * \return Возвращает копию строки, содержащий созданный ключ.
+ * Функция вызывается из задач сессий. События обрабатывает 
+ * process_events() в потоке приема, который один пишет в лог и ведет 
+ * фильтр закрытых сессий.
  */ 
-void unmake_key(const std::string& key, std::string& ip, int& port, uint32_t& marker) 
+void Server::post_event(SessionEvent&& event)
 {
-    auto first_pos = key.find_first_of("-");
-    if (first_pos == std::string::npos)
-        return;
-    auto last_pos = key.find_last_of("-");
-    if (last_pos == std::string::npos)
-        return;
-    if (first_pos == last_pos)
-        return;
-    ip = key.substr(0, first_pos);
-    port = std::stoi(key.substr(first_pos + 1, last_pos - first_pos + 1));
-    marker = static_cast<uint32_t>(std::stoul(key.substr(last_pos + 1)));
+    std::lock_guard<std::mutex> lock(m_events_mutex);
+    m_events.push_back(std::move(event));
 }
 
-/** \brief Удалить сборщик файла по таймауту.
+/** \brief Обработка событий сессий
  * 
- * Функция удаляет сборщик файла в который уже долгое время не приходил пакет.
+ * Функция записывает в лог ошибки, о которых сообщили задачи сессий, 
+ * добавляет в фильтр закрытых сессий сессии с ошибками и закрывает 
+ * завершенные сессии.
  */ 
-void Server::clear_file_builders_store_by_timeout()
+void Server::process_events()
 {
-    auto now = std::chrono::system_clock::now();
-    for (auto iter = m_fb_store.begin(); iter != m_fb_store.end();) {
-        FileBuilder *fb = iter->second.get();
-        std::string key = iter->first;
-        if (now - fb->get_last_writing_package_time() > max_package_waiting_time ||
-            fb->file_is_ready())
+    std::vector<SessionEvent> events;
+    {
+        std::lock_guard<std::mutex> lock(m_events_mutex);
+        if (m_events.empty())
+            return;
+        events.swap(m_events);
+    }
+    for (const SessionEvent& event: events)
+    {
+        int port;
+        uint32_t marker;
+        std::string ip;
+        unmake_key(event.key, ip, port, marker);
+        switch (event.type)
         {
-            int port;
-            uint32_t marker;
-            std::string ip;
-            unmake_key(key, ip, port, marker);
-            std::string file_name;
-            if (fb->file_name_is_ready())
-                file_name = fb->get_file_name();
-            if (fb->file_is_ready())
-            {
-                m_logger << "[INFO] Получен файл \""
-                    << file_name << "\" из ["  << ip << ":" << port << "]" 
-                    << std::endl;
-            } else 
+        case SESSION_RESULT:
+        {
+            auto iter = m_sessions.find(event.key);
+            if (iter != m_sessions.end())
+                insert_tombstone(iter->second->id);
+            log_result(event.result, event.error, ip, port);
+            break;
+        }
+        case SESSION_BAD_PACKAGE:
+            m_logger << "[WARNING] incoming bad package from [" 
+                << ip << ":" << port << "]" << std::endl;
+            break;
+        case SESSION_WRITE_ERROR:
+            m_logger << "[ERROR] ошибка записи файла [" << event.error << "]:"
+                << strerror(event.error) << std::endl;
+            break;
+        case SESSION_STATE:
+            m_stats += event.stats;
+            if (event.state != STATE_RECEIVING)
+                close_session(event);
+            break;
+        case SESSION_SIGNED:
+        {
+            auto signing = m_signing.find(ip);
+            if (signing != m_signing.end() && --signing->second == 0)
+                m_signing.erase(signing);
+            if (event.result == 0)
+                ++m_stats.signatures_sent;
+            else
+                log_result(event.result, event.error, ip, port);
+            auto iter = m_sessions.find(event.key);
+            if (iter != m_sessions.end())
             {
-                m_logger << "[INFO] удален файл \""
-                    << ((file_name != "") ? file_name : "Unknown") 
-                    << "\" по таймауту " <<" от ["  << ip << ":" 
-                    << port << "]" << std::endl;
+                Session *session = iter->second.get();
+                session->signature_pending = false;
+                m_pool->post(session->strand, [session] {
+                    --session->signing;
+                    session->signed_at = system_clock::now();
+                });
             }
-            m_keys_black_list[key] = now;
-            iter = m_fb_store.erase(iter);
-            continue;
-        } else {
-            iter++;
-        }   
-    }        
+            break;
+        }
+        }
+    }
 }
 
-/** \brief Удалить ключ из черно листа по таймауту
+/** \brief Запомнить закрытую сессию
+ * 
+ * Функция добавляет сессию \p id в фильтр закрытых сессий и пишет в лог,
+ * если фильтр заполнился и сменил поколения досрочно: закрытые сессии 
+ * тогда хранятся меньше tombstone_lifetime, и их опоздавшие пакеты могут 
+ * открыть новую сессию.
  * 
- * Функция удаляет ключ ключ из черного листа по таймауту, время таймаута 
- * определено в переменной key_black_list_timeout.
+ * \param[in] id    Идентификатор сессии.
  */ 
-void Server::clear_keys_black_list_by_timeout()
+void Server::insert_tombstone(uint64_t id)
 {
-    auto now = std::chrono::system_clock::now();
-    for (auto iter = m_keys_black_list.begin(); iter != m_keys_black_list.end();) {
-        if (now - iter->second > key_black_list_timeout)
-            iter = m_keys_black_list.erase(iter);
-        else {
-            iter++;
-        }
-    }
+    if (!m_tombstones.insert(id))
+        return;
+    m_logger << "[WARNING] фильтр закрытых сессий заполнен, поколение сменено "
+        "досрочно (" << m_tombstones.get_stats().early_rotations << " раз): "
+        "сессии закрываются быстрее, чем рассчитан фильтр" << std::endl;
 }
 
-/** \brief Проверка на разрешеный ключ
+/** \brief Закрыть сессию
  * 
- * Функция проверяет, находится ли ключ в черном списке. В случае, если ключ
- * помещен в этот список, то время срок его нахождения в этом списке 
- * обновляется и составляет key_black_list_timeout.
+ * Функция записывает в лог, чем завершилась сборка файла, и добавляет 
+ * сессию в фильтр закрытых сессий, чтобы отбрасывать ее опоздавшие пакеты.
+ * Сессия удаляется, когда у нее не останется задач.
  * 
- * \param[in] key    Символьный ключ.
+ * \param[in] event    Событие SESSION_STATE с состоянием сборки.
+ */ 
+void Server::close_session(const SessionEvent& event)
+{
+    auto iter = m_sessions.find(event.key);
+    if (iter == m_sessions.end() || iter->second->closing)
+        return;
+    int port;
+    uint32_t marker;
+    std::string ip;
+    unmake_key(event.key, ip, port, marker);
+    if (event.state == STATE_READY)
+    {
+        ++m_stats.files_received;
+        m_logger << "[INFO] Получен файл \""
+            << event.file_name << "\" (" << event.file_size << " байт) из ["  
+            << ip << ":" << port << "]" << std::endl;
+    } else if (event.state == STATE_SYNC_FAILED) {
+        ++m_stats.files_dropped;
+        m_logger << "[ERROR] Не удалось сохранить на диск файл \""
+            << event.file_name << "\" из [" << ip << ":" << port << "]" 
+            << std::endl;
+    } else 
+    {
+        ++m_stats.files_dropped;
+        m_logger << "[INFO] удален файл \""
+            << ((event.file_name != "") ? event.file_name : "Unknown") 
+            << "\" по таймауту " <<" от ["  << ip << ":" 
+            << port << "]" << std::endl;
+    }
+    insert_tombstone(iter->second->id);
+    m_meters.erase(event.key);
+    iter->second->closing = true;
+    if (iter->second->strand->idle())
+    {
+        m_stats += iter->second->stats;
+        m_sessions.erase(iter);
+    }
+}
+
+/** \brief Вывести статистику в лог по таймауту
  * 
- * \return true, если ключ не находится в черном списке, false иначе.
+ * Функция раз в stats_log_interval выводит в лог статистику сервера, если 
+ * с прошлого вывода сервер получил хотя бы один пакет.
  */ 
-bool Server::allow_key(const std::string& key)
+void Server::log_stats_by_timeout()
 {
-    auto now = std::chrono::system_clock::now();
-    auto iter_bl = m_keys_black_list.find(key);
-    if (iter_bl != m_keys_black_list.end()) 
+    auto now = steady_clock::now();
+    if (now - m_stats_time < stats_log_interval)
+        return;
+    m_stats_time = now;
+    if (m_durability == DURABILITY_GROUP)
+        m_stats.sync = m_storage.get_sync_stats();
+    if (m_stats.packages == m_logged_stats.packages &&
+        m_stats.sync.files == m_logged_stats.sync.files)
+        return;
+    m_stats.buffered_bytes = m_budget.usage();
+    m_stats.buffered_peak = m_budget.peak();
+    m_logged_stats = m_stats;
+    m_logger << "[STATS] " << m_stats << std::endl;
+    if (m_storage.size() > 1)
+        for (size_t i = 0; i < m_storage.size(); ++i)
+            m_logger << "[STATS] " << m_storage.describe(i) << std::endl;
+    if (m_pool->size() > 0)
+        m_logger << "[STATS] pool: threads=" << m_pool->size() << " " 
+            << m_pool->get_stats() << std::endl;
+    if (m_xdp)
+        m_logger << "[STATS] xdp: " << m_xdp->get_stats() << std::endl;
+    m_logger << "[STATS] tombstones: " << m_tombstones.get_stats() << std::endl;
+    m_logger << "[STATS] clients: active=" << m_clients.size() << std::endl;
+    for (const auto& client: m_clients.busiest(logged_clients))
     {
-        if (iter_bl->second - now <= key_black_list_timeout)
-        {
-            iter_bl->second = now;
-            return false;
-        }
-        m_keys_black_list.erase(iter_bl);        
+        char ip[INET_ADDRSTRLEN];
+        in_addr address;
+        address.s_addr = client.first;
+        inet_ntop(AF_INET, &address, ip, sizeof(ip));
+        m_logger << "[STATS] client " << ip << ": " << client.second << std::endl;
     }
-    return true;
 }
 
-/** \brief Нахождение или создание сборщика файла
+/** \brief Нахождение или создание сессии
  * 
- * Функция возращает указатель на файловый сборщик. В случае, если сборщик
- * не найден то будет создан сборщик по ключу \p key. 
+ * Функция возращает указатель на сессию приема файла. В случае, если сессия
+ * не найдена, то будет создана сессия со сборщиком файла по ключу \p key. 
  * 
  * \param[in] key    Символьный ключ.
+ * \param[in] id     Идентификатор сессии, смотрите session_id().
  * 
- * \return           Указатель на объект файловорго сборщика. 
+ * \return           Указатель на сессию. 
  */ 
-FileBuilder* Server::find_or_create_file_builder(const std::string& key)
+Session* Server::find_or_create_session(const std::string& key, uint64_t id)
 {
-    auto iter_store = m_fb_store.find(key);
-    if (iter_store == m_fb_store.end())
+    auto iter_store = m_sessions.find(key);
+    if (iter_store == m_sessions.end())
     {
         int port;
         uint32_t marker;
@@ -314,190 +841,497 @@ FileBuilder* Server::find_or_create_file_builder(const std::string& key)
         unmake_key(key, ip, port, marker);
         m_logger << "[INFO] Пришел новый файл от [" 
             << ip << ":" << port << "]" << std::endl; 
-        iter_store = m_fb_store.emplace(
-            key,
-            std::make_unique<FileBuilder>(m_dir, marker)
-        ).first;
+        iter_store = m_sessions.emplace(key, std::make_unique<Session>()).first;
+        Session *session = iter_store->second.get();
+        session->builder = std::make_unique<FileBuilder>(m_storage.root(0).dir, marker, 
+                                                         &session->stats, &m_budget);
+        session->builder->set_durability(m_durability, m_storage.root(0).batcher.get());
+        session->builder->set_storage(&m_storage);
+        if (m_sink_factory)
+            session->builder->set_sink(m_sink_factory());
+        session->builder->set_write_buffer(m_chunk_size, m_flush_interval);
+        session->strand = m_pool->make_strand();
+        session->id = id;
+        TRACEPOINT(SESSION, marker, m_sessions.size(), 1);
+        return session;
     }
+    TRACEPOINT(SESSION, iter_store->second->builder->get_marker(), m_sessions.size(), 0);
     return iter_store->second.get();
 }
 
-/** \brief Ограниченный по времени recvfrom
+/** \brief Ожидание пакетов
  * 
- * Функция ограничевает по времени блокировку функцией recvfrom. В работе 
- * функции используются вызовы recvfrom и select, поэтому в случае
- * возникновения ошибки в ходе выполнения функция вернет -1, а соответствующая
- * ошибка будет установлена в errno. 
+ * Функция ждет, пока в сокете появятся данные, не дольше 
+ * \p max_waiting_time_ms миллисекунд.
  * 
- * \param[in] buf                  Массив байтов, куда будет записана информация
- * \param[in] buf_len              Размер массива байтов.
- * \param[in] addr                 Адрес, с которого пришли данные.
- * \param[in] addr_len             Длинна адреса.
- * \param[in] max_waiting_time_ms  Максимальное время ожидания работы recvfrom
+ * \param[in] max_waiting_time_ms  Максимальное время ожидания.
  * 
- * \return -1, в случае ошибки или количество принятых байтов. 
+ * \return 1, если есть данные, 0, если время истекло, -1 в случае ошибки, 
+ * код ошибки в errno.
  */ 
-int Server::timed_recvfrom(char *buf, int buf_len, sockaddr_in &addr, socklen_t &addr_len, int max_waiting_time_ms)
+int Server::wait_readable(int max_waiting_time_ms)
 {
     fd_set s;
     FD_ZERO(&s);
     FD_SET(m_socket, &s);
+    int max_fd = m_socket;
+    if (m_xdp)
+    {
+        FD_SET(m_xdp->get_fd(), &s);
+        max_fd = std::max(max_fd, m_xdp->get_fd());
+    }
     struct timeval timeout;
     timeout.tv_sec = max_waiting_time_ms / 1000;
     timeout.tv_usec = (max_waiting_time_ms % 1000) * 1000;
-    int result = select(m_socket + 1, &s, 0, 0, &timeout);
-    if (result < 0)
-        return -1;
-    else if (result == 0)
-    {
-        errno = EAGAIN;
-        return -1;
-    }
-    return recvfrom(m_socket, buf, buf_len, 0, (sockaddr*)&addr, &addr_len);
+    return select(max_fd + 1, &s, 0, 0, &timeout);
 }
 
 /** \brief Обработка пакета
  * 
- * Функция обрабатывает пакет \p package , поставляемый вместе с ключом \p key .
- * в случае, если ключ разрешен, то пакет доставляется файловому сборщику для 
- * последующей обработки им. Если не разрешен, то пакет удаляется. Вслучае 
- * возникновения ошибки, ключ будет добавлен в черный список и все последующие
- * пакеты с этим ключем будут проигнорированы.
+ * Функция выполняется задачей сессии \p session . Она проверяет по 
+ * заголовку \p header , не принял ли уже сборщик пакет с этим номером, 
+ * затем создает пакет из датаграммы \p buf длиной \p bytes , проверяет его
+ * и доставляет сборщику файла. Дубликаты отбрасываются до создания пакета,
+ * поэтому не копируются. О некорректном пакете и об ошибке сборщика 
+ * функция сообщает потоку приема событием. После ошибки сборщика сессия 
+ * попадает в фильтр закрытых сессий.
  * 
  * \note
  * Как составляется ключ смотрите в функции make_key.
  * 
- * \param[in] package   Пакет данных файла.
+ * \param[in] session   Сессия.
  * \param[in] key       Строковый ключ.
- * 
- * \return 0, в случае успешного выполнения,В противном случае возвращается 
- * ошибка, код которых определенн функцией FileBuilder::process.
+ * \param[in] buf       Датаграмма.
+ * \param[in] bytes     Размер датаграммы.
+ * \param[in] header    Заголовок датаграммы.
  */ 
-int Server::process_package(Package& package, const std::string& key)
+void Server::process_package(Session& session, const std::string& key, const char *buf, 
+                             int bytes, const PackageHeader& header)
 {
-    if (!allow_key(key))
-        return 0;
-    FileBuilder *fb = find_or_create_file_builder(key);
+    FileBuilder *fb = session.builder.get();
+    if (fb->is_duplicate(header.number))
+    {
+        ++session.stats.duplicates;
+        TRACEPOINT(DUPLICATE, header.marker, header.number, 0);
+        return;
+    }
+    Package package(buf, bytes);
+
+#ifdef DEBUG            
+    print_package_as_row(package);
+#endif
+    bool valid = package.valid();
+    TRACEPOINT(VALIDATE, header.marker, header.number, valid);
+    SessionEvent event;
+    event.key = key;
+    if (!valid)
+    {
+        ++session.stats.bad_packages;
+        event.type = SESSION_BAD_PACKAGE;
+        post_event(std::move(event));
+        return;
+    }
     fb->insert_package(std::move(package));
     int result = fb->process();
-    if (result != 0 && result != ErrExpectPackage) {
-        m_keys_black_list.emplace(key, system_clock::now());
-    } 
-    return result;
+    if (result != 0 && result != ErrExpectPackage)
+    {
+        event.type = SESSION_RESULT;
+        event.result = result;
+        event.error = errno;
+        post_event(std::move(event));
+    }
 }
 
-/** \brief Работа сервера
+/** \brief Заполнение буфера приема
  * 
- * Функция запускает бесконечный процесс ожидания пакетов от клиентов с 
- * последующей их обработкой. После каждого цикла происходит 
- * очистка хранилища с файловыми сборщиками и очиска черного листа с ключами
- * по таймауту. В случае возникновения ошибок при вызове функций в теле функции
- * происходит их логиирование в Logger, переданный при инициализации 
- * конструктора сервера.
+ * Функция возвращает, насколько заполнен буфер приема сокета \p socket 
+ * датаграммами, которые сервер еще не прочитал.
  * 
- * \warning
- * Функция работает медленно, поэтому если несколько клиентов будут передавать 
- * свои файлы, то сервер не будет успеваь считать все пакеты, что приведет к
- * ситуации, когда сервер не сможет принять ни один файл клиентов, так как 
- * некоторые пакеты будут утеряны.
+ * \return Заполнение в долях 1/1000 или 0, если его не удалось узнать.
  */ 
-void Server::work() 
+static uint32_t receive_queue_permille(int socket)
 {
-    char buf[MAX_PACKAGE_SIZE];
-    sockaddr_in addr;
-    socklen_t   addr_len = sizeof(sockaddr_in);
-
-    std::string client_ip;
-    int client_port = 0;
-
-#ifdef DEBUG
-    print_headers_as_row();
-#endif
-
-    m_logger << "[INFO] Ожидание приема фалов." << std::endl;
-    while(1) {
-        memset(&addr, 0, sizeof(sockaddr_in));
-        int bytes = timed_recvfrom(buf, MAX_PACKAGE_SIZE, addr, addr_len, 2000);
-        if (bytes < 0) {
-            if (errno != EAGAIN)
-                m_logger << "[ERROR] " << strerror(errno) << std::endl;
-        } else {
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t len = sizeof(meminfo);
+    if (getsockopt(socket, SOL_SOCKET, SO_MEMINFO, meminfo, &len) != 0 ||
+        meminfo[SK_MEMINFO_RCVBUF] == 0)
+        return 0;
+    uint64_t permille = 1000ULL * meminfo[SK_MEMINFO_RMEM_ALLOC] / meminfo[SK_MEMINFO_RCVBUF];
+    return static_cast<uint32_t>(std::min<uint64_t>(permille, 1000));
+}
 
-            extract_address_info(addr, client_ip, client_port);
-            Package package(buf, bytes);
+/** \brief Заполнение очереди приема для клиента
+ * 
+ * \param[in] addr    Адрес клиента.
+ * 
+ * \return Наибольшее из заполнения буфера приема сокета, кольца приема 
+ * AF_XDP и превышения ограничения скорости клиента \p addr в долях 1/1000.
+ */ 
+uint32_t Server::queue_permille(const sockaddr_in& addr) const
+{
+    uint32_t permille = receive_queue_permille(m_socket);
+    if (m_xdp)
+        permille = std::max(permille, m_xdp->queue_permille());
+    return std::max(permille, m_clients.pressure_permille(addr.sin_addr.s_addr));
+}
 
-#ifdef DEBUG            
-            print_package_as_row(package);
-#endif
-            if (!package.valid())
-            {
-                m_logger << "[WARNING] incoming bad package from [" 
-                    << client_ip << ":" << client_port << "]" << std::endl;
-                continue;
-            }
-            std::string key = make_key(client_ip, client_port, package.get_marker());
-            int result = process_package(package, key);
-            if (result != 0 && result != ErrExpectPackage)
-            {
-                
-                if (result == ErrErrno) {
-                    m_logger << "[ERROR] ошибка ["<< errno << "]:"
-                        << strerror(errno) << ". client: [" << client_ip 
-                        << ":" << client_port << "]" << std::endl;     
-                } else if (result == ErrInvalidFileName) {
-                    m_logger << "[ERROR] Пришло невалидное имя файла из: [" 
-                        << client_ip << ":" << client_port << "]" << std::endl;                     
-                } else if (result == ErrCouldNotCreateFile) {
-                    m_logger << "[ERROR] Не смог созать файл [" << result << "]: " 
-                        << strerror(errno) << std::endl;
-                } else {
-                    m_logger << "[ERROR] Unknown error" << std::endl;
-                }
-            }
-        }
-        clear_file_builders_store_by_timeout();
-        clear_keys_black_list_by_timeout();
+/** \brief Учет пакета для отчетов о приеме
+ * 
+ * Функция учитывает пакет с номером \p number размером \p bytes в счетчике
+ * потока \p key и раз в интервал отправляет клиенту по адресу \p addr 
+ * отчет CONTROL_FEEDBACK о скорости приема, потерях и заполнении буфера 
+ * приема, по которому клиент выбирает скорость отправки.
+ * 
+ * \param[in] key       Строковый ключ.
+ * \param[in] marker    Идентификатор потока пакетов клиента.
+ * \param[in] number    Номер пакета.
+ * \param[in] bytes     Размер датаграммы.
+ * \param[in] addr      Адрес клиента.
+ */ 
+void Server::update_feedback(const std::string& key, uint32_t marker, uint32_t number,
+                             int bytes, const sockaddr_in& addr)
+{
+    auto iter = m_meters.find(key);
+    if (iter == m_meters.end())
+    {
+        if (m_sessions.count(key) == 0)
+            return;
+        iter = m_meters.emplace(key, ReceiveMeter()).first;
     }
+    ReceiveMeter& meter = iter->second;
+    meter.on_package(number, bytes);
+    if (meter.received() % queue_sample_interval == 0)
+        meter.on_queue(queue_permille(addr));
+    auto now = steady_clock::now();
+    if (!meter.report_due(now))
+        return;
+    meter.on_queue(queue_permille(addr));
+    char buf[FEEDBACK_SIZE];
+    FeedbackReport report = meter.make_report(now);
+    Package package;
+    package.set_number(report.sequence);
+    package.set_marker(marker);
+    package.set_option(FLAG_CONTROL);
+    package.set_data(buf, write_feedback(buf, report));
+    if (sendto(m_socket, package.as_bytes(), package.package_size(), 0,
+               (const sockaddr *)&addr, sizeof(addr)) >= 0)
+        ++m_stats.feedback_sent;
 }
 
-void print_usage(char *program_name)
+/** \brief Отправка сигнатур файла
+ * 
+ * Функция считает сигнатуры блоков файла \p filename из директории сервера и
+ * отправляет их клиенту по адресу \p addr управляющими сообщениями 
+ * CONTROL_SIGNATURES. Последнее сообщение помечается флагом 
+ * FLAG_LAST_PACKAGE. Если файла нет, то отправляется одно сообщение без 
+ * сигнатур, и клиент передает файл целиком. Подписываются не больше 
+ * max_signed_blocks первых блоков, остальное клиент передает как новые 
+ * данные.
+ * 
+ * \warning
+ * Функция читает файл и делает паузы между пачками сообщений, поэтому 
+ * вызывается в потоке сигнатур, а не в потоке приема пакетов.
+ * 
+ * \param[in] marker      Идентификатор потока пакетов клиента.
+ * \param[in] filename    Имя файла.
+ * \param[in] addr        Адрес клиента.
+ * 
+ * \return 0, в случае успеха, ErrInvalidFileName, если имя файла 
+ * недопустимо, ErrErrno, если не удалось отправить сигнатуры.
+ */ 
+int Server::send_signatures(uint32_t marker, const std::string& filename, 
+                            const sockaddr_in& addr)
 {
+    if (!valid_file_name(filename))
+        return ErrInvalidFileName;
+    uint32_t block_size = 0;
+    uint64_t file_size = 0;
+    std::vector<BlockSignature> signatures;
+    int root = std::max(0, m_storage.find(filename));
+    if (sign_file(m_storage.root(root).dir + filename, block_size, file_size, signatures,
+                  max_signed_blocks) != 0)
+    {
+        block_size = delta_block_size(0);
+        file_size = 0;
+    }
+    const size_t per_package = (MAX_DATA_SIZE - SIGNATURES_HEADER_SIZE) / 
+                               SIGNATURE_ENTRY_SIZE;
+    char buf[MAX_DATA_SIZE];
+    Package package;
+    package.set_marker(marker);
+    package.set_option(FLAG_CONTROL);
+    uint32_t number = 0;
+    size_t first = 0;
+    do
+    {
+        SignaturesHeader header;
+        header.block_size = block_size;
+        header.file_size = file_size;
+        header.first_block = first;
+        header.count = static_cast<uint16_t>(
+            std::min(per_package, signatures.size() - first));
+        uint32_t len = write_signatures(buf, header, signatures.data() + first);
+        first += header.count;
+        package.set_number(++number);
+        package.set_data(buf, len);
+        if (first == signatures.size())
+            package.set_package_flag(FLAG_LAST_PACKAGE);
+        if (sendto(m_socket, package.as_bytes(), package.package_size(), 0,
+                   (const sockaddr *)&addr, sizeof(addr)) < 0)
+            return ErrErrno;
+        // пауза, чтобы не переполнить буфер приема клиента
+        if (number % signatures_burst == 0)
+            usleep(1000);
+    } while (first < signatures.size());
+    return 0;
+}
 
-    std::cout << "Используйте: " << program_name;
-    std::cout << " <IPv4 адрес сервера> <Порт> <Директория для хранения файлов>" 
-        << std::endl;
+/** \brief Обработка управляющего сообщения
+ * 
+ * Функция обрабатывает пакет с опцией FLAG_CONTROL, пришедший от клиента с 
+ * адресом \p addr . Управляющие сообщения не относятся к передаче файла и
+ * не попадают в файловые сборщики.
+ * 
+ * На запрос сигнатур сервер отвечает, только если с того же адреса и порта 
+ * уже идет передача с тем же идентификатором потока: клиент сначала 
+ * отправляет имя файла с опцией FLAG_DELTA, затем запрашивает сигнатуры. 
+ * Сессия получает не больше max_signature_requests ответов и по одному за
+ * раз, а у одного адреса в работе не больше max_signing_per_client 
+ * ответов, остальные запросы отбрасываются. Сигнатуры считает и отправляет поток сигнатур 
+ * m_signer, а пока он работает, сессия не закрывается по таймауту.
+ * 
+ * \param[in] package        Пакет с управляющим сообщением.
+ * \param[in] addr           Адрес клиента.
+ * \param[in] client_ip      Адрес клиента в текстовом виде.
+ * \param[in] client_port    Порт клиента.
+ */ 
+void Server::process_control(const Package& package, const sockaddr_in& addr,
+                             std::string& client_ip, int client_port)
+{
+    if (package.get_data_size() < 1)
+        return;
+    const char *data = package.get_data();
+    if (data[0] == CONTROL_SIGNATURE_REQUEST)
+    {
+        uint32_t marker = package.get_marker();
+        std::string key = make_key(client_ip, client_port, marker);
+        auto iter = m_sessions.find(key);
+        auto signing = m_signing.find(client_ip);
+        if (iter == m_sessions.end() || iter->second->closing ||
+            iter->second->signature_pending ||
+            iter->second->signature_requests >= max_signature_requests ||
+            (signing != m_signing.end() && signing->second >= max_signing_per_client))
+        {
+            ++m_stats.signatures_refused;
+            return;
+        }
+        std::string filename(data + 1, package.get_data_size() - 1);
+        m_logger << "[INFO] Запрошены сигнатуры файла \"" << filename 
+            << "\" из [" << client_ip << ":" << client_port << "]" << std::endl;
+        Session *session = iter->second.get();
+        ++session->signature_requests;
+        session->signature_pending = true;
+        ++m_signing[client_ip];
+        m_pool->post(session->strand, [session] { ++session->signing; });
+        m_signer->post(m_signer->make_strand(), [this, key, marker, filename, addr] {
+            SessionEvent event;
+            event.key = key;
+            event.type = SESSION_SIGNED;
+            event.result = send_signatures(marker, filename, addr);
+            event.error = errno;
+            post_event(std::move(event));
+        });
+    }
 }
 
-int main(int argc, char *argv[])
+/** \brief Обработка датаграммы
+ * 
+ * Функция разбирает датаграмму \p buf длиной \p bytes , пришедшую с адреса
+ * \p addr , и передает пакет обработчику управляющих сообщений или в 
+ * очередь задач сессии. Если пул потоков пуст, пакет обрабатывается сразу, 
+ * иначе датаграмма копируется, и поток приема возвращается к сокету, пока 
+ * проверку, распаковку и запись выполняет поток пула.
+ */ 
+void Server::process_datagram(const char *buf, int bytes, const sockaddr_in& addr)
 {
-    if (argc != 4)
+    std::string client_ip;
+    int client_port = 0;
+    extract_address_info(addr, client_ip, client_port);
+    ++m_stats.packages;
+    PackageHeader header;
+    if (!peek_header(buf, bytes, header))
     {
-        std::cerr << "Ошибка: неверное количество аргументов." << std::endl;
-        print_usage(argv[0]);
-        exit(1);
+        ++m_stats.bad_packages;
+        m_logger << "[WARNING] incoming bad package from [" 
+            << client_ip << ":" << client_port << "]" << std::endl;
+        return;
     }
-    int port = 0;
-    try 
+    TRACEPOINT(RECEIVE, header.marker, bytes, header.number);
+    if (header.flag & FLAG_CONTROL)
     {
-        port = std::stoi(std::string(argv[2]));
+        Package package(buf, bytes);
+        if (!package.valid())
+        {
+            ++m_stats.bad_packages;
+            m_logger << "[WARNING] incoming bad package from [" 
+                << client_ip << ":" << client_port << "]" << std::endl;
+            return;
+        }
+        if (!m_clients.admit_control(addr.sin_addr.s_addr, steady_clock::now()))
+        {
+            ++m_stats.limited;
+            return;
+        }
+        process_control(package, addr, client_ip, client_port);
+        return;
     }
-    catch (std::invalid_argument &e)
+    if (!m_clients.admit(addr.sin_addr.s_addr, bytes, steady_clock::now()))
     {
-        std::cerr << "Ошибка: значение порта должено быть целом числом." << std::endl;
-        exit(1);
+        ++m_stats.limited;
+        return;
     }
-    Logger log;
-    try
+    uint64_t id = session_id(addr.sin_addr.s_addr, addr.sin_port, header.marker);
+    if (m_tombstones.reject(id))
+        return;
+    std::string key = make_key(client_ip, client_port, header.marker);
+    Session *session = find_or_create_session(key, id);
+    if (m_pool->size() == 0)
     {
-        Server server(std::string(argv[1]), port, argv[3], log);
-        server.work();
+        process_package(*session, key, buf, bytes, header);
+    } else {
+        std::vector<char> datagram(buf, buf + bytes);
+        m_pool->post(session->strand, [this, session, key, datagram, header] {
+            process_package(*session, key, datagram.data(), datagram.size(), header);
+        }, bytes);
     }
-    catch (const std::runtime_error& err)
+    update_feedback(key, header.marker, header.number, bytes, addr);
+}
+
+/** \brief Запись ошибки сборщика в лог
+ * 
+ * \param[in] result         Код ошибки FileBuilder::process.
+ * \param[in] error          errno после ошибки.
+ * \param[in] client_ip      Адрес клиента в текстовом виде.
+ * \param[in] client_port    Порт клиента.
+ */ 
+void Server::log_result(int result, int error, const std::string& client_ip, int client_port)
+{
+    errno = error;
+    if (result == ErrErrno) {
+        m_logger << "[ERROR] ошибка ["<< errno << "]:"
+            << strerror(errno) << ". client: [" << client_ip 
+            << ":" << client_port << "]" << std::endl;     
+    } else if (result == ErrInvalidFileName) {
+        m_logger << "[ERROR] Пришло невалидное имя файла из: [" 
+            << client_ip << ":" << client_port << "]" << std::endl;                     
+    } else if (result == ErrCouldNotCreateFile) {
+        m_logger << "[ERROR] Не смог созать файл [" << result << "]: " 
+            << strerror(errno) << std::endl;
+    } else if (result == ErrChecksumMismatch) {
+        m_logger << "[ERROR] Файл из [" << client_ip << ":" 
+            << client_port << "] не прошел проверку целостности" 
+            << std::endl;
+    } else if (result == ErrDeltaBase) {
+        m_logger << "[ERROR] Не удалось прочитать старую копию файла "
+            "для дельты из [" << client_ip << ":" << client_port 
+            << "]" << std::endl;
+    } else if (result == ErrSink) {
+        m_logger << "[ERROR] Получатель отказался от файла из [" 
+            << client_ip << ":" << client_port << "]: " 
+            << strerror(errno) << std::endl;
+    } else if (result == ErrBadCompressedData) {
+        m_logger << "[ERROR] Не удалось распаковать данные из [" 
+            << client_ip << ":" << client_port << "]" << std::endl;
+    } else {
+        m_logger << "[ERROR] Unknown error" << std::endl;
+    }
+}
+
+/** \brief Время до следующего вызова poll
+ * 
+ * Функция возвращает, через сколько миллисекунд нужно вызвать poll(), даже 
+ * если пакетов нет: чтобы записать данные из буферов записи, сообщить о 
+ * сохраненных на диск файлах и удалить сборщики по таймауту. Используется
+ * при встраивании сервера в цикл событий приложения.
+ * 
+ * \return Время ожидания в миллисекундах.
+ */ 
+int Server::next_timeout_ms() const
+{
+    // пока файлы ждут fsync, сервер просыпается чаще, чтобы сообщить о них
+    int waiting_ms = 2000;
+    if (m_storage.pending_syncs() > 0)
+        waiting_ms = std::max<int>(1, m_storage.group_interval().count());
+    else if (!m_sessions.empty())
+        waiting_ms = std::max<int>(1, std::min<int>(waiting_ms, m_flush_interval.count()));
+    return waiting_ms;
+}
+
+/** \brief Обработка пришедших пакетов
+ * 
+ * Функция без ожидания забирает до max_poll_datagrams датаграмм из кольца
+ * AF_XDP, если он включен, и столько же из сокета, обрабатывает их, а затем
+ * записывает буферы, удаляет сборщики, сменяет поколения фильтра закрытых
+ * сессий по таймауту и выводит статистику. Приложение, встроившее
+ * сервер в свой цикл событий, вызывает функцию, когда сокет get_socket() 
+ * или get_xdp_socket() готов к чтению или прошло next_timeout_ms() 
+ * миллисекунд.
+ * 
+ * \return Число обработанных датаграмм.
+ */ 
+int Server::poll()
+{
+    char buf[MAX_PACKAGE_SIZE];
+    int processed = 0;
+    if (m_xdp)
+        processed = m_xdp->receive([this](const char *data, int size, const sockaddr_in& from) {
+            process_datagram(data, size, from);
+            process_events();
+        }, max_poll_datagrams);
+    for (int read = 0; read < max_poll_datagrams; ++read)
     {
-        std::cerr << err.what();
-        exit(1);
+        sockaddr_in addr;
+        socklen_t addr_len = sizeof(sockaddr_in);
+        memset(&addr, 0, sizeof(sockaddr_in));
+        int bytes = recvfrom(m_socket, buf, MAX_PACKAGE_SIZE, MSG_DONTWAIT,
+                             (sockaddr*)&addr, &addr_len);
+        if (bytes < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                m_logger << "[ERROR] " << strerror(errno) << std::endl;
+            break;
+        }
+        process_datagram(buf, bytes, addr);
+        process_events();
+        ++processed;
     }
-    return 0;
+    check_sessions();
+    process_events();
+    m_tombstones.rotate(steady_clock::now());
+    m_clients.expire(steady_clock::now());
+    log_stats_by_timeout();
+    return processed;
 }
 
+/** \brief Работа сервера
+ * 
+ * Функция запускает бесконечный процесс ожидания пакетов от клиентов с 
+ * последующей их обработкой функцией poll(). В случае возникновения ошибок
+ * при вызове функций в теле функции происходит их логиирование в Logger, 
+ * переданный при инициализации конструктора сервера.
+ */ 
+void Server::work() 
+{
+#ifdef DEBUG
+    print_headers_as_row();
+#endif
 
+    if (pin_receive_thread() != 0)
+        m_logger << "[ERROR] не удалось закрепить поток приема: " 
+            << strerror(errno) << std::endl;
+    m_logger << "[INFO] Ожидание приема фалов." << std::endl;
+    while(1) {
+        if (wait_readable(next_timeout_ms()) < 0 && errno != EINTR)
+            m_logger << "[ERROR] " << strerror(errno) << std::endl;
+        poll();
+    }
+}
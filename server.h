@@ -12,51 +12,190 @@
 #include <arpa/inet.h>
 
 #include "package.h"
+#include "congestion.h"
 #include "file_builder.h"
 #include "logger.h"
+#include "stats.h"
+#include "memory_budget.h"
+#include "sync_batcher.h"
+#include "storage.h"
+#include "work_pool.h"
+#include "affinity.h"
+#include "xdp_receiver.h"
+#include "tombstone.h"
+#include "client_limiter.h"
 
 //#define DEBUG
 
 using namespace std::chrono;
 
+static const uint64_t default_memory_limit = 256ULL * 1024 * 1024;  // пакетов, ожидающих записи
+static const uint64_t default_session_quota = 32ULL * 1024 * 1024;
+static const milliseconds default_group_interval(10);             // время сбора пачки файлов для fsync
+static const size_t default_chunk_size = 1024 * 1024;             // блок записи принятых данных в файл
+static const milliseconds default_flush_interval(200);            // данные ждут в блоке записи не дольше
+
+// сессия приема одного файла
+struct Session {
+    std::unique_ptr<FileBuilder> builder;
+    std::shared_ptr<Strand> strand;       // задачи сессии в пуле потоков
+    uint64_t id = 0;                      // идентификатор для фильтра закрытых сессий
+    ServerStats stats;                    // меняется только задачами сессии
+    std::atomic<bool> checking{false};    // проверка состояния стоит в очереди
+    bool closing = false;                 // сборка завершена, ждет конца задач
+    uint32_t signature_requests = 0;      // меняется только потоком приема
+    bool signature_pending = false;       // то же, ответ сигнатурами в работе
+    uint32_t signing = 0;                 // ответов сигнатурами в работе, меняется только 
+                                          // задачами сессии, таймаут на это время не действует
+    time_point<system_clock> signed_at;   // конец последнего ответа сигнатурами
+};
+
+// событие, которое задача сессии передает потоку приема
+enum session_events {
+    SESSION_RESULT = 0,    // ошибка обработки пакета
+    SESSION_BAD_PACKAGE,   // пакет не прошел проверку
+    SESSION_WRITE_ERROR,   // ошибка записи буфера по таймауту
+    SESSION_STATE,         // состояние сборки и статистика
+    SESSION_SIGNED         // сигнатуры отправлены, передается из потока сигнатур
+};
+
+enum session_states {
+    STATE_RECEIVING = 0,
+    STATE_READY,           // файл собран
+    STATE_SYNC_FAILED,     // файл не удалось сохранить на диск
+    STATE_TIMEOUT          // пакеты перестали приходить
+};
+
+struct SessionEvent {
+    std::string key;
+    session_events type;
+    int result = 0;                       // код ошибки FileBuilder::process
+    int error = 0;                        // errno
+    session_states state = STATE_RECEIVING;
+    std::string file_name;
+    uint64_t file_size = 0;
+    ServerStats stats;                    // счетчики с прошлого события
+};
+
 class Server
 {
 public:
-    Server(const std::string& addr, int port, const std::string &dir, Logger& logger);
+    Server(const std::string& addr, int port, const std::vector<std::string>& dirs, 
+           Logger& logger);
 
     ~Server();
 
     int get_socket() const;
 
+    int get_xdp_socket() const;
+
     int get_port() const;
 
     std::string get_directory() const;
 
     std::string get_address() const;
 
+    void set_memory_limits(uint64_t limit, uint64_t session_quota);
+
+    void set_durability(durability_modes mode, milliseconds group_interval);
+
+    void set_placement(placement_policies policy);
+
+    void set_sink_factory(const SinkFactory& factory);
+
+    int set_multicast_interface(const std::string& interface);
+
+    void set_write_buffer(size_t chunk_size, milliseconds flush_interval);
+
+    void set_workers(size_t threads);
+
+    void set_client_rate_limit(double bytes_per_second, uint64_t burst);
+
+    int set_affinity(thread_roles role, const std::vector<int>& cpus);
+
+    void set_queue_affinity(bool enabled);
+
+    int pin_receive_thread();
+
+    int set_xdp(const std::string& ifname, uint32_t queue, bool native);
+
+    int next_timeout_ms() const;
+
+    int poll();
+
     void work();
 
 private:
     int m_socket;
-    std::string m_dir;
+    Storage m_storage;
     int m_port;
     std::string m_addr;
     Logger& m_logger;
     addrinfo *m_addrinfo;
-
-    std::map<std::string, time_point<system_clock>> m_keys_black_list;
-    std::map<std::string, std::unique_ptr<FileBuilder>> m_fb_store;
+    bool m_multicast;
+    in_addr m_group_interface;
+    ServerStats m_stats;
+    MemoryBudget m_budget;
+    ServerStats m_logged_stats;
+    time_point<steady_clock> m_stats_time;
+    durability_modes m_durability;
+    SinkFactory m_sink_factory;
+    size_t m_chunk_size;
+    milliseconds m_flush_interval;
+    std::vector<int> m_affinity[THREAD_ROLE_COUNT];
+    bool m_queue_affinity;                // закреплять поток приема по очередям карты
+
+    TombstoneFilter m_tombstones;         // недавно закрытые сессии
+    ClientLimiter m_clients;
+    std::map<std::string, std::unique_ptr<Session>> m_sessions;
+    std::map<std::string, ReceiveMeter> m_meters;
     std::vector<std::unique_ptr<Package>> m_pkg_store;
+    std::mutex m_events_mutex;
+    std::vector<SessionEvent> m_events;
+    std::unique_ptr<XdpReceiver> m_xdp;
+    std::string m_xdp_ifname;
+    std::map<std::string, uint32_t> m_signing;   // ответов сигнатурами в работе по адресу клиента
+    std::unique_ptr<WorkPool> m_signer;          // поток чтения файлов для сигнатур
+    // последним: потоки пула останавливаются раньше, чем удаляются сессии
+    std::unique_ptr<WorkPool> m_pool;
     
-    void clear_file_builders_store_by_timeout();
+    void check_sessions();
+
+    void check_session(Session& session, const std::string& key);
+
+    void post_event(SessionEvent&& event);
+
+    void process_events();
+
+    void close_session(const SessionEvent& event);
+
+    void insert_tombstone(uint64_t id);
+
+    void log_stats_by_timeout();
+
+    Session* find_or_create_session(const std::string& key, uint64_t id);
+
+    int wait_readable(int max_waiting_time_ms);
+
+    uint32_t queue_permille(const sockaddr_in& addr) const;
+
+    int join_group(bool join);
+
+    void pin_to_queue();
+
+    void process_datagram(const char *buf, int bytes, const sockaddr_in& addr);
 
-    void clear_keys_black_list_by_timeout();
+    void process_package(Session& session, const std::string& key, const char *buf, 
+                         int bytes, const PackageHeader& header);
 
-    bool allow_key(const std::string& key);
+    void log_result(int result, int error, const std::string& client_ip, int client_port);
 
-    FileBuilder* find_or_create_file_builder(const std::string& key);
+    void process_control(const Package& package, const sockaddr_in& addr,
+                         std::string& client_ip, int client_port);
 
-    int timed_recvfrom(char *buf, int buf_len, sockaddr_in &addr, socklen_t &addr_len, int max_waiting_time_ms);
+    void update_feedback(const std::string& key, uint32_t marker, uint32_t number,
+                         int bytes, const sockaddr_in& addr);
 
-    int process_package(Package& package, const std::string& key);
+    int send_signatures(uint32_t marker, const std::string& filename, 
+                        const sockaddr_in& addr);
 };
\ No newline at end of file
@@ -0,0 +1,175 @@
+#include "server.h"
+
+#include <unistd.h>
+
+void print_usage(char *program_name)
+{
+
+    std::cout << "Используйте: " << program_name;
+    std::cout << " [опции] <IPv4 адрес сервера> <Порт> <Директория для хранения файлов>"
+        " [Директория...]" << std::endl;
+    std::cout << "Опции:" << std::endl
+              << "  -m <МиБ>    память под пакеты, ожидающие записи (256)" << std::endl
+              << "  -q <МиБ>    та же память для одного файла (32)" << std::endl
+              << "  -D <режим>  сохранность файлов: buffered, direct или group (buffered)" 
+              << std::endl
+              << "  -g <мс>     время сбора пачки файлов для fsync в режиме group (10)" 
+              << std::endl
+              << "  -C <КиБ>    блок записи принятых данных в файл (1024)" << std::endl
+              << "  -F <мс>     наибольшее время ожидания данных в блоке записи (200)" 
+              << std::endl
+              << "  -P <выбор>  директория для нового файла: hash, round-robin или "
+                 "least-busy (hash)" << std::endl
+              << "  -S <куда>   передавать файлы вместо записи: pipe:<команда> или "
+                 "unix:<сокет>" << std::endl
+              << "  -I <адрес>  интерфейс для группового адреса сервера" << std::endl
+              << "  -W <число>  потоков обработки пакетов, 0 - в потоке приема (0)" 
+              << std::endl
+              << "  -A <роль>=<процессоры>  закрепить потоки rx, writer или compute за "
+                 "процессорами: 0-3,8 или node:<номер>; rx=auto - за узлом прерываний "
+                 "очередей приема сетевой карты" << std::endl
+              << "  -X [drv:]<интерфейс>[:<очередь>]  принимать через AF_XDP, без "
+                 "сокета (очередь 0, универсальный режим)" << std::endl
+              << "  -L <Мбит/с>[:<КиБ>]  ограничить скорость приема с одного адреса "
+                 "клиента, с наибольшей пачкой (1024)" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t memory_limit = default_memory_limit;
+    uint64_t session_quota = default_session_quota;
+    durability_modes durability = DURABILITY_BUFFERED;
+    milliseconds group_interval = default_group_interval;
+    size_t chunk_size = default_chunk_size;
+    milliseconds flush_interval = default_flush_interval;
+    placement_policies placement = PLACEMENT_HASH;
+    SinkFactory sink_factory;
+    std::string multicast_interface;
+    size_t workers = 0;
+    std::vector<std::pair<thread_roles, std::vector<int>>> affinity;
+    bool queue_affinity = false;
+    std::string xdp_ifname;
+    uint32_t xdp_queue = 0;
+    bool xdp_native = false;
+    double client_rate = 0;
+    uint64_t client_burst = 0;
+    int opt;
+    try
+    {
+        while ((opt = getopt(argc, argv, "m:q:D:g:C:F:P:S:I:W:A:X:L:")) != -1)
+        {
+            switch (opt)
+            {
+            case 'm':
+                memory_limit = std::stoull(optarg) * 1024 * 1024;
+                break;
+            case 'q':
+                session_quota = std::stoull(optarg) * 1024 * 1024;
+                break;
+            case 'D':
+                if (!parse_durability(optarg, durability))
+                    throw std::invalid_argument(optarg);
+                break;
+            case 'g':
+                group_interval = milliseconds(std::stoul(optarg));
+                break;
+            case 'C':
+                chunk_size = std::stoull(optarg) * 1024;
+                break;
+            case 'F':
+                flush_interval = milliseconds(std::stoul(optarg));
+                break;
+            case 'P':
+                if (!parse_placement(optarg, placement))
+                    throw std::invalid_argument(optarg);
+                break;
+            case 'S':
+                if (!parse_sink(optarg, sink_factory))
+                    throw std::invalid_argument(optarg);
+                break;
+            case 'I':
+                multicast_interface = optarg;
+                break;
+            case 'W':
+                workers = std::stoul(optarg);
+                break;
+            case 'A':
+            {
+                thread_roles role;
+                std::vector<int> cpus;
+                if (std::string(optarg) == "rx=auto")
+                    queue_affinity = true;
+                else if (parse_affinity(optarg, role, cpus))
+                    affinity.emplace_back(role, cpus);
+                else
+                    throw std::invalid_argument(optarg);
+                break;
+            }
+            case 'X':
+                if (!parse_xdp(optarg, xdp_ifname, xdp_queue, xdp_native))
+                    throw std::invalid_argument(optarg);
+                break;
+            case 'L':
+                if (!parse_client_rate(optarg, client_rate, client_burst))
+                    throw std::invalid_argument(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(1);
+            }
+        }
+    }
+    catch (const std::logic_error &e)
+    {
+        std::cerr << "Ошибка: некорректное значение опции -" << char(opt) << std::endl;
+        exit(1);
+    }
+    if (argc - optind < 3)
+    {
+        std::cerr << "Ошибка: неверное количество аргументов." << std::endl;
+        print_usage(argv[0]);
+        exit(1);
+    }
+    int port = 0;
+    try 
+    {
+        port = std::stoi(std::string(argv[optind + 1]));
+    }
+    catch (std::invalid_argument &e)
+    {
+        std::cerr << "Ошибка: значение порта должено быть целом числом." << std::endl;
+        exit(1);
+    }
+    Logger log;
+    try
+    {
+        std::vector<std::string> dirs(argv + optind + 2, argv + argc);
+        Server server(std::string(argv[optind]), port, dirs, log);
+        server.set_placement(placement);
+        server.set_sink_factory(sink_factory);
+        if (!multicast_interface.empty() && 
+            server.set_multicast_interface(multicast_interface) != 0)
+            throw std::runtime_error(std::string("multicast interface: ") + strerror(errno) + "\n");
+        server.set_memory_limits(memory_limit, session_quota);
+        server.set_durability(durability, group_interval);
+        server.set_write_buffer(chunk_size, flush_interval);
+        server.set_workers(workers);
+        server.set_client_rate_limit(client_rate, client_burst);
+        server.set_queue_affinity(queue_affinity);
+        for (const auto& item: affinity)
+            if (server.set_affinity(item.first, item.second) != 0)
+                throw std::runtime_error(std::string("affinity ") + 
+                    thread_role_name(item.first) + ": " + strerror(errno) + "\n");
+        if (!xdp_ifname.empty())
+            server.set_xdp(xdp_ifname, xdp_queue, xdp_native);
+        server.work();
+    }
+    catch (const std::runtime_error& err)
+    {
+        std::cerr << err.what();
+        exit(1);
+    }
+    return 0;
+}
+
+
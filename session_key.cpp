@@ -0,0 +1,55 @@
+#include "session_key.h"
+
+#include <sstream>
+
+/** \brief Создать ключ из имеющихся парамтров.
+ * 
+ * Функция создает строковый ключ, используя IP и порт клиента, идентификатор
+ * потока пакетов. Ключ получается относительно уникальным.
+ * 
+ * \note
+ * Ключ имеет вид: <clint_ip>-<client_port>-<marker>.
+ * 
+ * \param[in] client_ip    Адрес клиента
+ * \param[in] client_port  Порт клиента.
+ * \param[in] marker       Идентификатор потока пакета.
+ * 
+ * \return Возвращает копию строки, содержащий созданный ключ.
+ */ 
+std::string make_key(std::string& client_ip, int client_port, uint32_t marker)
+{
+    std::ostringstream  ss;
+    ss << client_ip << "-" << client_port << "-" << static_cast<unsigned long>(marker);
+    return ss.str();
+}
+
+/** \brief Разобрать ключ.
+ * 
+ * Функция разбирает ключ, созданный на онсове параметров сетевого адреса, 
+ * порта и идентификатора потока и загружает его в парамтры \p ip , \p port ,
+ * \p marker . Эти параметры использовались при создании ключа в make_key. 
+ * 
+ * \note
+ * Ключ имеет вид: <clint_ip>-<client_port>-<marker>.
+ * 
+ * \param[in] key       Строка ключ.
+ * \param[in] ip        строка адрес клиента.
+ * \param[in] port      Порт клиента.
+ * \param[in] marker    Идентификатор потока пакетов.
+ * 
+ * \return Возвращает копию строки, содержащий созданный ключ.
+ */ 
+void unmake_key(const std::string& key, std::string& ip, int& port, uint32_t& marker) 
+{
+    auto first_pos = key.find_first_of("-");
+    if (first_pos == std::string::npos)
+        return;
+    auto last_pos = key.find_last_of("-");
+    if (last_pos == std::string::npos)
+        return;
+    if (first_pos == last_pos)
+        return;
+    ip = key.substr(0, first_pos);
+    port = std::stoi(key.substr(first_pos + 1, last_pos - first_pos + 1));
+    marker = static_cast<uint32_t>(std::stoul(key.substr(last_pos + 1)));
+}
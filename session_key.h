@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+std::string make_key(std::string& client_ip, int client_port, uint32_t marker);
+
+void unmake_key(const std::string& key, std::string& ip, int& port, uint32_t& marker);
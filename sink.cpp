@@ -0,0 +1,366 @@
+#include "sink.h"
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <thread>
+#include <pthread.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static const std::chrono::milliseconds pipe_term_timeout(100);   // после SIGTERM команда получает SIGKILL
+static const std::chrono::milliseconds pipe_wait_step(1);
+
+/** \brief Записать данные целиком
+ *
+ * \param[in] socket    Дескриптор - сокет, запись в который не должна 
+ *                      вызывать SIGPIPE.
+ *
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */
+static int write_fully(int fd, const char *data, size_t size, bool socket)
+{
+    while (size > 0)
+    {
+        ssize_t written = socket ? send(fd, data, size, MSG_NOSIGNAL)
+                                 : ::write(fd, data, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return -1;
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/** \brief Записать данные в канал
+ *
+ * Если команда завершилась, запись в канал вызывает SIGPIPE, который по 
+ * умолчанию завершает процесс. Сигнал блокируется в потоке только на время
+ * записи, а вызванный ею сигнал снимается, поэтому ошибка возвращается как
+ * EPIPE, а обработка сигналов процесса, встроившего библиотеку, не 
+ * меняется.
+ *
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */
+static int write_pipe(int fd, const char *data, size_t size)
+{
+    sigset_t pipe_set, old_set, pending;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+    sigpending(&pending);
+    bool was_pending = sigismember(&pending, SIGPIPE);
+    int result = write_fully(fd, data, size, false);
+    int error = errno;
+    if (result != 0 && error == EPIPE && !was_pending)
+    {
+        timespec zero = {0, 0};
+        while (sigtimedwait(&pipe_set, nullptr, &zero) < 0 && errno == EINTR)
+            ;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+    errno = error;
+    return result;
+}
+
+/** \brief Конструктор получателя с обратными вызовами
+ *
+ * Функция создает получателя, который передает данные файла встроившему 
+ * сервер приложению через функции \p callbacks : on_open при получении 
+ * имени файла, on_data для каждого участка данных, идущего подряд, 
+ * on_complete после получения и проверки всего файла и on_abort, если файл
+ * не будет получен. Функция, вернувшая false, прерывает прием файла. 
+ * Незаданные функции пропускаются.
+ *
+ * \warning
+ * Функции вызываются потоком, который обрабатывает пакеты сессии: без пула
+ * обработки (-W 0) - потоком приема, с пулом (-W N, смотрите 
+ * Server::set_workers()) - потоками пула, а on_abort - и потоком приема при
+ * удалении сессии. Функции разных файлов выполняются одновременно в разных
+ * потоках, поэтому они должны быть потокобезопасными. Вызовы для одного 
+ * файла идут по порядку и не пересекаются, порядок между файлами не 
+ * определен. Пока функция работает, поток не обрабатывает другие пакеты,
+ * поэтому функции должны быть быстрыми.
+ */
+CallbackSink::CallbackSink(const SinkCallbacks& callbacks)
+    : m_callbacks(callbacks)
+    , m_size(0)
+{}
+
+int CallbackSink::open(const std::string& name)
+{
+    m_name = name;
+    m_size = 0;
+    return (!m_callbacks.on_open || m_callbacks.on_open(name)) ? 0 : -1;
+}
+
+int CallbackSink::write(const char *data, size_t size)
+{
+    m_size += size;
+    return (!m_callbacks.on_data || m_callbacks.on_data(m_name, data, size)) ? 0 : -1;
+}
+
+int CallbackSink::finish()
+{
+    return (!m_callbacks.on_complete || m_callbacks.on_complete(m_name, m_size)) ? 0 : -1;
+}
+
+void CallbackSink::abort()
+{
+    if (m_callbacks.on_abort)
+        m_callbacks.on_abort(m_name);
+}
+
+/** \brief Конструктор получателя в память
+ *
+ * Функция создает получателя, который собирает файл в памяти и после 
+ * получения и проверки всего файла передает буфер обработчику \p handler .
+ * Память под файл не входит в бюджет памяти сервера. Обработчик 
+ * вызывается в тех же потоках, что и функции CallbackSink, и должен быть 
+ * потокобезопасным.
+ */
+MemorySink::MemorySink(const MemoryHandler& handler)
+    : m_handler(handler)
+{}
+
+int MemorySink::open(const std::string& name)
+{
+    m_name = name;
+    m_data.clear();
+    return 0;
+}
+
+int MemorySink::write(const char *data, size_t size)
+{
+    m_data.insert(m_data.end(), data, data + size);
+    return 0;
+}
+
+int MemorySink::finish()
+{
+    m_handler(m_name, std::move(m_data));
+    m_data.clear();
+    return 0;
+}
+
+void MemorySink::abort()
+{
+    std::vector<char>().swap(m_data);
+}
+
+/** \brief Конструктор получателя через канал
+ *
+ * Функция создает получателя, который для каждого файла запускает команду
+ * \p command через /bin/sh и пишет данные файла в ее стандартный ввод по 
+ * мере получения. Имя файла передается в переменной окружения 
+ * PRIMETECH_FILE. Файл считается доставленным, если команда завершилась с 
+ * кодом 0; если файл не получен, команда получает SIGTERM, а если не 
+ * завершилась за pipe_term_timeout - SIGKILL, смотрите abort().
+ *
+ * \warning
+ * Запись в канал блокирует поток, который обрабатывает пакеты сессии, пока
+ * команда не прочитает данные: без пула обработки (-W 0) это поток приема,
+ * и медленная команда замедляет весь прием (буфер сокета заполняется, и 
+ * клиент снижает скорость по отчетам сервера); с пулом (-W N) - поток 
+ * пула, и ждут сессии в его очереди. Для каждого файла запускается своя 
+ * команда, и с пулом команды разных файлов работают одновременно: данные 
+ * одного файла приходят в его команду по порядку, порядок завершения 
+ * файлов не определен.
+ */
+PipeSink::PipeSink(const std::string& command)
+    : m_command(command)
+    , m_fd(-1)
+    , m_pid(-1)
+{}
+
+PipeSink::~PipeSink()
+{
+    if (m_pid > 0)
+        abort();
+}
+
+int PipeSink::open(const std::string& name)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0)
+        return -1;
+    std::vector<std::string> env_strings;
+    for (char **env = environ; *env != nullptr; ++env)
+        if (strncmp(*env, "PRIMETECH_FILE=", 15) != 0)
+            env_strings.push_back(*env);
+    env_strings.push_back("PRIMETECH_FILE=" + name);
+    std::vector<char *> envp;
+    for (std::string& env: env_strings)
+        envp.push_back(&env[0]);
+    envp.push_back(nullptr);
+    char sh[] = "/bin/sh", flag[] = "-c";
+    char *argv[] = {sh, flag, &m_command[0], nullptr};
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+    int result = posix_spawn(&m_pid, sh, &actions, nullptr, argv, envp.data());
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[0]);
+    if (result != 0)
+    {
+        close(fds[1]);
+        m_pid = -1;
+        errno = result;
+        return -1;
+    }
+    m_fd = fds[1];
+    return 0;
+}
+
+int PipeSink::write(const char *data, size_t size)
+{
+    return write_pipe(m_fd, data, size);
+}
+
+int PipeSink::finish()
+{
+    close(m_fd);
+    m_fd = -1;
+    int status = 0;
+    while (waitpid(m_pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    m_pid = -1;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        return 0;
+    errno = ECANCELED;
+    return -1;
+}
+
+/** \brief Прервать передачу файла команде
+ *
+ * Функция закрывает канал и завершает команду сигналом SIGTERM. abort() 
+ * вызывается и потоком приема при удалении сессии, поэтому команда, 
+ * которая перехватывает или игнорирует SIGTERM, ждется не дольше 
+ * pipe_term_timeout, а затем получает SIGKILL.
+ */
+void PipeSink::abort()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = -1;
+    if (m_pid <= 0)
+        return;
+    kill(m_pid, SIGTERM);
+    auto deadline = std::chrono::steady_clock::now() + pipe_term_timeout;
+    pid_t result;
+    while ((result = waitpid(m_pid, nullptr, WNOHANG)) == 0 || (result < 0 && errno == EINTR))
+    {
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            kill(m_pid, SIGKILL);
+            while (waitpid(m_pid, nullptr, 0) < 0 && errno == EINTR)
+                ;
+            break;
+        }
+        std::this_thread::sleep_for(pipe_wait_step);
+    }
+    m_pid = -1;
+}
+
+/** \brief Конструктор получателя через Unix-сокет
+ *
+ * Функция создает получателя, который для каждого файла подключается к 
+ * потоковому Unix-сокету \p path и передает файл кадрами: 4 байта длины 
+ * (little-endian) и данные. Первый кадр содержит имя файла, следующие - 
+ * данные по мере получения, кадр нулевой длины означает, что файл получен
+ * и проверен. Если файл не получен, соединение закрывается без него.
+ */
+SocketSink::SocketSink(const std::string& path)
+    : m_path(path)
+    , m_fd(-1)
+{}
+
+SocketSink::~SocketSink()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+int SocketSink::open(const std::string& name)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (m_path.size() >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(addr.sun_path, m_path.c_str(), m_path.size());
+    m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_fd < 0)
+        return -1;
+    if (connect(m_fd, (const sockaddr *)&addr, sizeof(addr)) != 0)
+        return -1;
+    return write_frame(name.data(), name.size());
+}
+
+int SocketSink::write(const char *data, size_t size)
+{
+    return write_frame(data, size);
+}
+
+int SocketSink::finish()
+{
+    int result = write_frame(nullptr, 0);
+    close(m_fd);
+    m_fd = -1;
+    return result;
+}
+
+void SocketSink::abort()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = -1;
+}
+
+int SocketSink::write_frame(const char *data, uint32_t size)
+{
+    char header[sizeof(size)];
+    memcpy(header, &size, sizeof(size));
+    if (write_fully(m_fd, header, sizeof(header), true) != 0)
+        return -1;
+    return write_fully(m_fd, data, size, true);
+}
+
+/** \brief Разбор описания получателя
+ *
+ * Функция разбирает описание получателя из опции сервера: 
+ * "pipe:<команда>" или "unix:<путь к сокету>".
+ *
+ * \param[in]  spec       Описание получателя.
+ * \param[out] factory    Функция, создающая получателя для нового файла.
+ *
+ * \return true, если описание корректно, false иначе.
+ */
+bool parse_sink(const std::string& spec, SinkFactory& factory)
+{
+    size_t colon = spec.find(':');
+    if (colon == std::string::npos || colon + 1 == spec.size())
+        return false;
+    std::string kind = spec.substr(0, colon);
+    std::string target = spec.substr(colon + 1);
+    if (kind == "pipe")
+        factory = [target]() { return std::unique_ptr<FileSink>(new PipeSink(target)); };
+    else if (kind == "unix")
+        factory = [target]() { return std::unique_ptr<FileSink>(new SocketSink(target)); };
+    else
+        return false;
+    return true;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+// получатель данных принятого файла вместо записи в директорию хранения
+class FileSink {
+public:
+    virtual ~FileSink() {}
+
+    virtual int open(const std::string& name) = 0;
+
+    virtual int write(const char *data, size_t size) = 0;
+
+    virtual int finish() = 0;
+
+    virtual void abort() = 0;
+};
+
+typedef std::function<std::unique_ptr<FileSink>()> SinkFactory;
+
+struct SinkCallbacks {
+    std::function<bool(const std::string& name)> on_open;
+    std::function<bool(const std::string& name, const char *data, size_t size)> on_data;
+    std::function<bool(const std::string& name, uint64_t size)> on_complete;
+    std::function<void(const std::string& name)> on_abort;
+};
+
+class CallbackSink: public FileSink {
+public:
+    CallbackSink(const SinkCallbacks& callbacks);
+
+    int open(const std::string& name) override;
+
+    int write(const char *data, size_t size) override;
+
+    int finish() override;
+
+    void abort() override;
+
+private:
+    SinkCallbacks m_callbacks;
+    std::string m_name;
+    uint64_t m_size;
+};
+
+typedef std::function<void(const std::string& name, std::vector<char>&& data)> MemoryHandler;
+
+class MemorySink: public FileSink {
+public:
+    MemorySink(const MemoryHandler& handler);
+
+    int open(const std::string& name) override;
+
+    int write(const char *data, size_t size) override;
+
+    int finish() override;
+
+    void abort() override;
+
+private:
+    MemoryHandler m_handler;
+    std::string m_name;
+    std::vector<char> m_data;
+};
+
+class PipeSink: public FileSink {
+public:
+    PipeSink(const std::string& command);
+
+    ~PipeSink();
+
+    int open(const std::string& name) override;
+
+    int write(const char *data, size_t size) override;
+
+    int finish() override;
+
+    void abort() override;
+
+private:
+    std::string m_command;
+    int m_fd;
+    pid_t m_pid;
+};
+
+class SocketSink: public FileSink {
+public:
+    SocketSink(const std::string& path);
+
+    ~SocketSink();
+
+    int open(const std::string& name) override;
+
+    int write(const char *data, size_t size) override;
+
+    int finish() override;
+
+    void abort() override;
+
+private:
+    std::string m_path;
+    int m_fd;
+
+    int write_frame(const char *data, uint32_t size);
+};
+
+bool parse_sink(const std::string& spec, SinkFactory& factory);
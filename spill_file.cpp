@@ -0,0 +1,89 @@
+#include "spill_file.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+/** \brief Конструктор файла вытеснения
+ *
+ * Функция создает хранилище пакетов, которые не поместились в память. Файл
+ * создается при первом вытеснении функцией mkstemp: к \p filename 
+ * добавляется случайный суффикс, поэтому сессии с одинаковым 
+ * идентификатором потока пакетов от разных клиентов не пишут в один файл. 
+ * Имя сразу удаляется из директории, и файл исчезает при закрытии 
+ * дескриптора, в том числе при аварийном завершении сервера. В памяти 
+ * остается только индекс: номер пакета, смещение и размер.
+ *
+ * \param[in] filename    Начало имени файла.
+ * \param[in] max_size    Наибольший размер файла в байтах.
+ */
+SpillFile::SpillFile(const std::string& filename, uint64_t max_size)
+    : m_filename(filename)
+    , m_max_size(max_size)
+    , m_fd(-1)
+    , m_end(0)
+{}
+
+/** \brief Деструктор файла вытеснения
+ *
+ * Функция закрывает файл, после чего файловая система его удаляет.
+ */
+SpillFile::~SpillFile()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+/** \brief Вытеснить пакет
+ *
+ * \param[in] number    Номер пакета.
+ * \param[in] data      Датаграмма пакета.
+ * \param[in] size      Размер датаграммы.
+ *
+ * \return true, если пакет записан, false, если файл достиг max_size или
+ * его не удалось создать или записать.
+ */
+bool SpillFile::store(uint64_t number, const char *data, uint32_t size)
+{
+    if (m_end + size > m_max_size)
+        return false;
+    if (m_fd < 0)
+    {
+        std::string name = m_filename + ".XXXXXX";
+        m_fd = mkstemp(&name[0]);
+        if (m_fd < 0)
+            return false;
+        unlink(name.c_str());
+    }
+    if (pwrite(m_fd, data, size, m_end) != static_cast<ssize_t>(size))
+        return false;
+    m_index[number] = {m_end, size};
+    m_end += size;
+    return true;
+}
+
+/** \brief Забрать пакет
+ *
+ * Функция читает вытесненный пакет в \p buf и удаляет его из индекса. Когда
+ * индекс пустеет, файл начинает заполняться с начала.
+ *
+ * \param[in]  number    Номер пакета.
+ * \param[out] buf       Датаграмма пакета.
+ *
+ * \return true, если пакет прочитан, false, если его нет или чтение не
+ * удалось.
+ */
+bool SpillFile::take(uint64_t number, std::vector<char>& buf)
+{
+    auto iter = m_index.find(number);
+    if (iter == m_index.end())
+        return false;
+    buf.resize(iter->second.size);
+    bool ok = pread(m_fd, buf.data(), iter->second.size, iter->second.offset) ==
+              static_cast<ssize_t>(iter->second.size);
+    m_index.erase(iter);
+    if (m_index.empty())
+        m_end = 0;
+    return ok;
+}
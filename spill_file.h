@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+class SpillFile {
+public:
+    SpillFile(const std::string& filename, uint64_t max_size);
+
+    ~SpillFile();
+
+    bool store(uint64_t number, const char *data, uint32_t size);
+
+    bool take(uint64_t number, std::vector<char>& buf);
+
+private:
+    struct Entry {
+        uint64_t offset;
+        uint32_t size;
+    };
+
+    std::string m_filename;
+    uint64_t m_max_size;
+    int m_fd;
+    uint64_t m_end;
+    std::map<uint64_t, Entry> m_index;
+};
@@ -0,0 +1,215 @@
+#include "spool.h"
+
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const size_t inotify_buf_size = 64 * 1024;
+
+/** \brief Конструктор отправителя спул-директории
+ *
+ * Функция создает отправителя, который следит за директорией \p dir через 
+ * inotify и передает через \p client каждый файл, как только его закрыли 
+ * после записи или переместили в директорию. Файлы, имя которых начинается
+ * с точки, пропускаются: так производитель может записать временный файл и
+ * переименовать его, когда он готов.
+ *
+ * \param[in] dir       Спул-директория.
+ * \param[in] client    Асинхронный клиент, ограничивающий число 
+ *                      одновременных передач.
+ * \param[in] logger    Лог передач.
+ *
+ * \throw std::runtime_error, если не удалось следить за директорией.
+ */
+SpoolSender::SpoolSender(const std::string& dir, AsyncClient& client, Logger& logger)
+    : m_dir(dir)
+    , m_client(client)
+    , m_logger(logger)
+    , m_inotify(-1)
+    , m_event(-1)
+    , m_action(SPOOL_KEEP)
+{
+    if (m_dir.find_last_of("/") != m_dir.size() - 1)
+        m_dir.append("/");
+    m_inotify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (m_inotify < 0)
+        throw std::runtime_error(strerror(errno));
+    if (inotify_add_watch(m_inotify, m_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        close(m_inotify);
+        throw std::runtime_error(strerror(errno));
+    }
+    m_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_event < 0)
+    {
+        close(m_inotify);
+        throw std::runtime_error(strerror(errno));
+    }
+}
+
+/** \brief Деструктор отправителя спул-директории
+ *
+ * Функция дожидается окончания начатых передач.
+ */
+SpoolSender::~SpoolSender()
+{
+    m_client.wait();
+    close(m_event);
+    close(m_inotify);
+}
+
+/** \brief Задать действие после передачи
+ *
+ * \param[in] action         Что делать с переданным файлом.
+ * \param[in] archive_dir    Директория для SPOOL_MOVE, должна быть на той же
+ *                           файловой системе, что и спул-директория.
+ */
+void SpoolSender::set_after_send(spool_actions action, const std::string& archive_dir)
+{
+    m_action = action;
+    m_archive_dir = archive_dir;
+    if (!m_archive_dir.empty() && m_archive_dir.find_last_of("/") != m_archive_dir.size() - 1)
+        m_archive_dir.append("/");
+}
+
+/** \brief Работа отправителя
+ *
+ * Функция передает файлы, уже лежащие в директории, а затем бесконечно 
+ * ждет событий inotify и завершения передач. Файл, измененный во время 
+ * передачи, передается еще раз. Если передача не удалась, файл остается в
+ * директории и передается снова при следующем изменении или запуске.
+ */
+void SpoolSender::work()
+{
+    m_logger << "[INFO] Слежение за директорией \"" << m_dir << "\"" << std::endl;
+    scan();
+    pollfd fds[2];
+    fds[0].fd = m_inotify;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_event;
+    fds[1].events = POLLIN;
+    while (1)
+    {
+        if (::poll(fds, 2, -1) < 0)
+        {
+            if (errno != EINTR)
+                m_logger << "[ERROR] " << strerror(errno) << std::endl;
+            continue;
+        }
+        if (fds[0].revents & POLLIN)
+            read_events();
+        if (fds[1].revents & POLLIN)
+            process_completions();
+    }
+}
+
+void SpoolSender::scan()
+{
+    DIR *dir = opendir(m_dir.c_str());
+    if (dir == nullptr)
+    {
+        m_logger << "[ERROR] " << strerror(errno) << std::endl;
+        return;
+    }
+    while (dirent *entry = readdir(dir))
+    {
+        struct stat info;
+        std::string name = entry->d_name;
+        if (stat((m_dir + name).c_str(), &info) == 0 && S_ISREG(info.st_mode))
+            enqueue(name);
+    }
+    closedir(dir);
+}
+
+/** \brief Поставить файл в очередь передачи
+ *
+ * Если файл уже передается, он будет передан еще раз после окончания 
+ * текущей передачи.
+ */
+void SpoolSender::enqueue(const std::string& name)
+{
+    if (name.empty() || name[0] == '.')
+        return;
+    auto iter = m_in_flight.find(name);
+    if (iter != m_in_flight.end())
+    {
+        iter->second = true;
+        return;
+    }
+    m_in_flight.emplace(name, false);
+    // вызывается в потоке передачи, деструктор дожидается всех передач
+    m_client.send_file(m_dir + name, [this](const TransferResult& result) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_done.push_back(result);
+        }
+        uint64_t one = 1;
+        if (write(m_event, &one, sizeof(one)) < 0)
+            return;
+    });
+}
+
+void SpoolSender::read_events()
+{
+    alignas(inotify_event) char buf[inotify_buf_size];
+    ssize_t len;
+    while ((len = read(m_inotify, buf, sizeof(buf))) > 0)
+    {
+        for (char *p = buf; p < buf + len;)
+        {
+            const inotify_event *event = reinterpret_cast<const inotify_event *>(p);
+            if (event->mask & IN_Q_OVERFLOW)
+                scan();
+            else if (event->len > 0 && !(event->mask & IN_ISDIR))
+                enqueue(event->name);
+            p += sizeof(inotify_event) + event->len;
+        }
+    }
+}
+
+/** \brief Обработка завершенных передач
+ *
+ * Функция выполняется в потоке work(), поэтому лог и список передаваемых 
+ * файлов не нужно защищать от потоков передачи.
+ */
+void SpoolSender::process_completions()
+{
+    uint64_t count;
+    if (read(m_event, &count, sizeof(count)) < 0)
+        return;
+    std::deque<TransferResult> done;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        done.swap(m_done);
+    }
+    for (const TransferResult& result: done)
+    {
+        std::string name = result.filename.substr(m_dir.size());
+        bool changed = m_in_flight[name];
+        m_in_flight.erase(name);
+        if (result.result != 0)
+        {
+            m_logger << "[ERROR] Не удалось передать \"" << name << "\": " 
+                << strerror(result.error) << std::endl;
+        } else {
+            m_logger << "[INFO] Передан \"" << name << "\", отправлено " 
+                << result.stats.bytes << " байт" << std::endl;
+            if (!changed && m_action == SPOOL_REMOVE && 
+                unlink(result.filename.c_str()) != 0)
+                m_logger << "[ERROR] Не удалось удалить \"" << name << "\": " 
+                    << strerror(errno) << std::endl;
+            if (!changed && m_action == SPOOL_MOVE && 
+                rename(result.filename.c_str(), (m_archive_dir + name).c_str()) != 0)
+                m_logger << "[ERROR] Не удалось перенести \"" << name << "\": " 
+                    << strerror(errno) << std::endl;
+        }
+        if (changed)
+            enqueue(name);
+    }
+}
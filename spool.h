@@ -0,0 +1,51 @@
+#pragma once
+
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "async_client.h"
+#include "logger.h"
+
+// что делать с файлом из спул-директории после успешной передачи
+enum spool_actions {
+    SPOOL_KEEP = 0,   // оставить, файл будет передан снова после изменения
+    SPOOL_REMOVE,     // удалить
+    SPOOL_MOVE        // перенести в архивную директорию
+};
+
+class SpoolSender {
+public:
+    SpoolSender(const std::string& dir, AsyncClient& client, Logger& logger);
+
+    ~SpoolSender();
+
+    void set_after_send(spool_actions action, const std::string& archive_dir = "");
+
+    void work();
+
+private:
+    std::string m_dir;
+    AsyncClient& m_client;
+    Logger& m_logger;
+    int m_inotify;
+    int m_event;
+    spool_actions m_action;
+    std::string m_archive_dir;
+    std::map<std::string, bool> m_in_flight;   // имя файла - изменен ли во время передачи
+    std::mutex m_mutex;
+    std::deque<TransferResult> m_done;
+
+    SpoolSender(const SpoolSender&) = delete;
+
+    SpoolSender& operator=(const SpoolSender&) = delete;
+
+    void scan();
+
+    void enqueue(const std::string& name);
+
+    void read_events();
+
+    void process_completions();
+};
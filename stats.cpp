@@ -0,0 +1,390 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <ctime>
+#include <iomanip>
+
+using namespace std::chrono;
+
+/** \brief Процессорное время потока
+ *
+ * Функция возвращает процессорное время, затраченное текущим потоком. Его
+ * разность до и после операции показывает стоимость операции без учета
+ * ожидания ввода-вывода.
+ *
+ * \return Процессорное время в наносекундах.
+ */
+uint64_t thread_cpu_time_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/** \brief Степень сжатия
+ *
+ * \return Отношение исходного размера данных к переданному или 1, если
+ * данных не было.
+ */
+double CodecStats::ratio() const
+{
+    if (wire_bytes == 0)
+        return 1.0;
+    return static_cast<double>(raw_bytes) / wire_bytes;
+}
+
+/** \brief Вывод статистики сжатия
+ *
+ * Функция выводит статистику сжатия в одну строку вида ключ=значение.
+ *
+ * \param[in] os       Выходной поток.
+ * \param[in] stats    Статистика сжатия.
+ *
+ * \return Ссылка на выходной поток.
+ */
+std::ostream& operator<<(std::ostream& os, const CodecStats& stats)
+{
+    return os << "raw=" << stats.raw_bytes
+              << " wire=" << stats.wire_bytes
+              << " ratio=" << std::fixed << std::setprecision(2) << stats.ratio()
+              << " compressed_blocks=" << stats.compressed_blocks
+              << " raw_blocks=" << stats.raw_blocks
+              << " codec_cpu_ms=" << std::setprecision(3) << stats.cpu_ns / 1e6;
+}
+
+/** \brief Вывод статистики дельта-передачи
+ *
+ * Функция выводит статистику дельта-передачи в одну строку вида 
+ * ключ=значение.
+ *
+ * \param[in] os       Выходной поток.
+ * \param[in] stats    Статистика дельта-передачи.
+ *
+ * \return Ссылка на выходной поток.
+ */
+std::ostream& operator<<(std::ostream& os, const DeltaStats& stats)
+{
+    return os << "signatures=" << stats.signatures
+              << " matched_blocks=" << stats.matched_blocks
+              << " matched=" << stats.matched_bytes
+              << " literal=" << stats.literal_bytes
+              << " copy_ops=" << stats.copy_ops;
+}
+
+/** \brief Вывод статистики синхронизации
+ *
+ * Функция выводит статистику сохранения файлов на диск в одну строку вида
+ * ключ=значение. Задержки выводятся в миллисекундах.
+ */
+std::ostream& operator<<(std::ostream& os, const SyncStats& stats)
+{
+    double average = stats.files ? stats.latency_total_us / 1000.0 / stats.files : 0.0;
+    return os << "files=" << stats.files
+              << " batches=" << stats.batches
+              << " errors=" << stats.errors
+              << std::fixed << std::setprecision(2)
+              << " latency_avg_ms=" << average
+              << " latency_max_ms=" << stats.latency_max_us / 1000.0
+              << std::defaultfloat;
+}
+
+/** \brief Вывод статистики контроллера перегрузки
+ *
+ * Функция выводит статистику контроллера перегрузки в одну строку вида
+ * ключ=значение. Скорости выводятся в мегабитах в секунду.
+ *
+ * \param[in] os       Выходной поток.
+ * \param[in] stats    Статистика контроллера.
+ *
+ * \return Ссылка на выходной поток.
+ */
+std::ostream& operator<<(std::ostream& os, const CongestionStats& stats)
+{
+    return os << "feedback_reports=" << stats.feedback_reports
+              << " reported_lost=" << stats.reported_lost
+              << " congestion_events=" << stats.congestion_events
+              << " timeouts=" << stats.timeouts
+              << std::fixed << std::setprecision(1)
+              << " rate_mbit=" << stats.rate * 8 / 1e6
+              << " max_rate_mbit=" << stats.max_rate * 8 / 1e6;
+}
+
+/** \brief Имя фазы отправки
+ *
+ * \param[in] phase    Фаза из send_phases.
+ *
+ * \return Имя фазы для вывода статистики.
+ */
+const char *phase_name(int phase)
+{
+    static const char *names[PHASE_COUNT] = {"read", "assemble", "send", "pacing", "receive"};
+    if (phase < 0 || phase >= PHASE_COUNT)
+        return "unknown";
+    return names[phase];
+}
+
+static double megabits(uint64_t bytes, uint64_t us)
+{
+    return us > 0 ? bytes * 8.0 / us : 0.0;
+}
+
+/** \brief Вывод статистики отправки
+ *
+ * Функция выводит статистику отправки в одну строку вида ключ=значение: 
+ * общее время, объем, скорость, число отказов sendto и для каждой фазы
+ * время в миллисекундах и число входов в нее.
+ *
+ * \param[in] os       Выходной поток.
+ * \param[in] stats    Статистика отправки.
+ *
+ * \return Ссылка на выходной поток.
+ */
+std::ostream& operator<<(std::ostream& os, const SendStats& stats)
+{
+    os << std::fixed << std::setprecision(3)
+       << "elapsed_ms=" << stats.elapsed_ns / 1e6
+       << " packages=" << stats.packages
+       << " bytes=" << stats.bytes
+       << std::setprecision(1)
+       << " mbit=" << megabits(stats.bytes, stats.elapsed_ns / 1000)
+       << " eagain=" << stats.eagain
+       << " enobufs=" << stats.enobufs;
+    for (int phase = 0; phase < PHASE_COUNT; ++phase)
+        os << std::setprecision(3)
+           << " " << phase_name(phase) << "_ms=" << stats.phases[phase].ns / 1e6
+           << " " << phase_name(phase) << "_calls=" << stats.phases[phase].calls;
+    return os;
+}
+
+/** \brief Вывод замера скорости за интервал
+ *
+ * \param[in] os        Выходной поток.
+ * \param[in] sample    Замер.
+ *
+ * \return Ссылка на выходной поток.
+ */
+std::ostream& operator<<(std::ostream& os, const ThroughputSample& sample)
+{
+    return os << std::fixed << std::setprecision(1)
+              << "t_ms=" << sample.elapsed_us / 1e3
+              << " interval_ms=" << sample.interval_us / 1e3
+              << " bytes=" << sample.bytes
+              << " packages=" << sample.packages
+              << " mbit=" << megabits(sample.bytes, sample.interval_us);
+}
+
+/** \brief Вывод статистики отправки в формате JSON
+ *
+ * Функция выводит статистику отправки и замеры скорости по интервалам 
+ * одним объектом JSON, чтобы результаты разных запусков можно было
+ * сравнивать скриптом.
+ *
+ * \param[in] os       Выходной поток.
+ * \param[in] stats    Статистика отправки.
+ */
+void write_json(std::ostream& os, const SendStats& stats)
+{
+    os << std::fixed << std::setprecision(3)
+       << "{\"elapsed_ms\": " << stats.elapsed_ns / 1e6
+       << ", \"packages\": " << stats.packages
+       << ", \"bytes\": " << stats.bytes
+       << ", \"mbit\": " << megabits(stats.bytes, stats.elapsed_ns / 1000)
+       << ", \"eagain\": " << stats.eagain
+       << ", \"enobufs\": " << stats.enobufs
+       << ",\n \"phases\": {";
+    for (int phase = 0; phase < PHASE_COUNT; ++phase)
+        os << (phase ? ", " : "") << "\"" << phase_name(phase) << "\": {\"ms\": "
+           << stats.phases[phase].ns / 1e6
+           << ", \"calls\": " << stats.phases[phase].calls << "}";
+    os << "},\n \"samples\": [";
+    for (size_t i = 0; i < stats.samples.size(); ++i)
+    {
+        const ThroughputSample& sample = stats.samples[i];
+        os << (i ? "," : "") << "\n  {\"t_ms\": " << sample.elapsed_us / 1e3
+           << ", \"interval_ms\": " << sample.interval_us / 1e3
+           << ", \"bytes\": " << sample.bytes
+           << ", \"packages\": " << sample.packages
+           << ", \"mbit\": " << megabits(sample.bytes, sample.interval_us) << "}";
+    }
+    os << "\n]}" << std::endl;
+}
+
+/** \brief Конструктор часов фаз
+ *
+ * Функция создает часы, которые делят время передачи между фазами 
+ * send_phases: в каждый момент идет ровно одна фаза, поэтому сумма времени 
+ * фаз равна времени передачи и вложенные замеры не учитываются дважды.
+ *
+ * \param[in] stats    Статистика, в которую записываются замеры.
+ */
+PhaseClock::PhaseClock(SendStats& stats)
+    : m_stats(stats)
+    , m_phase(-1)
+    , m_sample_interval(0)
+{}
+
+/** \brief Начать замер передачи
+ *
+ * Функция начинает отсчет с фазы PHASE_ASSEMBLE. Каждые 
+ * \p sample_interval в статистику добавляется замер скорости.
+ *
+ * \param[in] sample_interval    Длительность интервала замера скорости.
+ */
+void PhaseClock::start(microseconds sample_interval)
+{
+    m_sample_interval = sample_interval;
+    m_started = steady_clock::now();
+    m_since = m_started;
+    m_sample = ThroughputSample();
+    m_phase = PHASE_ASSEMBLE;
+    ++m_stats.phases[m_phase].calls;
+}
+
+/** \brief Перейти к фазе
+ *
+ * Функция относит время с прошлого перехода к текущей фазе и начинает фазу
+ * \p phase . До start() и после stop() вызов ничего не делает.
+ *
+ * \param[in] phase    Новая фаза.
+ *
+ * \return Фаза до перехода.
+ */
+int PhaseClock::enter(int phase)
+{
+    int previous = m_phase;
+    if (m_phase < 0 || phase == m_phase)
+        return previous;
+    auto now = steady_clock::now();
+    m_stats.phases[m_phase].ns += duration_cast<nanoseconds>(now - m_since).count();
+    m_since = now;
+    m_phase = phase;
+    ++m_stats.phases[m_phase].calls;
+    return previous;
+}
+
+/** \brief Учесть отправленную датаграмму
+ *
+ * Функция учитывает \p bytes байтов в статистике и в замере скорости.
+ * Время берется из последнего перехода между фазами, то есть из момента 
+ * окончания sendto.
+ *
+ * \param[in] bytes    Размер отправленной датаграммы.
+ */
+void PhaseClock::on_sent(uint64_t bytes)
+{
+    if (m_phase < 0)
+        return;
+    ++m_stats.packages;
+    m_stats.bytes += bytes;
+    ++m_sample.packages;
+    m_sample.bytes += bytes;
+    if (m_since - m_started >= microseconds(m_sample.elapsed_us) + m_sample_interval)
+        close_sample(m_since);
+}
+
+void PhaseClock::close_sample(steady_clock::time_point now)
+{
+    uint64_t elapsed_us = duration_cast<microseconds>(now - m_started).count();
+    m_sample.interval_us = elapsed_us - m_sample.elapsed_us;
+    m_sample.elapsed_us = elapsed_us;
+    m_stats.samples.push_back(m_sample);
+    m_sample.bytes = 0;
+    m_sample.packages = 0;
+}
+
+/** \brief Закончить замер передачи
+ *
+ * Функция относит оставшееся время к текущей фазе, добавляет последний
+ * неполный интервал и записывает общее время передачи.
+ */
+void PhaseClock::stop()
+{
+    if (m_phase < 0)
+        return;
+    auto now = steady_clock::now();
+    m_stats.phases[m_phase].ns += duration_cast<nanoseconds>(now - m_since).count();
+    if (m_sample.packages > 0)
+        close_sample(now);
+    m_stats.elapsed_ns = duration_cast<nanoseconds>(now - m_started).count();
+    m_phase = -1;
+}
+
+/** \brief Начать фазу до конца области видимости
+ *
+ * \param[in] clock    Часы фаз.
+ * \param[in] phase    Фаза.
+ */
+PhaseScope::PhaseScope(PhaseClock& clock, int phase)
+    : m_clock(clock)
+    , m_previous(clock.enter(phase))
+{}
+
+/** \brief Вернуться к предыдущей фазе
+ */
+PhaseScope::~PhaseScope()
+{
+    if (m_previous >= 0)
+        m_clock.enter(m_previous);
+}
+
+/** \brief Вывод статистики сервера
+ *
+ * Функция выводит статистику сервера в одну строку вида ключ=значение.
+ *
+ * \param[in] os       Выходной поток.
+ * \param[in] stats    Статистика сервера.
+ *
+ * \return Ссылка на выходной поток.
+ */
+std::ostream& operator<<(std::ostream& os, const ServerStats& stats)
+{
+    return os << "packages=" << stats.packages
+              << " bad_packages=" << stats.bad_packages
+              << " duplicates=" << stats.duplicates
+              << " spilled=" << stats.spilled
+              << " shed=" << stats.shed
+              << " limited=" << stats.limited
+              << " buffered=" << stats.buffered_bytes
+              << " buffered_peak=" << stats.buffered_peak
+              << " files_received=" << stats.files_received
+              << " files_dropped=" << stats.files_dropped
+              << " feedback_sent=" << stats.feedback_sent
+              << " signatures_sent=" << stats.signatures_sent
+              << " signatures_refused=" << stats.signatures_refused
+              << " decompression: " << stats.decompression
+              << " sync: " << stats.sync;
+}
+
+/** \brief Сложение статистики сервера
+ *
+ * Используется, чтобы собрать в общую статистику счетчики сессий, которые
+ * ведутся в потоках пула. Текущий и наибольший объем буферов не 
+ * складываются: их ведет общий бюджет памяти.
+ *
+ * \return Ссылка на \p total .
+ */
+ServerStats& operator+=(ServerStats& total, const ServerStats& stats)
+{
+    total.packages += stats.packages;
+    total.bad_packages += stats.bad_packages;
+    total.duplicates += stats.duplicates;
+    total.spilled += stats.spilled;
+    total.shed += stats.shed;
+    total.limited += stats.limited;
+    total.files_received += stats.files_received;
+    total.files_dropped += stats.files_dropped;
+    total.feedback_sent += stats.feedback_sent;
+    total.signatures_sent += stats.signatures_sent;
+    total.signatures_refused += stats.signatures_refused;
+    total.decompression.raw_bytes += stats.decompression.raw_bytes;
+    total.decompression.wire_bytes += stats.decompression.wire_bytes;
+    total.decompression.compressed_blocks += stats.decompression.compressed_blocks;
+    total.decompression.raw_blocks += stats.decompression.raw_blocks;
+    total.decompression.cpu_ns += stats.decompression.cpu_ns;
+    total.sync.files += stats.sync.files;
+    total.sync.batches += stats.sync.batches;
+    total.sync.errors += stats.sync.errors;
+    total.sync.latency_total_us += stats.sync.latency_total_us;
+    total.sync.latency_max_us = std::max(total.sync.latency_max_us, stats.sync.latency_max_us);
+    return total;
+}
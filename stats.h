@@ -0,0 +1,155 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+uint64_t thread_cpu_time_ns();
+
+struct CodecStats {
+    uint64_t raw_bytes         = 0;
+    uint64_t wire_bytes        = 0;
+    uint64_t compressed_blocks = 0;
+    uint64_t raw_blocks        = 0;
+    uint64_t cpu_ns            = 0;
+
+    double ratio() const;
+};
+
+std::ostream& operator<<(std::ostream& os, const CodecStats& stats);
+
+struct DeltaStats {
+    uint64_t signatures     = 0;
+    uint64_t matched_blocks = 0;
+    uint64_t matched_bytes  = 0;
+    uint64_t literal_bytes  = 0;
+    uint64_t copy_ops       = 0;
+};
+
+std::ostream& operator<<(std::ostream& os, const DeltaStats& stats);
+
+struct CongestionStats {
+    uint64_t feedback_reports = 0;
+    uint64_t reported_lost    = 0;
+    uint64_t congestion_events      = 0;
+    uint64_t timeouts         = 0;
+    double rate               = 0;   // байт/с
+    double max_rate           = 0;   // байт/с
+};
+
+std::ostream& operator<<(std::ostream& os, const CongestionStats& stats);
+
+// фазы отправки файла, между которыми делится время передачи
+enum send_phases {
+    PHASE_READ = 0,     // чтение файла
+    PHASE_ASSEMBLE,     // сборка пакетов: сжатие, контрольные суммы, поиск блоков
+    PHASE_SEND,         // системный вызов sendto
+    PHASE_PACING,       // ожидание перед отправкой очередного пакета
+    PHASE_RECEIVE,      // прием отчетов и сигнатур сервера
+    PHASE_COUNT
+};
+
+const char *phase_name(int phase);
+
+struct PhaseStats {
+    uint64_t ns    = 0;
+    uint64_t calls = 0;
+};
+
+struct ThroughputSample {
+    uint64_t elapsed_us  = 0;   // от начала передачи до конца интервала
+    uint64_t interval_us = 0;
+    uint64_t bytes       = 0;
+    uint64_t packages    = 0;
+};
+
+struct SendStats {
+    PhaseStats phases[PHASE_COUNT];
+    uint64_t packages   = 0;
+    uint64_t bytes      = 0;
+    uint64_t eagain     = 0;
+    uint64_t enobufs    = 0;
+    uint64_t elapsed_ns = 0;
+    std::vector<ThroughputSample> samples;
+};
+
+std::ostream& operator<<(std::ostream& os, const SendStats& stats);
+
+std::ostream& operator<<(std::ostream& os, const ThroughputSample& sample);
+
+void write_json(std::ostream& os, const SendStats& stats);
+
+class PhaseClock {
+public:
+    PhaseClock(SendStats& stats);
+
+    void start(std::chrono::microseconds sample_interval);
+
+    int enter(int phase);
+
+    void on_sent(uint64_t bytes);
+
+    void stop();
+
+private:
+    SendStats& m_stats;
+    int m_phase;
+    std::chrono::microseconds m_sample_interval;
+    std::chrono::steady_clock::time_point m_started;
+    std::chrono::steady_clock::time_point m_since;
+    ThroughputSample m_sample;
+
+    void close_sample(std::chrono::steady_clock::time_point now);
+};
+
+class PhaseScope {
+public:
+    PhaseScope(PhaseClock& clock, int phase);
+
+    ~PhaseScope();
+
+private:
+    PhaseClock& m_clock;
+    int m_previous;
+};
+
+struct SyncStats {
+    uint64_t files            = 0;   // файлов синхронизировано с диском
+    uint64_t batches          = 0;   // вызовов синхронизации пачки
+    uint64_t errors           = 0;
+    uint64_t latency_total_us = 0;   // от завершения записи до конца fsync
+    uint64_t latency_max_us   = 0;
+};
+
+std::ostream& operator<<(std::ostream& os, const SyncStats& stats);
+
+struct WriteStats {
+    uint64_t chunks  = 0;   // блоков записано потоком директории
+    uint64_t bytes   = 0;
+    uint64_t errors  = 0;
+    uint64_t waits   = 0;   // раз, когда сборщик ждал записи своего блока
+    uint64_t wait_us = 0;
+};
+
+struct ServerStats {
+    uint64_t packages       = 0;
+    uint64_t bad_packages   = 0;
+    uint64_t duplicates     = 0;
+    uint64_t spilled        = 0;
+    uint64_t shed           = 0;
+    uint64_t limited        = 0;   // отброшено ограничением скорости клиента
+    uint64_t buffered_bytes = 0;
+    uint64_t buffered_peak  = 0;
+    uint64_t files_received = 0;
+    uint64_t files_dropped  = 0;
+    uint64_t feedback_sent  = 0;
+    uint64_t signatures_sent    = 0;   // ответов на запросы сигнатур
+    uint64_t signatures_refused = 0;   // запросов без сессии или сверх ограничений
+    CodecStats decompression;
+    SyncStats sync;
+};
+
+std::ostream& operator<<(std::ostream& os, const ServerStats& stats);
+
+ServerStats& operator+=(ServerStats& total, const ServerStats& stats);
@@ -0,0 +1,322 @@
+#include "storage.h"
+#include "checksum.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+
+/** \brief Разбор политики размещения
+ *
+ * \param[in]  name      Имя политики: hash, round-robin или least-busy.
+ * \param[out] policy    Политика.
+ *
+ * \return true, если имя известно, false иначе.
+ */
+bool parse_placement(const std::string& name, placement_policies& policy)
+{
+    for (int i = PLACEMENT_HASH; i <= PLACEMENT_LEAST_BUSY; ++i)
+    {
+        if (name == placement_name(static_cast<placement_policies>(i)))
+        {
+            policy = static_cast<placement_policies>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/** \brief Имя политики размещения
+ *
+ * \return Имя политики для вывода и разбора опций.
+ */
+const char *placement_name(placement_policies policy)
+{
+    switch (policy)
+    {
+    case PLACEMENT_HASH:
+        return "hash";
+    case PLACEMENT_ROUND_ROBIN:
+        return "round-robin";
+    case PLACEMENT_LEAST_BUSY:
+        return "least-busy";
+    }
+    return "unknown";
+}
+
+/** \brief Проверка существования директории
+ * 
+ * Функция проверяет существование директори с именем  \p dirname .
+ * 
+ * \return true, если директория существует, false иначе.
+ */ 
+bool dir_exists(const std::string& dirname)
+{
+    struct stat info;
+    if (stat(dirname.c_str(), &info) != 0)
+        return false;
+    else if (info.st_mode & S_IFDIR)
+        return true;
+    else
+        return false;
+}
+
+/** \brief Вывод состояния директории хранения
+ *
+ * Функция выводит состояние директории в одну строку вида ключ=значение.
+ */
+std::ostream& operator<<(std::ostream& os, const StorageRoot& root)
+{
+    WriteStats writes = root.writer ? root.writer->get_stats() : WriteStats();
+    return os << "root=" << root.dir
+              << " active=" << root.active
+              << " pending_writes=" << (root.writer ? root.writer->pending() : 0)
+              << " write_waits=" << writes.waits
+              << " write_wait_ms=" << writes.wait_us / 1000
+              << " pending_sync=" << (root.batcher ? root.batcher->pending() : 0)
+              << " files=" << root.files
+              << " bytes=" << root.bytes;
+}
+
+/** \brief Конструктор хранилища
+ *
+ * Функция создает хранилище из нескольких директорий, обычно на разных 
+ * дисках. Каждый новый файл целиком записывается в одну из них, поэтому 
+ * пропускная способность дисков складывается, а файлы распределяются по 
+ * директориям. У каждой директории свой поток записи: поток, разбирающий
+ * пакеты, только собирает блоки файлов, а write на разные диски идут
+ * параллельно, и медленный диск не задерживает запись на остальные.
+ *
+ * \param[in] dirs      Директории хранения.
+ * \param[in] policy    Политика выбора директории для нового файла.
+ *
+ * \throw std::runtime_error, если список пуст или директория не существует.
+ */
+Storage::Storage(const std::vector<std::string>& dirs, placement_policies policy)
+    : m_roots(dirs.size())
+    , m_policy(policy)
+    , m_next(0)
+    , m_group_interval(0)
+{
+    if (dirs.empty())
+        throw std::runtime_error("no storage directories");
+    for (size_t i = 0; i < dirs.size(); ++i)
+    {
+        if (!dir_exists(dirs[i]))
+            throw std::runtime_error("directory does not exists: " + dirs[i]);
+        m_roots[i].dir = dirs[i];
+        if (m_roots[i].dir.find_last_of("/") != m_roots[i].dir.size() - 1)
+            m_roots[i].dir.append("/");
+        m_roots[i].writer = std::make_unique<WriteQueue>();
+    }
+}
+
+void Storage::set_policy(placement_policies policy)
+{
+    m_policy = policy;
+}
+
+/** \brief Задать режим сохранности
+ *
+ * В режиме DURABILITY_GROUP у каждой директории свой поток группового 
+ * fsync, чтобы медленный диск не задерживал сохранение файлов на других.
+ *
+ * \param[in] mode              Режим сохранности.
+ * \param[in] group_interval    Время сбора пачки файлов.
+ */
+void Storage::set_durability(durability_modes mode, milliseconds group_interval)
+{
+    m_group_interval = group_interval;
+    for (StorageRoot& root: m_roots)
+    {
+        root.batcher.reset();
+        if (mode == DURABILITY_GROUP)
+            root.batcher = std::make_unique<SyncBatcher>(group_interval);
+    }
+    if (!m_writer_cpus.empty())
+        set_affinity(m_writer_cpus);
+}
+
+/** \brief Закрепить потоки записи и синхронизации
+ *
+ * Функция закрепляет за процессорами \p cpus потоки записи и группового 
+ * fsync всех директорий, в том числе созданные позже функцией 
+ * set_durability().
+ *
+ * \param[in] cpus    Номера процессоров.
+ *
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */
+int Storage::set_affinity(const std::vector<int>& cpus)
+{
+    m_writer_cpus = cpus;
+    for (StorageRoot& root: m_roots)
+    {
+        if (root.writer->set_affinity(cpus) != 0)
+            return -1;
+        if (root.batcher && root.batcher->set_affinity(cpus) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+size_t Storage::size() const
+{
+    return m_roots.size();
+}
+
+StorageRoot& Storage::root(size_t index)
+{
+    return m_roots[index];
+}
+
+const StorageRoot& Storage::root(size_t index) const
+{
+    return m_roots[index];
+}
+
+/** \brief Найти копию файла
+ *
+ * \param[in] name    Имя файла.
+ *
+ * \return Номер директории, в которой есть файл \p name , или -1.
+ */
+int Storage::find(const std::string& name) const
+{
+    struct stat info;
+    for (size_t i = 0; i < m_roots.size(); ++i)
+        if (stat((m_roots[i].dir + name).c_str(), &info) == 0 && S_ISREG(info.st_mode))
+            return static_cast<int>(i);
+    return -1;
+}
+
+/** \brief Выбрать директорию для файла
+ *
+ * Функция выбирает директорию для нового файла \p name и учитывает его как 
+ * файл в записи. Если копия файла уже есть в одной из директорий, 
+ * выбирается она: новая версия заменяет старую, а при дельта-передаче 
+ * старая копия нужна как основа. Иначе директория выбирается по политике.
+ * После сборки файла нужно вызвать release().
+ *
+ * \param[in] name    Имя файла.
+ *
+ * \return Номер директории.
+ */
+size_t Storage::place(const std::string& name)
+{
+    size_t index = 0;
+    int existing = m_roots.size() > 1 ? find(name) : 0;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (existing >= 0)
+    {
+        index = existing;
+    } else if (m_policy == PLACEMENT_HASH) {
+        index = crc32c(0, name.data(), name.size()) % m_roots.size();
+    } else if (m_policy == PLACEMENT_ROUND_ROBIN) {
+        index = m_next++ % m_roots.size();
+    } else {
+        // при равной загрузке директории выбираются по очереди
+        size_t start = m_next++ % m_roots.size();
+        index = start;
+        for (size_t i = 1; i < m_roots.size(); ++i)
+        {
+            size_t candidate = (start + i) % m_roots.size();
+            if (queue_depth(m_roots[candidate]) < queue_depth(m_roots[index]))
+                index = candidate;
+        }
+    }
+    ++m_roots[index].active;
+    return index;
+}
+
+/** \brief Освободить директорию
+ *
+ * \param[in] index        Номер директории из place().
+ * \param[in] bytes        Размер файла.
+ * \param[in] completed    Собран ли файл.
+ */
+void Storage::release(size_t index, uint64_t bytes, bool completed)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    StorageRoot& root = m_roots[index];
+    --root.active;
+    if (completed)
+    {
+        ++root.files;
+        root.bytes += bytes;
+    }
+}
+
+/** \brief Описание директории
+ *
+ * \param[in] index    Номер директории.
+ *
+ * \return Строка со статистикой директории для лога.
+ */
+std::string Storage::describe(size_t index) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::ostringstream os;
+    os << m_roots[index];
+    return os.str();
+}
+
+/** \brief Число файлов, ожидающих fsync
+ *
+ * \return Сумма очередей группового fsync всех директорий.
+ */
+size_t Storage::pending_syncs() const
+{
+    size_t pending = 0;
+    for (const StorageRoot& root: m_roots)
+        if (root.batcher)
+            pending += root.batcher->pending();
+    return pending;
+}
+
+milliseconds Storage::group_interval() const
+{
+    return m_group_interval;
+}
+
+/** \brief Статистика группового fsync
+ *
+ * \return Статистика синхронизации, сложенная по всем директориям. 
+ * Наибольшая задержка - наибольшая среди директорий.
+ */
+SyncStats Storage::get_sync_stats() const
+{
+    SyncStats total;
+    for (const StorageRoot& root: m_roots)
+    {
+        if (!root.batcher)
+            continue;
+        SyncStats stats = root.batcher->get_stats();
+        total.files += stats.files;
+        total.batches += stats.batches;
+        total.errors += stats.errors;
+        total.latency_total_us += stats.latency_total_us;
+        total.latency_max_us = std::max(total.latency_max_us, stats.latency_max_us);
+    }
+    return total;
+}
+
+/** \brief Загрузка директории
+ *
+ * Загрузка считается в единицах ожидающей работы диска: каждый файл в 
+ * записи, каждый файл в очереди fsync и каждый блок в очереди потока 
+ * записи (размером -C, по умолчанию 1 МиБ) - одна единица. Блоки в очереди
+ * показывают, что диск не успевает за приемом, поэтому директория с 
+ * глубокой очередью записи не получает новые файлы, даже если файлов в 
+ * записи у нее меньше.
+ *
+ * \param[in] root    Директория.
+ *
+ * \return Число файлов в записи, файлов, ожидающих fsync, и блоков,
+ * ожидающих записи.
+ */
+uint64_t Storage::queue_depth(const StorageRoot& root) const
+{
+    return root.active + root.writer->pending() +
+           (root.batcher ? root.batcher->pending() : 0);
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "file_writer.h"
+#include "stats.h"
+#include "sync_batcher.h"
+#include "write_queue.h"
+
+using namespace std::chrono;
+
+// выбор директории хранения для нового файла
+enum placement_policies {
+    PLACEMENT_HASH = 0,      // по хешу имени файла
+    PLACEMENT_ROUND_ROBIN,   // по очереди
+    PLACEMENT_LEAST_BUSY     // с наименьшей очередью: файлы в записи и fsync, блоки в очереди записи
+};
+
+bool parse_placement(const std::string& name, placement_policies& policy);
+
+const char *placement_name(placement_policies policy);
+
+bool dir_exists(const std::string& dirname);
+
+struct StorageRoot {
+    std::string dir;                       // с завершающим '/'
+    std::unique_ptr<WriteQueue> writer;    // запись блоков файлов этой директории
+    std::unique_ptr<SyncBatcher> batcher;  // групповой fsync файлов этой директории
+    uint64_t active = 0;                   // файлов в записи
+    uint64_t files  = 0;                   // собранных файлов
+    uint64_t bytes  = 0;                   // байтов в собранных файлах
+};
+
+std::ostream& operator<<(std::ostream& os, const StorageRoot& root);
+
+class Storage {
+public:
+    Storage(const std::vector<std::string>& dirs, placement_policies policy = PLACEMENT_HASH);
+
+    void set_policy(placement_policies policy);
+
+    void set_durability(durability_modes mode, milliseconds group_interval);
+
+    int set_affinity(const std::vector<int>& cpus);
+
+    size_t size() const;
+
+    StorageRoot& root(size_t index);
+
+    const StorageRoot& root(size_t index) const;
+
+    int find(const std::string& name) const;
+
+    size_t place(const std::string& name);
+
+    void release(size_t index, uint64_t bytes, bool completed);
+
+    std::string describe(size_t index) const;
+
+    size_t pending_syncs() const;
+
+    milliseconds group_interval() const;
+
+    SyncStats get_sync_stats() const;
+
+private:
+    mutable std::mutex m_mutex;   // place и release вызываются из потоков пула
+    std::vector<StorageRoot> m_roots;
+    placement_policies m_policy;
+    size_t m_next;
+    milliseconds m_group_interval;
+    std::vector<int> m_writer_cpus;
+
+    uint64_t queue_depth(const StorageRoot& root) const;
+};
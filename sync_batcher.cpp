@@ -0,0 +1,164 @@
+#include "sync_batcher.h"
+#include "affinity.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <set>
+#include <fcntl.h>
+#include <unistd.h>
+
+/** \brief Конструктор группового fsync
+ *
+ * Функция запускает поток, который синхронизирует с диском готовые файлы 
+ * пачками: после прихода первого файла поток ждет \p interval , собирая 
+ * другие файлы, затем вызывает fdatasync для каждого и один fsync для 
+ * каждой директории. Так сотни малых файлов стоят несколько сбросов кеша 
+ * диска, а не по одному на файл, а поток приема не ждет диск.
+ *
+ * \param[in] interval    Время сбора пачки.
+ */
+SyncBatcher::SyncBatcher(milliseconds interval)
+    : m_interval(interval)
+    , m_in_flight(0)
+    , m_stop(false)
+    , m_thread(&SyncBatcher::run, this)
+{}
+
+/** \brief Деструктор группового fsync
+ *
+ * Функция синхронизирует оставшиеся файлы и останавливает поток.
+ */
+SyncBatcher::~SyncBatcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_one();
+    m_thread.join();
+}
+
+/** \brief Поставить файл в очередь синхронизации
+ *
+ * Функция передает потоку синхронизации дескриптор \p fd записанного 
+ * файла \p filename . После синхронизации дескриптор закрывается, а файл 
+ * переименовывается в \p target , если имена различаются: так новая версия
+ * заменяет старую копию только после того, как ее данные на диске.
+ *
+ * \return Квитанция, по которой видно завершение синхронизации.
+ */
+std::shared_ptr<SyncTicket> SyncBatcher::submit(int fd, const std::string& filename,
+                                                const std::string& target)
+{
+    auto ticket = std::make_shared<SyncTicket>();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back({fd, filename, target, steady_clock::now(), ticket});
+    }
+    m_cv.notify_one();
+    return ticket;
+}
+
+/** \brief Число файлов, ожидающих синхронизации
+ *
+ * \return Файлы в очереди и в синхронизируемой пачке.
+ */
+size_t SyncBatcher::pending() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queue.size() + m_in_flight;
+}
+
+milliseconds SyncBatcher::interval() const
+{
+    return m_interval;
+}
+
+/** \brief Закрепить поток синхронизации за процессорами
+ *
+ * \param[in] cpus    Номера процессоров.
+ *
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */
+int SyncBatcher::set_affinity(const std::vector<int>& cpus)
+{
+    return pin_thread(m_thread.native_handle(), cpus);
+}
+
+/** \brief Статистика синхронизации
+ *
+ * \return Копия статистики: файлы, пачки, ошибки и задержка от постановки 
+ * файла в очередь до завершения fsync.
+ */
+SyncStats SyncBatcher::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void SyncBatcher::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_cv.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+        if (m_queue.empty())
+            return;
+        if (!m_stop)
+            m_cv.wait_for(lock, m_interval, [this]() { return m_stop; });
+        std::vector<Request> batch;
+        batch.swap(m_queue);
+        m_in_flight = batch.size();
+        lock.unlock();
+        sync_batch(batch);
+        lock.lock();
+        m_in_flight = 0;
+        auto now = steady_clock::now();
+        ++m_stats.batches;
+        for (const Request& request: batch)
+        {
+            uint64_t latency = duration_cast<microseconds>(now - request.submitted).count();
+            ++m_stats.files;
+            m_stats.latency_total_us += latency;
+            m_stats.latency_max_us = std::max(m_stats.latency_max_us, latency);
+            if (request.ticket->state.load() < 0)
+                ++m_stats.errors;
+        }
+    }
+}
+
+/** \brief Синхронизировать пачку файлов
+ *
+ * Функция сбрасывает на диск данные файлов, переименовывает их и сбрасывает
+ * директории, в которых они лежат, чтобы сохранились и записи о файлах.
+ * Квитанции заполняются в конце, когда сохранено все.
+ */
+void SyncBatcher::sync_batch(std::vector<Request>& batch)
+{
+    std::vector<int> results(batch.size(), 1);
+    std::set<std::string> dirs;
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        Request& request = batch[i];
+        if (fdatasync(request.fd) != 0)
+            results[i] = -errno;
+        close(request.fd);
+        if (results[i] > 0 && request.filename != request.target &&
+            rename(request.filename.c_str(), request.target.c_str()) != 0)
+            results[i] = -errno;
+        size_t slash = request.target.find_last_of('/');
+        dirs.insert(slash == std::string::npos ? "." : request.target.substr(0, slash + 1));
+    }
+    int dir_result = 1;
+    for (const std::string& dir: dirs)
+    {
+        int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0 || fsync(fd) != 0)
+            dir_result = -errno;
+        if (fd >= 0)
+            close(fd);
+    }
+    for (size_t i = 0; i < batch.size(); ++i)
+        batch[i].ticket->state.store(results[i] > 0 ? dir_result : results[i]);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "stats.h"
+
+using namespace std::chrono;
+
+struct SyncTicket {
+    std::atomic<int> state{0};   // 0 - ждет, 1 - на диске, меньше 0 - -errno
+};
+
+class SyncBatcher {
+public:
+    SyncBatcher(milliseconds interval);
+
+    ~SyncBatcher();
+
+    std::shared_ptr<SyncTicket> submit(int fd, const std::string& filename,
+                                       const std::string& target);
+
+    size_t pending() const;
+
+    milliseconds interval() const;
+
+    int set_affinity(const std::vector<int>& cpus);
+
+    SyncStats get_stats() const;
+
+private:
+    struct Request {
+        int fd;
+        std::string filename;
+        std::string target;
+        time_point<steady_clock> submitted;
+        std::shared_ptr<SyncTicket> ticket;
+    };
+
+    milliseconds m_interval;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::vector<Request> m_queue;
+    size_t m_in_flight;
+    bool m_stop;
+    SyncStats m_stats;
+    std::thread m_thread;
+
+    void run();
+
+    void sync_batch(std::vector<Request>& batch);
+};
@@ -0,0 +1,229 @@
+#include "tombstone.h"
+
+#include <algorithm>
+#include <cmath>
+
+static const uint64_t bits_per_word = 64;
+static const double max_fill = 0.5;   // доля битов поколения, после которой оно сменяется досрочно
+
+std::ostream& operator<<(std::ostream& os, const TombstoneStats& stats)
+{
+    return os << "inserted=" << stats.inserted << " rejected=" << stats.rejected
+              << " rotations=" << stats.rotations << " early_rotations=" << stats.early_rotations
+              << " fill=" << stats.fill
+              << " false_positive=" << stats.false_positive;
+}
+
+static uint64_t mix(uint64_t x)
+{
+    // финализатор splitmix64
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/** \brief Идентификатор сессии
+ *
+ * Функция вычисляет 64-битный хеш адреса, порта клиента и идентификатора
+ * потока пакетов. В отличие от make_key() она не создает строку, поэтому
+ * пакеты закрытых сессий отбрасываются до построения ключа.
+ *
+ * \param[in] ip        IPv4 адрес клиента.
+ * \param[in] port      Порт клиента.
+ * \param[in] marker    Идентификатор потока пакетов.
+ *
+ * \return Идентификатор сессии.
+ */
+uint64_t session_id(uint32_t ip, uint16_t port, uint32_t marker)
+{
+    return mix(mix((static_cast<uint64_t>(ip) << 16) | port) ^ marker);
+}
+
+/** \brief Конструктор фильтра закрытых сессий
+ *
+ * Фильтр хранит идентификаторы недавно закрытых сессий в \p generations
+ * фильтрах Блума по \p bits_per_generation битов (округляется вверх до
+ * степени двойки) и \p hashes хеш-функций. Новые идентификаторы попадают в
+ * текущее поколение; каждые lifetime / (generations - 1) самое старое
+ * поколение очищается и становится текущим. Поэтому идентификатор хранится
+ * не меньше \p lifetime и не больше lifetime * generations /
+ * (generations - 1), а память фильтра не зависит от числа закрытых сессий и
+ * пришедших после закрытия пакетов.
+ *
+ * \note
+ * Фильтр Блума не ошибается в сторону пропуска, но может принять новую
+ * сессию за закрытую. Вероятность этого оценивает get_stats().
+ *
+ * \param[in] lifetime               Время хранения идентификатора.
+ * \param[in] generations            Число поколений, не меньше 2.
+ * \param[in] bits_per_generation    Битов в поколении.
+ * \param[in] hashes                 Число хеш-функций.
+ */
+TombstoneFilter::TombstoneFilter(std::chrono::milliseconds lifetime, size_t generations,
+                                 size_t bits_per_generation, unsigned hashes)
+    : m_interval(lifetime / (std::max<size_t>(generations, 2) - 1))
+    , m_rotated(std::chrono::steady_clock::now())
+    , m_generations(std::max<size_t>(generations, 2))
+    , m_current(0)
+    , m_hashes(std::max(hashes, 1u))
+{
+    uint64_t bits = bits_per_word;
+    while (bits < bits_per_generation)
+        bits <<= 1;
+    m_mask = bits - 1;
+    for (auto& generation: m_generations)
+        generation.words.assign(bits / bits_per_word, 0);
+}
+
+/** \brief Запомнить закрытую сессию
+ *
+ * Биты выбираются двойным хешированием: i-й бит - (h1 + i * h2) по модулю
+ * числа битов, где h1 и h2 - младшая и старшая половины \p id .
+ *
+ * Если в текущем поколении установлено больше max_fill битов, поколения 
+ * сменяются сразу, не дожидаясь rotate(): иначе при потоке закрытий 
+ * быстрее расчетного поколение заполнилось бы целиком и фильтр отбрасывал 
+ * бы пакеты всех новых сессий. Цена досрочной смены - самое старое 
+ * поколение очищается раньше, и закрытые сессии хранятся меньше lifetime.
+ *
+ * \param[in] id    Идентификатор сессии, смотрите session_id().
+ *
+ * \return true, если поколения сменены досрочно.
+ */
+bool TombstoneFilter::insert(uint64_t id)
+{
+    Generation& generation = m_generations[m_current];
+    uint64_t h1 = id & 0xffffffffULL;
+    uint64_t h2 = (id >> 32) | 1;
+    for (unsigned i = 0; i < m_hashes; ++i)
+    {
+        uint64_t bit = (h1 + i * h2) & m_mask;
+        uint64_t& word = generation.words[bit / bits_per_word];
+        uint64_t flag = 1ULL << (bit % bits_per_word);
+        if ((word & flag) == 0)
+        {
+            word |= flag;
+            ++generation.bits_set;
+        }
+    }
+    ++m_stats.inserted;
+    if (generation.bits_set <= max_fill * (m_mask + 1))
+        return false;
+    advance();
+    m_rotated = std::chrono::steady_clock::now();
+    ++m_stats.early_rotations;
+    return true;
+}
+
+/** \brief Сменить поколение
+ *
+ * Самое старое поколение очищается и становится текущим.
+ */
+void TombstoneFilter::advance()
+{
+    m_current = (m_current + 1) % m_generations.size();
+    Generation& generation = m_generations[m_current];
+    std::fill(generation.words.begin(), generation.words.end(), 0);
+    generation.bits_set = 0;
+    ++m_stats.rotations;
+}
+
+/** \brief Закрыта ли сессия
+ *
+ * \param[in] id    Идентификатор сессии.
+ *
+ * \return true, если идентификатор есть в одном из поколений.
+ */
+bool TombstoneFilter::contains(uint64_t id) const
+{
+    uint64_t h1 = id & 0xffffffffULL;
+    uint64_t h2 = (id >> 32) | 1;
+    for (const auto& generation: m_generations)
+    {
+        if (generation.bits_set == 0)
+            continue;
+        unsigned i = 0;
+        for (; i < m_hashes; ++i)
+        {
+            uint64_t bit = (h1 + i * h2) & m_mask;
+            if (((generation.words[bit / bits_per_word] >> (bit % bits_per_word)) & 1) == 0)
+                break;
+        }
+        if (i == m_hashes)
+            return true;
+    }
+    return false;
+}
+
+/** \brief Проверить пакет сессии
+ *
+ * В отличие от прежнего черного списка пакет закрытой сессии не продлевает
+ * время ее хранения, поэтому клиент, продолжающий слать пакеты, не
+ * удерживает запись.
+ *
+ * \param[in] id    Идентификатор сессии.
+ *
+ * \return true, если сессия закрыта и пакет нужно отбросить.
+ */
+bool TombstoneFilter::reject(uint64_t id)
+{
+    if (!contains(id))
+        return false;
+    ++m_stats.rejected;
+    return true;
+}
+
+/** \brief Сменить поколения по времени
+ *
+ * Функция очищает самые старые поколения, если с прошлой смены прошло
+ * время жизни поколения. После долгого простоя очищаются все поколения.
+ *
+ * \param[in] now    Текущее время.
+ */
+void TombstoneFilter::rotate(std::chrono::steady_clock::time_point now)
+{
+    size_t steps = 0;
+    while (now - m_rotated >= m_interval && steps < m_generations.size())
+    {
+        m_rotated += m_interval;
+        advance();
+        ++steps;
+    }
+    if (now - m_rotated >= m_interval)
+        m_rotated = now;
+}
+
+/** \brief Память фильтра
+ *
+ * \return Размер битовых карт всех поколений в байтах.
+ */
+size_t TombstoneFilter::memory() const
+{
+    return m_generations.size() * (m_mask + 1) / 8;
+}
+
+/** \brief Статистика фильтра
+ *
+ * Вероятность ложного срабатывания оценивается по заполнению поколений:
+ * для поколения с долей f установленных битов она равна f^k, где k - число
+ * хеш-функций, а для фильтра - вероятности, что сработает хотя бы одно
+ * поколение.
+ *
+ * \return Счетчики, заполнение и оценка вероятности ложного срабатывания.
+ */
+TombstoneStats TombstoneFilter::get_stats() const
+{
+    TombstoneStats stats = m_stats;
+    double pass = 1;
+    for (const auto& generation: m_generations)
+    {
+        double fill = static_cast<double>(generation.bits_set) / (m_mask + 1);
+        stats.fill = std::max(stats.fill, fill);
+        pass *= 1 - std::pow(fill, m_hashes);
+    }
+    stats.false_positive = 1 - pass;
+    return stats;
+}
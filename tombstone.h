@@ -0,0 +1,54 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+struct TombstoneStats {
+    uint64_t inserted    = 0;   // закрытых сессий
+    uint64_t rejected    = 0;   // отброшенных пакетов закрытых сессий
+    uint64_t rotations   = 0;   // смен поколений
+    uint64_t early_rotations = 0;   // из них досрочно из-за заполнения
+    double fill          = 0;   // доля установленных битов самого полного поколения
+    double false_positive = 0;  // оценка вероятности ложного срабатывания
+};
+
+std::ostream& operator<<(std::ostream& os, const TombstoneStats& stats);
+
+uint64_t session_id(uint32_t ip, uint16_t port, uint32_t marker);
+
+// Фильтр Блума по поколениям для недавно закрытых сессий
+class TombstoneFilter {
+public:
+    TombstoneFilter(std::chrono::milliseconds lifetime, size_t generations,
+                    size_t bits_per_generation, unsigned hashes);
+
+    bool insert(uint64_t id);
+
+    bool contains(uint64_t id) const;
+
+    bool reject(uint64_t id);
+
+    void rotate(std::chrono::steady_clock::time_point now);
+
+    size_t memory() const;
+
+    TombstoneStats get_stats() const;
+
+private:
+    struct Generation {
+        std::vector<uint64_t> words;
+        uint64_t bits_set = 0;
+    };
+
+    std::chrono::milliseconds m_interval;   // время жизни одного поколения
+    std::chrono::steady_clock::time_point m_rotated;
+    std::vector<Generation> m_generations;
+    size_t m_current;
+    uint64_t m_mask;                        // число битов поколения - 1
+    unsigned m_hashes;
+    TombstoneStats m_stats;
+
+    void advance();
+};
@@ -0,0 +1,113 @@
+#include "trace.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/** \brief Имя события
+ *
+ * \param[in] event    Событие из trace_events.
+ *
+ * \return Имя события для вывода.
+ */
+const char *trace_event_name(uint32_t event)
+{
+    static const char *names[TRACE_EVENT_COUNT] = {
+        "unknown", "receive", "duplicate", "validate", "session", "insert", "write",
+        "complete"
+    };
+    return event < TRACE_EVENT_COUNT ? names[event] : names[0];
+}
+
+/** \brief Имя аргумента события
+ *
+ * \param[in] event    Событие из trace_events.
+ * \param[in] arg      0 для аргумента a, 1 для аргумента b.
+ *
+ * \return Имя аргумента или nullptr, если событие его не использует.
+ */
+const char *trace_event_arg(uint32_t event, int arg)
+{
+    static const char *args[TRACE_EVENT_COUNT][2] = {
+        {"a", "b"},
+        {"size", "number"},
+        {"number", nullptr},
+        {"number", "valid"},
+        {"sessions", "created"},
+        {"sequence", "queued"},
+        {"sequence", "file_size"},
+        {"file_size", "packages"}
+    };
+    if (arg < 0 || arg > 1)
+        return nullptr;
+    return event < TRACE_EVENT_COUNT ? args[event][arg] : args[0][arg];
+}
+
+#ifdef TRACE
+
+static const uint64_t trace_capacity = 1 << 17;    // записей в кольце потока, 4 МиБ
+
+thread_local TraceRing *trace_ring = nullptr;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/** \brief Создать кольцевой буфер потока
+ *
+ * Функция создает файл primetech.<pid>.<tid>.trace в директории из 
+ * переменной окружения PRIMETECH_TRACE_DIR (по умолчанию в текущей) и 
+ * отображает его в память. Если файл создать не удалось, события пишутся в
+ * анонимную память и теряются при завершении процесса.
+ *
+ * \return Кольцевой буфер текущего потока.
+ */
+TraceRing *trace_open_ring()
+{
+    const size_t size = sizeof(TraceFileHeader) + trace_capacity * sizeof(TraceRecord);
+    const char *dir = getenv("PRIMETECH_TRACE_DIR");
+    uint64_t pid = getpid();
+    uint64_t tid = syscall(SYS_gettid);
+    std::string filename = std::string(dir != nullptr ? dir : ".") + "/primetech." + 
+                           std::to_string(pid) + "." + std::to_string(tid) + ".trace";
+    void *mapped = MAP_FAILED;
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0 && ftruncate(fd, size) == 0)
+        mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd >= 0)
+        close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        std::cerr << "[WARNING] не удалось создать файл трассировки " << filename 
+                  << ": " << strerror(errno) << std::endl;
+        mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, 
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED)
+            abort();
+    }
+    TraceRing *ring = new TraceRing;
+    ring->header = static_cast<TraceFileHeader *>(mapped);
+    ring->records = reinterpret_cast<TraceRecord *>(ring->header + 1);
+    ring->mask = trace_capacity - 1;
+    memcpy(ring->header->magic, TRACE_MAGIC, sizeof(ring->header->magic));
+    ring->header->version = TRACE_VERSION;
+    ring->header->record_size = sizeof(TraceRecord);
+    ring->header->capacity = trace_capacity;
+    ring->header->pid = pid;
+    ring->header->tid = tid;
+    ring->header->monotonic_start_ns = clock_ns(CLOCK_MONOTONIC);
+    ring->header->realtime_start_ns = clock_ns(CLOCK_REALTIME);
+    ring->header->head = 0;
+    trace_ring = ring;
+    return ring;
+}
+
+#endif
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+
+// Точки трассировки горячего пути сервера. Включаются при сборке с флагом
+// -DTRACE (make TRACE=1). Без флага макрос TRACEPOINT не вычисляет свои 
+// аргументы и не порождает кода. С флагом каждое событие записывается в 
+// кольцевой буфер потока, отображенный в файл, поэтому последние события 
+// сохраняются даже при аварийном завершении процесса. Файлы читает утилита
+// udp_trace_decode.
+
+#define TRACE_MAGIC    "PTTRACE1"
+#define TRACE_VERSION  1
+
+enum trace_events {
+    TRACE_RECEIVE = 1,  // датаграмма принята: a - размер, b - номер пакета
+    TRACE_DUPLICATE,    // повтор отброшен: a - номер пакета
+    TRACE_VALIDATE,     // проверка пакета: a - номер пакета, b - 1, если пакет корректен
+    TRACE_SESSION,      // поиск сборщика: a - число сборщиков, b - 1, если сборщик создан
+    TRACE_INSERT,       // пакет сохранен до записи: a - полный номер, b - длина очереди
+    TRACE_WRITE,        // пакет записан: a - полный номер, b - размер файла
+    TRACE_COMPLETE,     // файл собран: a - размер файла, b - число пакетов
+    TRACE_EVENT_COUNT
+};
+
+const char *trace_event_name(uint32_t event);
+
+const char *trace_event_arg(uint32_t event, int arg);
+
+struct TraceRecord {
+    uint64_t ns;        // CLOCK_MONOTONIC
+    uint32_t event;
+    uint32_t marker;
+    uint64_t a;
+    uint64_t b;
+};
+
+struct TraceFileHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;          // число записей в кольце, степень двойки
+    uint64_t pid;
+    uint64_t tid;
+    uint64_t monotonic_start_ns;
+    uint64_t realtime_start_ns;
+    uint64_t head;              // число записанных событий
+};
+
+#ifdef TRACE
+
+struct TraceRing {
+    TraceFileHeader *header;
+    TraceRecord *records;
+    uint64_t mask;
+};
+
+extern thread_local TraceRing *trace_ring;
+
+TraceRing *trace_open_ring();
+
+inline void trace_record(uint32_t event, uint32_t marker, uint64_t a, uint64_t b)
+{
+    TraceRing *ring = trace_ring;
+    if (ring == nullptr)
+        ring = trace_open_ring();
+    uint64_t head = ring->header->head;
+    TraceRecord& record = ring->records[head & ring->mask];
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    record.ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+    record.event = event;
+    record.marker = marker;
+    record.a = a;
+    record.b = b;
+    __atomic_store_n(&ring->header->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#define TRACEPOINT(event, marker, a, b) \
+    trace_record(TRACE_##event, (marker), (a), (b))
+
+#else
+
+#define TRACEPOINT(event, marker, a, b) \
+    do { (void)sizeof(TRACE_##event); (void)sizeof(marker); \
+         (void)sizeof(a); (void)sizeof(b); } while (0)
+
+#endif
@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "trace.h"
+
+// Утилита читает файлы трассировки сервера, собранного с TRACE=1, и выводит
+// события всех потоков в порядке времени: текстом, в формате CSV или сводкой
+// по событиям и файлам.
+
+struct DecodedRecord {
+    uint64_t tid;
+    TraceRecord record;
+};
+
+struct MarkerSummary {
+    uint64_t first_ns = 0;
+    uint64_t last_ns = 0;
+    uint64_t complete_ns = 0;
+    uint64_t events = 0;
+};
+
+/** \brief Прочитать файл трассировки
+ *
+ * Функция проверяет заголовок файла \p filename и добавляет в \p records 
+ * события, которые еще находятся в кольце: последние capacity событий.
+ *
+ * \return true, если файл прочитан, false иначе.
+ */
+static bool read_trace(const std::string& filename, std::vector<DecodedRecord>& records)
+{
+    std::ifstream in(filename, std::ios::binary);
+    TraceFileHeader header;
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)))
+    {
+        std::cerr << "Ошибка: " << filename << ": файл короче заголовка" << std::endl;
+        return false;
+    }
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord) ||
+        header.capacity == 0)
+    {
+        std::cerr << "Ошибка: " << filename << ": не файл трассировки" << std::endl;
+        return false;
+    }
+    uint64_t count = std::min(header.head, header.capacity);
+    uint64_t first = header.head - count;
+    std::vector<TraceRecord> ring(header.capacity);
+    in.read(reinterpret_cast<char *>(ring.data()), header.capacity * sizeof(TraceRecord));
+    if (!in)
+    {
+        std::cerr << "Ошибка: " << filename << ": файл обрезан" << std::endl;
+        return false;
+    }
+    for (uint64_t i = first; i < header.head; ++i)
+        records.push_back({header.tid, ring[i % header.capacity]});
+    std::cerr << "# " << filename << " pid=" << header.pid << " tid=" << header.tid
+              << " events=" << header.head << " lost=" << first << std::endl;
+    return true;
+}
+
+static void print_text(const std::vector<DecodedRecord>& records)
+{
+    uint64_t start = records.empty() ? 0 : records.front().record.ns;
+    for (const auto& decoded: records)
+    {
+        const TraceRecord& r = decoded.record;
+        std::cout << std::fixed << std::setprecision(6) << std::setw(12)
+                  << (r.ns - start) / 1e9 << " tid=" << decoded.tid
+                  << " " << std::left << std::setw(9) << trace_event_name(r.event) 
+                  << std::right << " marker=" << r.marker;
+        const char *a = trace_event_arg(r.event, 0);
+        const char *b = trace_event_arg(r.event, 1);
+        if (a != nullptr)
+            std::cout << " " << a << "=" << r.a;
+        if (b != nullptr)
+            std::cout << " " << b << "=" << r.b;
+        std::cout << std::endl;
+    }
+}
+
+static void print_csv(const std::vector<DecodedRecord>& records)
+{
+    std::cout << "ns,tid,event,marker,a,b" << std::endl;
+    for (const auto& decoded: records)
+    {
+        const TraceRecord& r = decoded.record;
+        std::cout << r.ns << "," << decoded.tid << "," << trace_event_name(r.event)
+                  << "," << r.marker << "," << r.a << "," << r.b << std::endl;
+    }
+}
+
+/** \brief Сводка трассировки
+ *
+ * Функция выводит число событий каждого типа и для каждого идентификатора
+ * файла - время от первого события до сборки файла.
+ */
+static void print_summary(const std::vector<DecodedRecord>& records)
+{
+    uint64_t counts[TRACE_EVENT_COUNT] = {};
+    std::map<uint32_t, MarkerSummary> markers;
+    for (const auto& decoded: records)
+    {
+        const TraceRecord& r = decoded.record;
+        ++counts[r.event < TRACE_EVENT_COUNT ? r.event : 0];
+        MarkerSummary& summary = markers[r.marker];
+        if (summary.events++ == 0)
+            summary.first_ns = r.ns;
+        summary.last_ns = r.ns;
+        if (r.event == TRACE_COMPLETE)
+            summary.complete_ns = r.ns;
+    }
+    for (uint32_t event = 0; event < TRACE_EVENT_COUNT; ++event)
+        if (counts[event] > 0)
+            std::cout << std::left << std::setw(10) << trace_event_name(event) 
+                      << std::right << std::setw(12) << counts[event] << std::endl;
+    for (const auto& item: markers)
+    {
+        const MarkerSummary& s = item.second;
+        std::cout << "marker=" << item.first << " events=" << s.events
+                  << std::fixed << std::setprecision(3)
+                  << " span_ms=" << (s.last_ns - s.first_ns) / 1e6;
+        if (s.complete_ns != 0)
+            std::cout << " complete_ms=" << (s.complete_ns - s.first_ns) / 1e6;
+        std::cout << std::endl;
+    }
+}
+
+static void print_usage(char *program_name)
+{
+    std::cout << "Используйте: " << program_name << " [-c | -s] <файл трассировки>..." 
+              << std::endl
+              << "  -c    вывод в формате CSV" << std::endl
+              << "  -s    число событий по типам и время сборки каждого файла" 
+              << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    bool csv = false;
+    bool summary = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "cs")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            csv = true;
+            break;
+        case 's':
+            summary = true;
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (optind == argc)
+    {
+        print_usage(argv[0]);
+        exit(1);
+    }
+    std::vector<DecodedRecord> records;
+    for (int i = optind; i < argc; ++i)
+        if (!read_trace(argv[i], records))
+            exit(1);
+    std::stable_sort(records.begin(), records.end(),
+                     [](const DecodedRecord& l, const DecodedRecord& r) {
+                         return l.record.ns < r.record.ns;
+                     });
+    if (summary)
+        print_summary(records);
+    else if (csv)
+        print_csv(records);
+    else
+        print_text(records);
+    return 0;
+}
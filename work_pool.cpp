@@ -0,0 +1,235 @@
+#include "work_pool.h"
+#include "affinity.h"
+
+static const size_t strand_batch = 64;          // задач сессии подряд, затем очередь уступает другим
+static const size_t strand_quantum = 32 * 1024;  // байтов датаграмм сессии за один запуск
+
+std::ostream& operator<<(std::ostream& os, const WorkPoolStats& stats)
+{
+    return os << "tasks=" << stats.tasks << " runs=" << stats.runs
+              << " steals=" << stats.steals << " pin_errors=" << stats.pin_errors
+              << " deferred=" << stats.deferred;
+}
+
+/** \brief Простаивает ли очередь
+ *
+ * \return true, если в очереди нет задач и она не выполняется.
+ */
+bool Strand::idle() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return !m_scheduled && m_tasks.empty();
+}
+
+/** \brief Конструктор пула потоков
+ *
+ * Функция запускает \p threads потоков для вычислений сессий. У каждого
+ * потока свой дек очередей сессий (Strand). Поток берет очереди из начала
+ * своего дека, а когда он пуст - из конца дека другого потока. Задачи одной
+ * очереди выполняет только один поток за раз и в порядке постановки, поэтому
+ * задачи одной сессии не требуют блокировок, а разные сессии обрабатываются
+ * на всех ядрах. Если \p threads равно 0, задачи выполняются сразу в
+ * вызывающем потоке. Если задан список \p cpus , потоки по очереди 
+ * закрепляются за его процессорами, и память потока, в том числе его пул 
+ * пакетов, выделяется на узле NUMA процессора.
+ *
+ * \param[in] threads    Число потоков.
+ * \param[in] cpus       Номера процессоров или пустой список.
+ */
+WorkPool::WorkPool(size_t threads, const std::vector<int>& cpus)
+    : m_cpus(cpus)
+    , m_queued(0)
+    , m_next(0)
+    , m_stop(false)
+    , m_tasks(0)
+    , m_runs(0)
+    , m_steals(0)
+    , m_pin_errors(0)
+    , m_deferred(0)
+{
+    for (size_t i = 0; i < threads; ++i)
+        m_workers.emplace_back(new Worker);
+    for (size_t i = 0; i < threads; ++i)
+        m_workers[i]->thread = std::thread(&WorkPool::run, this, i);
+}
+
+/** \brief Деструктор пула потоков
+ *
+ * Функция останавливает потоки, когда в деках не останется очередей, то 
+ * есть после выполнения всех поставленных задач, в том числе не начатых:
+ * поток перед сном берет очереди своего и чужих деков. Задачи держат 
+ * указатели на сессии и должны выполниться, например проверка сессии 
+ * снимает флаг Session::checking, поэтому деструктор может ждать, пока 
+ * пул разбирает накопленную работу. Ставить задачи во время работы 
+ * деструктора нельзя.
+ */
+WorkPool::~WorkPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    for (auto& worker: m_workers)
+        worker->thread.join();
+}
+
+size_t WorkPool::size() const
+{
+    return m_workers.size();
+}
+
+std::shared_ptr<Strand> WorkPool::make_strand()
+{
+    return std::make_shared<Strand>();
+}
+
+/** \brief Поставить задачу в очередь сессии
+ *
+ * Если очередь \p strand не выполняется и не ждет потока, она ставится в дек
+ * следующего по кругу потока, и один спящий поток просыпается.
+ *
+ * \param[in] strand    Очередь сессии.
+ * \param[in] task      Задача.
+ * \param[in] cost      Размер обрабатываемых задачей данных в байтах,
+ *                      смотрите run_strand().
+ */
+void WorkPool::post(const std::shared_ptr<Strand>& strand, std::function<void()> task,
+                    size_t cost)
+{
+    if (m_workers.empty())
+    {
+        task();
+        ++m_tasks;
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(strand->m_mutex);
+        strand->m_tasks.push_back({std::move(task), cost});
+        if (strand->m_scheduled)
+            return;
+        strand->m_scheduled = true;
+    }
+    schedule(m_next++ % m_workers.size(), strand);
+}
+
+void WorkPool::schedule(size_t index, std::shared_ptr<Strand> strand)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_workers[index]->mutex);
+        m_workers[index]->strands.push_back(std::move(strand));
+    }
+    ++m_queued;
+    {
+        // поток мог проверить m_queued и еще не уснуть
+        std::lock_guard<std::mutex> lock(m_mutex);
+    }
+    m_cv.notify_one();
+}
+
+/** \brief Взять очередь для выполнения
+ *
+ * \param[in] index    Номер потока.
+ *
+ * \return Очередь из своего дека, чужого дека или nullptr.
+ */
+std::shared_ptr<Strand> WorkPool::take(size_t index)
+{
+    std::shared_ptr<Strand> strand;
+    for (size_t i = 0; i < m_workers.size() && !strand; ++i)
+    {
+        Worker& worker = *m_workers[(index + i) % m_workers.size()];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.strands.empty())
+            continue;
+        if (i == 0)
+        {
+            strand = std::move(worker.strands.front());
+            worker.strands.pop_front();
+        } else {
+            strand = std::move(worker.strands.back());
+            worker.strands.pop_back();
+            ++m_steals;
+        }
+    }
+    if (strand)
+        --m_queued;
+    return strand;
+}
+
+/** \brief Выполнить задачи очереди
+ *
+ * Очереди обслуживаются по алгоритму deficit round robin: при каждом
+ * запуске очередь \p strand получает strand_quantum байтов и выполняет
+ * задачи, пока их стоимость укладывается в накопленный квант, но не больше
+ * strand_batch задач. Если задачи остались, очередь ставится в конец
+ * своего дека с остатком кванта, а опустевшая очередь остаток теряет.
+ * Поэтому сессия большого файла получает за круг столько же байтов,
+ * сколько сессия маленького, и пакеты маленьких файлов не ждут за длинной
+ * очередью большого.
+ */
+void WorkPool::run_strand(size_t index, std::shared_ptr<Strand> strand)
+{
+    ++m_runs;
+    {
+        std::lock_guard<std::mutex> lock(strand->m_mutex);
+        strand->m_deficit += strand_quantum;
+    }
+    for (size_t done = 0; ; ++done)
+    {
+        std::function<void()> task;
+        {
+            std::lock_guard<std::mutex> lock(strand->m_mutex);
+            if (strand->m_tasks.empty())
+            {
+                strand->m_scheduled = false;
+                strand->m_deficit = 0;
+                return;
+            }
+            if (done == strand_batch || strand->m_tasks.front().cost > strand->m_deficit)
+                break;
+            strand->m_deficit -= strand->m_tasks.front().cost;
+            task = std::move(strand->m_tasks.front().run);
+            strand->m_tasks.pop_front();
+        }
+        task();
+        ++m_tasks;
+    }
+    ++m_deferred;
+    schedule(index, std::move(strand));
+}
+
+void WorkPool::run(size_t index)
+{
+    if (!m_cpus.empty() && pin_current_thread({m_cpus[index % m_cpus.size()]}) != 0)
+        ++m_pin_errors;
+    while (true)
+    {
+        std::shared_ptr<Strand> strand = take(index);
+        if (strand)
+        {
+            run_strand(index, std::move(strand));
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this] { return m_stop || m_queued > 0; });
+        if (m_stop)
+            return;
+    }
+}
+
+/** \brief Статистика пула
+ *
+ * \return Число выполненных задач, запусков очередей, взятых у других
+ * потоков очередей и запусков, прерванных исчерпанием кванта.
+ */
+WorkPoolStats WorkPool::get_stats() const
+{
+    WorkPoolStats stats;
+    stats.tasks = m_tasks;
+    stats.runs = m_runs;
+    stats.steals = m_steals;
+    stats.pin_errors = m_pin_errors;
+    stats.deferred = m_deferred;
+    return stats;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+struct WorkPoolStats {
+    uint64_t tasks      = 0;   // выполнено задач
+    uint64_t runs       = 0;   // запусков очередей сессий
+    uint64_t steals     = 0;   // очередей, взятых у другого потока
+    uint64_t pin_errors = 0;   // потоков, не закрепленных за процессором
+    uint64_t deferred   = 0;   // запусков, прерванных исчерпанием кванта
+};
+
+std::ostream& operator<<(std::ostream& os, const WorkPoolStats& stats);
+
+// Очередь задач одной сессии: задачи выполняются по одной и по порядку
+class Strand {
+public:
+    bool idle() const;
+
+private:
+    friend class WorkPool;
+
+    struct Task {
+        std::function<void()> run;
+        size_t cost;               // байтов, учитываемых в кванте
+    };
+
+    mutable std::mutex m_mutex;
+    std::deque<Task> m_tasks;
+    bool m_scheduled = false;   // очередь стоит в деке потока или выполняется
+    size_t m_deficit = 0;       // неизрасходованный квант, байтов
+};
+
+class WorkPool {
+public:
+    WorkPool(size_t threads, const std::vector<int>& cpus = std::vector<int>());
+
+    ~WorkPool();
+
+    size_t size() const;
+
+    std::shared_ptr<Strand> make_strand();
+
+    void post(const std::shared_ptr<Strand>& strand, std::function<void()> task,
+              size_t cost = 0);
+
+    WorkPoolStats get_stats() const;
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::shared_ptr<Strand>> strands;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::vector<int> m_cpus;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::atomic<size_t> m_queued;
+    std::atomic<size_t> m_next;
+    bool m_stop;
+    std::atomic<uint64_t> m_tasks;
+    std::atomic<uint64_t> m_runs;
+    std::atomic<uint64_t> m_steals;
+    std::atomic<uint64_t> m_pin_errors;
+    std::atomic<uint64_t> m_deferred;
+
+    void schedule(size_t index, std::shared_ptr<Strand> strand);
+
+    std::shared_ptr<Strand> take(size_t index);
+
+    void run_strand(size_t index, std::shared_ptr<Strand> strand);
+
+    void run(size_t index);
+};
@@ -0,0 +1,164 @@
+#include "write_queue.h"
+#include "affinity.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+/** \brief Конструктор потока записи
+ *
+ * Функция запускает поток, который пишет в файлы блоки, заполненные
+ * потоками приема и пула. У каждой директории хранения свой поток, поэтому
+ * медленный диск задерживает только файлы своей директории, а записи на
+ * разные диски идут параллельно, даже если пакеты разбирает один поток.
+ */
+WriteQueue::WriteQueue()
+    : m_in_flight(0)
+    , m_stop(false)
+    , m_thread(&WriteQueue::run, this)
+{}
+
+/** \brief Деструктор потока записи
+ *
+ * Функция записывает оставшиеся блоки и останавливает поток.
+ */
+WriteQueue::~WriteQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_one();
+    m_thread.join();
+}
+
+/** \brief Поставить блок в очередь записи
+ *
+ * Функция передает потоку записи \p size байтов \p data , которые нужно
+ * записать в файл \p fd с его текущего смещения. Блоки одного файла
+ * пишутся в порядке постановки. Данные и дескриптор должны оставаться
+ * действительными, пока квитанция не покажет завершение.
+ *
+ * \return Квитанция, по которой видно завершение записи.
+ */
+std::shared_ptr<WriteTicket> WriteQueue::submit(int fd, const char *data, size_t size)
+{
+    auto ticket = std::make_shared<WriteTicket>();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back({fd, data, size, ticket});
+    }
+    m_cv.notify_one();
+    return ticket;
+}
+
+/** \brief Дождаться записи блока
+ *
+ * Время ожидания учитывается в статистике: оно показывает, что диск
+ * директории не успевает за приемом.
+ *
+ * \param[in] ticket    Квитанция из submit().
+ */
+void WriteQueue::wait(const WriteTicket& ticket)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (ticket.state.load() != WRITE_PENDING)
+        return;
+    auto started = steady_clock::now();
+    m_done.wait(lock, [&ticket]() { return ticket.state.load() != WRITE_PENDING; });
+    ++m_stats.waits;
+    m_stats.wait_us += duration_cast<microseconds>(steady_clock::now() - started).count();
+}
+
+/** \brief Число блоков, ожидающих записи
+ *
+ * \return Блоки в очереди и записываемый блок.
+ */
+size_t WriteQueue::pending() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queue.size() + m_in_flight;
+}
+
+/** \brief Закрепить поток записи за процессорами
+ *
+ * \param[in] cpus    Номера процессоров.
+ *
+ * \return 0, в случае успеха, -1 иначе, код ошибки в errno.
+ */
+int WriteQueue::set_affinity(const std::vector<int>& cpus)
+{
+    return pin_thread(m_thread.native_handle(), cpus);
+}
+
+/** \brief Статистика записи
+ *
+ * \return Копия статистики: блоки, байты, ошибки и ожидание записи.
+ */
+WriteStats WriteQueue::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void WriteQueue::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_cv.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+        if (m_queue.empty())
+            return;
+        Request request = m_queue.front();
+        m_queue.pop_front();
+        m_in_flight = 1;
+        lock.unlock();
+        int result = write_chunk(request);
+        lock.lock();
+        m_in_flight = 0;
+        ++m_stats.chunks;
+        m_stats.bytes += request.size;
+        if (result < 0)
+            ++m_stats.errors;
+        // состояние меняется под мьютексом, чтобы wait() не пропустил оповещение
+        request.ticket->state.store(result);
+        m_done.notify_all();
+    }
+}
+
+/** \brief Записать блок
+ *
+ * Если файловая система приняла O_DIRECT, но не поддерживает такую запись,
+ * флаг выключается, и блок пишется через кеш.
+ *
+ * \return WRITE_DONE или WRITE_DONE_BUFFERED, в случае успеха, -errno иначе.
+ */
+int WriteQueue::write_chunk(const Request& request)
+{
+    const char *data = request.data;
+    size_t size = request.size;
+    int result = WRITE_DONE;
+    while (size > 0)
+    {
+        ssize_t written = ::write(request.fd, data, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0 && errno == EINVAL)
+        {
+            int flags = fcntl(request.fd, F_GETFL);
+            if (flags >= 0 && (flags & O_DIRECT) &&
+                fcntl(request.fd, F_SETFL, flags & ~O_DIRECT) == 0)
+            {
+                result = WRITE_DONE_BUFFERED;
+                continue;
+            }
+            errno = EINVAL;
+        }
+        if (written < 0)
+            return -errno;
+        data += written;
+        size -= written;
+    }
+    return result;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "stats.h"
+
+using namespace std::chrono;
+
+// состояние блока: 0 - ждет, 1 - записан, 2 - записан без O_DIRECT, меньше 0 - -errno
+enum write_ticket_states {
+    WRITE_PENDING = 0,
+    WRITE_DONE,
+    WRITE_DONE_BUFFERED
+};
+
+struct WriteTicket {
+    std::atomic<int> state{WRITE_PENDING};
+};
+
+// поток записи блоков файлов одной директории хранения
+class WriteQueue {
+public:
+    WriteQueue();
+
+    ~WriteQueue();
+
+    std::shared_ptr<WriteTicket> submit(int fd, const char *data, size_t size);
+
+    void wait(const WriteTicket& ticket);
+
+    size_t pending() const;
+
+    int set_affinity(const std::vector<int>& cpus);
+
+    WriteStats get_stats() const;
+
+private:
+    struct Request {
+        int fd;
+        const char *data;
+        size_t size;
+        std::shared_ptr<WriteTicket> ticket;
+    };
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;     // новые блоки
+    std::condition_variable m_done;   // записанные блоки
+    std::deque<Request> m_queue;
+    size_t m_in_flight;
+    bool m_stop;
+    WriteStats m_stats;
+    std::thread m_thread;
+
+    void run();
+
+    int write_chunk(const Request& request);
+};
@@ -0,0 +1,434 @@
+#include "xdp_receiver.h"
+#include "package.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+static const uint32_t frame_size = 2048;      // наименьший размер кадра UMEM, больше MAX_PACKAGE_SIZE
+static const uint32_t umem_frames = 4096;     // кадров UMEM, 8 МиБ
+static const uint32_t rx_ring_size = 2048;
+static const uint32_t completion_ring_size = 64;  // передача через AF_XDP не используется
+static const uint32_t max_queues = 64;        // размер XSKMAP
+static const size_t eth_header = 14;
+static const size_t udp_header = 8;
+static const size_t bpf_log_size = 64 * 1024;
+
+std::ostream& operator<<(std::ostream& os, const XdpStats& stats)
+{
+    return os << "frames=" << stats.frames << " bytes=" << stats.bytes
+              << " invalid=" << stats.invalid << " rx_dropped=" << stats.rx_dropped
+              << " ring_full=" << stats.ring_full << " fill_empty=" << stats.fill_empty;
+}
+
+/** \brief Разбор параметров приема AF_XDP
+ *
+ * \param[in]  spec      Строка [drv:]<интерфейс>[:<очередь>]. Префикс drv
+ *                       выбирает режим драйвера, без него используется
+ *                       универсальный режим (SKB), работающий с любой картой
+ *                       и с veth.
+ * \param[out] ifname    Имя интерфейса.
+ * \param[out] queue     Номер очереди приема, по умолчанию 0.
+ * \param[out] native    true для режима драйвера.
+ *
+ * \return true, если строка корректна, false иначе.
+ */
+bool parse_xdp(const std::string& spec, std::string& ifname, uint32_t& queue, bool& native)
+{
+    std::string rest = spec;
+    native = rest.compare(0, 4, "drv:") == 0;
+    if (native)
+        rest = rest.substr(4);
+    size_t colon = rest.find(':');
+    ifname = rest.substr(0, colon);
+    queue = 0;
+    if (colon != std::string::npos)
+    {
+        std::string number = rest.substr(colon + 1);
+        if (number.empty() || number.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+        queue = std::stoul(number);
+    }
+    return !ifname.empty() && queue < max_queues;
+}
+
+static int sys_bpf(int cmd, bpf_attr& attr)
+{
+    return syscall(SYS_bpf, cmd, &attr, sizeof(attr));
+}
+
+static bpf_insn insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+    bpf_insn result;
+    result.code = code;
+    result.dst_reg = dst;
+    result.src_reg = src;
+    result.off = off;
+    result.imm = imm;
+    return result;
+}
+
+/** \brief Конструктор приема AF_XDP
+ *
+ * Функция создает сокет AF_XDP с областью кадров UMEM на очереди \p queue
+ * интерфейса \p ifname и подключает к интерфейсу программу XDP. Программа
+ * перенаправляет в сокет датаграммы UDP на адрес и порт \p addr (адрес
+ * 0.0.0.0 - на любой адрес интерфейса), а остальные кадры, фрагменты IP и
+ * пакеты с опциями IP пропускает в сетевой стек ядра. Поэтому сокет UDP
+ * сервера остается рабочим: через него уходят ответы, и через него
+ * принимаются пакеты других очередей. Программа и сокет создаются
+ * системными вызовами bpf и socket, без libbpf. Программа отключается при
+ * удалении объекта.
+ *
+ * \exception runtime_error
+ * AF_XDP недоступен: нет прав (CAP_NET_ADMIN, CAP_BPF), ядро старше 5.9,
+ * интерфейс не найден или драйвер не поддерживает выбранный режим.
+ *
+ * \param[in] ifname    Имя интерфейса.
+ * \param[in] queue     Номер очереди приема.
+ * \param[in] addr      Адрес и порт сервера.
+ * \param[in] native    true - режим драйвера, false - универсальный режим.
+ */
+XdpReceiver::XdpReceiver(const std::string& ifname, uint32_t queue, const sockaddr_in& addr,
+                         bool native)
+    : m_socket(-1)
+    , m_map(-1)
+    , m_prog(-1)
+    , m_link(-1)
+    , m_umem(nullptr)
+    , m_umem_size(static_cast<size_t>(umem_frames) * frame_size)
+{
+    int ifindex = if_nametoindex(ifname.c_str());
+    if (ifindex == 0)
+        throw std::runtime_error("interface not found: " + ifname);
+    try
+    {
+        create_socket(umem_frames);
+        sockaddr_xdp sxdp;
+        memset(&sxdp, 0, sizeof(sxdp));
+        sxdp.sxdp_family = AF_XDP;
+        sxdp.sxdp_ifindex = ifindex;
+        sxdp.sxdp_queue_id = queue;
+        sxdp.sxdp_flags = native ? 0 : XDP_COPY;
+        if (bind(m_socket, reinterpret_cast<sockaddr *>(&sxdp), sizeof(sxdp)) != 0)
+            throw std::runtime_error(std::string("bind AF_XDP: ") + strerror(errno));
+        load_program(addr);
+        bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = m_map;
+        attr.key = reinterpret_cast<uint64_t>(&queue);
+        attr.value = reinterpret_cast<uint64_t>(&m_socket);
+        if (sys_bpf(BPF_MAP_UPDATE_ELEM, attr) != 0)
+            throw std::runtime_error(std::string("XSKMAP update: ") + strerror(errno));
+        attach(ifindex, native);
+    }
+    catch (const std::runtime_error&)
+    {
+        release();
+        throw;
+    }
+}
+
+XdpReceiver::~XdpReceiver()
+{
+    release();
+}
+
+/** \brief Освободить ресурсы
+ *
+ * Закрытие связи программы с интерфейсом отключает программу XDP.
+ */
+void XdpReceiver::release()
+{
+    if (m_link >= 0)
+        close(m_link);
+    if (m_prog >= 0)
+        close(m_prog);
+    if (m_map >= 0)
+        close(m_map);
+    for (Ring *ring: {&m_rx, &m_fill, &m_completion})
+        if (ring->map != nullptr)
+            munmap(ring->map, ring->map_size);
+    if (m_socket >= 0)
+        close(m_socket);
+    if (m_umem != nullptr)
+        munmap(m_umem, m_umem_size);
+    m_link = m_prog = m_map = m_socket = -1;
+    m_umem = nullptr;
+    m_rx = m_fill = m_completion = Ring();
+}
+
+/** \brief Создать сокет и UMEM
+ *
+ * Функция регистрирует область из \p frames кадров, создает кольца
+ * заполнения, завершения и приема, отображает их в память и отдает ядру
+ * все кадры через кольцо заполнения.
+ */
+void XdpReceiver::create_socket(uint32_t frames)
+{
+    m_socket = socket(AF_XDP, SOCK_RAW, 0);
+    if (m_socket < 0)
+        throw std::runtime_error(std::string("socket AF_XDP: ") + strerror(errno));
+    void *umem = mmap(nullptr, m_umem_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (umem == MAP_FAILED)
+        throw std::runtime_error(std::string("UMEM: ") + strerror(errno));
+    m_umem = static_cast<char *>(umem);
+    xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = reinterpret_cast<uint64_t>(m_umem);
+    reg.len = m_umem_size;
+    reg.chunk_size = frame_size;
+    reg.headroom = 0;
+    uint32_t fill_size = frames;
+    uint32_t completion_size = completion_ring_size;
+    uint32_t rx_size = rx_ring_size;
+    if (setsockopt(m_socket, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) != 0 ||
+        setsockopt(m_socket, SOL_XDP, XDP_UMEM_FILL_RING, &fill_size, sizeof(fill_size)) != 0 ||
+        setsockopt(m_socket, SOL_XDP, XDP_UMEM_COMPLETION_RING, &completion_size,
+                   sizeof(completion_size)) != 0 ||
+        setsockopt(m_socket, SOL_XDP, XDP_RX_RING, &rx_size, sizeof(rx_size)) != 0)
+        throw std::runtime_error(std::string("UMEM setup: ") + strerror(errno));
+    xdp_mmap_offsets offsets;
+    socklen_t len = sizeof(offsets);
+    if (getsockopt(m_socket, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &len) != 0)
+        throw std::runtime_error(std::string("XDP_MMAP_OFFSETS: ") + strerror(errno));
+    map_ring(m_fill, fill_size, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING, offsets.fr);
+    map_ring(m_completion, completion_size, sizeof(uint64_t),
+             XDP_UMEM_PGOFF_COMPLETION_RING, offsets.cr);
+    map_ring(m_rx, rx_size, sizeof(xdp_desc), XDP_PGOFF_RX_RING, offsets.rx);
+    uint64_t *fill = static_cast<uint64_t *>(m_fill.desc);
+    for (uint32_t i = 0; i < frames; ++i)
+        fill[i] = static_cast<uint64_t>(i) * frame_size;
+    __atomic_store_n(m_fill.producer, frames, __ATOMIC_RELEASE);
+}
+
+void XdpReceiver::map_ring(Ring& ring, uint32_t size, size_t desc_size, uint64_t offset,
+                           const xdp_ring_offset& layout)
+{
+    ring.map_size = layout.desc + size * desc_size;
+    void *map = mmap(nullptr, ring.map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, m_socket, offset);
+    if (map == MAP_FAILED)
+        throw std::runtime_error(std::string("ring mmap: ") + strerror(errno));
+    ring.map = map;
+    ring.producer = reinterpret_cast<uint32_t *>(static_cast<char *>(map) + layout.producer);
+    ring.consumer = reinterpret_cast<uint32_t *>(static_cast<char *>(map) + layout.consumer);
+    ring.desc = static_cast<char *>(map) + layout.desc;
+    ring.size = size;
+}
+
+/** \brief Загрузить программу XDP
+ *
+ * Функция создает XSKMAP и загружает программу, которая проверяет, что
+ * кадр - датаграмма UDP в IPv4 без опций и не фрагмент, с портом и, если
+ * задан, адресом \p addr , и перенаправляет ее в сокет своей очереди
+ * функцией bpf_redirect_map. Если сокета на очереди нет, кадр уходит в
+ * стек ядра (XDP_PASS). Поля заголовков сравниваются в сетевом порядке
+ * байтов 32-битными сравнениями (BPF_JMP32).
+ */
+void XdpReceiver::load_program(const sockaddr_in& addr)
+{
+    bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = max_queues;
+    m_map = sys_bpf(BPF_MAP_CREATE, attr);
+    if (m_map < 0)
+        throw std::runtime_error(std::string("XSKMAP: ") + strerror(errno));
+
+    const uint8_t ldx_w = BPF_LDX | BPF_MEM | BPF_W;
+    const uint8_t ldx_h = BPF_LDX | BPF_MEM | BPF_H;
+    const uint8_t ldx_b = BPF_LDX | BPF_MEM | BPF_B;
+    const uint8_t jne = BPF_JMP32 | BPF_JNE | BPF_K;
+    std::vector<bpf_insn> prog;
+    std::vector<size_t> to_pass;    // переходы на XDP_PASS
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0));
+    prog.push_back(insn(ldx_w, BPF_REG_2, BPF_REG_6, offsetof(xdp_md, data), 0));
+    prog.push_back(insn(ldx_w, BPF_REG_3, BPF_REG_6, offsetof(xdp_md, data_end), 0));
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0));
+    prog.push_back(insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, eth_header + 20 + udp_header));
+    to_pass.push_back(prog.size());
+    prog.push_back(insn(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0));
+    // EtherType IPv4
+    prog.push_back(insn(ldx_h, BPF_REG_5, BPF_REG_2, 12, 0));
+    to_pass.push_back(prog.size());
+    prog.push_back(insn(jne, BPF_REG_5, 0, 0, htons(0x0800)));
+    // версия 4, заголовок 20 байтов
+    prog.push_back(insn(ldx_b, BPF_REG_5, BPF_REG_2, eth_header, 0));
+    to_pass.push_back(prog.size());
+    prog.push_back(insn(jne, BPF_REG_5, 0, 0, 0x45));
+    prog.push_back(insn(ldx_b, BPF_REG_5, BPF_REG_2, eth_header + 9, 0));
+    to_pass.push_back(prog.size());
+    prog.push_back(insn(jne, BPF_REG_5, 0, 0, IPPROTO_UDP));
+    // флаг MF и смещение фрагмента
+    prog.push_back(insn(ldx_h, BPF_REG_5, BPF_REG_2, eth_header + 6, 0));
+    prog.push_back(insn(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, htons(0x3fff)));
+    to_pass.push_back(prog.size());
+    prog.push_back(insn(jne, BPF_REG_5, 0, 0, 0));
+    if (addr.sin_addr.s_addr != htonl(INADDR_ANY))
+    {
+        prog.push_back(insn(ldx_w, BPF_REG_5, BPF_REG_2, eth_header + 16, 0));
+        to_pass.push_back(prog.size());
+        prog.push_back(insn(jne, BPF_REG_5, 0, 0, static_cast<int32_t>(addr.sin_addr.s_addr)));
+    }
+    prog.push_back(insn(ldx_h, BPF_REG_5, BPF_REG_2, eth_header + 20 + 2, 0));
+    to_pass.push_back(prog.size());
+    prog.push_back(insn(jne, BPF_REG_5, 0, 0, addr.sin_port));
+    // bpf_redirect_map(&xsks, rx_queue_index, XDP_PASS)
+    prog.push_back(insn(ldx_w, BPF_REG_2, BPF_REG_6, offsetof(xdp_md, rx_queue_index), 0));
+    prog.push_back(insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, m_map));
+    prog.push_back(insn(0, 0, 0, 0, 0));
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS));
+    prog.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+    prog.push_back(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+    size_t pass = prog.size();
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS));
+    prog.push_back(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+    for (size_t jump: to_pass)
+        prog[jump].off = static_cast<int16_t>(pass - jump - 1);
+
+    std::vector<char> log(bpf_log_size);
+    static const char license[] = "GPL";
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insn_cnt = prog.size();
+    attr.insns = reinterpret_cast<uint64_t>(prog.data());
+    attr.license = reinterpret_cast<uint64_t>(license);
+    attr.log_level = 1;
+    attr.log_size = log.size();
+    attr.log_buf = reinterpret_cast<uint64_t>(log.data());
+    attr.expected_attach_type = BPF_XDP;
+    m_prog = sys_bpf(BPF_PROG_LOAD, attr);
+    if (m_prog < 0)
+        throw std::runtime_error(std::string("XDP program: ") + strerror(errno) +
+                                 "\n" + log.data());
+}
+
+/** \brief Подключить программу к интерфейсу
+ *
+ * Программа подключается через bpf_link (BPF_LINK_CREATE): она отключается
+ * при закрытии дескриптора, в том числе при аварийном завершении процесса.
+ */
+void XdpReceiver::attach(int ifindex, bool native)
+{
+    bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = m_prog;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = native ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+    m_link = sys_bpf(BPF_LINK_CREATE, attr);
+    if (m_link < 0)
+        throw std::runtime_error(std::string("XDP attach: ") + strerror(errno));
+}
+
+int XdpReceiver::get_fd() const
+{
+    return m_socket;
+}
+
+/** \brief Прием датаграмм из кольца
+ *
+ * Функция без ожидания забирает из кольца приема до \p max_frames кадров,
+ * разбирает заголовки Ethernet, IPv4 и UDP и передает данные датаграммы и
+ * адрес отправителя обработчику \p handler прямо из UMEM, без копирования.
+ * После обработчика кадр возвращается ядру через кольцо заполнения,
+ * поэтому обработчик не должен хранить указатель на данные. Датаграммы
+ * короче заголовка пакета или длиннее MAX_PACKAGE_SIZE считаются
+ * некорректными и обработчику не передаются: в отличие от recvfrom кольцо
+ * не обрезает их до размера буфера. Контрольные суммы IP и UDP не
+ * проверяются: целостность пакетов проверяет протокол (опция -k клиента).
+ *
+ * \return Число принятых кадров.
+ */
+int XdpReceiver::receive(const XdpHandler& handler, int max_frames)
+{
+    uint32_t consumer = *m_rx.consumer;
+    uint32_t available = __atomic_load_n(m_rx.producer, __ATOMIC_ACQUIRE) - consumer;
+    uint32_t count = std::min<uint32_t>(available, max_frames);
+    if (count == 0)
+        return 0;
+    const xdp_desc *descs = static_cast<const xdp_desc *>(m_rx.desc);
+    uint64_t *fill = static_cast<uint64_t *>(m_fill.desc);
+    uint32_t fill_producer = *m_fill.producer;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const xdp_desc& desc = descs[(consumer + i) & (m_rx.size - 1)];
+        const uint8_t *frame = reinterpret_cast<const uint8_t *>(m_umem + desc.addr);
+        size_t ip_header = (frame[eth_header] & 0x0f) * 4;
+        size_t payload = eth_header + ip_header + udp_header;
+        uint16_t udp_length = 0;
+        if (desc.len >= payload)
+            memcpy(&udp_length, frame + eth_header + ip_header + 4, sizeof(udp_length));
+        udp_length = ntohs(udp_length);
+        if (desc.len < payload || udp_length < udp_header + HEADER_SIZE ||
+            udp_length > udp_header + MAX_PACKAGE_SIZE ||
+            eth_header + ip_header + udp_length > desc.len)
+        {
+            ++m_stats.invalid;
+        } else {
+            sockaddr_in from;
+            memset(&from, 0, sizeof(from));
+            from.sin_family = AF_INET;
+            memcpy(&from.sin_addr.s_addr, frame + eth_header + 12, sizeof(from.sin_addr.s_addr));
+            memcpy(&from.sin_port, frame + eth_header + ip_header, sizeof(from.sin_port));
+            ++m_stats.frames;
+            m_stats.bytes += udp_length - udp_header;
+            handler(reinterpret_cast<const char *>(frame + payload), udp_length - udp_header, from);
+        }
+        fill[(fill_producer + i) & (m_fill.size - 1)] = desc.addr & ~static_cast<uint64_t>(frame_size - 1);
+    }
+    __atomic_store_n(m_fill.producer, fill_producer + count, __ATOMIC_RELEASE);
+    __atomic_store_n(m_rx.consumer, consumer + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+/** \brief Заполнение кольца приема
+ *
+ * \return Заполнение в долях 1/1000, как для буфера приема сокета в
+ * отчетах о приеме.
+ */
+uint32_t XdpReceiver::queue_permille() const
+{
+    uint32_t used = __atomic_load_n(m_rx.producer, __ATOMIC_ACQUIRE) - *m_rx.consumer;
+    return static_cast<uint32_t>(std::min<uint64_t>(1000, 1000ULL * used / m_rx.size));
+}
+
+/** \brief Статистика приема
+ *
+ * \return Счетчики приема и счетчики ядра: кадры, отброшенные из-за
+ * переполнения кольца приема и нехватки кадров в кольце заполнения.
+ */
+XdpStats XdpReceiver::get_stats() const
+{
+    XdpStats stats = m_stats;
+    xdp_statistics kernel;
+    socklen_t len = sizeof(kernel);
+    if (getsockopt(m_socket, SOL_XDP, XDP_STATISTICS, &kernel, &len) == 0)
+    {
+        stats.rx_dropped = kernel.rx_dropped;
+        stats.ring_full = kernel.rx_ring_full;
+        stats.fill_empty = kernel.rx_fill_ring_empty_descs;
+    }
+    return stats;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <netinet/in.h>
+#include <linux/if_xdp.h>
+
+struct XdpStats {
+    uint64_t frames     = 0;   // датаграмм, принятых из кольца
+    uint64_t bytes      = 0;
+    uint64_t invalid    = 0;   // кадров, которые не удалось разобрать
+    uint64_t rx_dropped = 0;   // счетчики ядра из XDP_STATISTICS
+    uint64_t ring_full  = 0;
+    uint64_t fill_empty = 0;
+};
+
+std::ostream& operator<<(std::ostream& os, const XdpStats& stats);
+
+bool parse_xdp(const std::string& spec, std::string& ifname, uint32_t& queue, bool& native);
+
+typedef std::function<void(const char *data, int size, const sockaddr_in& from)> XdpHandler;
+
+class XdpReceiver {
+public:
+    XdpReceiver(const std::string& ifname, uint32_t queue, const sockaddr_in& addr,
+                bool native = false);
+
+    ~XdpReceiver();
+
+    int get_fd() const;
+
+    int receive(const XdpHandler& handler, int max_frames);
+
+    uint32_t queue_permille() const;
+
+    XdpStats get_stats() const;
+
+private:
+    struct Ring {
+        void *map = nullptr;
+        size_t map_size = 0;
+        uint32_t *producer = nullptr;
+        uint32_t *consumer = nullptr;
+        void *desc = nullptr;
+        uint32_t size = 0;
+    };
+
+    int m_socket;
+    int m_map;
+    int m_prog;
+    int m_link;
+    char *m_umem;
+    size_t m_umem_size;
+    Ring m_fill;
+    Ring m_completion;
+    Ring m_rx;
+    XdpStats m_stats;
+
+    void create_socket(uint32_t frames);
+
+    void map_ring(Ring& ring, uint32_t size, size_t desc_size, uint64_t offset,
+                  const xdp_ring_offset& layout);
+
+    void load_program(const sockaddr_in& addr);
+
+    void attach(int ifindex, bool native);
+
+    void release();
+};